@@ -0,0 +1,16 @@
+; deep closures: each adder captures the previous one
+(defun! (make-adder f k) (lambda (x) (f (+ x k))))
+
+(defun! (chain n f)
+        (if (= n 0)
+          f
+          (chain (- n 1) (make-adder f n))))
+
+(def! add-all (chain 200 (lambda (x) x)))
+
+(defun! (call-times k acc)
+        (if (= k 0)
+          acc
+          (call-times (- k 1) (+ acc (add-all k)))))
+
+(call-times 3000 0)
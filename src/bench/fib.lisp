@@ -0,0 +1,7 @@
+; naive recursive fibonacci: procedure application and arithmetic
+(defun! (fib n)
+        (if (> 2 n)
+          n
+          (+ (fib (- n 1)) (fib (- n 2)))))
+
+(fib 25)
@@ -0,0 +1,5 @@
+; a pipeline of lazy sequences, which never builds intermediate lists
+(defun! (square x) (* x x))
+(defun! (multiple-of-3? x) (= 0 (% x 3)))
+
+(reduce + 0 (lazy-map square (lazy-filter multiple-of-3? (range 300000))))
@@ -0,0 +1,13 @@
+; tail-recursive loops: tail calls in if and do must not grow the stack
+(defun! (count-down n acc)
+        (if (= n 0)
+          acc
+          (count-down (- n 1) (+ acc 1))))
+
+(defun! (count-do n acc)
+        (do
+          (if (= n 0)
+            acc
+            (count-do (- n 1) (+ acc 2)))))
+
+(+ (count-down 200000 0) (count-do 100000 0))
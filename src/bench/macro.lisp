@@ -0,0 +1,13 @@
+; macro-heavy code: defun!, and, or, cond
+(defun! (classify n)
+        (cond ((and (> n 100) (even? n)) 1)
+              ((or (= n 0) (= n 1) (= n 2)) 2)
+              ((and (< n 50) (or (even? n) (= (% n 3) 0))) 3)
+              (true 4)))
+
+(defun! (classify-sum n acc)
+        (if (= n 0)
+          acc
+          (classify-sum (- n 1) (+ acc (classify n)))))
+
+(classify-sum 40000 0)
@@ -0,0 +1,21 @@
+; map over long lists
+(defun! (range-acc n acc)
+        (if (= n 0)
+          acc
+          (range-acc (- n 1) (cons n acc))))
+(defun! (range n) (range-acc n (list)))
+
+(defun! (sum-acc lst acc)
+        (if (empty? lst)
+          acc
+          (sum-acc (rest lst) (+ acc (nth lst 0)))))
+
+(def! xs (range 2000))
+
+(defun! (map-times k acc)
+        (if (= k 0)
+          acc
+          (map-times (- k 1)
+                     (+ acc (sum-acc (map (lambda (x) (* x 2)) xs) 0)))))
+
+(map-times 100 0)
@@ -0,0 +1,17 @@
+; read-string of large inputs
+(defun! (double-str s n)
+        (if (= n 0)
+          s
+          (double-str (str s " " s) (- n 1))))
+
+(def! chunk "(defun! (f x y) (+ x y \"a string\" 'sym (1 2 (3 4 (5 6))) ; comment\n))")
+(def! input (str "(" (double-str chunk 12) ")"))
+
+; counts the inputs whose first and last forms were read equal
+(defun! (read-times k acc)
+        (if (= k 0)
+          acc
+          (let* ((forms (read-string input)))
+            (read-times (- k 1) (if (= (nth forms 0) (nth forms 4095)) (+ acc 1) acc)))))
+
+(read-times 10 0)
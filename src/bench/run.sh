@@ -0,0 +1,111 @@
+#!/usr/bin/env bash
+# Runs the benchmark workloads (bench/*.lisp) and reports, for each one, the
+# best wall time of BENCH_RUNS runs, the number of pool allocations and whether
+# its result matches the one saved in the baseline.
+#
+# usage: bench/run.sh [-s] [BINARY] [WORKLOAD...]
+#   -s        save the results as the new baseline
+#   BINARY    interpreter to run (default: ./mylisp-bench)
+#   WORKLOAD  names of workloads to run (default: all of them)
+#
+# Times include interpreter startup (loading lisp/core.lisp).
+# Exits with a non-zero status if some result differs from the baseline.
+
+cd "$(dirname "$0")/.." || exit 1
+
+BASELINE=bench/baseline.txt
+RUNS=${BENCH_RUNS:-3}
+
+save=0
+if [ "$1" = "-s" ]; then
+    save=1
+    shift
+fi
+
+BIN=${1:-./mylisp-bench}
+shift
+if [ ! -x "$BIN" ]; then
+    echo "$BIN: not an executable" >&2
+    exit 1
+fi
+
+if [ $# -gt 0 ]; then
+    names="$*"
+else
+    names=$(ls bench/*.lisp | sed 's|bench/\(.*\)\.lisp|\1|')
+fi
+
+# sums the ALLOCS column of a (mem-stats) result
+sum_allocs() {
+    grep -o '([a-z0-9-]* [0-9]* [0-9]* [0-9]* [0-9]*)' | grep -v '^(bytes ' \
+        | awk '{ n += $4 } END { print n + 0 }'
+}
+
+# baseline entry of a workload: NAME MS ALLOCS RESULT
+baseline_field() {
+    [ -f "$BASELINE" ] || return
+    awk -v name="$1" -v field="$2" '$1 == name {
+        if (field == 4) { $1 = $2 = $3 = ""; sub(/^ +/, ""); print }
+        else print $field
+    }' "$BASELINE"
+}
+
+status=0
+new_baseline=""
+
+printf "%-10s %8s %8s %7s %12s %12s  %s\n" \
+    workload ms base-ms speedup allocs base-allocs result
+for name in $names; do
+    file=bench/$name.lisp
+    input="(mem-stats)
+(println \"RESULT\" (pr-str (eval (read-string (str \"(do \" (slurp \"$file\") \"\n)\")))))
+(mem-stats)"
+
+    best=""
+    for ((i = 0; i < RUNS; i++)); do
+        start=$(date +%s%N)
+        out=$(echo "$input" | "$BIN" 2>&1)
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+
+    result=$(echo "$out" | grep -a '^RESULT ' | sed 's/^RESULT //')
+    [ -z "$result" ] && result="error: $(echo "$out" | grep -a -m1 'exception\|error')"
+    stats=$(echo "$out" | grep -a '^((')
+    before=$(echo "$stats" | sed -n 1p | sum_allocs)
+    after=$(echo "$stats" | sed -n 2p | sum_allocs)
+    allocs=$(( after - before ))
+
+    base_ms=$(baseline_field "$name" 2)
+    base_allocs=$(baseline_field "$name" 3)
+    base_result=$(baseline_field "$name" 4)
+
+    speedup="-"
+    if [ -n "$base_ms" ] && [ "$best" -gt 0 ]; then
+        speedup=$(awk -v a="$base_ms" -v b="$best" 'BEGIN { printf "%.2fx", a / b }')
+    fi
+
+    verdict="$result"
+    if [ -n "$base_result" ] && [ "$save" = 0 ]; then
+        if [ "$result" = "$base_result" ]; then
+            verdict="ok ($result)"
+        else
+            verdict="MISMATCH: $result (expected $base_result)"
+            status=1
+        fi
+    fi
+
+    printf "%-10s %8s %8s %7s %12s %12s  %s\n" \
+        "$name" "$best" "${base_ms:--}" "$speedup" "$allocs" "${base_allocs:--}" "$verdict"
+    new_baseline+="$name $best $allocs $result"$'\n'
+done
+
+if [ "$save" = 1 ]; then
+    printf "%s" "$new_baseline" > "$BASELINE"
+    echo "saved baseline to $BASELINE"
+fi
+
+exit $status
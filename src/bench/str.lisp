@@ -0,0 +1,14 @@
+; string building with str
+(defun! (build n s)
+        (if (= n 0)
+          s
+          (build (- n 1) (str s n " "))))
+
+; counts how many of the built strings are equal to the previous one
+(defun! (build-times k prev acc)
+        (if (= k 0)
+          acc
+          (let* ((s (build 500 "")))
+            (build-times (- k 1) s (if (= s prev) (+ acc 1) acc)))))
+
+(build-times 200 "" 0)
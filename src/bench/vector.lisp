@@ -0,0 +1,19 @@
+; indexing into a long vector
+(defun! (range-vec n acc)
+        (if (= n 0)
+          acc
+          (range-vec (- n 1) (conj acc n))))
+
+(def! xs (range-vec 5000 []))
+
+(defun! (sum-idx i acc)
+        (if (= i (count xs))
+          acc
+          (sum-idx (+ i 1) (+ acc (nth xs i)))))
+
+(defun! (sum-times k acc)
+        (if (= k 0)
+          acc
+          (sum-times (- k 1) (+ acc (sum-idx 0 0)))))
+
+(sum-times 20 0)
@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bignum.h"
+
+typedef uint64_t dlimb_t;
+
+#define LIMB_BITS 32
+// largest power of 10 that fits in a limb, used for conversions from/to decimal
+#define DEC_BASE 1000000000
+#define DEC_DIGITS 9
+
+// -----------------------------------------------------------------------------
+// Magnitudes: unsigned limb vectors
+
+static size_t mag_trim(const limb_t *a, size_t n)
+{
+    while (n > 0 && a[n - 1] == 0)
+        n--;
+    return n;
+}
+
+static int mag_cmp(const limb_t *a, size_t an, const limb_t *b, size_t bn)
+{
+    if (an != bn) return an > bn ? 1 : -1;
+    for (size_t i = an; i-- > 0; ) {
+        if (a[i] != b[i]) return a[i] > b[i] ? 1 : -1;
+    }
+    return 0;
+}
+
+// r += a, where r has rn >= an limbs and the sum fits in them
+static void mag_add_into(limb_t *r, size_t rn, const limb_t *a, size_t an)
+{
+    dlimb_t carry = 0;
+    size_t i = 0;
+    for (; i < an; i++) {
+        carry += (dlimb_t) r[i] + a[i];
+        r[i] = (limb_t) carry;
+        carry >>= LIMB_BITS;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (limb_t) carry;
+        carry >>= LIMB_BITS;
+    }
+}
+
+// r -= a, where r has rn >= an limbs and r >= a
+static void mag_sub_from(limb_t *r, size_t rn, const limb_t *a, size_t an)
+{
+    limb_t borrow = 0;
+    size_t i = 0;
+    for (; i < an; i++) {
+        dlimb_t d = (dlimb_t) r[i] - a[i] - borrow;
+        r[i] = (limb_t) d;
+        borrow = (d >> LIMB_BITS) != 0;
+    }
+    for (; borrow && i < rn; i++) {
+        borrow = r[i] == 0;
+        r[i]--;
+    }
+}
+
+// r = a * b, where r has an + bn limbs
+static void mag_mul_school(limb_t *r, const limb_t *a, size_t an, const limb_t *b, size_t bn)
+{
+    memset(r, 0, (an + bn) * sizeof(limb_t));
+    for (size_t i = 0; i < an; i++) {
+        dlimb_t carry = 0;
+        for (size_t j = 0; j < bn; j++) {
+            carry += (dlimb_t) a[i] * b[j] + r[i + j];
+            r[i + j] = (limb_t) carry;
+            carry >>= LIMB_BITS;
+        }
+        r[i + bn] = (limb_t) carry;
+    }
+}
+
+// r = a * b, where r has an + bn limbs and an, bn > 0
+static void mag_mul(limb_t *r, const limb_t *a, size_t an, const limb_t *b, size_t bn)
+{
+    if (an < bn) {
+        const limb_t *t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
+    }
+
+    if (bn < BIGINT_KARATSUBA_CUTOFF) {
+        mag_mul_school(r, a, an, b, bn);
+        return;
+    }
+
+    if (2 * bn <= an) {
+        // unbalanced: multiply b by slices of a that are as long as b
+        memset(r, 0, (an + bn) * sizeof(limb_t));
+        limb_t *t = malloc(2 * bn * sizeof(limb_t));
+        for (size_t i = 0; i < an; i += bn) {
+            size_t n = an - i < bn ? an - i : bn;
+            mag_mul(t, a + i, n, b, bn);
+            mag_add_into(r + i, an + bn - i, t, n + bn);
+        }
+        free(t);
+        return;
+    }
+
+    // Karatsuba: with a = a1 B^m + a0, b = b1 B^m + b0
+    //     a b = z2 B^2m + z1 B^m + z0
+    // where z0 = a0 b0, z2 = a1 b1 and z1 = (a0 + a1)(b0 + b1) - z0 - z2
+    size_t m = an / 2;
+    const limb_t *a0 = a, *a1 = a + m;
+    const limb_t *b0 = b, *b1 = b + m;
+    size_t a1n = an - m, b1n = bn - m; // m <= a1n, 0 < b1n <= a1n
+
+    // z0 and z2 are placed directly into r
+    mag_mul(r, a0, m, b0, m);
+    mag_mul(r + 2 * m, a1, a1n, b1, b1n);
+
+    size_t sn = a1n + 1;
+    size_t tn = (m > b1n ? m : b1n) + 1;
+    limb_t *s = calloc(sn + tn + sn + tn, sizeof(limb_t));
+    limb_t *t = s + sn;
+    limb_t *z1 = t + tn;
+
+    memcpy(s, a1, a1n * sizeof(limb_t));
+    mag_add_into(s, sn, a0, m);
+    if (m >= b1n) {
+        memcpy(t, b0, m * sizeof(limb_t));
+        mag_add_into(t, tn, b1, b1n);
+    } else {
+        memcpy(t, b1, b1n * sizeof(limb_t));
+        mag_add_into(t, tn, b0, m);
+    }
+
+    mag_mul(z1, s, sn, t, tn);
+    mag_sub_from(z1, sn + tn, r, 2 * m);
+    mag_sub_from(z1, sn + tn, r + 2 * m, a1n + b1n);
+    mag_add_into(r + m, an + bn - m, z1, mag_trim(z1, sn + tn));
+
+    free(s);
+}
+
+// q = a / d, returns a % d; q has an limbs and may be a
+static limb_t mag_divmod_limb(limb_t *q, const limb_t *a, size_t an, limb_t d)
+{
+    dlimb_t rem = 0;
+    for (size_t i = an; i-- > 0; ) {
+        rem = (rem << LIMB_BITS) | a[i];
+        q[i] = (limb_t) (rem / d);
+        rem %= d;
+    }
+    return (limb_t) rem;
+}
+
+// q = a / b, r = a % b, where an >= bn > 1 and b[bn - 1] != 0;
+// q has an - bn + 1 limbs, r has bn limbs (Knuth's algorithm D)
+static void mag_divmod(limb_t *q, limb_t *r, const limb_t *a, size_t an, const limb_t *b, size_t bn)
+{
+    // normalize, so that the top bit of the divisor is set
+    int s = __builtin_clz(b[bn - 1]);
+    limb_t *un = malloc((an + 1 + bn) * sizeof(limb_t));
+    limb_t *vn = un + an + 1;
+
+    for (size_t i = bn - 1; i > 0; i--)
+        vn[i] = (b[i] << s) | (limb_t) ((dlimb_t) b[i - 1] >> (LIMB_BITS - s));
+    vn[0] = b[0] << s;
+    un[an] = (limb_t) ((dlimb_t) a[an - 1] >> (LIMB_BITS - s));
+    for (size_t i = an - 1; i > 0; i--)
+        un[i] = (a[i] << s) | (limb_t) ((dlimb_t) a[i - 1] >> (LIMB_BITS - s));
+    un[0] = a[0] << s;
+
+    const dlimb_t base = (dlimb_t) 1 << LIMB_BITS;
+    for (size_t j = an - bn + 1; j-- > 0; ) {
+        // estimate the quotient limb from the top 2 limbs, it's off by at most 2
+        dlimb_t num = ((dlimb_t) un[j + bn] << LIMB_BITS) | un[j + bn - 1];
+        dlimb_t qhat = num / vn[bn - 1];
+        dlimb_t rhat = num % vn[bn - 1];
+        while (qhat >= base || qhat * vn[bn - 2] > ((rhat << LIMB_BITS) | un[j + bn - 2])) {
+            qhat--;
+            rhat += vn[bn - 1];
+            if (rhat >= base) break;
+        }
+
+        // un[j .. j + bn] -= qhat * vn
+        int64_t borrow = 0, t;
+        for (size_t i = 0; i < bn; i++) {
+            dlimb_t p = qhat * vn[i];
+            t = (int64_t) un[i + j] - borrow - (int64_t) (p & 0xffffffff);
+            un[i + j] = (limb_t) t;
+            borrow = (int64_t) (p >> LIMB_BITS) - (t >> LIMB_BITS);
+        }
+        t = (int64_t) un[j + bn] - borrow;
+        un[j + bn] = (limb_t) t;
+
+        q[j] = (limb_t) qhat;
+        if (t < 0) {
+            // subtracted too much, add the divisor back
+            q[j]--;
+            dlimb_t carry = 0;
+            for (size_t i = 0; i < bn; i++) {
+                carry += (dlimb_t) un[i + j] + vn[i];
+                un[i + j] = (limb_t) carry;
+                carry >>= LIMB_BITS;
+            }
+            un[j + bn] += (limb_t) carry;
+        }
+    }
+
+    // denormalize the remainder
+    for (size_t i = 0; i < bn - 1; i++)
+        r[i] = (un[i] >> s) | (limb_t) ((dlimb_t) un[i + 1] << (LIMB_BITS - s));
+    r[bn - 1] = un[bn - 1] >> s;
+
+    free(un);
+}
+
+// -----------------------------------------------------------------------------
+// BigInt
+
+// adopts a vector of n limbs (which may have leading zeros)
+static void BigInt_adopt(BigInt *big, bool neg, limb_t *limbs, size_t n)
+{
+    big->len = mag_trim(limbs, n);
+    big->neg = big->len > 0 && neg;
+    big->limbs = limbs;
+}
+
+void BigInt_view_i64(BigInt *big, int64_t val, limb_t buf[2])
+{
+    uint64_t mag = val < 0 ? -(uint64_t) val : (uint64_t) val;
+    buf[0] = (limb_t) mag;
+    buf[1] = (limb_t) (mag >> LIMB_BITS);
+    big->len = mag_trim(buf, 2);
+    big->neg = val < 0;
+    big->limbs = buf;
+}
+
+void BigInt_init_i64(BigInt *big, int64_t val)
+{
+    limb_t buf[2];
+    BigInt view;
+    BigInt_view_i64(&view, val, buf);
+    BigInt_copy(big, &view);
+}
+
+void BigInt_init_digits(BigInt *big, const char *s, size_t len)
+{
+    // each chunk of 9 digits adds less than 30 bits
+    size_t cap = len / DEC_DIGITS + 2;
+    limb_t *limbs = calloc(cap, sizeof(limb_t));
+    size_t n = 0;
+
+    // the 1st chunk takes the leftover digits, so that the rest are full
+    size_t chunk = len % DEC_DIGITS ? len % DEC_DIGITS : DEC_DIGITS;
+    for (size_t i = 0; i < len; i += chunk, chunk = DEC_DIGITS) {
+        limb_t mul = 1, add = 0;
+        for (size_t k = 0; k < chunk; k++) {
+            mul *= 10;
+            add = add * 10 + (s[i + k] - '0');
+        }
+        // limbs = limbs * mul + add
+        dlimb_t carry = add;
+        for (size_t k = 0; k < n; k++) {
+            carry += (dlimb_t) limbs[k] * mul;
+            limbs[k] = (limb_t) carry;
+            carry >>= LIMB_BITS;
+        }
+        if (carry)
+            limbs[n++] = (limb_t) carry;
+    }
+
+    BigInt_adopt(big, false, limbs, n);
+}
+
+void BigInt_copy(BigInt *dst, const BigInt *src)
+{
+    dst->neg = src->neg;
+    dst->len = src->len;
+    dst->limbs = malloc((src->len ? src->len : 1) * sizeof(limb_t));
+    memcpy(dst->limbs, src->limbs, src->len * sizeof(limb_t));
+}
+
+void BigInt_free(BigInt *big)
+{
+    free(big->limbs);
+    big->limbs = NULL;
+    big->len = 0;
+}
+
+bool BigInt_toi64(const BigInt *big, int64_t *out)
+{
+    if (big->len > 2) return false;
+
+    uint64_t mag = 0;
+    for (size_t i = big->len; i-- > 0; )
+        mag = (mag << LIMB_BITS) | big->limbs[i];
+
+    if (big->neg) {
+        if (mag > (uint64_t) INT64_MAX + 1) return false;
+        *out = mag == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) mag;
+    } else {
+        if (mag > INT64_MAX) return false;
+        *out = (int64_t) mag;
+    }
+    return true;
+}
+
+double BigInt_tod(const BigInt *big)
+{
+    double d = 0;
+    for (size_t i = big->len; i-- > 0; )
+        d = d * 4294967296.0 + big->limbs[i];
+    return big->neg ? -d : d;
+}
+
+bool BigInt_iseven(const BigInt *big)
+{
+    return big->len == 0 || !(big->limbs[0] & 1);
+}
+
+int BigInt_cmp(const BigInt *a, const BigInt *b)
+{
+    if (a->neg != b->neg) return a->neg ? -1 : 1;
+    int c = mag_cmp(a->limbs, a->len, b->limbs, b->len);
+    return a->neg ? -c : c;
+}
+
+// r = a + b, where b is negated if negb is true
+static void BigInt_addsub(BigInt *r, const BigInt *a, const BigInt *b, bool negb)
+{
+    bool bneg = b->neg != negb;
+
+    if (a->neg == bneg) {
+        // |a| + |b| with the common sign
+        const BigInt *hi = a->len >= b->len ? a : b;
+        const BigInt *lo = hi == a ? b : a;
+        size_t n = hi->len + 1;
+        limb_t *limbs = calloc(n, sizeof(limb_t));
+        memcpy(limbs, hi->limbs, hi->len * sizeof(limb_t));
+        mag_add_into(limbs, n, lo->limbs, lo->len);
+        BigInt_adopt(r, a->neg, limbs, n);
+        return;
+    }
+
+    // the smaller magnitude is subtracted from the larger one, whose sign wins
+    int c = mag_cmp(a->limbs, a->len, b->limbs, b->len);
+    const BigInt *hi = c >= 0 ? a : b;
+    const BigInt *lo = hi == a ? b : a;
+    bool neg = hi == a ? a->neg : bneg;
+    limb_t *limbs = malloc((hi->len ? hi->len : 1) * sizeof(limb_t));
+    memcpy(limbs, hi->limbs, hi->len * sizeof(limb_t));
+    mag_sub_from(limbs, hi->len, lo->limbs, lo->len);
+    BigInt_adopt(r, neg, limbs, hi->len);
+}
+
+void BigInt_add(BigInt *r, const BigInt *a, const BigInt *b)
+{
+    BigInt_addsub(r, a, b, false);
+}
+
+void BigInt_sub(BigInt *r, const BigInt *a, const BigInt *b)
+{
+    BigInt_addsub(r, a, b, true);
+}
+
+void BigInt_mul(BigInt *r, const BigInt *a, const BigInt *b)
+{
+    if (a->len == 0 || b->len == 0) {
+        BigInt_init_i64(r, 0);
+        return;
+    }
+
+    size_t n = a->len + b->len;
+    limb_t *limbs = malloc(n * sizeof(limb_t));
+    mag_mul(limbs, a->limbs, a->len, b->limbs, b->len);
+    BigInt_adopt(r, a->neg != b->neg, limbs, n);
+}
+
+bool BigInt_divmod(BigInt *q, BigInt *m, const BigInt *a, const BigInt *b)
+{
+    if (b->len == 0) return false;
+
+    if (mag_cmp(a->limbs, a->len, b->limbs, b->len) < 0) {
+        if (q) BigInt_init_i64(q, 0);
+        if (m) BigInt_copy(m, a);
+        return true;
+    }
+
+    size_t qn = a->len - b->len + 1;
+    limb_t *qlimbs = malloc(qn * sizeof(limb_t));
+    limb_t *mlimbs = malloc(b->len * sizeof(limb_t));
+    if (b->len == 1)
+        mlimbs[0] = mag_divmod_limb(qlimbs, a->limbs, a->len, b->limbs[0]);
+    else
+        mag_divmod(qlimbs, mlimbs, a->limbs, a->len, b->limbs, b->len);
+
+    if (q) BigInt_adopt(q, a->neg != b->neg, qlimbs, qn);
+    else free(qlimbs);
+    if (m) BigInt_adopt(m, a->neg, mlimbs, b->len);
+    else free(mlimbs);
+
+    return true;
+}
+
+char *BigInt_tostr(const BigInt *big)
+{
+    if (big->len == 0) {
+        char *s = malloc(2);
+        strcpy(s, "0");
+        return s;
+    }
+
+    // split into chunks of 9 decimal digits, the least significant one first
+    limb_t *mag = malloc(big->len * sizeof(limb_t));
+    memcpy(mag, big->limbs, big->len * sizeof(limb_t));
+    size_t n = big->len;
+    // each limb takes less than 10 digits, i.e. less than 2 chunks
+    limb_t *chunks = malloc(2 * n * sizeof(limb_t));
+    size_t nchunks = 0;
+    while (n > 0) {
+        chunks[nchunks++] = mag_divmod_limb(mag, mag, n, DEC_BASE);
+        n = mag_trim(mag, n);
+    }
+    free(mag);
+
+    char *s = malloc(nchunks * DEC_DIGITS + 2);
+    char *p = s;
+    if (big->neg) *p++ = '-';
+    p += sprintf(p, "%u", chunks[nchunks - 1]);
+    for (size_t i = nchunks - 1; i-- > 0; )
+        p += sprintf(p, "%09u", chunks[i]);
+
+    free(chunks);
+    return s;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Arbitrary-precision integers in sign-magnitude form.
+// The magnitude is a vector of 32-bit limbs, the least significant one first.
+// Multiplication switches from the schoolbook method to Karatsuba's once both
+// operands are at least BIGINT_KARATSUBA_CUTOFF limbs long.
+//
+// Results are written into an uninitialized BigInt, which then owns its limbs
+// and must be released with BigInt_free. Operands may be views that don't own
+// their limbs (see BigInt_view_i64), results never are.
+
+#define BIGINT_KARATSUBA_CUTOFF 32
+
+typedef uint32_t limb_t;
+
+typedef struct BigInt {
+    bool neg;
+    // amount of limbs, the most significant one is never 0 (0 has no limbs)
+    size_t len;
+    limb_t *limbs;
+} BigInt;
+
+void BigInt_init_i64(BigInt *big, int64_t val);
+// makes big a view of val whose limbs are stored in buf
+void BigInt_view_i64(BigInt *big, int64_t val, limb_t buf[2]);
+// parses a sequence of decimal digits without a sign
+void BigInt_init_digits(BigInt *big, const char *s, size_t len);
+void BigInt_copy(BigInt *dst, const BigInt *src);
+void BigInt_free(BigInt *big);
+
+// returns true and stores the value in out if it fits in 64 bits
+bool BigInt_toi64(const BigInt *big, int64_t *out);
+double BigInt_tod(const BigInt *big);
+bool BigInt_iseven(const BigInt *big);
+int BigInt_cmp(const BigInt *a, const BigInt *b);
+
+void BigInt_add(BigInt *r, const BigInt *a, const BigInt *b);
+void BigInt_sub(BigInt *r, const BigInt *a, const BigInt *b);
+void BigInt_mul(BigInt *r, const BigInt *a, const BigInt *b);
+// truncating division: q = a / b rounded towards 0, m = a - q * b;
+// either q or m may be NULL; returns false (writing nothing) if b is 0
+bool BigInt_divmod(BigInt *q, BigInt *m, const BigInt *a, const BigInt *b);
+
+// returns a newly allocated decimal representation
+char *BigInt_tostr(const BigInt *big);
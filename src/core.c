@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "common.h"
 #include "types.h"
@@ -7,6 +8,10 @@
 #include "env.h"
 #include "printer.h"
 #include "mem_debug.h"
+#include "pool.h"
+#include "gc.h"
+#include "profile.h"
+#include "vm.h"
 
 
 void *verify_proc_arg_type(const Proc *proc, const Arr *args, size_t arg_idx, 
@@ -23,6 +28,31 @@ void *verify_proc_arg_type(const Proc *proc, const Arr *args, size_t arg_idx,
     return (void*) arg;
 }
 
+typedef Number* (*num_op_ft)(const Number*, const Number*);
+
+// Slow path of arithmetic: folds op over args from index start on, beginning with
+// acc, which is a temporary result if acc_tmp is true (otherwise an argument).
+// The intermediate results are freed.
+static Number *fold_numbers(const Proc *proc, const Number *acc, bool acc_tmp,
+                            const Arr *args, size_t start, num_op_ft op)
+{
+    for (size_t i = start; i < args->len; i++) {
+        Number *next = op(acc, args->items[i]);
+        if (acc_tmp)
+            LispDatum_free((LispDatum*) acc);
+        if (!next) {
+            throwf(Symbol_name(Proc_name(proc)), "division by zero");
+            return NULL;
+        }
+        acc = next;
+        acc_tmp = true;
+    }
+    return (Number*) acc;
+}
+
+// Each operation first runs over fixnums in int64_t, checking for overflow.
+// Once it overflows or a bignum or a float comes up, the rest continues with
+// generic arithmetic from the result so far.
 static LispDatum *lisp_add(const Proc *proc, const Arr *args, MalEnv *env) {
     // validate arg types
     for (size_t i = 0; i < args->len; i++) {
@@ -30,14 +60,18 @@ static LispDatum *lisp_add(const Proc *proc, const Arr *args, MalEnv *env) {
             return NULL;
     }
 
-    Number *arg1 = args->items[0];
-    Number *sum = Number_true_copy(arg1);
-    for (size_t i = 1; i < args->len; i++) {
-        Number *arg = args->items[i];
-        Number_add(sum, arg);
+    int64_t sum = 0;
+    size_t i = 0;
+    for (; i < args->len && Number_isfixnum(args->items[i]); i++) {
+        int64_t next;
+        if (__builtin_add_overflow(sum, Number_tol(args->items[i]), &next))
+            break;
+        sum = next;
     }
+    if (i == args->len)
+        return (LispDatum*) Number_new(sum);
 
-    return (LispDatum*) sum;
+    return (LispDatum*) fold_numbers(proc, Number_new(sum), true, args, i, Number_add);
 }
 
 static LispDatum *lisp_sub(const Proc *proc, const Arr *args, MalEnv *env) {
@@ -47,14 +81,22 @@ static LispDatum *lisp_sub(const Proc *proc, const Arr *args, MalEnv *env) {
             return NULL;
     }
 
-    Number *arg1 = args->items[0];
-    Number *rslt = Number_true_copy(arg1);
-    for (size_t i = 1; i < args->len; i++) {
-        Number *arg = args->items[i];
-        Number_sub(rslt, arg);
+    const Number *first = args->items[0];
+    if (!Number_isfixnum(first))
+        return (LispDatum*) fold_numbers(proc, first, false, args, 1, Number_sub);
+
+    int64_t rslt = Number_tol(first);
+    size_t i = 1;
+    for (; i < args->len && Number_isfixnum(args->items[i]); i++) {
+        int64_t next;
+        if (__builtin_sub_overflow(rslt, Number_tol(args->items[i]), &next))
+            break;
+        rslt = next;
     }
+    if (i == args->len)
+        return (LispDatum*) Number_new(rslt);
 
-    return (LispDatum*) rslt;
+    return (LispDatum*) fold_numbers(proc, Number_new(rslt), true, args, i, Number_sub);
 }
 
 static LispDatum *lisp_mul(const Proc *proc, const Arr *args, MalEnv *env) {
@@ -64,14 +106,18 @@ static LispDatum *lisp_mul(const Proc *proc, const Arr *args, MalEnv *env) {
             return NULL;
     }
 
-    Number *arg1 = args->items[0];
-    Number *rslt = Number_true_copy(arg1);
-    for (size_t i = 1; i < args->len; i++) {
-        Number *arg = args->items[i];
-        Number_mul(rslt, arg);
+    int64_t rslt = 1;
+    size_t i = 0;
+    for (; i < args->len && Number_isfixnum(args->items[i]); i++) {
+        int64_t next;
+        if (__builtin_mul_overflow(rslt, Number_tol(args->items[i]), &next))
+            break;
+        rslt = next;
     }
+    if (i == args->len)
+        return (LispDatum*) Number_new(rslt);
 
-    return (LispDatum*) rslt;
+    return (LispDatum*) fold_numbers(proc, Number_new(rslt), true, args, i, Number_mul);
 }
 
 static LispDatum *lisp_div(const Proc *proc, const Arr *args, MalEnv *env) {
@@ -81,40 +127,80 @@ static LispDatum *lisp_div(const Proc *proc, const Arr *args, MalEnv *env) {
             return NULL;
     }
 
-    Number *arg1 = args->items[0];
-    Number *rslt = Number_true_copy(arg1);
-    for (size_t i = 1; i < args->len; i++) {
-        Number *arg = args->items[i];
-        Number_div(rslt, arg);
+    const Number *first = args->items[0];
+    if (!Number_isfixnum(first))
+        return (LispDatum*) fold_numbers(proc, first, false, args, 1, Number_div);
+
+    // the quotient of fixnums never overflows, it only gets smaller
+    int64_t rslt = Number_tol(first);
+    size_t i = 1;
+    for (; i < args->len && Number_isfixnum(args->items[i]); i++) {
+        int64_t divisor = Number_tol(args->items[i]);
+        if (divisor == 0) {
+            throwf(Symbol_name(Proc_name(proc)), "division by zero");
+            return NULL;
+        }
+        rslt /= divisor;
     }
+    if (i == args->len)
+        return (LispDatum*) Number_new(rslt);
 
-    return (LispDatum*) rslt;
+    return (LispDatum*) fold_numbers(proc, Number_new(rslt), true, args, i, Number_div);
 }
 
-/* '=' : compare the first two parameters and return true if they are the same type
+/* '=' : compare the parameters and return true if they are the same type
  * and contain the same value. In the case of equal length lists, each element
  * of the list should be compared for equality and if they are the same return
- * true, otherwise false
+ * true, otherwise false. More than 2 parameters are compared pairwise: 
+ * (= a b c) <=> (and (= a b) (= b c))
  */
 static LispDatum *lisp_eq(const Proc *proc, const Arr *args, MalEnv *env) {
-    const LispDatum *arg1 = args->items[0];
-    const LispDatum *arg2 = args->items[1];
+    for (size_t i = 1; i < args->len; i++) {
+        if (!LispDatum_eq(args->items[i - 1], args->items[i]))
+            return (LispDatum*) False_get();
+    }
 
-    return (LispDatum*) LispDatum_bool(LispDatum_eq(arg1, arg2));
+    return (LispDatum*) True_get();
 }
 
-/* '>' : compare the first two numeric parameters */
-static LispDatum *lisp_gt(const Proc *proc, const Arr *args, MalEnv *env) {
+// signs of comparisons accepted by compare_numbers
+#define CMP_LT 1
+#define CMP_EQ 2
+#define CMP_GT 4
+
+// Compares numeric parameters pairwise, e.g., (< a b c) <=> (and (< a b) (< b c)).
+// Returns true if each comparison has one of the accepted signs.
+static inline LispDatum *compare_numbers(const Proc *proc, const Arr *args, int signs)
+{
     // validate arg types
-    for (int i = 0; i < args->len; i++) {
+    for (size_t i = 0; i < args->len; i++) {
         if (!verify_proc_arg_type(proc, args, i, NUMBER)) 
             return NULL;
     }
 
-    const Number *arg1 = args->items[0];
-    const Number *arg2 = args->items[1];
+    for (size_t i = 1; i < args->len; i++) {
+        int cmp = Number_cmp(args->items[i - 1], args->items[i]);
+        if (!(signs & (cmp < 0 ? CMP_LT : cmp > 0 ? CMP_GT : CMP_EQ)))
+            return (LispDatum*) False_get();
+    }
+
+    return (LispDatum*) True_get();
+}
+
+static LispDatum *lisp_gt(const Proc *proc, const Arr *args, MalEnv *env) {
+    return compare_numbers(proc, args, CMP_GT);
+}
 
-    return (LispDatum*) LispDatum_bool(Number_cmp(arg1, arg2) > 0);
+static LispDatum *lisp_ge(const Proc *proc, const Arr *args, MalEnv *env) {
+    return compare_numbers(proc, args, CMP_GT | CMP_EQ);
+}
+
+static LispDatum *lisp_lt(const Proc *proc, const Arr *args, MalEnv *env) {
+    return compare_numbers(proc, args, CMP_LT);
+}
+
+static LispDatum *lisp_le(const Proc *proc, const Arr *args, MalEnv *env) {
+    return compare_numbers(proc, args, CMP_LT | CMP_EQ);
 }
 
 /* % : modulus */
@@ -125,9 +211,11 @@ static LispDatum *lisp_mod(const Proc *proc, const Arr *args, MalEnv *env)
     const Number *arg1 = verify_proc_arg_type(proc, args, 1, NUMBER);
     if (!arg1) return NULL;
 
-    Number *rslt = Number_true_copy(arg0);
-    Number_mod(rslt, arg1);
-
+    Number *rslt = Number_mod(arg0, arg1);
+    if (!rslt) {
+        throwf(Symbol_name(Proc_name(proc)), "division by zero");
+        return NULL;
+    }
     return (LispDatum*) rslt;
 }
 
@@ -140,6 +228,31 @@ static LispDatum *lisp_evenp(const Proc *proc, const Arr *args, MalEnv *env)
     return (LispDatum*) LispDatum_bool(Number_iseven(arg0));
 }
 
+// zero?, negative?, positive?
+static LispDatum *lisp_zerop(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    const Number *arg0 = verify_proc_arg_type(proc, args, 0, NUMBER);
+    if (!arg0) return NULL;
+
+    return (LispDatum*) LispDatum_bool(Number_cmpl(arg0, 0) == 0);
+}
+
+static LispDatum *lisp_negativep(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    const Number *arg0 = verify_proc_arg_type(proc, args, 0, NUMBER);
+    if (!arg0) return NULL;
+
+    return (LispDatum*) LispDatum_bool(Number_cmpl(arg0, 0) < 0);
+}
+
+static LispDatum *lisp_positivep(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    const Number *arg0 = verify_proc_arg_type(proc, args, 0, NUMBER);
+    if (!arg0) return NULL;
+
+    return (LispDatum*) LispDatum_bool(Number_cmpl(arg0, 0) > 0);
+}
+
 // number?
 static LispDatum *lisp_numberp(const Proc *proc, const Arr *args, MalEnv *env) 
 {
@@ -153,7 +266,7 @@ static LispDatum *lisp_symbol(const Proc *proc, const Arr *args, MalEnv *env)
     const String *arg0 = verify_proc_arg_type(proc, args, 0, STRING);
     if (!arg0) return NULL;
 
-    return (LispDatum*) Symbol_intern(String_str(arg0));
+    return (LispDatum*) Symbol_internn(String_chars(arg0), String_len(arg0));
 }
 
 // symbol?
@@ -180,6 +293,12 @@ static LispDatum *lisp_falsep(const Proc *proc, const Arr *args, MalEnv *env) {
     return (LispDatum*) LispDatum_bool(LispDatum_istype(arg0, FALSE));
 }
 
+// not : true if the argument is either nil or false
+static LispDatum *lisp_not(const Proc *proc, const Arr *args, MalEnv *env) {
+    const LispDatum *arg0 = Arr_get(args, 0);
+    return (LispDatum*) LispDatum_bool(LispDatum_istype(arg0, NIL) || LispDatum_istype(arg0, FALSE));
+}
+
 // list?
 static LispDatum *lisp_listp(const Proc *proc, const Arr *args, MalEnv *env) {
     const LispDatum *arg0 = Arr_get(args, 0);
@@ -202,28 +321,74 @@ static LispDatum *lisp_list(const Proc *proc, const Arr *args, MalEnv *env) {
 
 // empty?
 static LispDatum *lisp_emptyp(const Proc *proc, const Arr *args, MalEnv *env) {
+    LispDatum *arg0 = Arr_get(args, 0);
+    if (LispDatum_istype(arg0, VECTOR))
+        return (LispDatum*) LispDatum_bool(Vector_isempty((Vector*) arg0));
+    if (LispDatum_istype(arg0, HASHMAP))
+        return (LispDatum*) LispDatum_bool(HashMap_isempty((HashMap*) arg0));
+
     const List *list = verify_proc_arg_type(proc, args, 0, LIST);
     if (!list) return NULL;
     return (LispDatum*) LispDatum_bool(List_isempty(list));
 }
 
-// TODO replace with length
-// static LispDatum *lisp_count(const Proc *proc, const Arr *args, MalEnv *env) {
-//     // validate arg type
-//     LispDatum *arg = args->items[0];
+// count : returns the number of elements of a list or vector, or the number of
+//     entries of a hash-map (0 for nil)
+static LispDatum *lisp_count(const Proc *proc, const Arr *args, MalEnv *env) {
+    LispDatum *arg0 = Arr_get(args, 0);
+    switch (LispDatum_type(arg0)) {
+        case NIL:
+            return (LispDatum*) Number_new(0);
+        case LIST:
+            return (LispDatum*) Number_new(List_len((List*) arg0));
+        case VECTOR:
+            return (LispDatum*) Number_new(Vector_len((Vector*) arg0));
+        case HASHMAP:
+            return (LispDatum*) Number_new(HashMap_len((HashMap*) arg0));
+        default:
+            throwf("count", "bad 1st arg: expected LIST, VECTOR or HASHMAP, but was %s",
+                    LispType_name(LispDatum_type(arg0)));
+            return NULL;
+    }
+}
+
+// vector?
+static LispDatum *lisp_vectorp(const Proc *proc, const Arr *args, MalEnv *env) {
+    const LispDatum *arg0 = Arr_get(args, 0);
+    return (LispDatum*) LispDatum_bool(LispDatum_istype(arg0, VECTOR));
+}
 
-//     int len;
-//     if (LispDatum_istype(arg, NIL))
-//         len = 0;
-//     else if (LispDatum_islist(arg))
-//         len = List_len(arg->value.list);
-//     else {
-//         throwf("count", "expected a list, but got %s instead", LispType_tostr(arg->type));
-//         return NULL;
-//     }
+// vector : returns a new vector of its arguments
+static LispDatum *lisp_vector(const Proc *proc, const Arr *args, MalEnv *env) {
+    Vector *vec = Vector_newc(args->len);
+    for (size_t i = 0; i < args->len; i++) {
+        Vector_add(vec, args->items[i]);
+    }
+
+    return (LispDatum*) vec;
+}
+
+// conj : returns a new vector with the rest of the arguments appended to the
+// given vector. Appending to a vector that was not appended to before doesn't
+// copy its elements (amortized O(1)). A vector that nothing else refers to is
+// appended to in place.
+static LispDatum *lisp_conj(const Proc *proc, const Arr *args, MalEnv *env) {
+    Vector *vec = verify_proc_arg_type(proc, args, 0, VECTOR);
+    if (!vec) return NULL;
+
+    if (args->len == 1)
+        return (LispDatum*) vec;
+
+    size_t i = 1;
+    Vector *out = vec;
+    if (!(vm_unique_arg(args, 0) && Vector_isexclusive(vec)))
+        out = Vector_conj_new(vec, args->items[i++]);
+    for (; i < args->len; i++) {
+        Vector_add(out, args->items[i]);
+    }
 
-//     return LispDatum_new_int(len);
-// }
+    return (LispDatum*) out;
+}
 
 static LispDatum *lisp_list_ref(const Proc *proc, const Arr *args, MalEnv *env) 
 {
@@ -258,9 +423,48 @@ static LispDatum *lisp_list_rest(const Proc *proc, const Arr *args, MalEnv *env)
         return NULL;
     }
 
+    if (vm_unique_arg(args, 0) && List_isreusable(list)) {
+        List_pop(list);
+        return (LispDatum*) list;
+    }
     return (LispDatum*) List_rest_new(list);
 }
 
+static LispDatum *lisp_vec_ref(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    const Vector *vec = Arr_get(args, 0);
+    const Number *idx = verify_proc_arg_type(proc, args, 1, NUMBER);
+    if (!idx) return NULL;
+
+    if (Number_isneg(idx)) {
+        throwf("nth", "expected non-negative index");
+        return NULL;
+    }
+
+    size_t vec_len = Vector_len(vec);
+    if (Number_cmpl(idx, vec_len) >= 0) {
+        char *s = Number_tostr(idx);
+        throwf("nth", "index too large (%s >= %zu)", s, vec_len);
+        free(s);
+        return NULL;
+    }
+
+    return Vector_ref(vec, Number_tol(idx));
+}
+
+// the result shares the elements with the given vector
+static LispDatum *lisp_vec_rest(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    Vector *vec = Arr_get(args, 0);
+
+    if (Vector_isempty(vec)) {
+        throwf("rest", "received an empty vector");
+        return NULL;
+    }
+
+    return (LispDatum*) Vector_rest_new(vec);
+}
+
 // nth : takes a list (or vector) and a number (index) as arguments, returns
 // the element of the list/vector at the given index. If the index is out of range,
 // then an error is raised.
@@ -270,9 +474,9 @@ static LispDatum *lisp_nth(const Proc *proc, const Arr *args, MalEnv *env)
     if (LispDatum_istype(arg0, LIST)) {
         return lisp_list_ref(proc, args, env);
     }
-    // else if (LispDatum_istype(arg0, VECTOR)) {
-    //     return lisp_vec_ref(proc, args, env);
-    // }
+    else if (LispDatum_istype(arg0, VECTOR)) {
+        return lisp_vec_ref(proc, args, env);
+    }
     else {
         throwf("nth", "bad 1st arg: expected LIST or VECTOR, but was %s",
                 LispType_name(LispDatum_type(arg0)));
@@ -280,6 +484,28 @@ static LispDatum *lisp_nth(const Proc *proc, const Arr *args, MalEnv *env)
     }
 }
 
+// first : takes a list (or vector) and returns its first element. If the list/vector
+//     is empty then an error is raised.
+static LispDatum *lisp_first(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    LispDatum *arg0 = Arr_get(args, 0);
+    if (LispDatum_istype(arg0, LIST) && !List_isempty((List*) arg0)) {
+        return ((List*) arg0)->head->value;
+    }
+    else if (LispDatum_istype(arg0, VECTOR) && Vector_len((Vector*) arg0) > 0) {
+        return Vector_ref((Vector*) arg0, 0);
+    }
+    else if (LispDatum_istype(arg0, LIST) || LispDatum_istype(arg0, VECTOR)) {
+        throwf("first", "empty %s", LispType_name(LispDatum_type(arg0)));
+        return NULL;
+    }
+    else {
+        throwf("first", "bad 1st arg: expected LIST or VECTOR, but was %s",
+                LispType_name(LispDatum_type(arg0)));
+        return NULL;
+    }
+}
+
 // rest : takes a list (or vector) as its argument and returns a new list/vector
 //     containing all the elements except the first. If the list/vector is empty
 //     empty then an error is raised.
@@ -289,9 +515,9 @@ static LispDatum *lisp_rest(const Proc *proc, const Arr *args, MalEnv *env)
     if (LispDatum_istype(arg0, LIST)) {
         return lisp_list_rest(proc, args, env);
     }
-    // else if (LispDatum_istype(arg0, VECTOR)) {
-    //     return lisp_vec_rest(proc, args, env);
-    // }
+    else if (LispDatum_istype(arg0, VECTOR)) {
+        return lisp_vec_rest(proc, args, env);
+    }
     else {
         throwf("rest", "bad 1st arg: expected LIST or VECTOR, but was %s",
                 LispType_name(LispDatum_type(arg0)));
@@ -299,56 +525,163 @@ static LispDatum *lisp_rest(const Proc *proc, const Arr *args, MalEnv *env)
     }
 }
 
-// prn: calls pr_str on each argument with print_readably set to true, joins the
-// results with " ", prints the string to the screen and then returns nil.
-static LispDatum *lisp_prn(const Proc *proc, const Arr *args, MalEnv *env)
-{
-    if (args->len > 0) {
-        char *strings[args->len];
+// map? : is the argument a hash-map?
+static LispDatum *lisp_mapp(const Proc *proc, const Arr *args, MalEnv *env) {
+    const LispDatum *arg0 = Arr_get(args, 0);
+    return (LispDatum*) LispDatum_bool(LispDatum_istype(arg0, HASHMAP));
+}
 
-        for (size_t i = 0; i < args->len; i++) {
-            LispDatum *arg = args->items[i];
-            strings[i] = pr_str(arg, true);
-        }
+// hash-map : returns a new hash-map of its arguments, taken as alternating keys
+//     and values. A later value of the same key replaces the earlier one.
+static LispDatum *lisp_hash_map(const Proc *proc, const Arr *args, MalEnv *env) {
+    if (args->len % 2 != 0) {
+        throwf("hash-map", "expected an even number of args, but got %zu", args->len);
+        return NULL;
+    }
 
-        // join with " "
-        char *joined = str_join(strings, args->len, " ");
-        printf("%s\n", joined);
-        free(joined);
+    HashMap *map = HashMap_new();
+    for (size_t i = 0; i < args->len; i += 2) {
+        HashMap_put(map, args->items[i], args->items[i + 1]);
+    }
 
-        for (size_t i = 0; i < args->len; i++)
-            free(strings[i]);
+    return (LispDatum*) map;
+}
+
+// get : (get map key [default]) returns the value of key in the hash-map, or the
+//     default (nil if absent) if there is none. A nil map has no keys.
+static LispDatum *lisp_get(const Proc *proc, const Arr *args, MalEnv *env) {
+    if (args->len > 3) {
+        throwf("get", "expected at most 3 args, but got %zu", args->len);
+        return NULL;
     }
+    LispDatum *dflt = args->len == 3 ? args->items[2] : (LispDatum*) Nil_get();
 
-    return (LispDatum*) Nil_get();
+    LispDatum *arg0 = Arr_get(args, 0);
+    if (LispDatum_istype(arg0, NIL))
+        return dflt;
+
+    const HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
+
+    LispDatum *val = HashMap_get(map, Arr_get(args, 1));
+    return val ? val : dflt;
 }
 
-// pr-str: calls pr_str on each argument with print_readably set to true, joins
-// the results with " " and returns the new string.
-static LispDatum *lisp_pr_str(const Proc *proc, const Arr *args, MalEnv *env)
-{
-    if (args->len == 0) {
-        return (LispDatum*) String_new("");
+// contains? : does the hash-map have the given key?
+static LispDatum *lisp_containsp(const Proc *proc, const Arr *args, MalEnv *env) {
+    const HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
+    return (LispDatum*) LispDatum_bool(HashMap_get(map, Arr_get(args, 1)) != NULL);
+}
+
+// assoc : (assoc map k v ...) returns a new hash-map with the given keys mapped
+//     to the given values. The original map is left unchanged and shares all but
+//     the paths to the new entries with the result.
+static LispDatum *lisp_assoc(const Proc *proc, const Arr *args, MalEnv *env) {
+    HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
+
+    if (args->len % 2 != 1) {
+        throwf("assoc", "expected a value for every key");
+        return NULL;
     }
-    else {
-        char *strings[args->len];
+    if (args->len == 1)
+        return (LispDatum*) map;
 
-        for (size_t i = 0; i < args->len; i++) {
-            LispDatum *arg = args->items[i];
-            strings[i] = pr_str(arg, true);
-        }
+    HashMap *out = HashMap_assoc_new(map, args->items[1], args->items[2]);
+    for (size_t i = 3; i < args->len; i += 2) {
+        HashMap_put(out, args->items[i], args->items[i + 1]);
+    }
+
+    return (LispDatum*) out;
+}
+
+// dissoc : (dissoc map k ...) returns a new hash-map without the given keys
+static LispDatum *lisp_dissoc(const Proc *proc, const Arr *args, MalEnv *env) {
+    HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
+
+    if (args->len == 1)
+        return (LispDatum*) map;
+
+    HashMap *out = HashMap_dissoc_new(map, args->items[1]);
+    for (size_t i = 2; i < args->len; i++) {
+        HashMap *next = HashMap_dissoc_new(out, args->items[i]);
+        HashMap_free(out);
+        out = next;
+    }
 
-        // join with " "
-        char *joined = str_join(strings, args->len, " ");
+    return (LispDatum*) out;
+}
+
+static void add_map_key(LispDatum *key, LispDatum *val, void *data) {
+    List_add(data, key);
+}
+
+static void add_map_val(LispDatum *key, LispDatum *val, void *data) {
+    List_add(data, val);
+}
+
+// keys : returns a list of the keys of a hash-map (in no particular order)
+static LispDatum *lisp_keys(const Proc *proc, const Arr *args, MalEnv *env) {
+    const HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
+
+    List *list = List_new();
+    HashMap_foreach(map, add_map_key, list);
+    return (LispDatum*) list;
+}
+
+// vals : returns a list of the values of a hash-map, in the order of keys
+static LispDatum *lisp_vals(const Proc *proc, const Arr *args, MalEnv *env) {
+    const HashMap *map = verify_proc_arg_type(proc, args, 0, HASHMAP);
+    if (!map) return NULL;
 
-        for (size_t i = 0; i < args->len; i++)
-            free(strings[i]);
+    List *list = List_new();
+    HashMap_foreach(map, add_map_val, list);
+    return (LispDatum*) list;
+}
+
+// prints the arguments to stdout separated by sep and followed by a newline
+static void print_args(const Arr *args, bool print_readably, char sep)
+{
+    for (size_t i = 0; i < args->len; i++) {
+        if (i > 0)
+            putchar(sep);
+        pr_file(stdout, args->items[i], print_readably);
+    }
+    putchar('\n');
+}
 
-        // TODO optimize: add function String_from that does not copy the input string
-        LispDatum *out = (LispDatum*) String_new(joined);
-        free(joined);
-        return out;
+// returns a new string of the printed arguments, starting at the given one,
+// separated by sep (unless it's 0)
+static String *str_args(const Arr *args, size_t start, bool print_readably, char sep)
+{
+    StrAsm sa;
+    StrAsm_init(&sa);
+    for (size_t i = start; i < args->len; i++) {
+        if (i > start && sep)
+            StrAsm_addc(&sa, sep);
+        pr_sasm(&sa, args->items[i], print_readably);
     }
+    return String_from(StrAsm_str(&sa), StrAsm_len(&sa), sa.cap);
+}
+
+// prn: prints each argument with print_readably set to true, separated by " ",
+// to the screen and then returns nil.
+static LispDatum *lisp_prn(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 0)
+        print_args(args, true, ' ');
+
+    return (LispDatum*) Nil_get();
+}
+
+// pr-str: calls pr_str on each argument with print_readably set to true, joins
+// the results with " " and returns the new string.
+static LispDatum *lisp_pr_str(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    return (LispDatum*) str_args(args, 0, true, ' ');
 }
 
 /*
@@ -358,51 +691,98 @@ static LispDatum *lisp_pr_str(const Proc *proc, const Arr *args, MalEnv *env)
  */
 static LispDatum *lisp_str(const Proc *proc, const Arr *args, MalEnv *env)
 {
-    if (args->len == 0) {
-        return (LispDatum*) String_new("");
+    String *first = args->len > 0 ? args->items[0] : NULL;
+    if (first == NULL || !LispDatum_istype((LispDatum*) first, STRING))
+        return (LispDatum*) str_args(args, 0, false, 0);
+
+    // (str acc piece ...) appends to acc, which is cheap when acc was built the
+    // same way, so that accumulating a string in a loop takes linear time
+    if (args->len == 1)
+        return (LispDatum*) first;
+    if (args->len == 2 && LispDatum_istype(args->items[1], STRING)) {
+        const String *piece = args->items[1];
+        return (LispDatum*) String_append_new(first, String_chars(piece), String_len(piece));
     }
-    else {
-        char *strings[args->len];
+    StrAsm sa;
+    StrAsm_init(&sa);
+    for (size_t i = 1; i < args->len; i++)
+        pr_sasm(&sa, args->items[i], false);
+    String *out = String_append_new(first, StrAsm_str(&sa), StrAsm_len(&sa));
+    StrAsm_destroy(&sa);
+    return (LispDatum*) out;
+}
 
-        for (size_t i = 0; i < args->len; i++) {
-            LispDatum *arg = args->items[i];
-            strings[i] = pr_str(arg, false);
-        }
+// (string-length s) : the number of characters of string s
+static LispDatum *lisp_string_length(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    const String *string = verify_proc_arg_type(proc, args, 0, STRING);
+    if (!string) return NULL;
 
-        char *joined = str_join(strings, args->len, "");
+    return (LispDatum*) Number_new(String_len(string));
+}
 
-        for (size_t i = 0; i < args->len; i++)
-            free(strings[i]);
+/* (substring s start [end]) : the characters of string s in the range
+ * [start, end), where end defaults to the length of s. The new string shares
+ * the characters of s. */
+static LispDatum *lisp_substring(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 3) {
+        throwf("substring", "expected at most 3 arguments, but %zu were given", args->len);
+        return NULL;
+    }
 
-        // TODO optimize: add function String_from that does not copy the input string
-        LispDatum *out = (LispDatum*) String_new(joined);
-        free(joined);
-        return out;
+    const String *string = verify_proc_arg_type(proc, args, 0, STRING);
+    if (!string) return NULL;
+    const Number *start = verify_proc_arg_type(proc, args, 1, NUMBER);
+    if (!start) return NULL;
+    const Number *end = NULL;
+    if (args->len == 3) {
+        end = verify_proc_arg_type(proc, args, 2, NUMBER);
+        if (!end) return NULL;
     }
+
+    long len = String_len(string);
+    long from = Number_tol(start);
+    long to = end ? Number_tol(end) : len;
+    if (from < 0 || to < from || to > len) {
+        throwf("substring", "bad range [%ld, %ld) of string of length %ld", from, to, len);
+        return NULL;
+    }
+
+    return (LispDatum*) String_substr_new(string, from, to - from);
 }
 
-/*
- * println: calls pr_str on each argument with print_readably set to false,
- * joins the results with " ", prints the string to the screen and then returns
- * nil.
- */
-static LispDatum *lisp_println(const Proc *proc, const Arr *args, MalEnv *env)
+// (string-append s ...) : a new string of the given strings concatenated,
+// which extends the buffer of the first one when possible
+static LispDatum *lisp_string_append(const Proc *proc, const Arr *args, MalEnv *env)
 {
-    if (args->len > 0) {
-        char *strings[args->len];
-
-        for (size_t i = 0; i < args->len; i++) {
-            LispDatum *arg = args->items[i];
-            strings[i] = pr_str(arg, false);
-        }
+    for (size_t i = 0; i < args->len; i++) {
+        if (!verify_proc_arg_type(proc, args, i, STRING))
+            return NULL;
+    }
 
-        char *joined = str_join(strings, args->len, " ");
-        printf("%s\n", joined);
-        free(joined);
+    if (args->len == 0)
+        return (LispDatum*) String_new("");
 
-        for (size_t i = 0; i < args->len; i++)
-            free(strings[i]);
+    String *out = args->items[0];
+    for (size_t i = 1; i < args->len; i++) {
+        const String *piece = args->items[i];
+        String *next = String_append_new(out, String_chars(piece), String_len(piece));
+        if (i > 1)
+            String_free(out);
+        out = next;
     }
+    return (LispDatum*) out;
+}
+
+/*
+ * println: prints each argument with print_readably set to false, separated
+ * by " ", to the screen and then returns nil.
+ */
+static LispDatum *lisp_println(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 0)
+        print_args(args, false, ' ');
 
     return (LispDatum*) Nil_get();
 }
@@ -465,36 +845,145 @@ static LispDatum *lisp_type(const Proc *proc, const Arr *args, MalEnv *env)
 // FIXME once MalEnv becomes a first-class type
 static LispDatum *lisp_env(const Proc *proc, const Arr *args, MalEnv *env)
 {
-    unsigned int size = HashTbl_size(env->binds);
+    unsigned int size = MalEnv_size(env);
     if (size == 0) {
         return (LispDatum*) List_empty();
     }
     else {
-        void **keys = malloc(sizeof(*keys) * size);
-        HashTbl_keys(env->binds, keys);
-
-        void **values = malloc(sizeof(*keys) * size);
-        HashTbl_values(env->binds, values);
+        Symbol **ids = malloc(sizeof(*ids) * size);
+        LispDatum **datums = malloc(sizeof(*datums) * size);
+        MalEnv_bindings(env, ids, datums);
 
         List *list = List_new();
         for (unsigned int i = 0; i < size; i++) {
             List *pair = List_new();
-            // LispDatum *id = ids->items[i];
-            // LispDatum *dtm = datums->items[i];
-            LispDatum *id = keys[i];
-            LispDatum *dtm = values[i];
-            List_add(pair, id);
-            List_add(pair, dtm);
+            List_add(pair, (LispDatum*) ids[i]);
+            List_add(pair, datums[i]);
             List_add(list, (LispDatum*) pair);
         }
 
-        free(keys);
-        free(values);
+        free(ids);
+        free(datums);
 
         return (LispDatum*) list;
     }
 }
 
+static void mem_stats_add_pool(const Pool *pool, void *data)
+{
+    List *list = data;
+    List *entry = List_new();
+    List_add(entry, (LispDatum*) Symbol_intern(pool->name));
+    List_add(entry, (LispDatum*) Number_new(pool->live));
+    List_add(entry, (LispDatum*) Number_new(pool->peak));
+    List_add(entry, (LispDatum*) Number_new(pool->allocs));
+    List_add(entry, (LispDatum*) Number_new(pool->allocs ? pool->hits * 100 / pool->allocs : 0));
+    List_add(list, (LispDatum*) entry);
+}
+
+/* (mem-stats) : returns pool allocator statistics as a list of entries:
+ * (NAME LIVE PEAK ALLOCS HIT-RATE) for each pool, followed by
+ * (bytes LIVE PEAK RESERVED) for all pools together.
+ * HIT-RATE is the percentage of allocations that were served without calling malloc.
+ */
+static LispDatum *lisp_mem_stats(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    List *list = List_new();
+    Pool_foreach(mem_stats_add_pool, list);
+
+    List *bytes = List_new();
+    List_add(bytes, (LispDatum*) Symbol_intern("bytes"));
+    List_add(bytes, (LispDatum*) Number_new(Pool_live_bytes()));
+    List_add(bytes, (LispDatum*) Number_new(Pool_peak_bytes()));
+    List_add(bytes, (LispDatum*) Number_new(Pool_reserved_bytes()));
+    List_add(list, (LispDatum*) bytes);
+
+    return (LispDatum*) list;
+}
+
+static void gc_stats_add(List *list, const char *name, size_t val)
+{
+    List *entry = List_new();
+    List_add(entry, (LispDatum*) Symbol_intern(name));
+    List_add(entry, (LispDatum*) Number_new(val));
+    List_add(list, (LispDatum*) entry);
+}
+
+/* (gc-stats [threshold]) : returns statistics of the cycle collector:
+ * ((collections N) (freed N) (last-freed N) (tracked N) (threshold N))
+ * If threshold is given, it's set first: a collection happens once the number
+ * of tracked objects (frames and atoms) grows by that much, or by a few times as
+ * many as survived the last collection if that's more (see gc_isdue). */
+static LispDatum *lisp_gc_stats(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 1) {
+        throwf("gc-stats", "expected at most 1 argument, but %zu were given", args->len);
+        return NULL;
+    }
+    if (args->len == 1) {
+        const Number *threshold = verify_proc_arg_type(proc, args, 0, NUMBER);
+        if (!threshold) return NULL;
+        if (Number_isneg(threshold)) {
+            throwf("gc-stats", "threshold must not be negative");
+            return NULL;
+        }
+        gc_set_threshold(Number_tol(threshold));
+    }
+
+    const GcStats *stats = gc_stats();
+    List *list = List_new();
+    gc_stats_add(list, "collections", stats->collections);
+    gc_stats_add(list, "freed", stats->freed);
+    gc_stats_add(list, "last-freed", stats->last_freed);
+    gc_stats_add(list, "tracked", stats->tracked);
+    gc_stats_add(list, "threshold", stats->threshold);
+    return (LispDatum*) list;
+}
+
+// (gc) : collects garbage cycles once the current top-level form is evaluated
+static LispDatum *lisp_gc(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    gc_request();
+    return (LispDatum*) Nil_get();
+}
+
+// (profile-start) : starts profiling procedure applications, discarding the
+// previous profile
+static LispDatum *lisp_profile_start(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    prof_start();
+    return (LispDatum*) Nil_get();
+}
+
+/* (profile-report [path]) : stops profiling and prints the table of profiled
+ * procedures. If path is given, the samples are written to that file as folded
+ * stacks (the input of flamegraph.pl). */
+static LispDatum *lisp_profile_report(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 1) {
+        throwf("profile-report", "expected at most 1 argument, but %zu were given", args->len);
+        return NULL;
+    }
+
+    prof_report(stdout);
+
+    if (args->len == 1) {
+        String *path = verify_proc_arg_type(proc, args, 0, STRING);
+        if (!path) return NULL;
+
+        FILE *file = fopen(String_str(path), "w");
+        bool ok = file && prof_write_folded(file);
+        if (file && fclose(file) != 0)
+            ok = false;
+        if (!ok) {
+            throwf("profile-report", "failed to write %s", String_str(path));
+            return NULL;
+        }
+    }
+
+    return (LispDatum*) Nil_get();
+}
+
 // atom : creates a new Atom
 static LispDatum *lisp_atom(const Proc *proc, const Arr *args, MalEnv *env)
 {
@@ -529,53 +1018,91 @@ static LispDatum *lisp_atom_set_bang(const Proc *proc, const Arr *args, MalEnv *
     return arg1;
 }
 
-// cons : prepend a value to a list
+// cons : prepend a value to a list (or vector), the result shares the elements
+// of the given list/vector; a list that nothing else refers to is the result
 static LispDatum *lisp_cons(const Proc *proc, const Arr *args, MalEnv *env)
 {
+    LispDatum *arg0 = Arr_get(args, 0);
+    LispDatum *arg1 = Arr_get(args, 1);
+
+    if (LispDatum_istype(arg1, VECTOR))
+        return (LispDatum*) Vector_cons_new((Vector*) arg1, arg0);
+
     List *list = verify_proc_arg_type(proc, args, 1, LIST);
     if (!list) return NULL;
 
-    LispDatum *arg0 = Arr_get(args, 0);
-
+    if (vm_unique_arg(args, 1) && List_isreusable(list)) {
+        List_push(list, arg0);
+        return (LispDatum*) list;
+    }
     List *new_list = List_cons_new(list, arg0);
     return (LispDatum*) new_list;
 }
 
-// concat : concatenates given lists, if 0 arguments are given returns an empty list
+// concat : concatenates given lists (or vectors) into a list,
+// if 0 arguments are given returns an empty list
 static LispDatum *lisp_concat(const Proc *proc, const Arr *args, MalEnv *env)
 {
-    if (args->len == 0) {
-        return (LispDatum*) List_empty();
-    }
-
-    // verify argument types and find locations of the 1st and 2nd non-empty lists
-    size_t idxs[2] = { -1, -1 };
-    size_t j = 0;
+    // verify argument types and find the last non-empty list/vector
+    size_t last = args->len;
     for (size_t i = 0; i < args->len; i++) {
-        const List *list = verify_proc_arg_type(proc, args, i, LIST);
-        if (!list) return NULL;
-
-        if (j < 2 && !List_isempty(list)) {
-            idxs[j++] = i;
+        const LispDatum *arg = Arr_get(args, i);
+        if (LispDatum_istype(arg, LIST)) {
+            if (!List_isempty((List*) arg)) last = i;
+        }
+        else if (LispDatum_istype(arg, VECTOR)) {
+            if (!Vector_isempty((Vector*) arg)) last = i;
+        }
+        else {
+            throwf("concat", "bad arg no. %zd: expected LIST or VECTOR, but was %s",
+                    i + 1, LispType_name(LispDatum_type(arg)));
+            return NULL;
         }
     }
 
-    if (j == 0) 
+    if (last == args->len)
         return (LispDatum*) List_empty();
-    else if (j == 1) 
-        return Arr_get(args, idxs[0]);
-    else {
-        // copy the 1st non-empty list and append everything else to it
-        const List *first = Arr_get(args, idxs[0]);
-        List *new_list = List_shlw_copy(first);
 
-        for (size_t i = idxs[1]; i < args->len; i++) {
-            const List *list = Arr_get(args, i);
-            List_append(new_list, list);
+    // elements of all but the last one are copied; the last list is shared
+    // (appending to a shared list would modify it), and so is the first one if
+    // nothing else refers to it or to its nodes, it's appended to in place
+    size_t first = 0;
+    List *new_list;
+    if (last > 0 && vm_unique_arg(args, 0) && LispDatum_istype(Arr_get(args, 0), LIST)
+            && !List_isempty(Arr_get(args, 0)) && List_isexclusive(Arr_get(args, 0))) {
+        new_list = Arr_get(args, 0);
+        first = 1;
+    }
+    else
+        new_list = List_new();
+    for (size_t i = first; i < last; i++) {
+        const LispDatum *arg = Arr_get(args, i);
+        if (LispDatum_istype(arg, LIST)) {
+            for (struct Node *node = ((List*) arg)->head; node != NULL; node = node->next)
+                List_add(new_list, node->value);
         }
+        else {
+            const Vector *vec = (Vector*) arg;
+            for (size_t j = 0; j < Vector_len(vec); j++)
+                List_add(new_list, Vector_ref(vec, j));
+        }
+    }
 
-        return (LispDatum*) new_list;
+    LispDatum *arg_last = Arr_get(args, last);
+    if (LispDatum_istype(arg_last, VECTOR)) {
+        const Vector *vec = (Vector*) arg_last;
+        for (size_t j = 0; j < Vector_len(vec); j++)
+            List_add(new_list, Vector_ref(vec, j));
+    }
+    else if (List_isempty(new_list)) {
+        List_free(new_list);
+        return arg_last;
+    }
+    else {
+        List_append(new_list, (List*) arg_last);
     }
+
+    return (LispDatum*) new_list;
 }
 
 // macro?
@@ -624,61 +1151,106 @@ void core_def_procs(MalEnv *env)
         Symbol *_s = Symbol_intern(name); \
         MalEnv_put(env, _s, (LispDatum*) Proc_builtin(_s, arity, variadic, funp)); \
     }
+// a pure procedure, whose applications to constants are folded by the compiler
+#define DEF_PURE(name, arity, variadic, funp) \
+    { \
+        Symbol *_s = Symbol_intern(name); \
+        Proc *_p = Proc_builtin(_s, arity, variadic, funp); \
+        Proc_set_pure(_p); \
+        MalEnv_put(env, _s, (LispDatum*) _p); \
+    }
+// a procedure without side effects that isn't folded (see Proc_isfunctional)
+#define DEF_FUNC(name, arity, variadic, funp) \
+    { \
+        Symbol *_s = Symbol_intern(name); \
+        Proc *_p = Proc_builtin(_s, arity, variadic, funp); \
+        Proc_set_functional(_p); \
+        MalEnv_put(env, _s, (LispDatum*) _p); \
+    }
 
-    DEF("+", 2, true, lisp_add);
-    DEF("-", 2, true, lisp_sub);
-    DEF("*", 2, true, lisp_mul);
-    DEF("/", 2, true, lisp_div);
-    DEF("=", 2, false, lisp_eq);
-    DEF(">", 2, false, lisp_gt);
-    DEF("%", 2, false, lisp_mod);
-    DEF("even?", 1, false, lisp_evenp);
-    DEF("number?", 1, false, lisp_numberp);
-
-    DEF("symbol", 1, false, lisp_symbol);
-    DEF("symbol?", 1, false, lisp_symbolp);
-
-    DEF("string?", 1, false, lisp_stringp);
-
-    DEF("true?", 1, false, lisp_truep);
-    DEF("false?", 1, false, lisp_falsep);
-
-    DEF("list", 0, true, lisp_list);
-    DEF("list?", 1, false, lisp_listp);
-    DEF("empty?", 1, false, lisp_emptyp);
-    // DEF("count", 1, false, lisp_count);
-    DEF("list-ref", 2, false, lisp_list_ref);
-    DEF("list-rest", 1, false, lisp_list_rest);
-
-    DEF("nth", 2, false, lisp_nth);
-    DEF("rest", 1, false, lisp_rest);
+    DEF_PURE("+", 2, true, lisp_add);
+    DEF_PURE("-", 2, true, lisp_sub);
+    DEF_PURE("*", 2, true, lisp_mul);
+    DEF_PURE("/", 2, true, lisp_div);
+    DEF_PURE("=", 2, true, lisp_eq);
+    DEF_PURE(">", 2, true, lisp_gt);
+    DEF_PURE(">=", 2, true, lisp_ge);
+    DEF_PURE("<", 2, true, lisp_lt);
+    DEF_PURE("<=", 2, true, lisp_le);
+    DEF_PURE("%", 2, false, lisp_mod);
+    DEF_PURE("even?", 1, false, lisp_evenp);
+    DEF_PURE("zero?", 1, false, lisp_zerop);
+    DEF_PURE("negative?", 1, false, lisp_negativep);
+    DEF_PURE("positive?", 1, false, lisp_positivep);
+    DEF_PURE("number?", 1, false, lisp_numberp);
+
+    DEF_FUNC("symbol", 1, false, lisp_symbol);
+    DEF_PURE("symbol?", 1, false, lisp_symbolp);
+
+    DEF_PURE("string?", 1, false, lisp_stringp);
+
+    DEF_PURE("true?", 1, false, lisp_truep);
+    DEF_PURE("false?", 1, false, lisp_falsep);
+    DEF_PURE("not", 1, false, lisp_not);
+
+    DEF_FUNC("list", 0, true, lisp_list);
+    DEF_PURE("list?", 1, false, lisp_listp);
+    DEF_PURE("empty?", 1, false, lisp_emptyp);
+    DEF_PURE("count", 1, false, lisp_count);
+    DEF_FUNC("list-ref", 2, false, lisp_list_ref);
+    DEF_FUNC("list-rest", 1, false, lisp_list_rest);
+
+    DEF_PURE("vector?", 1, false, lisp_vectorp);
+    DEF_FUNC("vector", 0, true, lisp_vector);
+    DEF_FUNC("conj", 1, true, lisp_conj);
+
+    DEF_FUNC("nth", 2, false, lisp_nth);
+    DEF_FUNC("first", 1, false, lisp_first);
+    DEF_FUNC("rest", 1, false, lisp_rest);
+
+    DEF_PURE("map?", 1, false, lisp_mapp);
+    DEF_FUNC("hash-map", 0, true, lisp_hash_map);
+    DEF_FUNC("get", 2, true, lisp_get);
+    DEF_FUNC("contains?", 2, false, lisp_containsp);
+    DEF_FUNC("assoc", 1, true, lisp_assoc);
+    DEF_FUNC("dissoc", 1, true, lisp_dissoc);
+    DEF_FUNC("keys", 1, false, lisp_keys);
+    DEF_FUNC("vals", 1, false, lisp_vals);
 
     DEF("prn", 0, true, lisp_prn);
     DEF("pr-str", 0, true, lisp_pr_str);
-    DEF("str", 0, true, lisp_str);
+    DEF_PURE("str", 0, true, lisp_str);
+    DEF_PURE("string-length", 1, false, lisp_string_length);
+    DEF_PURE("substring", 2, true, lisp_substring);
+    DEF_PURE("string-append", 0, true, lisp_string_append);
     DEF("println", 0, true, lisp_println);
 
-    DEF("procedure?", 1, false, lisp_procedurep);
-    DEF("arity", 1, false, lisp_arity);
-    DEF("builtin?", 1, false, lisp_builtinp);
+    DEF_FUNC("procedure?", 1, false, lisp_procedurep);
+    DEF_FUNC("arity", 1, false, lisp_arity);
+    DEF_FUNC("builtin?", 1, false, lisp_builtinp);
 
     DEF("addr", 1, false, lisp_addr);
     DEF("refc", 1, false, lisp_refc);
-    DEF("type", 1, false, lisp_type);
+    DEF_FUNC("type", 1, false, lisp_type);
     DEF("env", 0, false, lisp_env);
+    DEF("mem-stats", 0, false, lisp_mem_stats);
+    DEF("gc-stats", 0, true, lisp_gc_stats);
+    DEF("gc", 0, false, lisp_gc);
+    DEF("profile-start", 0, false, lisp_profile_start);
+    DEF("profile-report", 0, true, lisp_profile_report);
 
     DEF("atom", 1, false, lisp_atom);
-    DEF("atom?", 1, false, lisp_atomp);
+    DEF_FUNC("atom?", 1, false, lisp_atomp);
     DEF("deref", 1, false, lisp_deref);
     DEF("atom-set!", 2, false, lisp_atom_set_bang);
 
-    DEF("cons", 2, false, lisp_cons);
-    DEF("concat", 0, true, lisp_concat);
+    DEF_FUNC("cons", 2, false, lisp_cons);
+    DEF_FUNC("concat", 0, true, lisp_concat);
 
-    DEF("macro?", 0, true, lisp_macrop);
+    DEF_FUNC("macro?", 0, true, lisp_macrop);
 
-    DEF("exn", 1, false, lisp_exn);
-    DEF("exn?", 1, false, lisp_exnp);
-    DEF("exn-datum", 1, false, lisp_exn_datum);
-    DEF("throw", 1, false, lisp_throw);
+    DEF_FUNC("exn", 1, false, lisp_exn);
+    DEF_FUNC("exn?", 1, false, lisp_exnp);
+    DEF_FUNC("exn-datum", 1, false, lisp_exn_datum);
+    DEF_FUNC("throw", 1, false, lisp_throw);
 }
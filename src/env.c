@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "types.h"
@@ -6,21 +7,49 @@
 #include "env.h"
 #include "common.h"
 #include "hashtbl.h"
+#include "pool.h"
+#include "threads.h"
 
+// symbols are interned, so their hash is computed only once
 static uint hash_symbol(const Symbol *sym)
 {
-    const char *name = Symbol_name(sym);
-    uint h = hash_simple_str(name);
-    return h;
+    return Symbol_hash(sym);
 }
 
+static Pool g_env_pool = POOL_INIT("env", MalEnv);
+
+// Bumped whenever the bindings of any top-level environment change, so that a
+// GlobalCache is validated by comparing a single number. It starts at 1, which
+// keeps zeroed caches invalid.
+static unsigned long g_root_version = 1;
+
 MalEnv *MalEnv_new(MalEnv *enclosing) {
-    MalEnv *env = malloc(sizeof(MalEnv));
+    if (enclosing)
+        return MalEnv_new_frame(enclosing, 0);
+
+    MalEnv *env = Pool_alloc(&g_env_pool);
     env->binds = HashTbl_new((hashkey_t) hash_symbol);
+    env->slots = NULL;
+    env->len = env->cap = env->nstatic = 0;
+    env->extended = false;
+    env->enclosing = NULL;
+    env->refc = 0;
+    return env;
+}
+
+MalEnv *MalEnv_new_frame(MalEnv *enclosing, unsigned nstatic) {
+    MalEnv *env = Pool_alloc(&g_env_pool);
+    env->binds = NULL;
+    env->len = 0;
+    env->cap = nstatic;
+    env->slots = nstatic ? Pool_alloc_sz(sizeof(Slot) * nstatic) : NULL;
+    env->nstatic = nstatic;
+    env->extended = false;
     env->enclosing = enclosing;
     if (enclosing)
         MalEnv_own(enclosing);
     env->refc = 0;
+    gc_track_env(env);
     return env;
 }
 
@@ -29,18 +58,79 @@ void MalEnv_free(MalEnv *env) {
         LOG_NULL(env);
         return;
     }
-    if (env->refc > 0) {
-        DEBUG("Refuse to free %p (refc %ld)", env, env->refc);
+    long refc = __atomic_load_n(&env->refc, __ATOMIC_RELAXED);
+    if (refc > 0) {
+        DEBUG("Refuse to free %p (refc %ld)", env, refc);
         return;
     }
 
     DEBUG("freeing MalEnv (refc = %ld)", env->refc);
 
-    HashTbl_free(env->binds, (free_t) LispDatum_rls_free, (free_t) LispDatum_rls_free);
+    if (env->binds) {
+        // another environment might be allocated at the same address
+        g_root_version++;
+        HashTbl_free(env->binds, (free_t) LispDatum_rls_free, (free_t) LispDatum_rls_free);
+    }
+    else {
+        if (!gc_untrack_env(env)) {
+            thread_defer((free_t) MalEnv_free, env);
+            return;
+        }
+        for (unsigned i = 0; i < env->len; i++) {
+            LispDatum_rls_free((LispDatum*) env->slots[i].id);
+            LispDatum_rls_free(env->slots[i].datum);
+        }
+        if (env->slots)
+            Pool_free_sz(env->slots, sizeof(Slot) * env->cap);
+    }
     // the enclosing env should not be freed, but simply released
     if (env->enclosing)
         MalEnv_release(env->enclosing);
-    free(env);
+    Pool_free(&g_env_pool, env);
+}
+
+void MalEnv_clear(MalEnv *env) {
+    unsigned len = env->len;
+    env->len = 0;
+    for (unsigned i = 0; i < len; i++) {
+        LispDatum_rls_free((LispDatum*) env->slots[i].id);
+        LispDatum_rls_free(env->slots[i].datum);
+    }
+
+    MalEnv *enclosing = env->enclosing;
+    env->enclosing = NULL;
+    if (enclosing)
+        MalEnv_rls_free(enclosing);
+}
+
+// returns the slot of a frame that binds id or NULL
+// symbols are interned, so they can be compared by identity
+static Slot *frame_find(const MalEnv *env, const Symbol *id)
+{
+    for (unsigned i = 0; i < env->len; i++) {
+        if (env->slots[i].id == id)
+            return &env->slots[i];
+    }
+    return NULL;
+}
+
+static void frame_append(MalEnv *env, Symbol *id, LispDatum *datum)
+{
+    if (env->len == env->cap) {
+        unsigned cap = env->cap ? env->cap * 2 : 4;
+        Slot *slots = Pool_alloc_sz(sizeof(Slot) * cap);
+        if (env->slots) {
+            memcpy(slots, env->slots, sizeof(Slot) * env->len);
+            Pool_free_sz(env->slots, sizeof(Slot) * env->cap);
+        }
+        env->slots = slots;
+        env->cap = cap;
+    }
+
+    if (env->len >= env->nstatic)
+        env->extended = true;
+
+    env->slots[env->len++] = (Slot) { .id = id, .datum = datum };
 }
 
 LispDatum *MalEnv_put(MalEnv *env, Symbol *id, LispDatum *datum) {
@@ -55,11 +145,30 @@ LispDatum *MalEnv_put(MalEnv *env, Symbol *id, LispDatum *datum) {
     if (LispDatum_type(datum) == PROCEDURE) {
         Proc *proc = (Proc*) datum;
         if (!Proc_isnamed(proc)) {
-            Proc_set_name(proc, id);
+            // the same procedure might be bound by other threads
+            if (g_threaded) thread_lock();
+            if (!Proc_isnamed(proc))
+                Proc_set_name(proc, id);
+            if (g_threaded) thread_unlock();
+        }
+    }
+
+    LispDatum *old = NULL;
+    if (env->binds) {
+        old = HashTbl_put(env->binds, id, datum, (keyeq_t) Symbol_eq);
+        g_root_version++;
+    }
+    else {
+        Slot *slot = frame_find(env, id);
+        if (slot) {
+            old = slot->datum;
+            slot->datum = datum;
+        }
+        else {
+            frame_append(env, id, datum);
         }
     }
 
-    LispDatum *old = HashTbl_put(env->binds, id, datum, (keyeq_t) Symbol_eq);
     if (old != NULL) // Symbol id is being bound to a different datum
         LispDatum_rls(old);
     else // first time entering Symbol id into this env, so let's own it
@@ -71,13 +180,55 @@ LispDatum *MalEnv_get(const MalEnv *env, const Symbol *id) {
     if (env == NULL)
         FATAL("env == NULL");
 
+    for (const MalEnv *e = env; e != NULL; e = e->enclosing) {
+        if (e->binds)
+            return HashTbl_get(e->binds, id, (keyeq_t) Symbol_eq);
+
+        const Slot *slot = frame_find(e, id);
+        if (slot)
+            return slot->datum;
+    }
+
+    return NULL;
+}
+
+LispDatum *MalEnv_get_addr(const MalEnv *env, unsigned depth, unsigned slot, const Symbol *id)
+{
     const MalEnv *e = env;
-    LispDatum *dtm = NULL;
-    while (e != NULL && dtm == NULL) {
-        dtm = HashTbl_get(e->binds, id, (keyeq_t) Symbol_eq);
+    for (unsigned d = 0; d < depth; d++) {
+        // anything bound dynamically in a frame on the way might shadow the binding
+        if (e->binds || e->extended)
+            return NULL;
         e = e->enclosing;
     }
 
+    if (e->binds || slot >= e->len || e->slots[slot].id != id)
+        return NULL;
+
+    return e->slots[slot].datum;
+}
+
+LispDatum *MalEnv_get_cached(const MalEnv *env, const Symbol *id, GlobalCache *cache)
+{
+    const MalEnv *e = env;
+    while (e->binds == NULL) {
+        const Slot *slot = frame_find(e, id);
+        if (slot)
+            return slot->datum;
+        if ((e = e->enclosing) == NULL)
+            return NULL;
+    }
+
+    if (cache && cache->root == e && cache->version == g_root_version)
+        return cache->datum;
+
+    LispDatum *dtm = HashTbl_get(e->binds, id, (keyeq_t) Symbol_eq);
+    // caches are shared by threads of a parallel section, which only read them
+    if (dtm && cache && !g_threaded) {
+        cache->root = e;
+        cache->datum = dtm;
+        cache->version = g_root_version;
+    }
     return dtm;
 }
 
@@ -87,6 +238,25 @@ MalEnv *MalEnv_enclosing_root(MalEnv *env)
     return env;
 }
 
+unsigned MalEnv_size(const MalEnv *env)
+{
+    return env->binds ? HashTbl_size(env->binds) : env->len;
+}
+
+void MalEnv_bindings(const MalEnv *env, Symbol **ids, LispDatum **datums)
+{
+    if (env->binds) {
+        HashTbl_keys(env->binds, (void**) ids);
+        HashTbl_values(env->binds, (void**) datums);
+        return;
+    }
+
+    for (unsigned i = 0; i < env->len; i++) {
+        ids[i] = env->slots[i].id;
+        datums[i] = env->slots[i].datum;
+    }
+}
+
 void MalEnv_own(MalEnv *env)
 {
     if (!env) {
@@ -94,23 +264,25 @@ void MalEnv_own(MalEnv *env)
         return;
     }
 
-    env->refc += 1;
+    REFC_INC(env->refc);
 }
 
-void MalEnv_release(MalEnv *env)
+long MalEnv_release(MalEnv *env)
 {
     if (env == NULL) {
         LOG_NULL(env);
-        return;
+        return 0;
     }
-    if (env->refc <= 0)
-        DEBUG("illegal attempt to decrement ref count = %ld", env->refc);
-
-    env->refc -= 1;
+    long refc = REFC_DEC(env->refc);
+    if (refc < 0)
+        DEBUG("illegal attempt to decrement ref count = %ld", refc + 1);
+    return refc;
 }
 
 void MalEnv_rls_free(MalEnv *env)
 {
-    MalEnv_release(env);
-    MalEnv_free(env);
+    // the count is tested by the thread that decremented it, so that only one of
+    // the threads releasing the last references frees the env
+    if (MalEnv_release(env) <= 0)
+        MalEnv_free(env);
 }
@@ -3,19 +3,48 @@
 #include "types.h"
 #include "stdbool.h"
 #include "hashtbl.h"
+#include "gc.h"
 
-/* This environment is an associative structure that maps identifiers to mal values */
+// a single binding of a frame
+typedef struct Slot {
+    Symbol *id;
+    LispDatum *datum;
+} Slot;
+
+/* This environment is an associative structure that maps identifiers to mal values.
+ * The top-level environment keeps its bindings in a hash table. Every other
+ * environment is a frame (of a procedure application, let*, catch*) that keeps
+ * its bindings in a flat array of slots, so that a binding can also be addressed
+ * by its lexical address (depth, slot) which is resolved ahead of evaluation.
+ */
 typedef struct MalEnv {
-    HashTbl *binds; // Symbol* -> LispDatum*
+    HashTbl *binds; // Symbol* -> LispDatum*, NULL for frames
+    // frame bindings, the first nstatic of them are laid out in the order
+    // known ahead of evaluation (e.g., procedure parameters)
+    Slot *slots;
+    unsigned len;
+    unsigned cap;
+    unsigned nstatic;
+    // true if bindings beyond the static layout were added (e.g., by def!),
+    // which invalidates lexical addresses that reach past this frame
+    bool extended;
     struct MalEnv *enclosing;
     long refc;    // reference count
+    GcLink gc;    // frames can close cycles, so they are tracked (see gc.h)
 } MalEnv;
 
 // Creates a new environment that is enclosed by the given environment.
 // env might be NULL when a top-level environment is created.
 MalEnv *MalEnv_new(MalEnv *env);
 
+// Creates a new frame enclosed by the given environment, whose first nstatic
+// bindings follow a static layout (see lexical addressing in mylisp.c).
+MalEnv *MalEnv_new_frame(MalEnv *env, unsigned nstatic);
+
 void MalEnv_free(MalEnv *env);
+// releases the bindings and the enclosing environment of a frame, leaving it
+// empty (used by the cycle collector)
+void MalEnv_clear(MalEnv *env);
 
 /* Associates a LispDatum with an identifier.
  * If the given identifier was already associated with some datum, returns that datum,
@@ -28,10 +57,36 @@ LispDatum *MalEnv_puts(MalEnv *env, const char *id, LispDatum *datum);
 LispDatum *MalEnv_get(const MalEnv *env, const Symbol *id);
 LispDatum *MalEnv_gets(const MalEnv *env, const char *id);
 
+/* Returns the LispDatum bound to id at the given lexical address or NULL if
+ * the address is no longer valid (in which case MalEnv_get should be used).
+ * depth is the number of frames to go up, slot is the index of the binding. */
+LispDatum *MalEnv_get_addr(const MalEnv *env, unsigned depth, unsigned slot, const Symbol *id);
+
+/* Inline cache of a top-level binding, kept by a site that looks up the same
+ * symbol over and over (see OP_GLOBAL in vm.c). A zeroed cache is empty. */
+typedef struct GlobalCache {
+    const MalEnv *root;
+    LispDatum *datum;
+    unsigned long version; // of top-level bindings when the cache was filled
+} GlobalCache;
+
+/* Like MalEnv_get, but the lookup in the top-level environment is answered by
+ * the cache as long as no top-level binding was added or replaced since it was
+ * filled. Frames on the way are still searched, they might shadow the binding.
+ * cache may be NULL, and isn't filled during a parallel section (see threads.h). */
+LispDatum *MalEnv_get_cached(const MalEnv *env, const Symbol *id, GlobalCache *cache);
+
 // returns the top-most enclosing environment of the given one
 MalEnv *MalEnv_enclosing_root(MalEnv *env);
 
+// number of bindings in the given environment (enclosing ones are not considered)
+unsigned MalEnv_size(const MalEnv *env);
+// populates ids and datums with the bindings of the given environment,
+// arrays must be large enough
+void MalEnv_bindings(const MalEnv *env, Symbol **ids, LispDatum **datums);
+
 // reference counting
 void MalEnv_own(MalEnv *env);
-void MalEnv_release(MalEnv *env);
+// returns the new reference count
+long MalEnv_release(MalEnv *env);
 void MalEnv_rls_free(MalEnv *env);
@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "gc.h"
+#include "types.h"
+#include "env.h"
+#include "hashtbl.h"
+#include "utils.h"
+#include "threads.h"
+#include "vm.h"
+#include "common.h"
+
+#define GC_DEF_THRESHOLD 10000
+// growth of tracked objects that triggers a collection per survivor of the last one
+#define GC_SURVIVOR_GROWTH 4
+
+// tracked objects, each list is headed by a sentinel
+static GcLink g_envs = { &g_envs, &g_envs };
+static GcLink g_atoms = { &g_atoms, &g_atoms };
+
+static GcStats g_stats = { .threshold = GC_DEF_THRESHOLD };
+// number of tracked objects after the last collection
+static size_t g_tracked_base = 0;
+static bool g_requested = false;
+static bool g_collecting = false;
+
+// Objects created by a worker thread are tracked in lists of its own, since
+// most of them are frames that live as long as a single application and locking
+// shared lists twice per application wouldn't scale. Only the owner of an object
+// can unlink it during a parallel section, other threads defer freeing it. The
+// lists are moved to the shared ones at the end of the section.
+typedef struct GcThreadLists {
+    GcLink envs;
+    GcLink atoms;
+    size_t tracked;
+} GcThreadLists;
+
+static __thread GcThreadLists *t_lists = NULL; // NULL on the main thread
+static GcThreadLists *g_thread_lists[THREADS_MAX];
+
+#define CONTAINER_OF(link, type) ((type*) ((char*) (link) - offsetof(type, gc)))
+
+static void link_insert(GcLink *head, GcLink *link)
+{
+    link->prev = head;
+    link->next = head->next;
+    link->owner = thread_index();
+    head->next->prev = link;
+    head->next = link;
+    if (t_lists)
+        t_lists->tracked++;
+    else
+        g_stats.tracked++;
+}
+
+static bool link_remove(GcLink *link)
+{
+    if (link->owner != thread_index())
+        return false;
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    if (t_lists)
+        t_lists->tracked--;
+    else
+        g_stats.tracked--;
+    return true;
+}
+
+void gc_track_env(MalEnv *env)
+{
+    link_insert(t_lists ? &t_lists->envs : &g_envs, &env->gc);
+}
+
+bool gc_untrack_env(MalEnv *env)
+{
+    return link_remove(&env->gc);
+}
+
+void gc_track_atom(Atom *atom)
+{
+    link_insert(t_lists ? &t_lists->atoms : &g_atoms, &atom->gc);
+}
+
+bool gc_untrack_atom(Atom *atom)
+{
+    return link_remove(&atom->gc);
+}
+
+void gc_thread_init()
+{
+    GcThreadLists *lists = malloc(sizeof(GcThreadLists));
+    if (lists == NULL)
+        FATAL("out of memory (gc lists of a thread)");
+    lists->envs = (GcLink) { &lists->envs, &lists->envs, 0 };
+    lists->atoms = (GcLink) { &lists->atoms, &lists->atoms, 0 };
+    lists->tracked = 0;
+    t_lists = lists;
+    g_thread_lists[thread_index()] = lists;
+}
+
+// moves the objects of list from to the list head, which belongs to the main thread
+static void list_splice(GcLink *head, GcLink *from)
+{
+    if (from->next == from) return;
+    for (GcLink *link = from->next; link != from; link = link->next)
+        link->owner = 0;
+
+    from->next->prev = head;
+    from->prev->next = head->next;
+    head->next->prev = from->prev;
+    head->next = from->next;
+    from->next = from->prev = from;
+}
+
+void gc_join_threads()
+{
+    for (unsigned i = 1; i < THREADS_MAX; i++) {
+        GcThreadLists *lists = g_thread_lists[i];
+        if (lists == NULL) continue;
+        list_splice(&g_envs, &lists->envs);
+        list_splice(&g_atoms, &lists->atoms);
+        g_stats.tracked += lists->tracked;
+        lists->tracked = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Collection
+
+// kinds of examined objects
+typedef enum {
+    V_DATUM, // List, Vector, HashMap, LazySeq, Atom or language-defined Proc
+    V_NODE,  // struct Node
+    V_VECBUF,
+    V_HAMTNODE,
+    V_ENV    // frame
+} VertexKind;
+
+typedef struct Vertex {
+    void *ptr;
+    VertexKind kind;
+    // reference count minus the references from other examined objects
+    long gc_refs;
+    bool reachable;
+} Vertex;
+
+typedef struct Collector {
+    HashTbl *index; // object -> index of its vertex + 1
+    Vertex *vtx;
+    size_t len;
+    size_t cap;
+    Arr *work;      // indices of vertices yet to be visited
+} Collector;
+
+static uint ptr_hash(const void *ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    return (uint) (p ^ (p >> 32));
+}
+
+static bool ptr_eq(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static void noop_free(void *ptr) { }
+
+static long refcount(const void *ptr, VertexKind kind)
+{
+    switch (kind) {
+        case V_DATUM: return LispDatum_refc(ptr);
+        case V_NODE: return ((struct Node*) ptr)->refc;
+        case V_VECBUF: return ((struct VecBuf*) ptr)->refc;
+        case V_HAMTNODE: return ((struct HamtNode*) ptr)->refc;
+        case V_ENV: return ((MalEnv*) ptr)->refc;
+    }
+    return 0;
+}
+
+// returns true if the datum can refer to a tracked object
+static bool isvertex_datum(const LispDatum *dtm)
+{
+    if (dtm == NULL || LispDatum_isimm(dtm) || dtm == (LispDatum*) List_empty())
+        return false;
+
+    switch (LispDatum_type(dtm)) {
+        case LIST:
+        case VECTOR:
+        case HASHMAP:
+        case LAZYSEQ:
+        case ATOM:
+            return true;
+        case PROCEDURE:
+            return !Proc_isbuiltin((Proc*) dtm);
+        default:
+            return false;
+    }
+}
+
+typedef void (*child_fn)(Collector *gc, void *ptr, VertexKind kind);
+
+static void visit_datum(Collector *gc, LispDatum *dtm, child_fn fn)
+{
+    if (isvertex_datum(dtm))
+        fn(gc, dtm, V_DATUM);
+}
+
+static void visit_env(Collector *gc, MalEnv *env, child_fn fn)
+{
+    // the top-level environment is a root
+    if (env != NULL && env->binds == NULL)
+        fn(gc, env, V_ENV);
+}
+
+// applies fn to each examinable object that the given one holds a reference to
+static void children(Collector *gc, const Vertex *v, child_fn fn)
+{
+    switch (v->kind) {
+        case V_DATUM: {
+            LispDatum *dtm = v->ptr;
+            switch (LispDatum_type(dtm)) {
+                case LIST: {
+                    struct Node *head = ((List*) dtm)->head;
+                    if (head) fn(gc, head, V_NODE);
+                    break;
+                }
+                case VECTOR: {
+                    struct VecBuf *buf = ((Vector*) dtm)->buf;
+                    if (buf) fn(gc, buf, V_VECBUF);
+                    break;
+                }
+                case HASHMAP: {
+                    struct HamtNode *root = ((HashMap*) dtm)->root;
+                    if (root) fn(gc, root, V_HAMTNODE);
+                    break;
+                }
+                case LAZYSEQ:
+                    // the numbers of a range can't close a cycle
+                    visit_datum(gc, ((LazySeq*) dtm)->src, fn);
+                    visit_datum(gc, (LispDatum*) ((LazySeq*) dtm)->proc, fn);
+                    break;
+                case ATOM:
+                    visit_datum(gc, Atom_deref((Atom*) dtm), fn);
+                    break;
+                case PROCEDURE: {
+                    Proc *proc = (Proc*) dtm;
+                    visit_datum(gc, (LispDatum*) proc->logic.body, fn);
+                    visit_env(gc, proc->env, fn);
+                    break;
+                }
+                default:
+                    break;
+            }
+            break;
+        }
+        case V_NODE: {
+            struct Node *node = v->ptr;
+            visit_datum(gc, node->value, fn);
+            if (node->next) fn(gc, node->next, V_NODE);
+            break;
+        }
+        case V_VECBUF: {
+            struct VecBuf *buf = v->ptr;
+            for (uint32_t i = buf->lo; i < buf->hi; i++)
+                visit_datum(gc, buf->items[i], fn);
+            break;
+        }
+        case V_HAMTNODE: {
+            struct HamtNode *node = v->ptr;
+            for (uint32_t i = 0; i < node->len; i++) {
+                const struct HamtEntry *entry = &node->entries[i];
+                if (entry->key) {
+                    visit_datum(gc, entry->key, fn);
+                    visit_datum(gc, entry->u.val, fn);
+                }
+                else {
+                    fn(gc, entry->u.node, V_HAMTNODE);
+                }
+            }
+            break;
+        }
+        case V_ENV: {
+            MalEnv *env = v->ptr;
+            for (unsigned i = 0; i < env->len; i++)
+                visit_datum(gc, env->slots[i].datum, fn);
+            visit_env(gc, env->enclosing, fn);
+            break;
+        }
+    }
+}
+
+// returns the index of the vertex of an object or -1 if it wasn't discovered
+static long vertex_idx(const Collector *gc, const void *ptr)
+{
+    return (long) (uintptr_t) HashTbl_get(gc->index, ptr, ptr_eq) - 1;
+}
+
+static void work_push(Collector *gc, size_t idx)
+{
+    Arr_add(gc->work, (void*) (uintptr_t) idx);
+}
+
+static size_t work_pop(Collector *gc)
+{
+    size_t idx = (uintptr_t) Arr_get(gc->work, gc->work->len - 1);
+    gc->work->len--;
+    return idx;
+}
+
+// adds a vertex of an object that hasn't been discovered yet
+static size_t vertex_add(Collector *gc, void *ptr, VertexKind kind)
+{
+    if (gc->len == gc->cap) {
+        gc->cap = gc->cap ? gc->cap * 2 : 1024;
+        gc->vtx = realloc(gc->vtx, sizeof(Vertex) * gc->cap);
+    }
+    gc->vtx[gc->len] = (Vertex) {
+        .ptr = ptr, .kind = kind, .gc_refs = refcount(ptr, kind), .reachable = false
+    };
+    HashTbl_put(gc->index, ptr, (void*) (uintptr_t) (gc->len + 1), ptr_eq);
+    work_push(gc, gc->len);
+    return gc->len++;
+}
+
+// discovers the referenced object and subtracts the reference from its count
+static void discover_child(Collector *gc, void *ptr, VertexKind kind)
+{
+    long idx = vertex_idx(gc, ptr);
+    if (idx < 0)
+        idx = vertex_add(gc, ptr, kind);
+    gc->vtx[idx].gc_refs--;
+}
+
+static void mark_child(Collector *gc, void *ptr, VertexKind kind)
+{
+    long idx = vertex_idx(gc, ptr);
+    if (!gc->vtx[idx].reachable) {
+        gc->vtx[idx].reachable = true;
+        work_push(gc, idx);
+    }
+}
+
+// marks a root that the VM refers to (see vm_roots)
+static void mark_root(void *ptr, bool isenv, void *data)
+{
+    Collector *gc = data;
+    if (!isenv && !isvertex_datum(ptr)) return;
+
+    long idx = vertex_idx(gc, ptr);
+    if (idx >= 0 && !gc->vtx[idx].reachable) {
+        gc->vtx[idx].reachable = true;
+        work_push(gc, idx);
+    }
+}
+
+static void discover(Collector *gc, GcLink *head, bool envs)
+{
+    for (GcLink *link = head->next; link != head; link = link->next) {
+        void *ptr = envs ? (void*) CONTAINER_OF(link, MalEnv) : (void*) CONTAINER_OF(link, Atom);
+        if (vertex_idx(gc, ptr) < 0)
+            vertex_add(gc, ptr, envs ? V_ENV : V_DATUM);
+    }
+
+    while (gc->work->len > 0) {
+        // a copy, since the array of vertices may be reallocated
+        Vertex v = gc->vtx[work_pop(gc)];
+        children(gc, &v, discover_child);
+    }
+}
+
+// frees garbage: frames and datums, nodes and buffers are freed along with them
+static size_t sweep(Collector *gc)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < gc->len; i++) {
+        Vertex *v = &gc->vtx[i];
+        if (v->reachable || v->kind == V_NODE || v->kind == V_VECBUF || v->kind == V_HAMTNODE)
+            continue;
+        gc->vtx[n++] = *v;
+    }
+
+    // first the objects are held and cleared, so that none of them is freed while
+    // the references among them are being dropped
+    for (size_t i = 0; i < n; i++) {
+        if (gc->vtx[i].kind == V_ENV)
+            MalEnv_own(gc->vtx[i].ptr);
+        else
+            LispDatum_own(gc->vtx[i].ptr);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = gc->vtx[i].ptr;
+        if (gc->vtx[i].kind == V_ENV) {
+            MalEnv_clear(ptr);
+            continue;
+        }
+        switch (LispDatum_type(ptr)) {
+            case LIST: List_clear(ptr); break;
+            case VECTOR: Vector_clear(ptr); break;
+            case HASHMAP: HashMap_clear(ptr); break;
+            case LAZYSEQ: LazySeq_clear(ptr); break;
+            case ATOM: Atom_clear(ptr); break;
+            case PROCEDURE: Proc_clear(ptr); break;
+            default: break;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (gc->vtx[i].kind == V_ENV)
+            MalEnv_rls_free(gc->vtx[i].ptr);
+        else
+            LispDatum_rls_free(gc->vtx[i].ptr);
+    }
+
+    return n;
+}
+
+size_t gc_collect()
+{
+    if (g_collecting || g_threaded) return 0;
+    g_collecting = true;
+
+    Collector gc = {
+        .index = HashTbl_newc(1024, ptr_hash),
+        .work = Arr_newn(64)
+    };
+
+    // 1. discover everything reachable from tracked objects, subtracting the
+    //    references among them
+    discover(&gc, &g_envs, true);
+    discover(&gc, &g_atoms, false);
+
+    // 2. objects that are still referenced are reachable from outside, and so is
+    //    everything they refer to, as well as everything the VM refers to
+    vm_roots(mark_root, &gc);
+    bool consistent = true;
+    for (size_t i = 0; i < gc.len; i++) {
+        if (gc.vtx[i].gc_refs < 0) {
+            // some reference wasn't counted, don't trust the counts then
+            DEBUG("negative gc_refs of %p (kind %d)", gc.vtx[i].ptr, gc.vtx[i].kind);
+            consistent = false;
+        }
+        if (gc.vtx[i].gc_refs != 0 && !gc.vtx[i].reachable) {
+            gc.vtx[i].reachable = true;
+            work_push(&gc, i);
+        }
+    }
+    while (gc.work->len > 0) {
+        Vertex v = gc.vtx[work_pop(&gc)];
+        children(&gc, &v, mark_child);
+    }
+
+    // 3. free what's left
+    size_t freed = consistent ? sweep(&gc) : 0;
+
+    free(gc.vtx);
+    Arr_free(gc.work);
+    HashTbl_free(gc.index, noop_free, noop_free);
+
+    g_stats.collections++;
+    g_stats.freed += freed;
+    g_stats.last_freed = freed;
+    g_tracked_base = g_stats.tracked;
+    g_requested = false;
+    g_collecting = false;
+
+    return freed;
+}
+
+bool gc_isdue()
+{
+    size_t growth = GC_SURVIVOR_GROWTH * g_tracked_base;
+    if (growth < g_stats.threshold)
+        growth = g_stats.threshold;
+    return g_requested || g_stats.tracked >= g_tracked_base + growth;
+}
+
+void gc_maybe_collect()
+{
+    if (gc_isdue())
+        gc_collect();
+}
+
+void gc_request()
+{
+    g_requested = true;
+}
+
+const GcStats *gc_stats()
+{
+    return &g_stats;
+}
+
+void gc_set_threshold(size_t threshold)
+{
+    g_stats.threshold = threshold;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Cycle collector.
+ * Memory is managed by reference counting, which never reclaims a cycle of
+ * references, e.g., a procedure that is bound in the frame it encloses:
+ *     (let* ((f (lambda (n) (if (= n 0) 0 (f (- n 1)))))) (f 10))
+ * The collector finds such cycles by trial deletion (like the one of CPython):
+ * it subtracts the references among the examined objects from their reference
+ * counts, so that what remains are references from outside (the top-level
+ * environment, bytecode, the C stack). Objects that can't be reached from any
+ * of them are garbage.
+ *
+ * A cycle can only be closed through a mutable object, that is a frame (which
+ * gets bindings after it's created) or an atom, so only these are tracked. A
+ * collection examines everything reachable from them (lists, vectors, hash-maps,
+ * lazy sequences, procedures and other frames), except the top-level environment.
+ *
+ * References held by C code aren't always reference counted (e.g., a builtin
+ * procedure may keep a datum that it's building), so a collection happens only at
+ * a safe point, where whatever C code refers to is owned:
+ *  - between evaluating top-level forms (see enter in mylisp.c);
+ *  - at a call in the outermost run of the VM (see vm_run), so that a long-running
+ *    form (e.g., the main loop of a daemon) gets collections too. Below that run
+ *    there are only the host, eval of a top-level form and built-in procedures
+ *    applied by it, which own what they refer to. Calls in nested runs (e.g., of a
+ *    procedure applied by map from compiled code) aren't safe points.
+ * Values on the VM stack and the frames of suspended activations and handlers are
+ * owned by the VM, and the collector also marks them as roots (see vm_roots), as
+ * it does the top-level environment and whatever owns datums outside of the
+ * examined objects.
+ */
+
+// intrusive link of a tracked object
+typedef struct GcLink {
+    struct GcLink *prev;
+    struct GcLink *next;
+    unsigned owner; // index of the thread whose list holds it (see threads.h)
+} GcLink;
+
+struct MalEnv;
+struct Atom;
+
+// Frames and atoms are tracked from their creation until they are freed.
+// Untracking returns false if the object belongs to another thread of a parallel
+// section, then it has to be freed once the section is over (see thread_defer).
+void gc_track_env(struct MalEnv *env);
+bool gc_untrack_env(struct MalEnv *env);
+void gc_track_atom(struct Atom *atom);
+bool gc_untrack_atom(struct Atom *atom);
+
+// a worker thread gets lists of its own (see gc.c), before it creates anything
+void gc_thread_init();
+// Moves the objects tracked by worker threads to the lists of the main thread,
+// at the end of a parallel section. Collections don't happen during one.
+void gc_join_threads();
+
+// True if the number of tracked objects has grown by the threshold since the last
+// collection, or if a collection was requested. The growth is also at least a few
+// times the number of objects that survived the last collection, so that the work
+// of collections stays proportional to the number of objects created even when
+// lots of them are live (e.g., frames of a deep recursion).
+bool gc_isdue();
+// Collects garbage cycles if gc_isdue. Should only be called at a safe point.
+void gc_maybe_collect();
+// Collects garbage cycles and returns the number of freed objects.
+// Should only be called at a safe point.
+size_t gc_collect();
+// requests a collection at the next safe point
+void gc_request();
+
+typedef struct GcStats {
+    size_t collections; // number of collections so far
+    size_t freed;       // objects freed by all collections
+    size_t last_freed;  // objects freed by the last collection
+    size_t tracked;     // frames and atoms currently alive
+    size_t threshold;   // least growth of tracked objects that triggers a collection
+} GcStats;
+
+const GcStats *gc_stats();
+void gc_set_threshold(size_t threshold);
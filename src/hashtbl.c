@@ -2,55 +2,72 @@
 #include <stdlib.h>
 #include "hashtbl.h"
 #include "common.h"
-
-#define DEFAULT_CAPACITY 16
-#define SIZE_THRESH_RATIO 0.75
+#include "pool.h"
+
+// Open addressing with linear probing.
+// Entries are stored inline in a power-of-2 sized array together with the hash
+// of their key, so that probing rarely has to call keyeq on a mismatch.
+// A slot is empty if its key is NULL (keys are never NULL).
+// Tables of up to INLINE_CAPACITY entries keep them in the table itself.
+
+#define INLINE_CAPACITY 4
+#define DEFAULT_CAPACITY INLINE_CAPACITY
+// grow when size exceeds 3/4 of capacity
+#define SIZE_THRESH(cap) ((cap) / 4 * 3)
 #define GROW_RATIO 2
 
-typedef struct Bucket {
+typedef struct Entry {
+    uint hash;
     const void *key;
     const void *val;
-    struct Bucket *next;
-} Bucket;
-
-static Bucket *Bucket_new(const void *key, const void *val) {
-    Bucket *bkt = malloc(sizeof(Bucket));
-    bkt->key = key;
-    bkt->val = val;
-    bkt->next = NULL;
-    return bkt;
-}
-
-static void Bucket_free(Bucket *bkt, const free_t keyfree, const free_t valfree)
-{
-    Bucket *b = bkt;
-    while (b) {
-        keyfree((void*) b->key);
-        valfree((void*) b->val);
-        Bucket *tmp = b;
-        b = b->next;
-        free(tmp);
-    }
+} Entry;
+
+typedef struct HashTbl {
+    uint size;
+    uint cap; // always a power of 2
+    uint shift; // 32 - log2(cap), cap is at least INLINE_CAPACITY
+    Entry *entries;
+    hashkey_t hashkey;
+    Entry inl[INLINE_CAPACITY];
+} HashTbl;
+
+static Pool g_tbl_pool = POOL_INIT("hashtbl", HashTbl);
+
+static Entry *entries_new(uint cap)
+{
+    Entry *entries = Pool_alloc_sz(sizeof(Entry) * cap);
+    for (uint i = 0; i < cap; i++)
+        entries[i].key = NULL;
+    return entries;
 }
 
-static void *Bucket_find(const Bucket *bkt, const void *key, const keyeq_t keyeq)
+static void entries_free(HashTbl *tbl)
 {
-    while (bkt) {
-        if (keyeq(bkt->key, key)) 
-            return (void*) bkt->val;
-        bkt = bkt->next;
+    if (tbl->entries != tbl->inl)
+        Pool_free_sz(tbl->entries, sizeof(Entry) * tbl->cap);
+}
+
+static void HashTbl_init_entries(HashTbl *tbl, uint cap)
+{
+    uint log2cap = 0;
+    while ((1u << log2cap) < cap) log2cap++;
+    cap = 1u << log2cap;
+
+    if (cap <= INLINE_CAPACITY) {
+        cap = INLINE_CAPACITY;
+        while ((1u << log2cap) < cap) log2cap++;
+        tbl->entries = tbl->inl;
+        for (uint i = 0; i < cap; i++)
+            tbl->entries[i].key = NULL;
+    }
+    else {
+        tbl->entries = entries_new(cap);
     }
 
-    return NULL;
+    tbl->cap = cap;
+    tbl->shift = 32 - log2cap;
 }
 
-typedef struct HashTbl {
-    uint size;
-    uint cap;
-    Bucket **buckets;
-    hashkey_t hashkey;
-} HashTbl;
-
 HashTbl *HashTbl_new(hashkey_t hashkey)
 {
     return HashTbl_newc(DEFAULT_CAPACITY, hashkey);
@@ -58,13 +75,9 @@ HashTbl *HashTbl_new(hashkey_t hashkey)
 
 HashTbl *HashTbl_newc(uint cap, hashkey_t hashkey)
 {
-    HashTbl *tbl = malloc(sizeof(HashTbl));
-    tbl->buckets = malloc(sizeof(Bucket*) * cap);
-    for (uint i = 0; i < cap; i++) {
-        tbl->buckets[i] = NULL;
-    }
+    HashTbl *tbl = Pool_alloc(&g_tbl_pool);
+    HashTbl_init_entries(tbl, cap);
     tbl->size = 0;
-    tbl->cap = cap;
     tbl->hashkey = hashkey;
     return tbl;
 }
@@ -72,123 +85,132 @@ HashTbl *HashTbl_newc(uint cap, hashkey_t hashkey)
 void HashTbl_free(HashTbl *tbl, free_t keyfree, free_t valfree)
 {
     for (uint i = 0; i < tbl->cap; i++) {
-        Bucket *bkt = tbl->buckets[i];
-        if (bkt)
-            Bucket_free(bkt, keyfree, valfree);
+        Entry *e = &tbl->entries[i];
+        if (e->key) {
+            keyfree((void*) e->key);
+            valfree((void*) e->val);
+        }
     }
-    free(tbl->buckets);
-    free(tbl);
+    entries_free(tbl);
+    Pool_free(&g_tbl_pool, tbl);
 }
 
-static uint HashTbl_keyidx(const HashTbl *tbl, const void *key)
+// Fibonacci hashing spreads the hash over the high bits, so that weak hashes
+// don't cluster in the low ones
+static uint HashTbl_home(const HashTbl *tbl, uint hash)
 {
-    return tbl->hashkey(key) % tbl->cap;
+    return (uint) (hash * 2654435769u) >> tbl->shift;
 }
 
-static void try_grow(HashTbl *tbl)
+// returns the index of the entry with the given key, or of the empty slot
+// where it would be inserted
+static uint HashTbl_probe(const HashTbl *tbl, const void *key, uint hash, const keyeq_t keyeq)
 {
-    if (tbl->size < SIZE_THRESH_RATIO * tbl->cap)
-        return;
+    uint mask = tbl->cap - 1;
+    uint idx = HashTbl_home(tbl, hash);
+    while (1) {
+        const Entry *e = &tbl->entries[idx];
+        if (e->key == NULL || (e->hash == hash && keyeq(e->key, key)))
+            return idx;
+        idx = (idx + 1) & mask;
+    }
+}
 
-    uint newcap = tbl->cap * GROW_RATIO;
-    DEBUG("Growing HashTbl %u -> %u", tbl->cap, newcap);
+static void grow(HashTbl *tbl)
+{
     uint oldcap = tbl->cap;
-    tbl->cap = newcap;
-
-    // 1. allocate memory for a new array of buckets
-    // 2. recalculate hashes to get a new position of each bucket and put it
-    // into the new array
-    // 3. free memory used by the previous bucket array
-
-    Bucket **new_buckets = malloc(sizeof(Bucket*) * newcap);
-    for (uint i = 0; i < newcap; i++)
-        new_buckets[i] = NULL;
+    uint newcap = oldcap * GROW_RATIO;
+    DEBUG("Growing HashTbl %u -> %u", oldcap, newcap);
+
+    // move entries into a new array; their hashes are cached, so keys are
+    // neither rehashed nor compared
+    Entry old_inl[INLINE_CAPACITY];
+    Entry *old_entries = tbl->entries;
+    if (old_entries == tbl->inl) {
+        for (uint i = 0; i < oldcap; i++)
+            old_inl[i] = tbl->inl[i];
+        old_entries = old_inl;
+    }
 
+    HashTbl_init_entries(tbl, newcap);
+    uint mask = tbl->cap - 1;
     for (uint i = 0; i < oldcap; i++) {
-        Bucket *bkt = tbl->buckets[i];
-        if (!bkt)
+        const Entry *e = &old_entries[i];
+        if (e->key == NULL)
             continue;
-
-        // go through all buckets at the current index
-        while (bkt) {
-            Bucket *next_bkt = bkt->next;
-
-            uint newidx = HashTbl_keyidx(tbl, bkt->key);
-            Bucket *curr_bkt = new_buckets[newidx];
-            new_buckets[newidx] = bkt;
-            bkt->next = curr_bkt;
-
-            bkt = next_bkt;
-        }
+        uint idx = HashTbl_home(tbl, e->hash);
+        while (tbl->entries[idx].key != NULL)
+            idx = (idx + 1) & mask;
+        tbl->entries[idx] = *e;
     }
 
-    free(tbl->buckets);
-    tbl->buckets = new_buckets;
-
-    DEBUG("Grew HashTbl %u -> %u\n", oldcap, newcap);
+    if (old_entries != old_inl)
+        Pool_free_sz(old_entries, sizeof(Entry) * oldcap);
 }
 
 void *HashTbl_get(const HashTbl *tbl, const void *key, const keyeq_t keyeq)
 {
-    uint idx = HashTbl_keyidx(tbl, key);
-    Bucket *bkt = tbl->buckets[idx];
-    if (!bkt)
-        return NULL;
-    else
-        return Bucket_find(bkt, key, keyeq);
+    return HashTbl_get_hashed(tbl, key, tbl->hashkey(key), keyeq);
 }
 
-void *HashTbl_put(HashTbl *tbl, const void *key, const void *val, const keyeq_t keyeq)
+void *HashTbl_get_hashed(const HashTbl *tbl, const void *key, uint hash, const keyeq_t keyeq)
 {
-    try_grow(tbl);
-
-    // TODO optimise: compute hash only once
-    void *popd = HashTbl_pop(tbl, key, keyeq);
+    uint idx = HashTbl_probe(tbl, key, hash, keyeq);
+    const Entry *e = &tbl->entries[idx];
+    return e->key ? (void*) e->val : NULL;
+}
 
-    Bucket *bkt_new = Bucket_new(key, val);
+void *HashTbl_put(HashTbl *tbl, const void *key, const void *val, const keyeq_t keyeq)
+{
+    uint hash = tbl->hashkey(key);
+    uint idx = HashTbl_probe(tbl, key, hash, keyeq);
+    Entry *e = &tbl->entries[idx];
+
+    // update in place
+    if (e->key) {
+        const void *old = e->val;
+        e->key = key;
+        e->val = val;
+        return (void*) old;
+    }
 
-    uint idx = HashTbl_keyidx(tbl, key);
-    Bucket *bkt = tbl->buckets[idx];
-    if (!bkt)
-        tbl->buckets[idx] = bkt_new;
-    else {
-        bkt_new->next = bkt;
-        tbl->buckets[idx] = bkt_new;
+    if (tbl->size + 1 > SIZE_THRESH(tbl->cap)) {
+        grow(tbl);
+        idx = HashTbl_probe(tbl, key, hash, keyeq);
+        e = &tbl->entries[idx];
     }
 
+    e->hash = hash;
+    e->key = key;
+    e->val = val;
     tbl->size += 1;
 
-    return popd;
+    return NULL;
 }
 
 void *HashTbl_pop(HashTbl *tbl, const void *key, const keyeq_t keyeq)
 {
-    uint idx = HashTbl_keyidx(tbl, key);
-    Bucket *bkt = tbl->buckets[idx];
-    const void *val_out = NULL;
-
-    if (bkt) {
-        Bucket *prev = NULL;
-        while (bkt) {
-            if (keyeq(bkt->key, key)) {
-                val_out = bkt->val;
-
-                if (prev)
-                    prev->next = bkt->next;
-                else {
-                    // this was the 1st key in the bucket
-                    tbl->buckets[idx] = bkt->next;
-                }
-
-                // free key?
-                free(bkt);
-                tbl->size -= 1;
-                break;
-            }
-            prev = bkt;
-            bkt = bkt->next;
-        }
+    uint idx = HashTbl_probe(tbl, key, tbl->hashkey(key), keyeq);
+    Entry *e = &tbl->entries[idx];
+    if (e->key == NULL)
+        return NULL;
+
+    const void *val_out = e->val;
+    tbl->size -= 1;
+
+    // backward shift deletion: move following entries of the cluster into the
+    // hole unless that would put them before their home slot
+    uint mask = tbl->cap - 1;
+    uint hole = idx;
+    for (uint i = (hole + 1) & mask; tbl->entries[i].key != NULL; i = (i + 1) & mask) {
+        uint home = HashTbl_home(tbl, tbl->entries[i].hash);
+        // is home cyclically within (hole, i]? then the entry has to stay
+        if (((i - home) & mask) < ((i - hole) & mask))
+            continue;
+        tbl->entries[hole] = tbl->entries[i];
+        hole = i;
     }
+    tbl->entries[hole].key = NULL;
 
     return (void*) val_out;
 }
@@ -201,40 +223,30 @@ unsigned int HashTbl_size(const HashTbl *tbl)
 void HashTbl_keys(const HashTbl *tbl, void **arr)
 {
     for (uint i = 0; i < tbl->cap; i++) {
-        Bucket *bkt = tbl->buckets[i];
-        if (bkt == NULL)
-            continue;
-        for (Bucket *b = bkt; b != NULL; b = b->next) {
-            *arr++ = (void*) b->key;
-        }
+        if (tbl->entries[i].key)
+            *arr++ = (void*) tbl->entries[i].key;
     }
 }
 
 void HashTbl_values(const HashTbl *tbl, void **arr)
 {
     for (uint i = 0; i < tbl->cap; i++) {
-        Bucket *bkt = tbl->buckets[i];
-        if (bkt == NULL)
-            continue;
-        for (Bucket *b = bkt; b != NULL; b = b->next) {
-            *arr++ = (void*) b->val;
-        }
+        if (tbl->entries[i].key)
+            *arr++ = (void*) tbl->entries[i].val;
     }
 }
 
 void HashTbl_print(const HashTbl *tbl, const printkey_t printkey, const printval_t printval)
 {
     for (size_t i = 0; i < tbl->cap; i++) {
-        Bucket *bkt = tbl->buckets[i];
-        if (!bkt)
+        const Entry *e = &tbl->entries[i];
+        if (!e->key)
             continue;
-        printf("%zu\n", i);
-        for (Bucket *b = bkt; b != NULL; b = b->next) {
-            printf("  ");
-            printkey(b->key);
-            printf(" : ");
-            printval(b->val);
-            printf("\n");
-        }
+        printf("%zu (home %u)\n", i, HashTbl_home(tbl, e->hash));
+        printf("  ");
+        printkey(e->key);
+        printf(" : ");
+        printval(e->val);
+        printf("\n");
     }
 }
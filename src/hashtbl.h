@@ -15,6 +15,9 @@ HashTbl *HashTbl_newc(uint cap, hashkey_t);
 void HashTbl_free(HashTbl *tbl, free_t keyfree, free_t valfree);
 
 void *HashTbl_get(const HashTbl *tbl, const void *key, const keyeq_t keyeq);
+// same as HashTbl_get, but for a key whose hash is already known, so the key
+// doesn't have to be of the type accepted by hashkey (it's only passed to keyeq)
+void *HashTbl_get_hashed(const HashTbl *tbl, const void *key, uint hash, const keyeq_t keyeq);
 void *HashTbl_put(HashTbl *tbl, const void *key, const void *val, const keyeq_t keyeq);
 void *HashTbl_pop(HashTbl *tbl, const void *key, const keyeq_t keyeq);
 
@@ -0,0 +1,894 @@
+// getpid and open_memstream
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "types.h"
+#include "env.h"
+#include "hashtbl.h"
+#include "utils.h"
+#include "common.h"
+#include "vm.h"
+
+// Image format (integers are stored in native byte order, since an image is only
+// meant to be loaded by the interpreter that wrote it):
+//   header    magic[8] version:u32
+//   checksum  u64, hash_strn64 of the rest of the file
+//   objects   nobjs:u32 followed by nobjs records, the i-th of which has id
+//             FIRST_ID + i
+//   bindings  n:u32 followed by n pairs (id:ref datum:ref)
+// Each record starts with a tag (u8), the rest of it is described in write_obj.
+// A ref (u64) is either an immediate datum (a fixnum, nil, true or false), encoded
+// just like the pointer, or an id shifted left by 2, so that its low bits are 0
+// unlike those of immediates.
+//
+// References between objects may form cycles (e.g., a procedure bound in the
+// frame that encloses it), so the loader first creates all objects and only then
+// fills them in. Frames are created upon the first pass too, which is possible
+// because a frame always gets a greater id than its enclosing one.
+//
+// A cache (see image_dump_cache) stores objects in the same records:
+//   header    magic[8] version:u32
+//   key       path:str mtime:i64 size:u64 hash:u64 (str is len:u32 chars)
+//   checksum  u64, hash_strn64 of the rest of the file
+//   objects   nobjs:u32 followed by nobjs records, all of which are data
+//   root      ref
+
+#define IMAGE_MAGIC "mylisp\0i"
+#define CACHE_MAGIC "mylisp\0c"
+#define IMAGE_MAGIC_LEN 8
+#define IMAGE_VERSION 4
+// records are those of images, the rest has a version of its own
+#define CACHE_VERSION (IMAGE_VERSION << 8 | 1)
+
+// ids with a fixed meaning
+enum {
+    ID_NULL,
+    ID_ROOT_ENV,
+    ID_EMPTY_LIST,
+    FIRST_ID
+};
+
+enum {
+    TAG_SYMBOL,
+    TAG_STRING,
+    TAG_NUMBER,
+    TAG_LIST,
+    TAG_VECTOR,
+    TAG_ATOM,
+    TAG_PROC,
+    TAG_BUILTIN,
+    TAG_ENV,
+    TAG_HASHMAP,
+};
+
+#define REF_ID(id) ((uint64_t) (id) << 2)
+#define REF_ISIMM(ref) (((ref) & 3) != 0)
+
+// -----------------------------------------------------------------------------
+// Writer
+
+typedef struct Obj {
+    uint8_t tag;
+    const void *ptr; // LispDatum* or MalEnv*
+} Obj;
+
+typedef struct Writer {
+    const MalEnv *root;
+    HashTbl *ids; // object -> id
+    Obj *objs;    // in the order of their ids
+    size_t len;
+    size_t cap;
+    FILE *file;
+} Writer;
+
+static uint ptr_hash(const void *ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    return (uint) (p ^ (p >> 32));
+}
+
+static bool ptr_eq(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static void noop_free(void *ptr) { }
+
+// returns the id of a visited object or ID_NULL
+static uint32_t obj_id(const Writer *w, const void *ptr)
+{
+    return (uint32_t) (uintptr_t) HashTbl_get(w->ids, ptr, ptr_eq);
+}
+
+static uint32_t obj_add(Writer *w, uint8_t tag, const void *ptr)
+{
+    if (w->len == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 256;
+        w->objs = realloc(w->objs, sizeof(Obj) * w->cap);
+    }
+    w->objs[w->len] = (Obj) { .tag = tag, .ptr = ptr };
+    uint32_t id = FIRST_ID + w->len++;
+    HashTbl_put(w->ids, ptr, (void*) (uintptr_t) id, ptr_eq);
+    return id;
+}
+
+static bool visit_env(Writer *w, const MalEnv *env);
+
+static bool visit_datum(Writer *w, const LispDatum *dtm);
+
+typedef struct VisitMapState {
+    Writer *w;
+    bool ok;
+} VisitMapState;
+
+static void visit_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    VisitMapState *st = data;
+    st->ok = st->ok && visit_datum(st->w, key) && visit_datum(st->w, val);
+}
+
+// assigns ids to the datum and everything reachable from it
+static bool visit_datum(Writer *w, const LispDatum *dtm)
+{
+    if (dtm == NULL || LispDatum_isimm(dtm) || dtm == (LispDatum*) List_empty())
+        return true;
+    if (obj_id(w, dtm) != ID_NULL)
+        return true;
+
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL:
+            obj_add(w, TAG_SYMBOL, dtm);
+            return true;
+        case STRING:
+            obj_add(w, TAG_STRING, dtm);
+            return true;
+        case NUMBER:
+            obj_add(w, TAG_NUMBER, dtm);
+            return true;
+        case LIST:
+            obj_add(w, TAG_LIST, dtm);
+            for (struct Node *node = ((List*) dtm)->head; node != NULL; node = node->next) {
+                if (!visit_datum(w, node->value))
+                    return false;
+            }
+            return true;
+        case VECTOR: {
+            obj_add(w, TAG_VECTOR, dtm);
+            const Vector *vec = (Vector*) dtm;
+            for (size_t i = 0; i < Vector_len(vec); i++) {
+                if (!visit_datum(w, Vector_ref(vec, i)))
+                    return false;
+            }
+            return true;
+        }
+        case HASHMAP: {
+            obj_add(w, TAG_HASHMAP, dtm);
+            VisitMapState st = { .w = w, .ok = true };
+            HashMap_foreach((HashMap*) dtm, visit_map_entry, &st);
+            return st.ok;
+        }
+        case ATOM:
+            obj_add(w, TAG_ATOM, dtm);
+            return visit_datum(w, Atom_deref((Atom*) dtm));
+        case PROCEDURE: {
+            const Proc *proc = (Proc*) dtm;
+            if (Proc_isbuiltin(proc)) {
+                obj_add(w, TAG_BUILTIN, dtm);
+                return visit_datum(w, (LispDatum*) proc->name);
+            }
+            obj_add(w, TAG_PROC, dtm);
+            if (!visit_datum(w, (LispDatum*) proc->name))
+                return false;
+            for (size_t i = 0; i < proc->params->len; i++) {
+                if (!visit_datum(w, Arr_get(proc->params, i)))
+                    return false;
+            }
+            return visit_datum(w, (LispDatum*) proc->logic.body) && visit_env(w, proc->env);
+        }
+        default:
+            throwf("dump-image", "can't store a datum of type %s",
+                    LispType_name(LispDatum_type(dtm)));
+            return false;
+    }
+}
+
+static bool visit_env(Writer *w, const MalEnv *env)
+{
+    if (env == NULL || env == w->root || obj_id(w, env) != ID_NULL)
+        return true;
+    if (env->binds) {
+        throwf("dump-image", "can't store a top-level environment other than the current one");
+        return false;
+    }
+
+    if (!visit_env(w, env->enclosing))
+        return false;
+    // the enclosing frame might have led back to this one
+    if (obj_id(w, env) != ID_NULL)
+        return true;
+
+    obj_add(w, TAG_ENV, env);
+    for (unsigned i = 0; i < env->len; i++) {
+        if (!visit_datum(w, env->slots[i].datum))
+            return false;
+        visit_datum(w, (LispDatum*) env->slots[i].id);
+    }
+    return true;
+}
+
+static uint64_t datum_ref(const Writer *w, const LispDatum *dtm)
+{
+    if (dtm == NULL)
+        return REF_ID(ID_NULL);
+    if (LispDatum_isimm(dtm))
+        return (uintptr_t) dtm;
+    if (dtm == (LispDatum*) List_empty())
+        return REF_ID(ID_EMPTY_LIST);
+    return REF_ID(obj_id(w, dtm));
+}
+
+static uint64_t env_ref(const Writer *w, const MalEnv *env)
+{
+    if (env == NULL)
+        return REF_ID(ID_NULL);
+    if (env == w->root)
+        return REF_ID(ID_ROOT_ENV);
+    return REF_ID(obj_id(w, env));
+}
+
+static void put(Writer *w, const void *ptr, size_t n)
+{
+    fwrite(ptr, 1, n, w->file);
+}
+
+#define PUT(w, type, val) { type _v = (val); put(w, &_v, sizeof(_v)); }
+
+static void put_str(Writer *w, const char *s, uint32_t len)
+{
+    PUT(w, uint32_t, len);
+    put(w, s, len);
+}
+
+static void put_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    Writer *w = data;
+    PUT(w, uint64_t, datum_ref(w, key));
+    PUT(w, uint64_t, datum_ref(w, val));
+}
+
+static void write_obj(Writer *w, const Obj *obj)
+{
+    PUT(w, uint8_t, obj->tag);
+
+    switch (obj->tag) {
+        // len:u32 chars
+        case TAG_SYMBOL:
+            put_str(w, Symbol_name(obj->ptr), strlen(Symbol_name(obj->ptr)));
+            break;
+        // len:u32 chars
+        case TAG_STRING:
+            put_str(w, String_chars(obj->ptr), String_len(obj->ptr));
+            break;
+        // isfloat:u8 followed by either val:f64 or len:u32 decimal digits
+        // (fixnums are immediate, so this is a float or a bignum)
+        case TAG_NUMBER: {
+            const Number *num = obj->ptr;
+            PUT(w, uint8_t, Number_isfloat(num));
+            if (Number_isfloat(num)) {
+                PUT(w, double, Number_tod(num));
+            } else {
+                char *s = Number_tostr(num);
+                put_str(w, s, strlen(s));
+                free(s);
+            }
+            break;
+        }
+        // resolved:u8 len:u32 followed by len triples (value:ref depth:i16 slot:i16)
+        case TAG_LIST: {
+            const List *list = obj->ptr;
+            PUT(w, uint8_t, list->resolved);
+            PUT(w, uint32_t, List_len(list));
+            for (struct Node *node = list->head; node != NULL; node = node->next) {
+                PUT(w, uint64_t, datum_ref(w, node->value));
+                PUT(w, int16_t, node->depth);
+                PUT(w, int16_t, node->slot);
+            }
+            break;
+        }
+        // len:u32 followed by len refs
+        case TAG_VECTOR: {
+            const Vector *vec = obj->ptr;
+            PUT(w, uint32_t, Vector_len(vec));
+            for (size_t i = 0; i < Vector_len(vec); i++)
+                PUT(w, uint64_t, datum_ref(w, Vector_ref(vec, i)));
+            break;
+        }
+        // len:u32 followed by len pairs (key:ref value:ref)
+        case TAG_HASHMAP: {
+            const HashMap *map = obj->ptr;
+            PUT(w, uint32_t, HashMap_len(map));
+            HashMap_foreach(map, put_map_entry, w);
+            break;
+        }
+        // value:ref
+        case TAG_ATOM:
+            PUT(w, uint64_t, datum_ref(w, Atom_deref(obj->ptr)));
+            break;
+        // name:ref
+        case TAG_BUILTIN:
+            PUT(w, uint64_t, datum_ref(w, (LispDatum*) ((Proc*) obj->ptr)->name));
+            break;
+        // name:ref macro:u8 variadic:u8 argc:i32 nparams:u32 params:ref* body:ref env:ref
+        case TAG_PROC: {
+            const Proc *proc = obj->ptr;
+            PUT(w, uint64_t, datum_ref(w, (LispDatum*) proc->name));
+            PUT(w, uint8_t, proc->macro);
+            PUT(w, uint8_t, proc->variadic);
+            PUT(w, int32_t, proc->argc);
+            PUT(w, uint32_t, proc->params->len);
+            for (size_t i = 0; i < proc->params->len; i++)
+                PUT(w, uint64_t, datum_ref(w, Arr_get(proc->params, i)));
+            PUT(w, uint64_t, datum_ref(w, (LispDatum*) proc->logic.body));
+            PUT(w, uint64_t, env_ref(w, proc->env));
+            break;
+        }
+        // enclosing:ref nstatic:u32 len:u32 followed by len pairs (id:ref datum:ref)
+        case TAG_ENV: {
+            const MalEnv *env = obj->ptr;
+            PUT(w, uint64_t, env_ref(w, env->enclosing));
+            PUT(w, uint32_t, env->nstatic);
+            PUT(w, uint32_t, env->len);
+            for (unsigned i = 0; i < env->len; i++) {
+                PUT(w, uint64_t, datum_ref(w, (LispDatum*) env->slots[i].id));
+                PUT(w, uint64_t, datum_ref(w, env->slots[i].datum));
+            }
+            break;
+        }
+    }
+}
+
+static void write_objs(Writer *w)
+{
+    PUT(w, uint32_t, w->len);
+    for (size_t i = 0; i < w->len; i++)
+        write_obj(w, &w->objs[i]);
+}
+
+// Directs the writer to a buffer in memory, so that the checksum of what it
+// writes can go before it in the file. Returns false if an exception was thrown.
+static bool body_open(Writer *w, char **body, size_t *len, const char *src,
+        const char *path)
+{
+    w->file = open_memstream(body, len);
+    if (w->file == NULL) {
+        throwf(src, "can't write %s", path);
+        return false;
+    }
+    return true;
+}
+
+static bool body_close(Writer *w, const char *src, const char *path)
+{
+    if (ferror(w->file) | (fclose(w->file) != 0)) {
+        throwf(src, "can't write %s", path);
+        return false;
+    }
+    return true;
+}
+
+bool image_dump(const MalEnv *env, const char *path)
+{
+    unsigned size = MalEnv_size(env);
+    Symbol **ids = malloc(sizeof(*ids) * size);
+    LispDatum **datums = malloc(sizeof(*datums) * size);
+    MalEnv_bindings(env, ids, datums);
+
+    Writer w = { .root = env, .ids = HashTbl_newc(1024, ptr_hash) };
+
+    bool ok = true;
+    for (unsigned i = 0; ok && i < size; i++) {
+        ok = visit_datum(&w, (LispDatum*) ids[i]) && visit_datum(&w, datums[i]);
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    if (ok)
+        ok = body_open(&w, &body, &body_len, "dump-image", path);
+    if (ok) {
+        write_objs(&w);
+        PUT(&w, uint32_t, size);
+        for (unsigned i = 0; i < size; i++) {
+            PUT(&w, uint64_t, datum_ref(&w, (LispDatum*) ids[i]));
+            PUT(&w, uint64_t, datum_ref(&w, datums[i]));
+        }
+        ok = body_close(&w, "dump-image", path);
+    }
+
+    if (ok) {
+        w.file = fopen(path, "wb");
+        if (w.file == NULL) {
+            throwf("dump-image", "can't open file %s for writing", path);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        put(&w, IMAGE_MAGIC, IMAGE_MAGIC_LEN);
+        PUT(&w, uint32_t, IMAGE_VERSION);
+        PUT(&w, uint64_t, hash_strn64(body, body_len));
+        put(&w, body, body_len);
+
+        if (ferror(w.file) | (fclose(w.file) != 0)) {
+            throwf("dump-image", "failed to write file %s", path);
+            ok = false;
+        }
+    }
+
+    free(body);
+    free(ids);
+    free(datums);
+    free(w.objs);
+    HashTbl_free(w.ids, noop_free, noop_free);
+
+    return ok;
+}
+
+bool image_dump_cache(const char *path, const SourceKey *key, const LispDatum *dtm)
+{
+    Writer w = { .root = NULL, .ids = HashTbl_newc(256, ptr_hash) };
+    bool ok = visit_datum(&w, dtm);
+
+    char *body = NULL;
+    size_t body_len = 0;
+    if (ok)
+        ok = body_open(&w, &body, &body_len, "load-file", path);
+    if (ok) {
+        write_objs(&w);
+        PUT(&w, uint64_t, datum_ref(&w, dtm));
+        ok = body_close(&w, "load-file", path);
+    }
+
+    // written to a file of its own first, since other processes might be loading
+    // the same source
+    char *tmp_path = NULL;
+    if (ok) {
+        tmp_path = malloc(strlen(path) + 32);
+        sprintf(tmp_path, "%s.%ld.tmp", path, (long) getpid());
+        w.file = fopen(tmp_path, "wb");
+        if (w.file == NULL) {
+            throwf("load-file", "can't open file %s for writing", tmp_path);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        put(&w, CACHE_MAGIC, IMAGE_MAGIC_LEN);
+        PUT(&w, uint32_t, CACHE_VERSION);
+        put_str(&w, key->path, strlen(key->path));
+        PUT(&w, int64_t, key->mtime);
+        PUT(&w, uint64_t, key->size);
+        PUT(&w, uint64_t, key->hash);
+        PUT(&w, uint64_t, hash_strn64(body, body_len));
+        put(&w, body, body_len);
+
+        if (ferror(w.file) | (fclose(w.file) != 0) | (rename(tmp_path, path) != 0)) {
+            throwf("load-file", "failed to write file %s", path);
+            remove(tmp_path);
+            ok = false;
+        }
+    }
+
+    free(tmp_path);
+    free(body);
+    free(w.objs);
+    HashTbl_free(w.ids, noop_free, noop_free);
+
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Loader
+
+typedef struct Loader {
+    MalEnv *root;
+    const char *cur; // cursor
+    const char *end;
+    bool bad; // true once the cursor has gone past the end
+    uint32_t nobjs;
+    void **objs;   // LispDatum* or MalEnv*, NULL until created
+    uint8_t *tags;
+    bool data_only; // only data are expected (a cache), all of them owned
+} Loader;
+
+static const char *get(Loader *ld, size_t n)
+{
+    if ((size_t) (ld->end - ld->cur) < n) {
+        ld->bad = true;
+        return NULL;
+    }
+    const char *p = ld->cur;
+    ld->cur += n;
+    return p;
+}
+
+// reads a value of the given type, 0 if the input ends
+#define DEFINE_GET(name, type) \
+    static type name(Loader *ld) { \
+        type v = 0; \
+        const char *p = get(ld, sizeof(type)); \
+        if (p) memcpy(&v, p, sizeof(type)); \
+        return v; \
+    }
+
+DEFINE_GET(get_u8, uint8_t)
+DEFINE_GET(get_i16, int16_t)
+DEFINE_GET(get_i32, int32_t)
+DEFINE_GET(get_u32, uint32_t)
+DEFINE_GET(get_u64, uint64_t)
+DEFINE_GET(get_f64, double)
+
+// returns the object (of the given tag) that ref refers to, or NULL
+static void *ref_obj(Loader *ld, uint64_t ref, uint8_t tag)
+{
+    uint64_t id = ref >> 2;
+    if (id < FIRST_ID || id - FIRST_ID >= ld->nobjs || ld->tags[id - FIRST_ID] != tag) {
+        ld->bad = true;
+        return NULL;
+    }
+    return ld->objs[id - FIRST_ID];
+}
+
+// returns the datum that ref refers to, or NULL
+static LispDatum *ref_datum(Loader *ld, uint64_t ref)
+{
+    if (REF_ISIMM(ref)) {
+        // any fixnum, but only the known singletons
+        LispDatum *dtm = (LispDatum*) (uintptr_t) ref;
+        if ((ref & 1) == 0 && dtm != (LispDatum*) Nil_get()
+                && dtm != (LispDatum*) True_get() && dtm != (LispDatum*) False_get()) {
+            ld->bad = true;
+            return NULL;
+        }
+        return dtm;
+    }
+
+    uint64_t id = ref >> 2;
+    if (id == ID_EMPTY_LIST)
+        return (LispDatum*) List_empty();
+    if (id < FIRST_ID || id - FIRST_ID >= ld->nobjs || ld->tags[id - FIRST_ID] == TAG_ENV) {
+        ld->bad = true;
+        return NULL;
+    }
+    return ld->objs[id - FIRST_ID];
+}
+
+static MalEnv *ref_env(Loader *ld, uint64_t ref)
+{
+    if (ref == REF_ID(ID_ROOT_ENV))
+        return ld->root;
+    return ref_obj(ld, ref, TAG_ENV);
+}
+
+// objects are created in 2 passes: procedures refer to their bodies and frames,
+// so they are created after everything else; then all of them are filled in
+enum {
+    PASS_CREATE,
+    PASS_CREATE_PROCS,
+    PASS_FILL
+};
+
+// parses the record of object idx and does the part of the given pass
+static void load_obj(Loader *ld, uint32_t idx, int pass)
+{
+    uint8_t tag = get_u8(ld);
+    if (pass == PASS_CREATE)
+        ld->tags[idx] = tag;
+    void **obj = &ld->objs[idx];
+
+    if (ld->data_only && tag != TAG_SYMBOL && tag != TAG_STRING && tag != TAG_NUMBER
+            && tag != TAG_LIST && tag != TAG_VECTOR && tag != TAG_HASHMAP) {
+        ld->bad = true;
+        return;
+    }
+
+    switch (tag) {
+        case TAG_SYMBOL:
+        case TAG_STRING: {
+            uint32_t len = get_u32(ld);
+            const char *s = get(ld, len);
+            if (s && pass == PASS_CREATE) {
+                *obj = tag == TAG_SYMBOL
+                    ? (void*) Symbol_internn(s, len)
+                    : (void*) String_newn(s, len);
+            }
+            break;
+        }
+        case TAG_NUMBER: {
+            if (get_u8(ld)) {
+                double val = get_f64(ld);
+                if (pass == PASS_CREATE)
+                    *obj = Number_newf(val);
+            } else {
+                uint32_t len = get_u32(ld);
+                const char *s = get(ld, len);
+                if (s && pass == PASS_CREATE)
+                    *obj = Number_parse(s, s + len);
+            }
+            break;
+        }
+        case TAG_LIST: {
+            if (pass == PASS_CREATE)
+                *obj = List_new();
+            List *list = *obj;
+            bool resolved = get_u8(ld);
+            uint32_t len = get_u32(ld);
+            for (uint32_t i = 0; i < len && !ld->bad; i++) {
+                uint64_t ref = get_u64(ld);
+                int16_t depth = get_i16(ld);
+                int16_t slot = get_i16(ld);
+                if (pass == PASS_FILL) {
+                    LispDatum *dtm = ref_datum(ld, ref);
+                    if (!dtm) break;
+                    List_add(list, dtm);
+                    list->tail->depth = depth;
+                    list->tail->slot = slot;
+                }
+            }
+            if (pass == PASS_FILL)
+                list->resolved = resolved;
+            break;
+        }
+        case TAG_VECTOR: {
+            uint32_t len = get_u32(ld);
+            if (pass == PASS_CREATE)
+                *obj = Vector_newc(len);
+            for (uint32_t i = 0; i < len && !ld->bad; i++) {
+                uint64_t ref = get_u64(ld);
+                if (pass == PASS_FILL) {
+                    LispDatum *dtm = ref_datum(ld, ref);
+                    if (!dtm) break;
+                    Vector_add(*obj, dtm);
+                }
+            }
+            break;
+        }
+        case TAG_HASHMAP: {
+            uint32_t len = get_u32(ld);
+            if (pass == PASS_CREATE)
+                *obj = HashMap_new();
+            for (uint32_t i = 0; i < len && !ld->bad; i++) {
+                uint64_t key_ref = get_u64(ld);
+                uint64_t val_ref = get_u64(ld);
+                if (pass == PASS_FILL) {
+                    LispDatum *key = ref_datum(ld, key_ref);
+                    LispDatum *val = key ? ref_datum(ld, val_ref) : NULL;
+                    if (!val) break;
+                    HashMap_put(*obj, key, val);
+                }
+            }
+            break;
+        }
+        case TAG_ATOM: {
+            uint64_t ref = get_u64(ld);
+            if (pass == PASS_CREATE)
+                *obj = Atom_new((LispDatum*) Nil_get());
+            else if (pass == PASS_FILL) {
+                LispDatum *dtm = ref_datum(ld, ref);
+                if (dtm) Atom_set(*obj, dtm);
+            }
+            break;
+        }
+        case TAG_BUILTIN: {
+            uint64_t ref = get_u64(ld);
+            if (pass == PASS_CREATE_PROCS) {
+                Symbol *name = ref_obj(ld, ref, TAG_SYMBOL);
+                if (!name) break;
+                // built-in procedures are bound before the image is loaded
+                LispDatum *dtm = MalEnv_get(ld->root, name);
+                if (!dtm || !LispDatum_istype(dtm, PROCEDURE) || !Proc_isbuiltin((Proc*) dtm)) {
+                    throwf("image", "unknown built-in procedure %s", Symbol_name(name));
+                    ld->bad = true;
+                    break;
+                }
+                *obj = dtm;
+            }
+            break;
+        }
+        case TAG_PROC: {
+            uint64_t name_ref = get_u64(ld);
+            bool macro = get_u8(ld);
+            bool variadic = get_u8(ld);
+            int32_t argc = get_i32(ld);
+            uint32_t nparams = get_u32(ld);
+            Arr *params = pass == PASS_CREATE_PROCS ? Arr_newn(nparams) : NULL;
+            for (uint32_t i = 0; i < nparams && !ld->bad; i++) {
+                uint64_t ref = get_u64(ld);
+                if (params) {
+                    Symbol *param = ref_obj(ld, ref, TAG_SYMBOL);
+                    if (param) Arr_add(params, param);
+                }
+            }
+            uint64_t body_ref = get_u64(ld);
+            uint64_t env_ref = get_u64(ld);
+            if (pass == PASS_CREATE_PROCS) {
+                Symbol *name = name_ref == REF_ID(ID_NULL) ? NULL : ref_obj(ld, name_ref, TAG_SYMBOL);
+                List *body = ref_obj(ld, body_ref, TAG_LIST);
+                MalEnv *env = ref_env(ld, env_ref);
+                if (ld->bad) {
+                    Arr_free(params);
+                    break;
+                }
+                Proc *proc = Proc_new(name, argc, variadic, params, body, env);
+                if (macro)
+                    Proc_set_macro(proc);
+                *obj = proc;
+            }
+            break;
+        }
+        case TAG_ENV: {
+            uint64_t enclosing_ref = get_u64(ld);
+            uint32_t nstatic = get_u32(ld);
+            uint32_t len = get_u32(ld);
+            if (pass == PASS_CREATE) {
+                // enclosing frames have smaller ids, so they are already created
+                MalEnv *enclosing = ref_env(ld, enclosing_ref);
+                if (!enclosing) break;
+                *obj = MalEnv_new_frame(enclosing, nstatic);
+            }
+            for (uint32_t i = 0; i < len && !ld->bad; i++) {
+                uint64_t id_ref = get_u64(ld);
+                uint64_t dtm_ref = get_u64(ld);
+                if (pass == PASS_FILL) {
+                    Symbol *id = ref_obj(ld, id_ref, TAG_SYMBOL);
+                    LispDatum *dtm = ref_datum(ld, dtm_ref);
+                    if (!id || !dtm) break;
+                    MalEnv_put(*obj, id, dtm);
+                }
+            }
+            break;
+        }
+        default:
+            ld->bad = true;
+            break;
+    }
+}
+
+// parses the number of objects followed by their records
+static void load_objs(Loader *ld)
+{
+    ld->nobjs = get_u32(ld);
+    if ((size_t) (ld->end - ld->cur) < ld->nobjs) { // each record takes at least a byte
+        ld->bad = true;
+        ld->nobjs = 0;
+    }
+    ld->objs = calloc(ld->nobjs, sizeof(*ld->objs));
+    ld->tags = calloc(ld->nobjs, sizeof(*ld->tags));
+
+    const char *records = ld->cur;
+    for (int pass = PASS_CREATE; pass <= PASS_FILL && !ld->bad; pass++) {
+        ld->cur = records;
+        for (uint32_t i = 0; i < ld->nobjs && !ld->bad; i++)
+            load_obj(ld, i, pass);
+
+        // so that whatever was created can be freed if the rest is corrupted
+        if (ld->data_only && pass == PASS_CREATE) {
+            for (uint32_t i = 0; i < ld->nobjs; i++) {
+                if (ld->objs[i])
+                    LispDatum_own(ld->objs[i]);
+            }
+        }
+    }
+}
+
+bool image_load(MalEnv *env, const char *path)
+{
+    if (!file_readable(path)) {
+        throwf("image", "can't read file %s", path);
+        return false;
+    }
+
+    size_t len;
+    char *contents = file_map(path, &len);
+    if (!contents) {
+        throwf("image", "failed to read file %s", path);
+        return false;
+    }
+
+    Loader ld = { .root = env, .cur = contents, .end = contents + len };
+
+    const char *magic = get(&ld, IMAGE_MAGIC_LEN);
+    uint32_t version = get_u32(&ld);
+    if (!magic || memcmp(magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN) != 0 || version != IMAGE_VERSION) {
+        throwf("image", "%s is not an image of this version", path);
+        file_unmap(contents, len);
+        return false;
+    }
+    uint64_t checksum = get_u64(&ld);
+    if (ld.bad || checksum != hash_strn64(ld.cur, ld.end - ld.cur)) {
+        throwf("image", "file %s is corrupted", path);
+        file_unmap(contents, len);
+        return false;
+    }
+
+    load_objs(&ld);
+
+    if (!ld.bad) {
+        for (uint32_t i = 0; i < ld.nobjs; i++) {
+            if (ld.tags[i] == TAG_PROC) {
+                Proc *proc = ld.objs[i];
+                Proc_set_code(proc, Code_compile(proc->logic.body->head, proc->env));
+            }
+        }
+
+        uint32_t nbinds = get_u32(&ld);
+        for (uint32_t i = 0; i < nbinds && !ld.bad; i++) {
+            Symbol *id = ref_obj(&ld, get_u64(&ld), TAG_SYMBOL);
+            LispDatum *dtm = ref_datum(&ld, get_u64(&ld));
+            if (id && dtm)
+                MalEnv_put(env, id, dtm);
+        }
+        if (ld.cur != ld.end)
+            ld.bad = true;
+    }
+
+    bool ok = !ld.bad;
+    if (!ok && !didthrow())
+        throwf("image", "file %s is corrupted", path);
+
+    free(ld.objs);
+    free(ld.tags);
+    file_unmap(contents, len);
+
+    return ok;
+}
+
+LispDatum *image_load_cache(const char *path, const SourceKey *key)
+{
+    size_t len;
+    char *contents = file_readable(path) ? file_map(path, &len) : NULL;
+    if (!contents) return NULL;
+
+    Loader ld = { .root = NULL, .cur = contents, .end = contents + len, .data_only = true };
+
+    const char *magic = get(&ld, IMAGE_MAGIC_LEN);
+    uint32_t version = get_u32(&ld);
+    uint32_t path_len = get_u32(&ld);
+    const char *key_path = get(&ld, path_len);
+    int64_t mtime = get_u64(&ld);
+    uint64_t size = get_u64(&ld);
+    uint64_t hash = get_u64(&ld);
+    uint64_t checksum = get_u64(&ld);
+    if (!magic || memcmp(magic, CACHE_MAGIC, IMAGE_MAGIC_LEN) != 0 || version != CACHE_VERSION
+            || !key_path || path_len != strlen(key->path)
+            || memcmp(key_path, key->path, path_len) != 0
+            || mtime != key->mtime || size != key->size || hash != key->hash
+            || ld.bad || checksum != hash_strn64(ld.cur, ld.end - ld.cur)) {
+        file_unmap(contents, len);
+        return NULL;
+    }
+
+    load_objs(&ld);
+    LispDatum *out = ld.bad ? NULL : ref_datum(&ld, get_u64(&ld));
+    if (ld.bad) out = NULL;
+
+    // objects that the root doesn't refer to are freed, so is everything if the
+    // cache is corrupted
+    if (out) LispDatum_own(out);
+    for (uint32_t i = 0; i < ld.nobjs; i++) {
+        if (ld.objs[i])
+            LispDatum_rls_free(ld.objs[i]);
+    }
+    if (out) LispDatum_rls(out);
+
+    free(ld.objs);
+    free(ld.tags);
+    file_unmap(contents, len);
+
+    return out;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types.h"
+#include "env.h"
+
+/* An image is a snapshot of the bindings of the top-level environment, e.g.,
+ * taken after lisp/core.lisp has been loaded, so that it can be loaded at startup
+ * instead of evaluating the source again. Everything reachable from the bindings
+ * is stored: procedures (with their bodies and enclosing frames), macros, atoms
+ * and other datums. Built-in procedures are stored by name only.
+ * Bytecode is not stored, it's compiled again when an image is loaded. An image
+ * that doesn't match its checksum, e.g., a truncated one, isn't loaded at all.
+ */
+
+// Writes the bindings of the top-level environment env to the file at path.
+// Returns false if an exception was thrown.
+bool image_dump(const MalEnv *env, const char *path);
+
+// Adds the bindings stored in the image at path to the top-level environment env,
+// which should already contain the built-in procedures.
+// Returns false if an exception was thrown, in which case env might be left with
+// only some of the bindings.
+bool image_load(MalEnv *env, const char *path);
+
+/* A cache of a source file stores a datum made of the forms read from it (see
+ * load_file in mylisp.c), in the same format, together with the key of the
+ * source and a checksum of the records. A cache is valid as long as the source
+ * has the same key and the records match their checksum.
+ */
+typedef struct SourceKey {
+    const char *path;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash; // of the contents (see hash_strn64)
+} SourceKey;
+
+// Writes the cache of a source to the file at path, replacing it at once.
+// The datum may only consist of data (no procedures, atoms, etc.).
+// Returns false if an exception was thrown.
+bool image_dump_cache(const char *path, const SourceKey *key, const LispDatum *dtm);
+
+// Returns the datum of the cache at path, or NULL if there's no cache of the
+// source with this key (or it's corrupted).
+LispDatum *image_load_cache(const char *path, const SourceKey *key);
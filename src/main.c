@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include <string.h>
+
+#include "mylisp.h"
+#include "types.h"
+#include "printer.h"
+#include "reader.h"
+#include "image.h"
+#include "profile.h"
+
+/* The REPL, a host of the interpreter like any other (see mylisp.h). */
+
+#define PROMPT "user> "
+#define HISTORY_FILE ".mal_history"
+
+// prints the datum readably to stdout, followed by a newline
+static void print(LispDatum *datum) {
+    if (datum == NULL) return;
+
+    pr_file(stdout, datum, true);
+    putchar('\n');
+}
+
+static void rep(const char *str, MyLisp *ml) {
+    // blank lines (and comments) are skipped quietly
+    Reader *rdr = read_str(str);
+    bool blank = Reader_eof(rdr);
+    Reader_free(rdr);
+    if (blank) return;
+
+    // TODO implement a stack trace of error messages
+    LispDatum *e = mylisp_eval_str(ml, str);
+    if (e == NULL) return;
+    print(e);
+    // the evaled value can be either discarded (e.g., (+ 1 2) => 3)
+    // or owned by something (e.g., (def! x 5) => 5)
+    LispDatum_free(e);
+}
+
+// where --profile writes the folded stacks
+static const char *g_profile_path = NULL;
+
+static void write_profile()
+{
+    prof_report(stderr);
+
+    FILE *file = fopen(g_profile_path, "w");
+    bool ok = file && prof_write_folded(file);
+    if (file && fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "failed to write profile %s\n", g_profile_path);
+}
+
+int main(int argc, char **argv) {
+    MyLisp *ml = mylisp_new();
+
+    // --image FILE: load the bootstrapped environment from an image instead of
+    //               evaluating lisp/core.lisp
+    // --dump-image FILE: write an image of the bootstrapped environment and exit
+    // --profile FILE: profile everything evaluated after bootstrapping, at exit
+    //                 print the table of procedures to stderr and write the
+    //                 folded stacks to FILE
+    const char *image = NULL, *dump_image = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+            image = argv[++i];
+        else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc)
+            dump_image = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            g_profile_path = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--image FILE | --dump-image FILE] [--profile FILE]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (image) {
+        if (!mylisp_load_image(ml, image))
+            exit(EXIT_FAILURE);
+    }
+    else
+        rep("(load-file \"lisp/core.lisp\")", ml);
+
+    if (dump_image)
+        exit(image_dump(mylisp_env(ml), dump_image) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    if (g_profile_path) {
+        atexit(write_profile);
+        prof_start();
+    }
+
+    // TODO if the first arg is a filename, then eval (load-file <filename>)
+    // TODO bind *ARGV* to command line arguments
+
+    // using_history();
+    read_history(HISTORY_FILE);
+    // if (read_history(HISTORY_FILE) != 0) {
+    //     fprintf(stderr, "failed to read history file %s\n", HISTORY_FILE);
+    //     exit(EXIT_FAILURE);
+    // }
+
+    while (1) {
+        char *line = readline(PROMPT);
+        if (line == NULL) {
+            exit(EXIT_SUCCESS);
+        }
+
+        if (line[0] != '\0') {
+            add_history(line);
+            // FIXME append to history file just once on exit
+            if (append_history(1, HISTORY_FILE) != 0)
+                fprintf(stderr,
+                        "failed to append to history file %s (try creating it manually)\n",
+                        HISTORY_FILE);
+        }
+
+        rep(line, ml);
+        free(line);
+    }
+
+    mylisp_free(ml);
+
+    clear_history();
+}
@@ -1,11 +1,15 @@
+// getline and realpath
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <readline/readline.h>
-#include <readline/history.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 
+#include "mylisp.h"
 #include "reader.h"
 #include "types.h"
 #include "printer.h"
@@ -14,9 +18,10 @@
 #include "core.h"
 #include "mem_debug.h"
 #include "utils.h"
-
-#define PROMPT "user> "
-#define HISTORY_FILE ".mal_history"
+#include "vm.h"
+#include "image.h"
+#include "gc.h"
+#include "threads.h"
 
 #define BADSTX(fmt, ...) \
     error("bad syntax: " fmt "\n", ##__VA_ARGS__);
@@ -28,135 +33,315 @@ List *eval_list(const List *list, MalEnv *env);
 static LispDatum *read(const char* in) {
     Reader *rdr = read_str(in);
     OWN(rdr);
-    if (rdr == NULL) return NULL;
-    if (rdr->tokens->len == 0) {
-        FREE(rdr);
-        Reader_free(rdr);
-        return NULL;
-    }
     LispDatum *form = read_form(rdr);
     FREE(rdr);
     Reader_free(rdr);
     return form;
 }
 
-static bool verify_proc_application(const Proc *proc, const Arr* args)
+// -----------------------------------------------------------------------------
+// Lexical addressing
+//
+// When a form that introduces bindings (lambda, let*, try*) is evaluated for the
+// first time, the variables within it are resolved to lexical addresses:
+// (depth, slot) where depth is the number of frames to go up from the current one
+// and slot is the index of the binding in that frame (see env.h).
+// An address is stored in the list node that holds the variable, so that eval_node
+// can fetch the value directly instead of searching each frame by name.
+//
+// Only bindings whose layout is known ahead of evaluation get addresses: parameters,
+// let* bindings and catch* symbols. Globals and anything created by def! inside a
+// frame are always looked up by name, though the heads of applications and the
+// variables of compiled code keep inline caches of top-level bindings
+// (see GlobalCache in env.h). Addresses are validated at lookup
+// (see MalEnv_get_addr), and if a node is shared by forms with different
+// layouts (e.g., a macro argument spliced into several places), it is left
+// unaddressed.
+
+// static layout of a frame
+typedef struct Scope {
+    Arr *ids; // of Symbol*, in the order of frame slots
+    const struct Scope *enclosing;
+} Scope;
+
+static void resolve_form(List *list, const Scope *scope, MalEnv *env);
+
+static void node_set_addr(struct Node *node, int depth, int slot)
 {
-    const Symbol *proc_name = Proc_name(proc);
+    if (depth > INT16_MAX || slot > INT16_MAX)
+        slot = NODE_UNADDRESSED;
 
-    int argc = args->len;
-    int proc_argc = Proc_argc(proc);
-    if (argc < proc_argc /* too few? */
-            || (!Proc_isva(proc) && argc > proc_argc)) /* too much? */
-    {
-        throwf(Symbol_name(proc_name),
-                "expected at least %d arguments, but %d were given", 
-                proc_argc, argc);
-        return false;
+    if (node->slot == NODE_UNRESOLVED) {
+        node->depth = depth;
+        node->slot = slot;
     }
+    else if (node->depth != depth || node->slot != slot) {
+        node->slot = NODE_UNADDRESSED;
+    }
+}
 
-    return true;
+static bool scope_find(const Scope *scope, const Symbol *id, int *depth, int *slot)
+{
+    for (int d = 0; scope != NULL; scope = scope->enclosing, d++) {
+        int i = Arr_find(scope->ids, id);
+        if (i >= 0) {
+            *depth = d;
+            *slot = i;
+            return true;
+        }
+    }
+    return false;
 }
 
-// procedure application without TCO
-// args: array of *LispDatum (argument values)
-static LispDatum *apply_proc(const Proc *proc, const Arr *args, MalEnv *env) {
-    if (!verify_proc_application(proc, args)) return NULL;
-
-    if (proc->builtin) {
-        return proc->logic.apply(proc, args, env);
-    }
-
-    // local env is created even if a procedure expects no parameters
-    // so that def! inside it have only local effect
-    // NOTE: this is where the need to track reachability stems from,
-    // since we don't know whether the environment of this particular application
-    // (with all the arguments) will be needed after its applied.
-    // Example where it won't be needed and thus can be safely discarded:
-    // ((lambda (x) x) 10) => 10
-    // Here a local env { x = 10 } with enclosing one set to the global env will be created
-    // and discarded immediately after the result (10) is obtained.
-    // (((lambda (x) (lambda () x)) 10)) => 10
-    // But here the result of this application will be a procedure that should
-    // "remember" about x = 10, so the local env should be preserved. 
-    MalEnv *proc_env = MalEnv_new(proc->env);
-    MalEnv_own(proc_env);
-    OWN(proc_env);
-
-    // 1. bind params to args in the local env
-    // mandatory arguments
-    for (int i = 0; i < proc->argc; i++) {
-        Symbol *param = Arr_get(proc->params, i);
-        LispDatum *arg = Arr_get(args, i);
-        MalEnv_put(proc_env, param, arg); 
-    }
-
-    // if variadic, then bind the last param to the rest of arguments
-    if (Proc_isva(proc)) {
-        Symbol *var_param = Arr_get(proc->params, proc->params->len - 1);
-        List *var_args = List_new();
-        for (size_t i = proc->argc; i < args->len; i++) {
-            LispDatum *arg = Arr_get(args, i);
-            List_add(var_args, arg);
+typedef struct ResolveMapState {
+    const Scope *scope;
+    MalEnv *env;
+} ResolveMapState;
+
+static void resolve_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    const ResolveMapState *st = data;
+    if (LispDatum_istype(val, LIST))
+        resolve_form((List*) val, st->scope, st->env);
+}
+
+static void resolve_node(struct Node *node, const Scope *scope, MalEnv *env)
+{
+    LispDatum *dtm = node->value;
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL: {
+            int depth, slot;
+            if (scope_find(scope, (Symbol*) dtm, &depth, &slot))
+                node_set_addr(node, depth, slot);
+            else
+                node_set_addr(node, 0, NODE_UNADDRESSED);
+            break;
+        }
+        case LIST:
+            resolve_form((List*) dtm, scope, env);
+            break;
+        case VECTOR: {
+            // elements are evaluated in the same environment as the vector
+            const Vector *vec = (Vector*) dtm;
+            for (size_t i = 0; i < Vector_len(vec); i++) {
+                LispDatum *elt = Vector_ref(vec, i);
+                if (LispDatum_istype(elt, LIST))
+                    resolve_form((List*) elt, scope, env);
+            }
+            break;
+        }
+        case HASHMAP: {
+            // so are values of a hash-map
+            ResolveMapState st = { .scope = scope, .env = env };
+            HashMap_foreach((HashMap*) dtm, resolve_map_entry, &st);
+            break;
         }
+        default:
+            break;
+    }
+}
+
+static void resolve_nodes(struct Node *node, const Scope *scope, MalEnv *env)
+{
+    for (; node != NULL; node = node->next)
+        resolve_node(node, scope, env);
+}
+
+// only unquoted parts of a quasiquoted form are evaluated
+static void resolve_quasiquoted(const LispDatum *dtm, const Scope *scope, MalEnv *env)
+{
+    if (!LispDatum_istype(dtm, LIST)) return;
+    const List *list = (List*) dtm;
+    if (List_isempty(list)) return;
 
-        MalEnv_put(proc_env, var_param, (LispDatum*) var_args);
+    LispDatum *ref0 = List_ref(list, 0);
+    if (LispDatum_istype(ref0, SYMBOL)
+            && (Symbol_special((Symbol*) ref0) == SF_UNQUOTE
+                || Symbol_special((Symbol*) ref0) == SF_SPLICE_UNQUOTE))
+    {
+        resolve_nodes(list->head->next, scope, env);
+        return;
     }
 
-    // 2. evaluate the body
-    const List *body = proc->logic.body;
-    // the body must not be empty at this point
-    if (List_isempty(body)) FATAL("empty body");
-    // evalute each expression and return the result of the last one
-    struct Node *node;
-    // for all except last last 
-    for (node = body->head; node->next != NULL; node = node->next) {
-        LispDatum *dtm = node->value;
-        LispDatum *evaled = eval(dtm, proc_env);
-        if (!evaled) {
-            FREE(proc_env);
-            MalEnv_rls_free(proc_env);
-            return NULL;
+    for (struct Node *node = list->head; node != NULL; node = node->next)
+        resolve_quasiquoted(node->value, scope, env);
+}
+
+static void resolve_lambda(List *list, const Scope *scope, MalEnv *env)
+{
+    if (List_len(list) < 3 || !LispDatum_istype(List_ref(list, 1), LIST))
+        return; // bad syntax is reported by eval_fnstar
+
+    Scope lambda_scope = { .ids = Arr_new(), .enclosing = scope };
+    // slots follow the order in which bind_params binds the parameters
+    const List *params = (List*) List_ref(list, 1);
+    for (struct Node *node = params->head; node != NULL; node = node->next) {
+        if (!LispDatum_istype(node->value, SYMBOL)) {
+            Arr_free(lambda_scope.ids);
+            return;
         }
-        LispDatum_free(evaled);
+        if (Symbol_special((Symbol*) node->value) != SF_AMPERSAND || node->next == NULL)
+            Arr_add(lambda_scope.ids, node->value);
     }
-    LispDatum *out = eval(node->value, proc_env);
 
-    LispDatum_guard(out, {
-            FREE(proc_env);
-            MalEnv_rls_free(proc_env);
-            });
-
-    return out;
+    resolve_nodes(list->head->next->next, &lambda_scope, env);
+    Arr_free(lambda_scope.ids);
 }
 
-static LispDatum *eval_application_tco(const Proc *proc, const Arr* args, MalEnv *env)
+static void resolve_letstar(List *list, const Scope *scope, MalEnv *env)
 {
-    if (!verify_proc_application(proc, args)) return NULL;
+    if (List_len(list) < 3 || !LispDatum_istype(List_ref(list, 1), LIST))
+        return; // bad syntax is reported by eval_letstar
 
-    for (size_t i = 0; i < args->len; i++) {
-        Symbol *param = Arr_get(proc->params, i);
-        MalEnv_put(env, param, args->items[i]);
+    Scope let_scope = { .ids = Arr_new(), .enclosing = scope };
+    const List *bindings = (List*) List_ref(list, 1);
+    for (struct Node *bind_node = bindings->head; bind_node; bind_node = bind_node->next) {
+        const List *bind = (List*) bind_node->value;
+        if (!LispDatum_istype(bind_node->value, LIST) || List_len(bind) != 2
+                || !LispDatum_istype(List_ref(bind, 0), SYMBOL))
+        {
+            Arr_free(let_scope.ids);
+            return;
+        }
+        // the value can only see previous bindings
+        resolve_node(bind->head->next, &let_scope, env);
+
+        LispDatum *id = List_ref(bind, 0);
+        if (Arr_find(let_scope.ids, id) < 0)
+            Arr_add(let_scope.ids, id);
     }
 
-    const List *body = proc->logic.body;
-    // eval body except for the last expression 
-    // (TODO transform into 'do' special form)
-    struct Node *node;
-    // for all except last
-    for (node = body->head; node->next; node = node->next) {
-        LispDatum *body_part = node->value;
-        LispDatum *evaled = eval(body_part, env);
-        if (evaled)
-            LispDatum_free(evaled);
-        else {
-            LOG_NULL(evaled);
-            return NULL;
+    resolve_nodes(list->head->next->next, &let_scope, env);
+    Arr_free(let_scope.ids);
+}
+
+static void resolve_try_star(List *list, const Scope *scope, MalEnv *env)
+{
+    if (List_len(list) != 3) return;
+
+    resolve_node(list->head->next, scope, env);
+
+    const List *catch_list = (List*) List_ref(list, 2);
+    if (!LispDatum_istype(List_ref(list, 2), LIST) || List_len(catch_list) != 3
+            || !LispDatum_istype(List_ref(catch_list, 1), SYMBOL))
+        return;
+
+    Scope catch_scope = { .ids = Arr_newn(1), .enclosing = scope };
+    Arr_add(catch_scope.ids, List_ref(catch_list, 1));
+    resolve_node(catch_list->tail, &catch_scope, env);
+    Arr_free(catch_scope.ids);
+}
+
+// is sym bound to a macro? (it's not if it's shadowed by a local binding)
+static bool resolve_ismacro(const Symbol *sym, const Scope *scope, MalEnv *env)
+{
+    int depth, slot;
+    if (scope_find(scope, sym, &depth, &slot))
+        return false;
+
+    const LispDatum *dtm = MalEnv_get(env, sym);
+    return dtm && LispDatum_istype(dtm, PROCEDURE) && Proc_ismacro((Proc*) dtm);
+}
+
+// marks a lambda, let* or try* form whose addresses are in place, threads of a
+// parallel section might start reading them right away
+static void set_resolved(List *list)
+{
+    __atomic_store_n(&list->resolved, true, __ATOMIC_RELEASE);
+}
+
+// computes lexical addresses of variables within the given form
+// env is only used to recognise macro calls, whose arguments are not evaluated
+static void resolve_form(List *list, const Scope *scope, MalEnv *env)
+{
+    if (List_isempty(list)) return;
+
+    LispDatum *head = List_ref(list, 0);
+    if (LispDatum_istype(head, SYMBOL)) {
+        const Symbol *sym = (Symbol*) head;
+        switch (Symbol_special(sym)) {
+            case SF_LAMBDA:
+                resolve_lambda(list, scope, env);
+                set_resolved(list);
+                return;
+            case SF_LETSTAR:
+                resolve_letstar(list, scope, env);
+                set_resolved(list);
+                return;
+            case SF_TRYSTAR:
+                resolve_try_star(list, scope, env);
+                set_resolved(list);
+                return;
+            case SF_DEF:
+            case SF_DEFMACRO:
+                // the bound symbol is not a variable reference
+                if (List_len(list) == 3)
+                    resolve_node(list->tail, scope, env);
+                return;
+            case SF_QUOTE:
+            case SF_MACROEXPAND:
+                return;
+            case SF_QUASIQUOTE:
+                if (List_len(list) == 2)
+                    resolve_quasiquoted(List_ref(list, 1), scope, env);
+                return;
+            default:
+                if (resolve_ismacro(sym, scope, env)) {
+                    // arguments will be resolved in the context of the expansion
+                    return;
+                }
         }
     }
 
-    LispDatum *body_last = node->value;
-    return body_last;
+    resolve_nodes(list->head, scope, env);
+}
+
+// Resolves a lambda, let* or try* form the first time it's evaluated. Threads of a
+// parallel section might evaluate the same form, one of them resolves it under
+// the global lock.
+static void resolve_once(List *list, MalEnv *env)
+{
+    if (__atomic_load_n(&list->resolved, __ATOMIC_ACQUIRE)) return;
+
+    if (!g_threaded) {
+        resolve_form(list, NULL, env);
+        return;
+    }
+    thread_lock();
+    if (!list->resolved)
+        resolve_form(list, NULL, env);
+    thread_unlock();
+}
+
+// evaluates the datum held by the given node, using its lexical address if it has one
+static LispDatum *eval_node(const struct Node *node, MalEnv *env)
+{
+    if (node->slot >= 0) {
+        LispDatum *dtm = MalEnv_get_addr(env, node->depth, node->slot, (Symbol*) node->value);
+        if (dtm) return dtm;
+    }
+    return eval(node->value, env);
+}
+
+// evaluates the head of an application, a procedure bound at the top level is
+// found through the inline cache of the application
+static LispDatum *eval_head(List *list, MalEnv *env)
+{
+    const struct Node *head = list->head;
+    if (head->slot >= 0 || !LispDatum_istype(head->value, SYMBOL))
+        return eval_node(head, env);
+
+    const Symbol *id = (Symbol*) head->value;
+    LispDatum *dtm = MalEnv_get_cached(env, id, List_head_cache(list));
+    if (dtm == NULL)
+        throwf(NULL, "symbol binding '%s' not found", Symbol_name(id));
+    return dtm;
+}
+
+// procedure application
+// args: array of *LispDatum (argument values)
+static LispDatum *apply_proc(const Proc *proc, const Arr *args, MalEnv *env) {
+    return vm_apply(proc, args, env);
 }
 
 /* 'if' expression comes in 2 forms:
@@ -177,7 +362,7 @@ static LispDatum *eval_if(const List *ast_list, MalEnv *env) {
         return NULL;
     }
 
-    LispDatum *ev_cond = eval(List_ref(ast_list, 1), env);
+    LispDatum *ev_cond = eval_node(ast_list->head->next, env);
     if (ev_cond == NULL) return NULL;
     OWN(ev_cond);
 
@@ -195,7 +380,8 @@ static LispDatum *eval_if(const List *ast_list, MalEnv *env) {
 
 /* 'do' expression evalutes each succeeding expression returning the result of the last one.
  * (do expr ...)
- * return expr.map(eval).last
+ * evaluates the expressions but the last one, which is returned to be evaluated
+ * in tail position (NULL if one of them failed)
  */
 static LispDatum *eval_do(const List *list, MalEnv *env) {
     int argc = List_len(list) - 1;
@@ -206,13 +392,13 @@ static LispDatum *eval_do(const List *list, MalEnv *env) {
 
     struct Node *node;
     for (node = list->head->next; node->next != NULL; node = node->next) {
-        LispDatum *ev = eval(node->value, env);
+        LispDatum *ev = eval_node(node, env);
         if (ev == NULL) return NULL;
         FREE(ev);
         LispDatum_free(ev);
     }
 
-    return eval(node->value, env);
+    return node->value;
 }
 
 /* 'lambda' expression is like the 'lambda' expression, it creates and returns a function
@@ -263,7 +449,7 @@ static LispDatum *eval_fnstar(const List *list, MalEnv *env) {
         // '&' is a special symbol that marks a variadic procedure
         // exactly one parameter is expected after it
         // NOTE: we allow that parameter to also be named '&'
-        if (Symbol_eq_str(sym, "&")) {
+        if (Symbol_special(sym) == SF_AMPERSAND) {
             if (node->next == NULL || node->next->next != NULL) {
                 BADSTX("lambda bad parameter list: 1 parameter expected after '&'");
                 return NULL;
@@ -279,16 +465,47 @@ static LispDatum *eval_fnstar(const List *list, MalEnv *env) {
         }
     }
 
+    // each parameter gets its own slot in the application frame
+    for (size_t i = 1; i < param_names_symbols->len; i++) {
+        if (Arr_find(param_names_symbols, Arr_get(param_names_symbols, i)) < (int) i) {
+            BADSTX("lambda bad parameter list: duplicate parameter %s",
+                    Symbol_name(Arr_get(param_names_symbols, i)));
+            FREE(param_names_symbols);
+            Arr_free(param_names_symbols);
+            return NULL;
+        }
+    }
+
+    resolve_once((List*) list, env);
+
     // 2. construct the Procedure
     // body
     // TODO replace by List_slice
     List *body = List_new();
     for (struct Node *node = list->head->next->next; node; node = node->next) {
         List_add(body, node->value);
+        // keep lexical addresses, so that the body can be compiled on its own
+        body->tail->depth = node->depth;
+        body->tail->slot = node->slot;
     }
 
     Proc *proc = Proc_new_lambda(proc_argc, variadic, param_names_symbols, body, env);
 
+    // the body is compiled once and shared by all procedures created from this
+    // expression; threads of a parallel section might compile it at the same time,
+    // the first one to install its code wins
+    Code *code = __atomic_load_n(&list->code, __ATOMIC_ACQUIRE);
+    if (code == NULL) {
+        Code *compiled = Code_compile(list->head->next->next, env);
+        Code_own(compiled);
+        if (__atomic_compare_exchange_n(&((List*) list)->code, &code, compiled,
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            code = compiled;
+        else
+            Code_rls_free(compiled);
+    }
+    Proc_set_code(proc, code);
+
     return (LispDatum*) proc;
 }
 
@@ -308,18 +525,18 @@ static LispDatum *eval_def(const List *list, MalEnv *env) {
     }
     Symbol *id = (Symbol*) snd;
 
-    LispDatum *new_assoc = eval(List_ref(list, 2), env);
-    if (new_assoc == NULL) {
+    // top-level bindings are shared by all threads (see threads.h)
+    if (g_threaded && env->binds) {
+        throwf("def!", "top-level bindings can't be changed in a parallel section");
         return NULL;
     }
 
-    // if id is being bound to an unnamed procedure, then set id as its name
-    if (LispDatum_istype(new_assoc, PROCEDURE)) {
-        Proc *proc = (Proc*) new_assoc;
-        if (!Proc_isnamed(proc))
-            Proc_set_name(proc, id);
+    LispDatum *new_assoc = eval(List_ref(list, 2), env);
+    if (new_assoc == NULL) {
+        return NULL;
     }
 
+    // if id is being bound to an unnamed procedure, then MalEnv_put sets id as its name
     MalEnv_put(env, id, new_assoc);
 
     return new_assoc;
@@ -340,6 +557,11 @@ static LispDatum *eval_defmacro(const List *list, MalEnv *env) {
     }
     Symbol *id = (Symbol*) arg1;
 
+    if (g_threaded && env->binds) {
+        throwf("defmacro!", "top-level bindings can't be changed in a parallel section");
+        return NULL;
+    }
+
     LispDatum *macro_datum = NULL;
     {
         LispDatum *arg2 = List_ref(list, 2);
@@ -359,7 +581,7 @@ static LispDatum *eval_defmacro(const List *list, MalEnv *env) {
             return NULL;
         }
         const Symbol *sym = (Symbol*) arg2_list_ref0;
-        if (!Symbol_eq_str(sym, "lambda")) {
+        if (Symbol_special(sym) != SF_LAMBDA) {
             BADSTX("defmacro!: 2nd arg must be an lambda expression");
             return NULL;
         }
@@ -386,8 +608,12 @@ static LispDatum *eval_defmacro(const List *list, MalEnv *env) {
 
 /* (let* (bindings) expr ...) 
  * bindings := ((id val) ...)
+ * Enters the let* frame, replacing *envp by it (the caller owns it), and
+ * evaluates the expressions but the last one, which is returned to be evaluated
+ * in tail position. Returns NULL if something failed, *envp is left as it is.
  */
-static LispDatum *eval_letstar(const List *list, MalEnv *env) {
+static LispDatum *eval_letstar(const List *list, MalEnv **envp) {
+    MalEnv *env = *envp;
     // 1. validate the list
     int argc = List_len(list) - 1;
     if (argc < 2) {
@@ -408,8 +634,23 @@ static LispDatum *eval_letstar(const List *list, MalEnv *env) {
         return NULL;
     }
 
+    resolve_once((List*) list, env);
+
     // 2. initialise the let* environment 
-    MalEnv *let_env = MalEnv_new(env);
+    // its static layout consists of distinct bound symbols (see resolve_letstar)
+    unsigned nstatic = 0;
+    for (struct Node *bind_node = bindings->head; bind_node; bind_node = bind_node->next) {
+        const LispDatum *dtm = bind_node->value;
+        if (!LispDatum_istype(dtm, LIST) || List_isempty((List*) dtm)) continue;
+        const LispDatum *bind_sym = List_ref((List*) dtm, 0);
+        struct Node *prev = bindings->head;
+        while (prev != bind_node && (!LispDatum_istype(prev->value, LIST)
+                    || List_isempty((List*) prev->value)
+                    || List_ref((List*) prev->value, 0) != bind_sym))
+            prev = prev->next;
+        if (prev == bind_node) nstatic++;
+    }
+    MalEnv *let_env = MalEnv_new_frame(env, nstatic);
     MalEnv_own(let_env);
     OWN(let_env);
     // step = 2
@@ -444,7 +685,7 @@ static LispDatum *eval_letstar(const List *list, MalEnv *env) {
 
         // it's important to evaluate the bound value using the let* env,
         // so that previous bindings can be used during evaluation
-        LispDatum *val = eval(List_ref(bind, 1), let_env);
+        LispDatum *val = eval_node(bind->head->next, let_env);
         OWN(val);
         if (val == NULL) {
             FREE(let_env);
@@ -456,24 +697,53 @@ static LispDatum *eval_letstar(const List *list, MalEnv *env) {
     }
 
     // 3. evaluate expressions using let* env
-    LispDatum *out = NULL;
-    for (struct Node *node = list->head->next->next; node; node = node->next) {
-        out = eval(node->value, let_env);
-        if (out == NULL)
-            break;
-    }
-
-    // this is a hack
-    // if the returned value was computed in let* bindings,
-    // then we don't want it to be freed when we free the let_env,
-    // so we increment its ref count only to decrement it after let_env is freed
-    LispDatum_guard(out, {
-            // discard the let* env
+    struct Node *node;
+    for (node = list->head->next->next; node->next != NULL; node = node->next) {
+        LispDatum *ev = eval(node->value, let_env);
+        if (ev == NULL) {
             FREE(let_env);
             MalEnv_rls_free(let_env);
-            });
+            return NULL;
+        }
+        LispDatum_free(ev);
+    }
 
-    return out;
+    FREE(let_env);
+    *envp = let_env;
+    return node->value;
+}
+
+/* (and expr ...) and (or expr ...)
+ * evaluate the expressions from left to right until the value of one of them is
+ * false (and) or true (or), which is then the value of the form: nil or false
+ * count as false, anything else as true. Returns the last expression, which is
+ * evaluated in tail position, or NULL if the value is already known, in which
+ * case it's stored in out (NULL if something failed).
+ */
+static LispDatum *eval_and_or(SpecialForm form, const List *list, MalEnv *env,
+        LispDatum **out)
+{
+    *out = NULL;
+    // (and) is true, (or) is false
+    if (List_len(list) == 1) {
+        *out = (LispDatum*) LispDatum_bool(form == SF_AND);
+        return NULL;
+    }
+
+    struct Node *node;
+    for (node = list->head->next; node->next != NULL; node = node->next) {
+        LispDatum *ev = eval_node(node, env);
+        if (ev == NULL) return NULL;
+
+        bool truth = !LispDatum_istype(ev, NIL) && !LispDatum_istype(ev, FALSE);
+        if (truth != (form == SF_AND)) {
+            *out = ev;
+            return NULL;
+        }
+        LispDatum_free(ev);
+    }
+
+    return node->value;
 }
 
 // quote : this special form returns its argument without evaluating it
@@ -536,10 +806,10 @@ static LispDatum *eval_quasiquote_list(const List *list, MalEnv *env, bool *spli
     if (LispDatum_istype(ref0, SYMBOL)) {
         const Symbol *sym = (Symbol*) ref0;
 
-        if (Symbol_eq_str(sym, "unquote")) {
+        if (Symbol_special(sym) == SF_UNQUOTE) {
             return eval_unquote(list, env);
         }
-        else if (Symbol_eq_str(sym, "splice-unquote")) {
+        else if (Symbol_special(sym) == SF_SPLICE_UNQUOTE) {
             List *evaled = eval_splice_unquote(list, env);
             if (!evaled)  {
                 return NULL;
@@ -612,7 +882,7 @@ static LispDatum *eval_quasiquote(const List *list, MalEnv *env)
     LispDatum *ast0 = List_ref(ast_list, 0);
     if (LispDatum_istype(ast0, SYMBOL)) {
         const Symbol *sym = (Symbol*) ast0;
-        if (Symbol_eq_str(sym, "splice-unquote")) {
+        if (Symbol_special(sym) == SF_SPLICE_UNQUOTE) {
             BADSTX("splice-unquote: illegal context within quasiquote (nothing to splice into)");
             return NULL;
         }
@@ -636,7 +906,7 @@ List *eval_list(const List *list, MalEnv *env) {
     List *out = List_new();
     struct Node *node = list->head;
     while (node) {
-        LispDatum *evaled = eval(node->value, env);
+        LispDatum *evaled = eval_node(node, env);
         if (evaled == NULL) {
             LOG_NULL(evaled);
             FREE(out);
@@ -650,20 +920,62 @@ List *eval_list(const List *list, MalEnv *env) {
     return out;
 }
 
+// returns a new vector that is the result of calling EVAL on each vector element
+static Vector *eval_vector(const Vector *vec, MalEnv *env) {
+    Vector *out = Vector_newc(Vector_len(vec));
+    for (size_t i = 0; i < Vector_len(vec); i++) {
+        LispDatum *evaled = eval(Vector_ref(vec, i), env);
+        if (evaled == NULL) {
+            Vector_free(out);
+            return NULL;
+        }
+        Vector_add(out, evaled);
+    }
+
+    return out;
+}
+
+typedef struct EvalMapState {
+    MalEnv *env;
+    HashMap *out; // NULL once an evaluation fails
+} EvalMapState;
+
+static void eval_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    EvalMapState *st = data;
+    if (st->out == NULL) return;
+
+    LispDatum *evaled = eval(val, st->env);
+    if (evaled == NULL) {
+        HashMap_free(st->out);
+        st->out = NULL;
+        return;
+    }
+    HashMap_put(st->out, key, evaled);
+}
+
+// returns a new hash-map with the values of the given one evaluated (keys aren't)
+static HashMap *eval_hashmap(const HashMap *map, MalEnv *env) {
+    EvalMapState st = { .env = env, .out = HashMap_new() };
+    HashMap_foreach(map, eval_map_entry, &st);
+    return st.out;
+}
+
 LispDatum *eval_ast(const LispDatum *datum, MalEnv *env) {
     LispDatum *out = NULL;
 
     switch (LispDatum_type(datum)) {
-        case SYMBOL:
+        case SYMBOL: {
             Symbol *sym = (Symbol*) datum;
             LispDatum *assoc = MalEnv_get(env, sym);
             if (assoc == NULL) {
                 throwf(NULL, "symbol binding '%s' not found", Symbol_name(sym));
             } else {
-                out = assoc;;
+                out = assoc;
             }
             break;
-        case LIST:
+        }
+        case LIST: {
             List *elist = eval_list((List*) datum, env);
             if (elist == NULL) {
                 LOG_NULL(elist);
@@ -671,39 +983,59 @@ LispDatum *eval_ast(const LispDatum *datum, MalEnv *env) {
                 out = (LispDatum*) elist;
             }
             break;
+        }
+        case VECTOR:
+            out = (LispDatum*) eval_vector((Vector*) datum, env);
+            break;
+        case HASHMAP:
+            out = (LispDatum*) eval_hashmap((HashMap*) datum, env);
+            break;
         default:
-            // STRING | INT
-            out = LispDatum_copy(datum);
+            // STRING | NUMBER, which are immutable and evaluate to themselves
+            out = (LispDatum*) datum;
             break;
     }
 
     return out;
 }
 
-static LispDatum *macroexpand_single(LispDatum *ast, MalEnv *env)
+// returns the head of an application that might be a macro call: a symbol that
+// isn't a special form (those can't be redefined as macros), NULL if there's none
+static Symbol *call_head(const LispDatum *ast)
+{
+    if (!LispDatum_istype(ast, LIST) || List_isempty((List*) ast)) return NULL;
+
+    LispDatum *ref0 = List_ref((List*) ast, 0);
+    if (!LispDatum_istype(ref0, SYMBOL) || Symbol_special((Symbol*) ref0) != SF_NONE)
+        return NULL;
+    return (Symbol*) ref0;
+}
+
+// this is a macro call if the first list element is a symbol that's bound to a
+// macro procedure, which is returned (NULL if it isn't a macro call)
+static const Proc *call_macro(LispDatum *ast, MalEnv *env)
 {
-    if (!LispDatum_istype(ast, LIST)) return ast;
+    Symbol *head = call_head(ast);
+    if (head == NULL) return NULL;
+
+    const LispDatum *datum = MalEnv_get_cached(env, head, List_head_cache((List*) ast));
+    if (datum && LispDatum_istype(datum, PROCEDURE) && Proc_ismacro((Proc*) datum))
+        return (Proc*) datum;
+    return NULL;
+}
 
+static LispDatum *macroexpand_single(LispDatum *ast, MalEnv *env)
+{
+    const Proc *macro = call_macro(ast, env);
+    if (macro == NULL) return ast;
     List *ast_list = (List*) ast;
-    if (List_isempty(ast_list)) return ast;
 
-    // this is a macro call if the first list element is a symbol that's bound to a macro procedure
-    const Proc *macro = NULL;
-    {
-        LispDatum *ref0 = List_ref(ast_list, 0);
-        if (!LispDatum_istype(ref0, SYMBOL)) 
-            return ast;
-
-        const LispDatum *datum = MalEnv_get(env, (Symbol*) ref0);
-        if (datum && LispDatum_istype(datum, PROCEDURE)) {
-            const Proc *proc = (Proc*) datum;
-            if (!Proc_ismacro(proc)) 
-                return ast;
-            else 
-                macro = proc; 
-        }
-        else return ast;
-    }
+    // each call site is expanded once: the expansion is cached together with the
+    // macro that produced it, which is valid as long as the head symbol is bound
+    // to the same macro (the cache owns the macro, so it can't be reallocated)
+    List *cached = __atomic_load_n(&ast_list->expansion, __ATOMIC_ACQUIRE);
+    if (cached && List_ref(cached, 0) == (LispDatum*) macro)
+        return List_ref(cached, 1);
 
     Arr *args = Arr_newn(List_len(ast_list) - 1);
     for (struct Node *node = ast_list->head->next; node != NULL; node = node->next) {
@@ -714,11 +1046,18 @@ static LispDatum *macroexpand_single(LispDatum *ast, MalEnv *env)
 
     LispDatum_guard(out, Arr_free(args));
 
+    if (out) {
+        List *expansion = List_new();
+        List_add(expansion, (LispDatum*) macro);
+        List_add(expansion, out);
+        List_set_expansion(ast_list, expansion);
+    }
+
     return out;
 }
 
 // recursively expands a macro
-static LispDatum *macroexpand(LispDatum *ast, MalEnv *env)
+LispDatum *macroexpand(LispDatum *ast, MalEnv *env)
 {
     LispDatum *out = ast;
 
@@ -761,8 +1100,13 @@ static LispDatum *eval_macroexpand(List *ast_list, MalEnv *env)
 // (try* <expr1> (catch* <symbol> <expr2>))
 // if <expr1> throws an exception, then the exception is bound to <symbol> 
 // and <expr2> is evaluated
-static LispDatum *eval_try_star(List *ast_list, MalEnv *env)
+// Returns the value of <expr1>. If it threw an exception, caught is set, *envp is
+// replaced by the frame of catch* (the caller owns it) and <expr2> is returned to
+// be evaluated in tail position.
+static LispDatum *eval_try_star(List *ast_list, MalEnv **envp, bool *caught)
 {
+    MalEnv *env = *envp;
+    *caught = false;
     size_t argc = List_len(ast_list) - 1;
     if (argc != 2) {
         BADSTX("try* expects 2 arguments, but %zu were given", argc);
@@ -789,7 +1133,7 @@ static LispDatum *eval_try_star(List *ast_list, MalEnv *env)
         // validate (catch* ...)
         LispDatum *catch0 = List_ref(catch_list, 0);
         if (!LispDatum_istype(catch0, SYMBOL) 
-                || !Symbol_eq_str((Symbol*) catch0, "catch*")) 
+                || Symbol_special((Symbol*) catch0) != SF_CATCHSTAR)
         {
             BADSTX("try* expects (catch* SYMBOL EXPR) as 2nd arg");
             return NULL;
@@ -804,37 +1148,74 @@ static LispDatum *eval_try_star(List *ast_list, MalEnv *env)
         expr2 = List_ref(catch_list, 2);
     }
 
+    resolve_once(ast_list, env);
+
     LispDatum *expr1_rslt = eval(expr1, env);
     if (expr1_rslt == NULL && didthrow()) {
-        MalEnv *catch_env = MalEnv_new(env);
+        MalEnv *catch_env = MalEnv_new_frame(env, 1);
         MalEnv_own(catch_env);
         Exception *exn = thrown_copy();
         MalEnv_put(catch_env, (Symbol*) catch_sym, (LispDatum*) exn);
 
-        LispDatum *expr2_rslt = eval(expr2, catch_env);
-
-        LispDatum_guard(expr2_rslt, MalEnv_rls_free(catch_env));
-
-        return expr2_rslt;
+        *envp = catch_env;
+        *caught = true;
+        return expr2;
     }
     else {
         return expr1_rslt;
     }
 }
 
+// handles special forms: def!, lambda, quote, quasiquote, defmacro!, macroexpand
+// (if, do, let*, try*, and and or are handled by eval, since they are subject to TCO)
+// returns false if form is not one of them
+static bool eval_special(SpecialForm form, List *ast_list, MalEnv *env, LispDatum **out)
+{
+    switch (form) {
+        case SF_DEF:
+            *out = eval_def(ast_list, env);
+            return true;
+        case SF_DEFMACRO:
+            *out = eval_defmacro(ast_list, env);
+            return true;
+        case SF_LAMBDA:
+            *out = eval_fnstar(ast_list, env);
+            return true;
+        case SF_QUOTE:
+            *out = eval_quote(ast_list, env);
+            return true;
+        case SF_QUASIQUOTE:
+            *out = eval_quasiquote(ast_list, env);
+            return true;
+        case SF_MACROEXPAND:
+            *out = eval_macroexpand(ast_list, env);
+            return true;
+        default:
+            return false;
+    }
+}
+
 #ifdef EVAL_STACK_DEPTH
 static int eval_stack_depth = 0; 
 #endif
 
+// leaves the frames of let* and catch* entered by eval, from env up to outer
+static void leave_frames(MalEnv *env, const MalEnv *outer)
+{
+    while (env != outer) {
+        MalEnv *enclosing = env->enclosing;
+        // eval holds a reference to the enclosing frame too
+        MalEnv_rls_free(env);
+        env = enclosing;
+    }
+}
+
 LispDatum *eval(LispDatum *ast, MalEnv *env) {
+    MalEnv *const outer = env;
 #ifdef EVAL_STACK_DEPTH
     eval_stack_depth++;
     printf("ENTER eval, stack depth: %d\n", eval_stack_depth);
 #endif
-    // we create a new environment for each procedure application to bind params to args
-    // because of TCO, ast might be the last body part of a procedure, so we might need 
-    // apply_env created in the previous loop cycle to evaluate ast
-    MalEnv *apply_env = env;
     LispDatum *out = NULL;
 
     while (ast) {
@@ -860,140 +1241,90 @@ LispDatum *eval(LispDatum *ast, MalEnv *env) {
             }
 
             LispDatum *head = List_ref(ast_list, 0);
-            // handle special forms: def!, let*, if, do, lambda, quote, quasiquote,
-            // defmacro!, macroexpand, try*/catch*
-            if (LispDatum_istype(head, SYMBOL)) {
-                const Symbol *sym = (Symbol*) head;
-                if (Symbol_eq_str(sym, "def!")) {
-                    out = eval_def(ast_list, apply_env);
-                    break;
-                }
-                if (Symbol_eq_str(sym, "defmacro!")) {
-                    out = eval_defmacro(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "let*")) {
-                    // applying TCO to let* saves us only 1 level of call stack depth
-                    // TODO so we can be lazy about it
-                    out = eval_letstar(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "if")) {
-                    // eval the condition and replace AST with the AST of the branched part
-                    LispDatum* new_ast = eval_if(ast_list, apply_env);
-                    LispDatum_guard(new_ast, LispDatum_free(ast));
-                    ast = new_ast;
-                    continue;
-                }
-                else if (Symbol_eq_str(sym, "do")) {
-                    // applying TCO to do saves us only 1 level of call stack depth
-                    // TODO so we can be lazy about it
-                    out = eval_do(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "lambda")) {
-                    out = eval_fnstar(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "quote")) {
-                    out = eval_quote(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "quasiquote")) {
-                    out = eval_quasiquote(ast_list, apply_env);
-                    break;
-                }
-                else if (Symbol_eq_str(sym, "macroexpand")) {
-                    out = eval_macroexpand(ast_list, apply_env);
+            SpecialForm form = LispDatum_istype(head, SYMBOL) ? Symbol_special((Symbol*) head) : SF_NONE;
+            if (form == SF_IF) {
+                // eval the condition and replace AST with the AST of the branched part
+                LispDatum* new_ast = eval_if(ast_list, env);
+                LispDatum_guard(new_ast, LispDatum_free(ast));
+                ast = new_ast;
+                continue;
+            }
+            else if (form == SF_DO || form == SF_LETSTAR) {
+                // the last expression is evaluated in tail position, in the frame
+                // of let*, which is left when eval returns
+                LispDatum *new_ast = form == SF_DO
+                    ? eval_do(ast_list, env)
+                    : eval_letstar(ast_list, &env);
+                LispDatum_guard(new_ast, LispDatum_free(ast));
+                ast = new_ast;
+                continue;
+            }
+            else if (form == SF_AND || form == SF_OR) {
+                LispDatum *new_ast = eval_and_or(form, ast_list, env, &out);
+                if (new_ast == NULL) {
+                    // the value might be owned by the form
+                    LispDatum_guard(out, LispDatum_free(ast));
+                    ast = NULL;
                     break;
                 }
-                else if (Symbol_eq_str(sym, "try*")) {
-                    out = eval_try_star(ast_list, apply_env);
+                LispDatum_guard(new_ast, LispDatum_free(ast));
+                ast = new_ast;
+                continue;
+            }
+            else if (form == SF_TRYSTAR) {
+                // so is the expression of catch*, in its frame
+                bool caught;
+                LispDatum *dtm = eval_try_star(ast_list, &env, &caught);
+                if (!caught) {
+                    out = dtm;
                     break;
                 }
+                LispDatum_guard(dtm, LispDatum_free(ast));
+                ast = dtm;
+                continue;
+            }
+            else if (eval_special(form, ast_list, env, &out)) {
+                break;
             }
 
             // looks like a procedure application
-            // if TCO has been applied, then ast_list is the last body part of a procedure
-            // 1. eval the ast_list
-            List *evaled_list = eval_list(ast_list, apply_env);
-            if (evaled_list == NULL) {
-                out = NULL;
-                break;
+            // 1. eval the procedure and the arguments onto the VM stack
+            size_t base = vm_height();
+            bool ok = true;
+            for (struct Node *node = ast_list->head; ok && node != NULL; node = node->next) {
+                LispDatum *evaled = node == ast_list->head
+                    ? eval_head(ast_list, env)
+                    : eval_node(node, env);
+                ok = evaled != NULL && vm_push(evaled);
+                if (evaled && !ok)
+                    LispDatum_free(evaled);
             }
-            OWN(evaled_list);
-            // 2. make sure that the 1st element is a procedure
-            LispDatum *first = List_ref(evaled_list, 0);
-            if (!LispDatum_istype(first, PROCEDURE)) {
-                throwf(NULL, "application: expected a procedure");
+            if (!ok) {
+                vm_drop(vm_height() - base);
                 out = NULL;
-                FREE(evaled_list);
-                List_free(evaled_list);
                 break;
             }
 
-            Proc *proc = (Proc*) first;
-
-            Arr *args = Arr_newn(List_len(evaled_list) - 1);
-            OWN(args);
-            for (struct Node *node = evaled_list->head->next; node != NULL; node = node->next) {
-                Arr_add(args, node->value);
-                LispDatum_own(node->value); // hold onto argument values
-            }
-
-            // previous application's env is no longer needed after we have argument values
-            if (apply_env != env) {
-                MalEnv_rls_free(apply_env);
-                apply_env = NULL;
-            }
-
-            // 3. apply TCO only if it's a non-lambda MAL procedure
-            if (!proc->builtin && Proc_isnamed(proc)) {
-                // args will be put into apply_env
-                apply_env = MalEnv_new(proc->env);
-                MalEnv_own(apply_env);
-
-                LispDatum *new_ast = eval_application_tco(proc, args, apply_env);
-                LispDatum_guard(new_ast, LispDatum_free(ast));
-                ast = new_ast;
-
-                // release and free args
-                FREE(args);
-                Arr_freep(args, (free_t) LispDatum_rls_free);
-
-                FREE(evaled_list);
-                List_free(evaled_list);
-            }
-            else {
-                // 4. otherwise just return the result of procedure application
-                // builtin procedures do not get TCO
-                // unnamed procedures cannot be called recursively apriori
-                out = apply_proc(proc, args, env);
-                LispDatum_guard(out, {
-                        FREE(args);
-                        Arr_freep(args, (free_t) LispDatum_rls_free);
-                        FREE(evaled_list);
-                        List_free(evaled_list);
-                        });
-                break;
-            }
+            // 2. apply the procedure
+            // language-defined procedures are executed by the VM, which applies TCO
+            // the form is held meanwhile, since cycles may be collected (see gc.h)
+            LispDatum_own(ast);
+            out = vm_call(vm_height() - base - 1, env);
+            LispDatum_rls(ast);
+            break;
         }
         else { // AST is not a list
-            out = eval_ast(ast, apply_env);
+            out = eval_ast(ast, env);
             break;
         }
     } // end while
 
-    if (ast) LispDatum_free(ast);
+    // the value might be the AST itself (e.g., a string)
+    if (ast) LispDatum_guard(out, LispDatum_free(ast));
 
-    // we might need to free the application env of the last tail call 
-    if (apply_env && apply_env != env) {
-        // a hack to prevent the return value of a procedure to be freed (similar to let* hack)
-        LispDatum_guard(out, {
-                FREE(apply_env);
-                MalEnv_rls_free(apply_env);
-                });
-    }
+    // the value might be owned by one of the frames
+    if (env != outer)
+        LispDatum_guard(out, leave_frames(env, outer));
 
 #ifdef EVAL_STACK_DEPTH
     eval_stack_depth--;
@@ -1003,61 +1334,31 @@ LispDatum *eval(LispDatum *ast, MalEnv *env) {
     return out;
 }
 
-static char *print(LispDatum *datum) {
-    if (datum == NULL) {
-        return NULL;
-    }
-
-    char *str = pr_str(datum, true);
-    return str;
-}
-
-static void rep(const char *str, MalEnv *env) {
-    // read
-    LispDatum *r = read(str);
-    if (r == NULL) return;
-    LispDatum_own(r);
-
-    // eval
-    // TODO implement a stack trace of error messages
-    LispDatum *e = eval(r, env);
-    if (e == NULL) {
-        LispDatum_rls_free(r);
-        return;
-    }
-    LispDatum_guard(e, LispDatum_rls_free(r));
-    // print
-    char *p = print(e);
-    if (p != NULL) { 
-        printf("%s\n", p);
-        free(p);
-    }
-    // the evaled value can be either discarded (e.g., (+ 1 2) => 3)
-    // or owned by something (e.g., (def! x 5) => 5)
-    LispDatum_free(e);
-}
-
 // TODO reorganise file structure and move to core.c
 /* apply : applies a procedure to the list of arguments 
  * (apply proc <interm> arg-list) 
  * if <interm> (intermediate arguments) are present, they are simply consed onto arg-list;
  * for example: (apply f a b '(c d)) <=> (apply f '(a b c d))
  * */
-static LispDatum *lisp_apply(const Proc *proc, const Arr *args, MalEnv *env)
+LispDatum *lisp_apply(const Proc *proc, const Arr *args, MalEnv *env)
 {
     const Proc *f = verify_proc_arg_type(proc, args, 0, PROCEDURE);
     if (!f) return NULL;
 
     const LispDatum *arg_last = Arr_last(args);
-    if (!LispDatum_istype(arg_last, LIST)) {
-        throwf("apply", "bad last arg: expected a list");
+    size_t last_len;
+    if (LispDatum_istype(arg_last, LIST))
+        last_len = List_len((List*) arg_last);
+    else if (LispDatum_istype(arg_last, VECTOR))
+        last_len = Vector_len((Vector*) arg_last);
+    else {
+        throwf("apply", "bad last arg: expected a list or vector");
         return NULL;
     }
-    const List *arg_list = (List*) arg_last;
 
     size_t interm_argc = args->len - 2;
 
-    Arr *args_arr = Arr_newn(List_len(arg_list) + interm_argc);
+    Arr *args_arr = Arr_newn(last_len + interm_argc);
     OWN(args_arr);
 
     // first intermediate arguments
@@ -1067,8 +1368,15 @@ static LispDatum *lisp_apply(const Proc *proc, const Arr *args, MalEnv *env)
         }
     }
     // now arg-list
-    for (struct Node *node = arg_list->head; node != NULL; node = node->next) {
-        Arr_add(args_arr, node->value);
+    if (LispDatum_istype(arg_last, LIST)) {
+        for (struct Node *node = ((List*) arg_last)->head; node != NULL; node = node->next) {
+            Arr_add(args_arr, node->value);
+        }
+    }
+    else {
+        for (size_t i = 0; i < last_len; i++) {
+            Arr_add(args_arr, Vector_ref((Vector*) arg_last, i));
+        }
     }
 
     LispDatum *rslt = apply_proc(f, args_arr, env);
@@ -1121,11 +1429,589 @@ static LispDatum *lisp_slurp(const Proc *proc, const Arr *args, MalEnv *env)
     return (LispDatum*) out;
 }
 
-// eval : takes an AST and evaluates it in the top-level environment
-// local environments are not taken into account by eval
-static LispDatum *lisp_eval(const Proc *proc, const Arr *args, MalEnv *env) 
+// -----------------------------------------------------------------------------
+// Caches of load-file
+//
+// With the environment variable MYLISP_CACHE_DIR set, load_file keeps a cache of
+// each file that it loads in that directory (see image.h), so that a file that
+// hasn't changed is not read again. The cache is a list with an entry for each
+// form of the file, in order: (form) or, for a macro call, (form expansion deps),
+// where deps is a list of the heads of the form and of the intermediate
+// expansions, each followed by the fingerprint of the macro that it was bound to,
+// and then the head of the expansion (if any), followed by 0 since it wasn't bound
+// to a macro. The expansion is evaluated in place of the form only as long as all
+// the heads are bound the same way, otherwise the form is expanded again.
+// An expansion that isn't made of data only (e.g., a macro put a procedure in it)
+// isn't stored.
+//
+// A fingerprint of a macro covers everything that its expansions can depend on:
+// its parameters and body, and the bindings of the globals that the body refers
+// to, with the fingerprints of procedures among them, and so on. Only a macro
+// defined at the top level whose code refers to nothing but special forms,
+// functional built-in procedures (see Proc_isfunctional), booleans, nil and such
+// procedures gets a fingerprint, other macros (e.g., those that close over a
+// frame, read a global variable or call a macro) get 0, and expansions of calls
+// to them aren't stored.
+
+// the path of the cache of a source file, NULL if there are no caches
+static char *cache_path(const char *path)
 {
-    LispDatum *arg0 = Arr_get(args, 0);
+    const char *dir = getenv("MYLISP_CACHE_DIR");
+    if (dir == NULL || dir[0] == '\0') return NULL;
+
+    char *out = malloc(strlen(dir) + 32);
+    sprintf(out, "%s/%016llx.cache", dir,
+            (unsigned long long) hash_strn64(path, strlen(path)));
+    return out;
+}
+
+typedef struct FpState {
+    MalEnv *top_env;
+    Arr *visiting; // of Proc*, whose fingerprints are being computed
+    Arr *locals;   // of Symbol*, bound within the code being walked
+    Arr *refs;     // the globals that were looked up and their values, or NULL
+    uint64_t h;
+    bool ok;
+} FpState;
+
+static void fp_proc(FpState *st, const Proc *proc);
+
+static void fp_mix(FpState *st, uint64_t h)
+{
+    st->h = st->h * 31 + h;
+}
+
+static void fp_mix_name(FpState *st, const Symbol *sym)
+{
+    const char *name = Symbol_name(sym);
+    fp_mix(st, hash_strn64(name, strlen(name)));
+}
+
+// a reference to a global
+static void fp_global(FpState *st, const Symbol *sym)
+{
+    fp_mix_name(st, sym);
+
+    LispDatum *dtm = MalEnv_get(st->top_env, sym);
+    if (st->refs) {
+        Arr_add(st->refs, (void*) sym);
+        Arr_add(st->refs, dtm);
+    }
+    if (dtm == NULL) {
+        st->ok = false;
+        return;
+    }
+    switch (LispDatum_type(dtm)) {
+        case NIL: case TRUE: case FALSE:
+            fp_mix(st, LispDatum_type(dtm));
+            return;
+        case PROCEDURE: {
+            const Proc *proc = (Proc*) dtm;
+            if (Proc_isbuiltin(proc)) {
+                st->ok = st->ok && Proc_isfunctional(proc);
+                fp_mix_name(st, Proc_name(proc));
+            }
+            else if (proc->env != st->top_env)
+                st->ok = false;
+            // the fingerprint of a recursive procedure already covers itself
+            else if (Arr_find(st->visiting, proc) < 0)
+                fp_proc(st, proc);
+            return;
+        }
+        default:
+            st->ok = false;
+            return;
+    }
+}
+
+static void fp_code(FpState *st, const LispDatum *dtm);
+
+static void fp_codes(FpState *st, const struct Node *node)
+{
+    for (; node != NULL && st->ok; node = node->next)
+        fp_code(st, node->value);
+}
+
+static void fp_quasiquoted(FpState *st, const LispDatum *dtm)
+{
+    if (!LispDatum_istype(dtm, LIST) || List_isempty((List*) dtm)) return;
+    const List *list = (List*) dtm;
+
+    const LispDatum *ref0 = List_ref(list, 0);
+    if (LispDatum_istype(ref0, SYMBOL)
+            && (Symbol_special((Symbol*) ref0) == SF_UNQUOTE
+                || Symbol_special((Symbol*) ref0) == SF_SPLICE_UNQUOTE))
+    {
+        fp_codes(st, list->head->next);
+        return;
+    }
+    for (const struct Node *node = list->head; node != NULL; node = node->next)
+        fp_quasiquoted(st, node->value);
+}
+
+// adds the symbols of a parameter list to the locals
+static void fp_bind_params(FpState *st, const LispDatum *params)
+{
+    if (!LispDatum_istype(params, LIST)) {
+        st->ok = false;
+        return;
+    }
+    for (const struct Node *node = ((List*) params)->head; node != NULL; node = node->next) {
+        if (LispDatum_istype(node->value, SYMBOL))
+            Arr_add(st->locals, node->value);
+    }
+}
+
+static void fp_code_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    FpState *st = data;
+    fp_code(st, key);
+    fp_code(st, val);
+}
+
+// Walks code like eval would evaluate it, following the references to globals.
+// Anything that isn't understood makes the code unfit for a fingerprint.
+static void fp_code(FpState *st, const LispDatum *dtm)
+{
+    if (!st->ok) return;
+
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL:
+            if (Symbol_special((Symbol*) dtm) == SF_NONE && Arr_find(st->locals, dtm) < 0)
+                fp_global(st, (Symbol*) dtm);
+            return;
+        case VECTOR: {
+            const Vector *vec = (Vector*) dtm;
+            for (size_t i = 0; i < Vector_len(vec); i++)
+                fp_code(st, Vector_ref(vec, i));
+            return;
+        }
+        case HASHMAP:
+            HashMap_foreach((HashMap*) dtm, fp_code_map_entry, st);
+            return;
+        case LIST:
+            break;
+        default:
+            return;
+    }
+
+    const List *list = (List*) dtm;
+    if (List_isempty(list)) return;
+    const LispDatum *head = List_ref(list, 0);
+    const struct Node *args = list->head->next;
+    size_t nlocals = st->locals->len;
+
+    switch (LispDatum_istype(head, SYMBOL) ? Symbol_special((Symbol*) head) : SF_NONE) {
+        case SF_QUOTE:
+            return;
+        case SF_QUASIQUOTE:
+            if (args) fp_quasiquoted(st, args->value);
+            return;
+        case SF_LAMBDA:
+            if (args == NULL) break;
+            fp_bind_params(st, args->value);
+            fp_codes(st, args->next);
+            st->locals->len = nlocals;
+            return;
+        case SF_LETSTAR:
+            if (args == NULL || !LispDatum_istype(args->value, LIST)) break;
+            for (const struct Node *bind = ((List*) args->value)->head; bind; bind = bind->next) {
+                if (!LispDatum_istype(bind->value, LIST) || List_len((List*) bind->value) != 2) {
+                    st->ok = false;
+                    return;
+                }
+                fp_code(st, List_ref((List*) bind->value, 1));
+                Arr_add(st->locals, List_ref((List*) bind->value, 0));
+            }
+            fp_codes(st, args->next);
+            st->locals->len = nlocals;
+            return;
+        case SF_TRYSTAR:
+            if (List_len(list) != 3 || !LispDatum_istype(List_ref(list, 2), LIST)) break;
+            fp_code(st, args->value);
+            const List *catch_list = (List*) List_ref(list, 2);
+            if (List_len(catch_list) != 3) break;
+            Arr_add(st->locals, List_ref(catch_list, 1));
+            fp_code(st, List_ref(catch_list, 2));
+            st->locals->len = nlocals;
+            return;
+        case SF_DEF: case SF_DEFMACRO: case SF_MACROEXPAND:
+            break;
+        case SF_NONE: {
+            // the expansion of a macro call could refer to anything
+            const LispDatum *macro = LispDatum_istype(head, SYMBOL)
+                && Arr_find(st->locals, head) < 0 ? MalEnv_get(st->top_env, (Symbol*) head) : NULL;
+            if (macro && LispDatum_istype(macro, PROCEDURE) && Proc_ismacro((Proc*) macro))
+                break;
+            fp_codes(st, list->head);
+            return;
+        }
+        default:
+            fp_codes(st, args);
+            return;
+    }
+    st->ok = false;
+}
+
+static void fp_proc(FpState *st, const Proc *proc)
+{
+    Arr_add(st->visiting, (void*) proc);
+    // globals are referred to by that procedure in its own scope
+    Arr *locals = st->locals;
+    st->locals = Arr_new();
+
+    char *body = pr_str((LispDatum*) proc->logic.body, true);
+    fp_mix(st, hash_strn64(body, strlen(body)) ^ proc->variadic);
+    free(body);
+    for (size_t i = 0; i < proc->params->len; i++) {
+        fp_mix_name(st, Arr_get(proc->params, i));
+        Arr_add(st->locals, Arr_get(proc->params, i));
+    }
+    fp_codes(st, proc->logic.body->head);
+
+    Arr_free(st->locals);
+    st->locals = locals;
+}
+
+// the fingerprint of a macro, a positive fixnum or 0 (see above); the globals
+// that it covers are added to refs (see FpState)
+static int64_t macro_fingerprint(const Proc *macro, MalEnv *top_env, Arr *refs)
+{
+    if (macro->env != top_env) return 0;
+
+    FpState st = { .top_env = top_env, .visiting = Arr_new(), .locals = NULL, .refs = refs,
+        .h = 0, .ok = true };
+    fp_proc(&st, macro);
+    Arr_free(st.visiting);
+    return st.ok ? (int64_t) (st.h >> 2) | 1 : 0;
+}
+
+// true if the datum consists of data that a cache can store
+static bool isdata(const LispDatum *dtm);
+
+static void isdata_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    bool *ok = data;
+    *ok = *ok && isdata(key) && isdata(val);
+}
+
+static bool isdata(const LispDatum *dtm)
+{
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL: case STRING: case NUMBER: case NIL: case TRUE: case FALSE:
+            return true;
+        case LIST:
+            for (struct Node *node = ((List*) dtm)->head; node != NULL; node = node->next) {
+                if (!isdata(node->value))
+                    return false;
+            }
+            return true;
+        case VECTOR: {
+            const Vector *vec = (Vector*) dtm;
+            for (size_t i = 0; i < Vector_len(vec); i++) {
+                if (!isdata(Vector_ref(vec, i)))
+                    return false;
+            }
+            return true;
+        }
+        case HASHMAP: {
+            bool ok = true;
+            HashMap_foreach((HashMap*) dtm, isdata_entry, &ok);
+            return ok;
+        }
+        default:
+            return false;
+    }
+}
+
+// Fingerprints of the macros that forms of a file depend on, most files use only
+// a few of them. A fingerprint is valid as long as the globals that it covers are
+// bound to the same values. The macros, the symbols and the values are owned, so
+// that none of them can be reallocated.
+#define FP_MEMO_SIZE 8
+typedef struct FpMemo {
+    Proc *macros[FP_MEMO_SIZE];
+    int64_t fps[FP_MEMO_SIZE];
+    Arr *refs[FP_MEMO_SIZE]; // see FpState
+    unsigned next; // the entry to be replaced next
+} FpMemo;
+
+static void FpMemo_drop(FpMemo *memo, unsigned i)
+{
+    if (memo->macros[i] == NULL) return;
+
+    LispDatum_rls_free((LispDatum*) memo->macros[i]);
+    memo->macros[i] = NULL;
+    Arr *refs = memo->refs[i];
+    for (size_t k = 0; k < refs->len; k++) {
+        if (Arr_get(refs, k))
+            LispDatum_rls_free(Arr_get(refs, k));
+    }
+    Arr_free(refs);
+}
+
+static int64_t FpMemo_get(FpMemo *memo, const Proc *macro, MalEnv *top_env)
+{
+    for (unsigned i = 0; i < FP_MEMO_SIZE; i++) {
+        if (memo->macros[i] != macro) continue;
+
+        const Arr *refs = memo->refs[i];
+        bool valid = true;
+        for (size_t k = 0; valid && k < refs->len; k += 2)
+            valid = MalEnv_get(top_env, Arr_get(refs, k)) == Arr_get(refs, k + 1);
+        if (valid)
+            return memo->fps[i];
+        FpMemo_drop(memo, i);
+        break;
+    }
+
+    unsigned i = memo->next;
+    memo->next = (i + 1) % FP_MEMO_SIZE;
+    FpMemo_drop(memo, i);
+
+    Arr *refs = Arr_new();
+    int64_t fp = macro_fingerprint(macro, top_env, refs);
+    for (size_t k = 0; k < refs->len; k++) {
+        if (Arr_get(refs, k))
+            LispDatum_own(Arr_get(refs, k));
+    }
+    LispDatum_own((LispDatum*) macro);
+    memo->macros[i] = (Proc*) macro;
+    memo->refs[i] = refs;
+    return memo->fps[i] = fp;
+}
+
+static void FpMemo_clear(FpMemo *memo)
+{
+    for (unsigned i = 0; i < FP_MEMO_SIZE; i++)
+        FpMemo_drop(memo, i);
+}
+
+// Expands the form like macroexpand, adding the heads of the form and of the
+// intermediate expansions to deps, followed by fingerprints (see above).
+// cacheable is set to false if a macro has no fingerprint.
+static LispDatum *macroexpand_deps(LispDatum *form, MalEnv *env, List *deps, FpMemo *memo,
+        bool *cacheable)
+{
+    LispDatum *out = form;
+    *cacheable = true;
+    while (1) {
+        Symbol *head = call_head(out);
+        const Proc *macro = call_macro(out, env);
+        if (head && *cacheable) {
+            int64_t fp = macro ? FpMemo_get(memo, macro, env) : 0;
+            *cacheable = macro == NULL || fp != 0;
+            List_add(deps, (LispDatum*) head);
+            List_add(deps, (LispDatum*) Number_new(fp));
+        }
+        if (macro == NULL) return out;
+
+        LispDatum *expanded = macroexpand_single(out, env);
+        if (out != form)
+            LispDatum_guard(expanded, LispDatum_free(out));
+        if (expanded == NULL) return NULL;
+        out = expanded;
+    }
+}
+
+// true if the heads in deps are bound the same way as when they were added
+static bool deps_hold(const List *deps, MalEnv *env, FpMemo *memo)
+{
+    for (struct Node *node = deps->head; node != NULL; node = node->next->next) {
+        LispDatum *dtm = MalEnv_get(env, (Symbol*) node->value);
+        int64_t fp = Number_tol((Number*) node->next->value);
+        bool ismacro = dtm && LispDatum_istype(dtm, PROCEDURE) && Proc_ismacro((Proc*) dtm);
+        if (ismacro != (fp != 0) || (ismacro && FpMemo_get(memo, (Proc*) dtm, env) != fp))
+            return false;
+    }
+    return true;
+}
+
+// true if the datum has the shape of the datum of a cache
+static bool iscache(const LispDatum *dtm)
+{
+    if (!LispDatum_istype(dtm, LIST)) return false;
+
+    for (struct Node *node = ((List*) dtm)->head; node != NULL; node = node->next) {
+        if (!LispDatum_istype(node->value, LIST)) return false;
+        const List *entry = (List*) node->value;
+        if (List_len(entry) == 1) continue;
+        if (List_len(entry) != 3 || !LispDatum_istype(List_ref(entry, 2), LIST))
+            return false;
+
+        const List *deps = (List*) List_ref(entry, 2);
+        if (List_len(deps) % 2 != 0) return false;
+        for (struct Node *dep = deps->head; dep != NULL; dep = dep->next->next) {
+            if (!LispDatum_istype(dep->value, SYMBOL) || !Number_isfixnum((Number*) dep->next->value))
+                return false;
+        }
+    }
+    return true;
+}
+
+// evaluates a form of a file, which is owned by the caller
+static bool load_form(LispDatum *form, MalEnv *top_env)
+{
+    LispDatum *rslt = eval(form, top_env);
+    if (rslt == NULL) return false;
+    LispDatum_free(rslt);
+    return true;
+}
+
+static bool load_cache(const List *cache, MalEnv *top_env)
+{
+    FpMemo memo = { .next = 0 };
+    bool ok = true;
+    for (struct Node *node = cache->head; ok && node != NULL; node = node->next) {
+        const List *entry = (List*) node->value;
+        LispDatum *form = List_ref(entry, 0);
+        if (List_len(entry) == 3 && deps_hold((List*) List_ref(entry, 2), top_env, &memo))
+            form = List_ref(entry, 1);
+        ok = load_form(form, top_env);
+    }
+    FpMemo_clear(&memo);
+    return ok;
+}
+
+// Reads and evaluates the forms in a file one at a time in the top-level
+// environment. The file is memory-mapped, so it's never copied as a whole, and
+// each form is evaluated as soon as it's read, unless the file has a cache (see
+// above). Evaluation stops at the first exception, in which case false is
+// returned.
+static bool load_file(const char *path, MalEnv *top_env)
+{
+    if (!file_readable(path)) {
+        throwf("load-file", "can't read file %s", path);
+        return false;
+    }
+
+    size_t len;
+    char *contents = file_map(path, &len);
+    if (!contents) {
+        throwf("load-file", "failed to read file %s", path);
+        return false;
+    }
+
+    // caches are keyed by the absolute path
+    char *real_path = realpath(path, NULL);
+    SourceKey key = { .path = real_path ? real_path : path, .size = len };
+    char *cache_file = cache_path(key.path);
+    if (cache_file && !file_mtime(path, &key.mtime)) {
+        free(cache_file);
+        cache_file = NULL;
+    }
+
+    List *cache = NULL;
+    FpMemo memo = { .next = 0 };
+    if (cache_file) {
+        key.hash = hash_strn64(contents, len);
+        LispDatum *dtm = image_load_cache(cache_file, &key);
+        if (dtm && iscache(dtm)) {
+            LispDatum_own(dtm);
+            bool ok = load_cache((List*) dtm, top_env);
+            LispDatum_rls_free(dtm);
+            free(cache_file);
+            free(real_path);
+            file_unmap(contents, len);
+            return ok;
+        }
+        if (dtm) LispDatum_free(dtm);
+
+        cache = List_new();
+        LispDatum_own((LispDatum*) cache);
+    }
+
+    Reader *rdr = read_strn(contents, len);
+    OWN(rdr);
+
+    bool ok = true;
+    while (ok && !Reader_eof(rdr)) {
+        LispDatum *form = read_form(rdr);
+        if (form == NULL) {
+            throwf("load-file", "could not parse bad syntax in file %s", path);
+            ok = false;
+            break;
+        }
+        LispDatum_own(form);
+
+        if (cache) {
+            List *entry = List_new();
+            List_add(cache, (LispDatum*) entry);
+            List_add(entry, form);
+
+            // the expansion is evaluated right away, as eval would
+            List *deps = List_new();
+            bool cacheable;
+            LispDatum *expanded = macroexpand_deps(form, top_env, deps, &memo, &cacheable);
+            if (expanded && expanded != form && cacheable && isdata(expanded)) {
+                List_add(entry, expanded);
+                List_add(entry, (LispDatum*) deps);
+            }
+            else
+                List_free(deps);
+
+            ok = expanded != NULL;
+            if (ok) {
+                LispDatum_own(expanded);
+                ok = load_form(expanded, top_env);
+                LispDatum_rls_free(expanded);
+            }
+        }
+        else
+            ok = load_form(form, top_env);
+        LispDatum_rls_free(form);
+    }
+
+    FREE(rdr);
+    Reader_free(rdr);
+    file_unmap(contents, len);
+
+    // a cache that can't be written is reported, but the file was still loaded
+    if (cache && ok)
+        image_dump_cache(cache_file, &key, (LispDatum*) cache);
+    if (cache)
+        LispDatum_rls_free((LispDatum*) cache);
+    FpMemo_clear(&memo);
+    free(cache_file);
+    free(real_path);
+
+    return ok;
+}
+
+// load-file : takes a file name (string), evaluates the forms in the file in the
+// top-level environment (see load_file) and returns nil.
+static LispDatum *lisp_load_file(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    String *string = verify_proc_arg_type(proc, args, 0, STRING);
+    if (!string) return NULL;
+
+    const char *path = String_str(string);
+    if (!load_file(path, MalEnv_enclosing_root(env)))
+        return NULL;
+
+    printf("loaded file %s\n", path);
+    return (LispDatum*) Nil_get();
+}
+
+// dump-image : takes a file name (string) and writes an image of the top-level
+// environment to it (see image.h), which can be loaded with --image on startup.
+// Returns nil.
+static LispDatum *lisp_dump_image(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    String *string = verify_proc_arg_type(proc, args, 0, STRING);
+    if (!string) return NULL;
+
+    if (!image_dump(MalEnv_enclosing_root(env), String_str(string)))
+        return NULL;
+
+    return (LispDatum*) Nil_get();
+}
+
+// eval : takes an AST and evaluates it in the top-level environment
+// local environments are not taken into account by eval
+static LispDatum *lisp_eval(const Proc *proc, const Arr *args, MalEnv *env) 
+{
+    LispDatum *arg0 = Arr_get(args, 0);
     MalEnv *top_env = MalEnv_enclosing_root(env);
     return eval(arg0, top_env);
 }
@@ -1144,18 +2030,27 @@ static LispDatum *lisp_swap_bang(const Proc *proc, const Arr *args, MalEnv *env)
     Arr *proc_args = Arr_newn(1 + args->len - 2); // of *LispDatum
     OWN(proc_args);
 
-    // use atom's value as the 1st argument 
-    Arr_add(proc_args, Atom_deref(atom));
+    // atom's value is the 1st argument
+    Arr_add(proc_args, NULL);
 
     for (size_t i = 2; i < args->len; i++) {
         Arr_add(proc_args, args->items[i]);
     }
 
-    LispDatum *rslt = NULL;
-
-    if (verify_proc_application(applied_proc, proc_args)) {
+    LispDatum *rslt;
+    while (1) {
+        LispDatum *old = Atom_deref(atom);
+        proc_args->items[0] = old;
         rslt = apply_proc(applied_proc, proc_args, env);
-        Atom_set(atom, rslt);
+        if (rslt == NULL) break;
+        if (!g_threaded) {
+            Atom_set(atom, rslt);
+            break;
+        }
+        // threads of a parallel section may swap the same atom, the procedure is
+        // applied again to the value set by the one that got ahead
+        if (Atom_compare_set(atom, old, rslt)) break;
+        LispDatum_free(rslt);
     }
 
     FREE(proc_args);
@@ -1164,13 +2059,50 @@ static LispDatum *lisp_swap_bang(const Proc *proc, const Arr *args, MalEnv *env)
     return rslt;
 }
 
-// map : maps over a list/vector using a procedure
+// map : maps over a list/vector using a procedure, the result is a list or
+// a vector respectively
 // TODO accept multiple lists/vectors
+// a vector or a list that nothing else refers to gets the results in place of its
+// elements (an element is released once the mapper is done with it)
+static LispDatum *lisp_map_vector(const Proc *mapper, Vector *vec, bool reuse, MalEnv *env) 
+{
+    Vector *out = reuse ? vec : Vector_newc(Vector_len(vec));
+    // args to mapper proc
+    Arr *mapper_args = Arr_newn(1);
+    Arr_add(mapper_args, NULL); // to increase length to 1
+
+    for (size_t i = 0; i < Vector_len(vec); i++) {
+        Arr_replace(mapper_args, 0, Vector_ref(vec, i));
+        LispDatum *new_elt = apply_proc(mapper, mapper_args, env);
+        if (!new_elt) {
+            if (!reuse) Vector_free(out);
+            Arr_free(mapper_args);
+            return NULL;
+        }
+
+        if (reuse)
+            Vector_set(out, i, new_elt);
+        else
+            Vector_add(out, new_elt);
+    }
+
+    Arr_free(mapper_args);
+
+    return (LispDatum*) out;
+}
+
 static LispDatum *lisp_map(const Proc *proc, const Arr *args, MalEnv *env) 
 {
     Proc *mapper = verify_proc_arg_type(proc, args, 0, PROCEDURE);
     if (!mapper) return NULL;
 
+    LispDatum *arg1 = Arr_get(args, 1);
+    if (LispDatum_istype(arg1, VECTOR)) {
+        Vector *vec = (Vector*) arg1;
+        return lisp_map_vector(mapper, vec,
+                vm_unique_arg(args, 1) && Vector_isexclusive(vec), env);
+    }
+
     List *list = verify_proc_arg_type(proc, args, 1, LIST);
     if (!list) return NULL;
 
@@ -1178,7 +2110,8 @@ static LispDatum *lisp_map(const Proc *proc, const Arr *args, MalEnv *env)
         return (LispDatum*) List_empty();
     }
 
-    List *out = List_new();
+    bool reuse = vm_unique_arg(args, 1) && List_isexclusive(list);
+    List *out = reuse ? list : List_new();
     // args to mapper proc
     Arr *mapper_args = Arr_newn(1);
     Arr_add(mapper_args, NULL); // to increase length to 1
@@ -1189,12 +2122,15 @@ static LispDatum *lisp_map(const Proc *proc, const Arr *args, MalEnv *env)
         Arr_replace(mapper_args, 0, list_elt);
         LispDatum *new_elt = apply_proc(mapper, mapper_args, env);
         if (!new_elt) {
-            List_free(out);
+            if (!reuse) List_free(out);
             Arr_free(mapper_args);
             return NULL;
         }
 
-        List_add(out, new_elt);
+        if (reuse)
+            List_node_set(node, new_elt);
+        else
+            List_add(out, new_elt);
     }
 
     Arr_free(mapper_args);
@@ -1202,75 +2138,659 @@ static LispDatum *lisp_map(const Proc *proc, const Arr *args, MalEnv *env)
     return (LispDatum*) out;
 }
 
-int main(int argc, char **argv) {
+// -----------------------------------------------------------------------------
+// Lazy sequences (see LazySeq in types.h)
+
+typedef enum { SEQ_MORE, SEQ_STOP, SEQ_FAIL } SeqStatus;
+
+// takes an element that came out of a pipeline, which is valid only during the
+// call; returns SEQ_STOP once it doesn't need any more elements
+typedef SeqStatus (*seq_consume_ft)(LispDatum *elt, void *data);
+
+typedef struct Pipeline {
+    const LazySeq **stages; // of map and filter, the one next to the source first
+    size_t nstages;
+    seq_consume_ft consume;
+    void *data;
+    MalEnv *env;
+} Pipeline;
+
+// passes an element of the source through all stages to the consumer, the element
+// and what the stages make of it are owned for as long as they are in the pipeline
+static SeqStatus pipeline_put(const Pipeline *pl, LispDatum *elt)
+{
+    LispDatum_own(elt);
+
+    SeqStatus status = SEQ_MORE;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        const LazySeq *stage = pl->stages[i];
+        Arr args = { .len = 1, .cap = 1, .items = (void**) &elt };
+        LispDatum *out = apply_proc(stage->proc, &args, pl->env);
+        if (out == NULL) {
+            status = SEQ_FAIL;
+            break;
+        }
+
+        if (stage->kind == SEQ_MAP) {
+            LispDatum_own(out);
+            LispDatum_rls_free(elt);
+            elt = out;
+            continue;
+        }
+
+        bool keep = !LispDatum_istype(out, NIL) && !LispDatum_istype(out, FALSE);
+        LispDatum_free(out);
+        if (!keep) {
+            LispDatum_rls_free(elt);
+            return SEQ_MORE;
+        }
+    }
+
+    if (status == SEQ_MORE)
+        status = pl->consume(elt, pl->data);
+    LispDatum_rls_free(elt);
+    return status;
+}
+
+static SeqStatus range_run(const LazySeq *seq, const Pipeline *pl)
+{
+    bool down = Number_isneg(seq->step);
+    Number *num = seq->start;
+    LispDatum_own((LispDatum*) num);
+
+    SeqStatus status = SEQ_MORE;
+    while (status == SEQ_MORE) {
+        if (seq->end) {
+            int cmp = Number_cmp(num, seq->end);
+            if (down ? cmp <= 0 : cmp >= 0) break;
+        }
+        status = pipeline_put(pl, (LispDatum*) num);
+
+        Number *next = Number_add(num, seq->step);
+        LispDatum_own((LispDatum*) next);
+        LispDatum_rls_free((LispDatum*) num);
+        num = next;
+    }
+
+    LispDatum_rls_free((LispDatum*) num);
+    return status;
+}
+
+// the file is read one line at a time, so it takes no more memory than its
+// longest line
+static SeqStatus lines_run(const LazySeq *seq, const Pipeline *pl)
+{
+    const char *path = String_str((String*) seq->src);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        throwf("file-lines", "can't read file %s", path);
+        return SEQ_FAIL;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    SeqStatus status = SEQ_MORE;
+    while (status == SEQ_MORE && (len = getline(&line, &cap, file)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            len--;
+        status = pipeline_put(pl, (LispDatum*) String_newn(line, len));
+    }
+    if (status == SEQ_MORE && ferror(file)) {
+        throwf("file-lines", "failed to read file %s", path);
+        status = SEQ_FAIL;
+    }
+
+    free(line);
+    fclose(file);
+    return status;
+}
+
+// Consumes a list, a vector or a lazy sequence: each element of the source is
+// pulled through the stages of map and filter on top of it and given to the
+// consumer, until either runs out. Returns false if something failed.
+static bool seq_run(const LispDatum *coll, seq_consume_ft consume, void *data, MalEnv *env)
+{
+    size_t n = 0;
+    const LispDatum *src = coll;
+    while (LispDatum_istype(src, LAZYSEQ) && ((LazySeq*) src)->proc) {
+        src = ((LazySeq*) src)->src;
+        n++;
+    }
+
+    Pipeline pl = {
+        .stages = malloc(sizeof(*pl.stages) * (n ? n : 1)), .nstages = n,
+        .consume = consume, .data = data, .env = env
+    };
+    src = coll;
+    for (size_t i = n; i-- > 0; src = ((LazySeq*) src)->src)
+        pl.stages[i] = (LazySeq*) src;
+
+    SeqStatus status = SEQ_MORE;
+    switch (LispDatum_type(src)) {
+        case LIST:
+            for (struct Node *node = ((List*) src)->head; node && status == SEQ_MORE;
+                    node = node->next)
+                status = pipeline_put(&pl, node->value);
+            break;
+        case VECTOR: {
+            const Vector *vec = (Vector*) src;
+            for (size_t i = 0; i < Vector_len(vec) && status == SEQ_MORE; i++)
+                status = pipeline_put(&pl, Vector_ref(vec, i));
+            break;
+        }
+        default: {
+            const LazySeq *seq = (LazySeq*) src;
+            status = seq->kind == SEQ_RANGE ? range_run(seq, &pl) : lines_run(seq, &pl);
+            break;
+        }
+    }
+
+    free(pl.stages);
+    return status != SEQ_FAIL;
+}
+
+static void *verify_seq_arg(const Proc *proc, const Arr *args, size_t arg_idx)
+{
+    LispDatum *arg = Arr_get(args, arg_idx);
+    if (!LispDatum_istype(arg, LIST) && !LispDatum_istype(arg, VECTOR)
+            && !LispDatum_istype(arg, LAZYSEQ)) {
+        throwf(Symbol_name(Proc_name(proc)), "bad arg no. %zd: expected a LIST, VECTOR or %s",
+                arg_idx + 1, LispType_name(LAZYSEQ));
+        return NULL;
+    }
+    return arg;
+}
+
+// range : (range), (range end), (range start end) or (range start end step)
+// numbers from start (0 by default) by step (1 by default) up to end (exclusive),
+// without an end the sequence is infinite
+static LispDatum *lisp_range(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (args->len > 3) {
+        throwf("range", "expected at most 3 arguments, but %zu were given", args->len);
+        return NULL;
+    }
+    for (size_t i = 0; i < args->len; i++) {
+        if (!verify_proc_arg_type(proc, args, i, NUMBER))
+            return NULL;
+    }
+
+    Number *start = args->len >= 2 ? Arr_get(args, 0) : Number_new(0);
+    Number *end = args->len == 1 ? Arr_get(args, 0) : args->len >= 2 ? Arr_get(args, 1) : NULL;
+    Number *step = args->len == 3 ? Arr_get(args, 2) : Number_new(1);
+    if (Number_cmpl(step, 0) == 0) {
+        throwf("range", "step must not be 0");
+        return NULL;
+    }
+
+    return (LispDatum*) LazySeq_range(start, end, step);
+}
+
+// lazy-map : (lazy-map proc seq) the lazy sequence of proc applied to each element
+// of a list, a vector or a lazy sequence
+static LispDatum *lisp_lazy_map(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    Proc *mapper = verify_proc_arg_type(proc, args, 0, PROCEDURE);
+    if (!mapper) return NULL;
+    LispDatum *src = verify_seq_arg(proc, args, 1);
+    if (!src) return NULL;
+
+    return (LispDatum*) LazySeq_map(mapper, src);
+}
+
+// lazy-filter : (lazy-filter pred seq) the lazy sequence of the elements for which
+// pred returns true
+static LispDatum *lisp_lazy_filter(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    Proc *pred = verify_proc_arg_type(proc, args, 0, PROCEDURE);
+    if (!pred) return NULL;
+    LispDatum *src = verify_seq_arg(proc, args, 1);
+    if (!src) return NULL;
+
+    return (LispDatum*) LazySeq_filter(pred, src);
+}
+
+// file-lines : (file-lines path) the lazy sequence of the lines of a file, which is
+// read again each time the sequence is consumed
+static LispDatum *lisp_file_lines(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    String *path = verify_proc_arg_type(proc, args, 0, STRING);
+    if (!path) return NULL;
+
+    return (LispDatum*) LazySeq_lines(path);
+}
+
+static LispDatum *lisp_lazy_seqp(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    return (LispDatum*) LispDatum_bool(LispDatum_istype(Arr_get(args, 0), LAZYSEQ));
+}
+
+typedef struct TakeState {
+    List *out;   // NULL until the first element
+    long left;
+} TakeState;
+
+static SeqStatus take_put(LispDatum *elt, void *data)
+{
+    TakeState *st = data;
+    if (st->out == NULL)
+        st->out = List_new();
+    List_add(st->out, elt);
+    return --st->left > 0 ? SEQ_MORE : SEQ_STOP;
+}
+
+// take : (take n seq) a list of the first n elements of a list, a vector or a lazy
+// sequence (all of them if there are fewer), nothing past them is computed
+static LispDatum *lisp_take(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    const Number *n = verify_proc_arg_type(proc, args, 0, NUMBER);
+    if (!n) return NULL;
+    LispDatum *src = verify_seq_arg(proc, args, 1);
+    if (!src) return NULL;
+
+    TakeState st = { .out = NULL, .left = Number_tol(n) };
+    if (st.left > 0 && !seq_run(src, take_put, &st, env)) {
+        if (st.out) List_free(st.out);
+        return NULL;
+    }
+
+    return (LispDatum*) (st.out ? st.out : List_empty());
+}
+
+typedef struct ReduceState {
+    const Proc *proc;
+    LispDatum *acc; // owned
+    MalEnv *env;
+} ReduceState;
+
+static SeqStatus reduce_put(LispDatum *elt, void *data)
+{
+    ReduceState *st = data;
+    LispDatum *items[] = { st->acc, elt };
+    Arr args = { .len = 2, .cap = 2, .items = (void**) items };
+    LispDatum *acc = apply_proc(st->proc, &args, st->env);
+    if (acc == NULL) return SEQ_FAIL;
+
+    LispDatum_own(acc);
+    LispDatum_rls_free(st->acc);
+    st->acc = acc;
+    return SEQ_MORE;
+}
+
+// reduce : (reduce proc init seq) folds the elements of a list, a vector or a lazy
+// sequence from the left, starting with init: (proc (proc init x1) x2) ...
+static LispDatum *lisp_reduce(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    const Proc *reducer = verify_proc_arg_type(proc, args, 0, PROCEDURE);
+    if (!reducer) return NULL;
+    LispDatum *src = verify_seq_arg(proc, args, 2);
+    if (!src) return NULL;
+
+    ReduceState st = { .proc = reducer, .acc = Arr_get(args, 1), .env = env };
+    LispDatum_own(st.acc);
+    if (!seq_run(src, reduce_put, &st, env)) {
+        LispDatum_rls_free(st.acc);
+        return NULL;
+    }
+
+    // the result is the caller's
+    LispDatum_rls(st.acc);
+    return st.acc;
+}
+
+// pmap : like map, but the procedure is applied to all elements at once on the
+// worker threads (see par_for), so the applications should be independent of each
+// other. If some of them fail, the failure of the first one (in the order of
+// elements) is raised, applications to the elements after it might have run.
+// pfor-each : like pmap, for the side effects of the applications, returns nil
+
+typedef struct PMapJob {
+    const Proc *mapper;
+    MalEnv *env;
+    size_t len;
+    LispDatum **elts;
+    LispDatum **outs;  // owned results of the applications
+    Exception **exns;  // owned exceptions raised by the applications
+    size_t failed;     // index of the first failed application, or SIZE_MAX
+} PMapJob;
+
+static void pmap_task(size_t idx, void *data)
+{
+    PMapJob *job = data;
+    // the failure of an earlier element is the one that gets reported
+    if (idx > __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) return;
+
+    Arr args = { .len = 1, .cap = 1, .items = (void**) &job->elts[idx] };
+    LispDatum *out = apply_proc(job->mapper, &args, job->env);
+    if (out) {
+        LispDatum_own(out);
+        job->outs[idx] = out;
+        return;
+    }
+
+    if (didthrow()) {
+        job->exns[idx] = thrown_copy();
+        LispDatum_own((LispDatum*) job->exns[idx]);
+    }
+    size_t failed = __atomic_load_n(&job->failed, __ATOMIC_RELAXED);
+    while (idx < failed && !__atomic_compare_exchange_n(&job->failed, &failed, idx,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void PMapJob_free(PMapJob *job)
+{
+    for (size_t i = 0; i < job->len; i++) {
+        if (job->outs[i]) LispDatum_rls_free(job->outs[i]);
+        if (job->exns[i]) LispDatum_rls_free((LispDatum*) job->exns[i]);
+    }
+    free(job->elts);
+    free(job->outs);
+    free(job->exns);
+}
+
+// Applies the procedure to each element of a list or a vector (arguments of proc),
+// returns false after raising the first failure. The job is freed by the caller.
+static bool pmap_run(PMapJob *job, const Proc *proc, const Arr *args, MalEnv *env)
+{
+    *job = (PMapJob) { .env = env, .failed = SIZE_MAX };
+    job->mapper = verify_proc_arg_type(proc, args, 0, PROCEDURE);
+    if (!job->mapper) return false;
+
+    LispDatum *arg1 = Arr_get(args, 1);
+    if (LispDatum_istype(arg1, VECTOR)) {
+        const Vector *vec = (Vector*) arg1;
+        job->len = Vector_len(vec);
+        job->elts = malloc(sizeof(*job->elts) * (job->len ? job->len : 1));
+        for (size_t i = 0; i < job->len; i++)
+            job->elts[i] = Vector_ref(vec, i);
+    }
+    else {
+        const List *list = verify_proc_arg_type(proc, args, 1, LIST);
+        if (!list) return false;
+        job->len = List_len(list);
+        job->elts = malloc(sizeof(*job->elts) * (job->len ? job->len : 1));
+        size_t i = 0;
+        for (struct Node *node = list->head; node != NULL; node = node->next)
+            job->elts[i++] = node->value;
+    }
+    job->outs = calloc(job->len ? job->len : 1, sizeof(*job->outs));
+    job->exns = calloc(job->len ? job->len : 1, sizeof(*job->exns));
+
+    par_for(job->len, pmap_task, job);
+
+    if (job->failed == SIZE_MAX)
+        return true;
+
+    // the failure was reported by the thread that ran into it
+    const Exception *exn = job->exns[job->failed];
+    if (exn)
+        rethrow(Exception_datum(exn));
+    else
+        error("%s", "");
+    return false;
+}
+
+static LispDatum *lisp_pmap(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    PMapJob job;
+    if (!pmap_run(&job, proc, args, env)) {
+        PMapJob_free(&job);
+        return NULL;
+    }
+
+    LispDatum *out;
+    if (LispDatum_istype(Arr_get(args, 1), VECTOR)) {
+        Vector *vec = Vector_newc(job.len);
+        for (size_t i = 0; i < job.len; i++)
+            Vector_add(vec, job.outs[i]);
+        out = (LispDatum*) vec;
+    }
+    else if (job.len == 0) {
+        out = (LispDatum*) List_empty();
+    }
+    else {
+        List *list = List_new();
+        for (size_t i = 0; i < job.len; i++)
+            List_add(list, job.outs[i]);
+        out = (LispDatum*) list;
+    }
+
+    PMapJob_free(&job);
+    return out;
+}
+
+static LispDatum *lisp_pfor_each(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    PMapJob job;
+    bool ok = pmap_run(&job, proc, args, env);
+    PMapJob_free(&job);
+    return ok ? (LispDatum*) Nil_get() : NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Embedding API (see mylisp.h)
+
+struct MyLisp {
+    MalEnv *env;
+    // evaluations in progress, which are nested when a built-in procedure of the
+    // host evaluates through the API
+    unsigned depth;
+};
+
+static bool g_created = false;
+// held by the thread that is in the interpreter (see mylisp_enter)
+static pthread_mutex_t g_entry_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread unsigned t_entries = 0;
+
+// Evaluation through the API starts. Nothing is referenced from the C stack
+// outside of evaluations, which is when the cycle collector gets a chance to run.
+static void enter(MyLisp *ml)
+{
+    mylisp_enter(ml);
+    if (ml->depth++ == 0)
+        gc_maybe_collect();
+}
+
+static void leave(MyLisp *ml)
+{
+    ml->depth--;
+    mylisp_leave(ml);
+}
+
+// defines a built-in procedure without side effects (see Proc_isfunctional)
+static void def_proc_functional(MyLisp *ml, const char *name, int arity, bool variadic,
+        builtin_apply_t apply)
+{
+    Symbol *sym = Symbol_intern(name);
+    Proc *proc = Proc_builtin(sym, arity, variadic, apply);
+    Proc_set_functional(proc);
+    MalEnv_put(ml->env, sym, (LispDatum*) proc);
+}
+
+MyLisp *mylisp_new()
+{
+    // tested before the lock, which the thread that is in the interpreter holds
+    if (__atomic_exchange_n(&g_created, true, __ATOMIC_ACQ_REL)) {
+        error("mylisp_new: the interpreter has already been created\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&g_entry_lock);
+    t_entries = 1;
+
     init_symbol_table();
 
+    MyLisp *ml = malloc(sizeof(MyLisp));
     MalEnv *env = MalEnv_new(NULL);
-    OWN(env);
     MalEnv_own(env);
+    ml->env = env;
+    ml->depth = 0;
 
     MalEnv_put(env, Symbol_intern("nil"),   (LispDatum*) Nil_get());
     MalEnv_put(env, Symbol_intern("true"),  (LispDatum*) True_get());
     MalEnv_put(env, Symbol_intern("false"), (LispDatum*) False_get());
 
-#define ENV_PUT_PROC(name, arity, variadic, funp) \
-    { \
-        Symbol *_s = Symbol_intern(name); \
-        MalEnv_put(env, _s, (LispDatum*) Proc_builtin(_s, arity, variadic, funp)); \
+    def_proc_functional(ml, "apply", 2, true, lisp_apply);
+    def_proc_functional(ml, "read-string", 1, false, lisp_read_string);
+    mylisp_def_proc(ml, "slurp", 1, false, lisp_slurp);
+    mylisp_def_proc(ml, "load-file", 1, false, lisp_load_file);
+    mylisp_def_proc(ml, "dump-image", 1, false, lisp_dump_image);
+    mylisp_def_proc(ml, "eval", 1, false, lisp_eval);
+    mylisp_def_proc(ml, "swap!", 2, true, lisp_swap_bang);
+    def_proc_functional(ml, "map", 2, false, lisp_map);
+    mylisp_def_proc(ml, "pmap", 2, false, lisp_pmap);
+    mylisp_def_proc(ml, "pfor-each", 2, false, lisp_pfor_each);
+    mylisp_def_proc(ml, "range", 0, true, lisp_range);
+    mylisp_def_proc(ml, "lazy-map", 2, false, lisp_lazy_map);
+    mylisp_def_proc(ml, "lazy-filter", 2, false, lisp_lazy_filter);
+    mylisp_def_proc(ml, "file-lines", 1, false, lisp_file_lines);
+    mylisp_def_proc(ml, "lazy-seq?", 1, false, lisp_lazy_seqp);
+    mylisp_def_proc(ml, "take", 2, false, lisp_take);
+    def_proc_functional(ml, "reduce", 3, false, lisp_reduce);
+
+    core_def_procs(env);
+
+    return ml;
+}
+
+void mylisp_free(MyLisp *ml)
+{
+    // the lock is released below whatever the number of entries of this thread
+    mylisp_enter(ml);
+    MalEnv_release(ml->env);
+    MalEnv_free(ml->env);
+    free(ml);
+
+    free_symbol_table();
+    __atomic_store_n(&g_created, false, __ATOMIC_RELEASE);
+    t_entries = 0;
+    pthread_mutex_unlock(&g_entry_lock);
+}
+
+void mylisp_enter(MyLisp *ml)
+{
+    // worker threads are in the interpreter on behalf of the thread that runs the
+    // parallel section
+    if (t_entries++ == 0 && thread_index() == 0)
+        pthread_mutex_lock(&g_entry_lock);
+}
+
+void mylisp_leave(MyLisp *ml)
+{
+    if (t_entries == 0) {
+        error("mylisp_leave: the interpreter hasn't been entered by this thread\n");
+        return;
     }
+    if (--t_entries == 0 && thread_index() == 0)
+        pthread_mutex_unlock(&g_entry_lock);
+}
 
-    ENV_PUT_PROC("apply", 2, true, lisp_apply);
-    ENV_PUT_PROC("read-string", 1, false, lisp_read_string);
-    ENV_PUT_PROC("slurp", 1, false, lisp_slurp);
-    ENV_PUT_PROC("eval", 1, false, lisp_eval);
-    ENV_PUT_PROC("swap!", 2, true, lisp_swap_bang);
-    ENV_PUT_PROC("map", 2, false, lisp_map);
+MalEnv *mylisp_env(const MyLisp *ml)
+{
+    return ml->env;
+}
 
-    core_def_procs(env);
+void mylisp_def(MyLisp *ml, const char *name, LispDatum *dtm)
+{
+    mylisp_enter(ml);
+    MalEnv_put(ml->env, Symbol_intern(name), dtm);
+    mylisp_leave(ml);
+}
 
-    rep("(def! load-file\n"
-            // closing paren of 'do' must be on a separate line in case a file ends
-            // with a comment without a newline at the end
-            "(lambda (path) (eval (read-string (str \"(do \" (slurp path) \"\n)\")))\n"
-                        "(println \"loaded file\" path) nil))", 
-            env);
+void mylisp_def_proc(MyLisp *ml, const char *name, int arity, bool variadic,
+        builtin_apply_t apply)
+{
+    mylisp_enter(ml);
+    Symbol *sym = Symbol_intern(name);
+    MalEnv_put(ml->env, sym, (LispDatum*) Proc_builtin(sym, arity, variadic, apply));
+    mylisp_leave(ml);
+}
 
-    rep("(load-file \"lisp/core.lisp\")", env);
+bool mylisp_load_file(MyLisp *ml, const char *path)
+{
+    enter(ml);
+    bool ok = load_file(path, ml->env);
+    leave(ml);
+    return ok;
+}
 
-    // TODO if the first arg is a filename, then eval (load-file <filename>)
-    // TODO bind *ARGV* to command line arguments
+bool mylisp_load_image(MyLisp *ml, const char *path)
+{
+    enter(ml);
+    bool ok = image_load(ml->env, path);
+    leave(ml);
+    return ok;
+}
 
-    // using_history();
-    read_history(HISTORY_FILE);
-    // if (read_history(HISTORY_FILE) != 0) {
-    //     fprintf(stderr, "failed to read history file %s\n", HISTORY_FILE);
-    //     exit(EXIT_FAILURE);
-    // }
+LispDatum *mylisp_read(MyLisp *ml, const char *src)
+{
+    mylisp_enter(ml);
+    Reader *rdr = read_str(src);
+    LispDatum *form = NULL;
+    if (Reader_eof(rdr))
+        error("mylisp_read: end of input\n");
+    else
+        form = read_form(rdr); // which reports bad syntax
+    Reader_free(rdr);
+    mylisp_leave(ml);
+    return form;
+}
 
-    while (1) {
-        char *line = readline(PROMPT);
-        if (line == NULL) {
-            exit(EXIT_SUCCESS);
-        }
+LispDatum *mylisp_eval(MyLisp *ml, LispDatum *form)
+{
+    enter(ml);
+    // eval might free the form when it's done with it
+    LispDatum_own(form);
+    LispDatum *out = eval(form, ml->env);
+    LispDatum_rls(form);
+    leave(ml);
+    return out;
+}
 
-        if (line[0] != '\0') {
-            add_history(line);
-            // FIXME append to history file just once on exit
-            if (append_history(1, HISTORY_FILE) != 0)
-                fprintf(stderr, 
-                        "failed to append to history file %s (try creating it manually)\n", 
-                        HISTORY_FILE);
-        }
+LispDatum *mylisp_eval_str(MyLisp *ml, const char *src)
+{
+    LispDatum *form = mylisp_read(ml, src);
+    if (form == NULL) return NULL;
+
+    LispDatum *out = mylisp_eval(ml, form);
+    LispDatum_guard(out, LispDatum_free(form));
+    return out;
+}
 
-        rep(line, env);
-        free(line);
+Proc *mylisp_compile(MyLisp *ml, const char *src)
+{
+    LispDatum *dtm = mylisp_eval_str(ml, src);
+    if (dtm == NULL) return NULL;
+
+    if (!LispDatum_istype(dtm, PROCEDURE)) {
+        throwf("mylisp_compile", "expected a procedure, but got %s",
+                LispType_name(LispDatum_type(dtm)));
+        LispDatum_free(dtm);
+        return NULL;
     }
 
-    MalEnv_release(env);
-    FREE(env);
-    MalEnv_free(env);
+    LispDatum_own(dtm);
+    return (Proc*) dtm;
+}
 
-    clear_history();
+LispDatum *mylisp_apply(MyLisp *ml, const Proc *proc, LispDatum **args, size_t argc)
+{
+    enter(ml);
+    // the arguments are owned by the application, but stay the caller's
+    for (size_t i = 0; i < argc; i++)
+        LispDatum_own(args[i]);
 
-    free_symbol_table();
+    Arr view = { .len = argc, .cap = argc, .items = (void**) args };
+    LispDatum *out = apply_proc(proc, &view, ml->env);
+
+    for (size_t i = 0; i < argc; i++)
+        LispDatum_rls(args[i]);
+    leave(ml);
+    return out;
+}
+
+const LispDatum *mylisp_exception()
+{
+    return thrown_datum();
 }
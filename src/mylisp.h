@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "env.h"
+
+/* Embedding API, built as libmylisp.a and libmylisp.so.
+ * A host application creates the interpreter once, defines its own built-in
+ * procedures, loads its code (e.g., lisp/core.lisp or an image of it) and then
+ * evaluates as many forms as it needs. A form that is evaluated repeatedly should
+ * be compiled to a procedure once (mylisp_compile) and applied to arguments
+ * built by the host (with the constructors of types.h), so that neither the
+ * reader nor the printer are involved.
+ *
+ * There is a single interpreter per process: its state is global (the symbol
+ * table, pools, the cycle collector, caches of top-level bindings and of loaded
+ * files, the profiler), so a MyLisp handle isn't an independent instance and
+ * mylisp_new fails while the interpreter exists. Any thread of the host can use
+ * it, one at a time. Each function enters the interpreter for its duration
+ * (mylisp_enter), waiting while another thread is in it; a thread that touches
+ * datums between calls (results it owns, arguments it builds) enters it around
+ * them and leaves it (mylisp_leave) when it's done. The thread that creates the
+ * interpreter is in it until it leaves. The last exception and the VM stack are
+ * kept per thread. Host threads don't evaluate in parallel; a program uses more
+ * than one core through pmap and pfor-each, whose applications are spread over
+ * the worker threads of the interpreter (see threads.h).
+ *
+ * Datums follow the usual conventions: datums passed in stay the caller's, and so
+ * do the results, which the caller either owns (LispDatum_own) or discards
+ * (LispDatum_free, which frees only a datum that nothing else refers to).
+ * Functions fail by returning NULL (false), after reporting the error or the
+ * exception on stderr. The value of the last exception is available through
+ * mylisp_exception.
+ */
+
+typedef struct MyLisp MyLisp;
+
+// Creates the interpreter with the built-in procedures defined in the top-level
+// environment, entered by the calling thread. Returns NULL while the interpreter
+// exists, i.e., until mylisp_free.
+MyLisp *mylisp_new();
+// frees the interpreter, entering it first unless the calling thread already has
+void mylisp_free(MyLisp *ml);
+
+// Enters the interpreter on the calling thread, waiting until no other thread is
+// in it. Calls nest, e.g., a built-in procedure of the host may enter again.
+void mylisp_enter(MyLisp *ml);
+// leaves the interpreter after as many calls as entered it
+void mylisp_leave(MyLisp *ml);
+
+// the top-level environment
+MalEnv *mylisp_env(const MyLisp *ml);
+
+// defines a top-level binding, the datum becomes owned by the environment
+void mylisp_def(MyLisp *ml, const char *name, LispDatum *dtm);
+// defines a built-in procedure (see builtin_apply_t), which gets its arguments as
+// a view of the VM stack that is valid only during the application
+void mylisp_def_proc(MyLisp *ml, const char *name, int arity, bool variadic,
+        builtin_apply_t apply);
+
+// evaluates the forms in the file in the top-level environment, stops at the
+// first exception
+bool mylisp_load_file(MyLisp *ml, const char *path);
+// loads the bindings of an image (see image.h)
+bool mylisp_load_image(MyLisp *ml, const char *path);
+
+// reads the first form of a string, returns NULL on bad syntax or at the end of
+// input (an error that isn't an exception)
+LispDatum *mylisp_read(MyLisp *ml, const char *src);
+// evaluates a form in the top-level environment
+LispDatum *mylisp_eval(MyLisp *ml, LispDatum *form);
+// reads and evaluates the first form of a string
+LispDatum *mylisp_eval_str(MyLisp *ml, const char *src);
+
+// Evaluates the first form of a string, which should result in a procedure, e.g.,
+// "(lambda (order) (> (order-total order) 100))". The body of a lambda is
+// resolved and compiled right away. The procedure is owned by the caller, who
+// releases it with LispDatum_rls_free.
+Proc *mylisp_compile(MyLisp *ml, const char *src);
+// applies a procedure to argc arguments
+LispDatum *mylisp_apply(MyLisp *ml, const Proc *proc, LispDatum **args, size_t argc);
+
+// returns the value of the last exception, NULL if the last failure was an error
+// that isn't an exception (e.g., bad syntax); valid until the next failure
+const LispDatum *mylisp_exception();
@@ -0,0 +1,272 @@
+// pthreads
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "threads.h"
+#include "common.h"
+
+#define SLAB_SIZE (16 * 1024)
+// objects are aligned so that their low bits are free for tagging (see types.h)
+#define OBJ_ALIGN 8
+
+typedef struct Slab {
+    struct Slab *next;
+} Slab;
+
+// slab header is padded so that objects following it stay aligned
+#define SLAB_HDR_SIZE ((sizeof(Slab) + OBJ_ALIGN - 1) & ~(size_t) (OBJ_ALIGN - 1))
+
+#define MAX_POOLS 32
+
+static Pool *g_pools = NULL;
+static Pool *g_pools_by_id[MAX_POOLS];
+static unsigned g_npools = 0;
+static pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_live_bytes = 0;
+static size_t g_peak_bytes = 0;
+
+// Worker threads (see threads.h) don't touch the free lists of the shared pools.
+// Each of them has a shadow of every pool, indexed by the pool id, which serves
+// its allocations and takes the objects it frees, wherever they were allocated
+// (slabs are never given back, so objects can move between free lists). Their
+// statistics are added to the shared pools by Pool_join_threads.
+typedef struct ThreadPools {
+    Pool shadows[MAX_POOLS];
+    size_t live_bytes;
+} ThreadPools;
+
+static __thread ThreadPools *t_pools = NULL; // NULL on the main thread
+static ThreadPools *g_thread_pools[THREADS_MAX];
+
+// pools are registered by whichever thread uses them first
+static void Pool_register(Pool *pool)
+{
+    pthread_mutex_lock(&g_pools_lock);
+    if (!pool->registered) {
+        if (g_npools == MAX_POOLS)
+            FATAL("too many pools (%s)", pool->name);
+        pool->id = g_npools++;
+        g_pools_by_id[pool->id] = pool;
+        pool->next = g_pools;
+        g_pools = pool;
+        __atomic_store_n(&pool->registered, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_pools_lock);
+}
+
+// returns the shadow of the pool that serves the calling worker thread
+static Pool *thread_shadow(Pool *pool)
+{
+    if (!__atomic_load_n(&pool->registered, __ATOMIC_ACQUIRE))
+        Pool_register(pool);
+
+    Pool *shadow = &t_pools->shadows[pool->id];
+    if (shadow->objsz == 0) {
+        shadow->name = pool->name;
+        shadow->objsz = pool->objsz;
+    }
+    return shadow;
+}
+
+#ifndef POOL_DISABLE
+static size_t obj_size(const Pool *pool)
+{
+    size_t sz = pool->objsz < sizeof(void*) ? sizeof(void*) : pool->objsz;
+    return (sz + OBJ_ALIGN - 1) & ~(size_t) (OBJ_ALIGN - 1);
+}
+
+// allocates a new slab and puts all of its objects on the free list
+static void Pool_grow(Pool *pool)
+{
+    size_t objsz = obj_size(pool);
+    size_t n = (SLAB_SIZE - SLAB_HDR_SIZE) / objsz;
+    if (n == 0) n = 1;
+
+    size_t slabsz = SLAB_HDR_SIZE + n * objsz;
+    Slab *slab = malloc(slabsz);
+    if (slab == NULL)
+        FATAL("out of memory (pool %s)", pool->name);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->reserved += slabsz;
+
+    char *objs = (char*) slab + SLAB_HDR_SIZE;
+    // thread objects in reverse so that they are handed out in address order
+    for (size_t i = n; i > 0; i--) {
+        void **obj = (void**) (objs + (i - 1) * objsz);
+        *obj = pool->free;
+        pool->free = obj;
+    }
+}
+#endif
+
+static inline void *take(Pool *pool)
+{
+    pool->allocs++;
+    pool->live++;
+    if (pool->live > pool->peak)
+        pool->peak = pool->live;
+
+#ifdef POOL_DISABLE
+    return malloc(pool->objsz);
+#else
+    if (pool->free)
+        pool->hits++;
+    else
+        Pool_grow(pool);
+
+    void **obj = pool->free;
+    pool->free = *obj;
+    return obj;
+#endif
+}
+
+static inline void give(Pool *pool, void *ptr)
+{
+    pool->live--;
+
+#ifdef POOL_DISABLE
+    free(ptr);
+#else
+    void **obj = ptr;
+    *obj = pool->free;
+    pool->free = obj;
+#endif
+}
+
+void *Pool_alloc(Pool *pool)
+{
+    if (t_pools) {
+        Pool *shadow = thread_shadow(pool);
+        t_pools->live_bytes += shadow->objsz;
+        return take(shadow);
+    }
+
+    if (!__atomic_load_n(&pool->registered, __ATOMIC_RELAXED))
+        Pool_register(pool);
+
+    g_live_bytes += pool->objsz;
+    if (g_live_bytes > g_peak_bytes)
+        g_peak_bytes = g_live_bytes;
+
+    return take(pool);
+}
+
+void Pool_free(Pool *pool, void *ptr)
+{
+    if (ptr == NULL) return;
+
+    if (t_pools) {
+        Pool *shadow = thread_shadow(pool);
+        t_pools->live_bytes -= shadow->objsz;
+        give(shadow, ptr);
+        return;
+    }
+
+    g_live_bytes -= pool->objsz;
+    give(pool, ptr);
+}
+
+// size classes for Pool_alloc_sz: 16, 32, ..., 512 bytes
+#define SIZE_CLASS_MIN_SHIFT 4
+#define SIZE_CLASS_COUNT 6
+
+static Pool g_size_pools[SIZE_CLASS_COUNT] = {
+    { .name = "block-16",  .objsz = 16 },
+    { .name = "block-32",  .objsz = 32 },
+    { .name = "block-64",  .objsz = 64 },
+    { .name = "block-128", .objsz = 128 },
+    { .name = "block-256", .objsz = 256 },
+    { .name = "block-512", .objsz = 512 },
+};
+
+// returns the pool for blocks of the given size or NULL if the size is too large
+static Pool *size_pool(size_t size)
+{
+    size_t cls = 0;
+    while (cls < SIZE_CLASS_COUNT && ((size_t) 1 << (cls + SIZE_CLASS_MIN_SHIFT)) < size)
+        cls++;
+    return cls < SIZE_CLASS_COUNT ? &g_size_pools[cls] : NULL;
+}
+
+void *Pool_alloc_sz(size_t size)
+{
+    Pool *pool = size_pool(size);
+    return pool ? Pool_alloc(pool) : malloc(size);
+}
+
+void Pool_free_sz(void *ptr, size_t size)
+{
+    Pool *pool = size_pool(size);
+    if (pool)
+        Pool_free(pool, ptr);
+    else
+        free(ptr);
+}
+
+void Pool_thread_init()
+{
+    t_pools = calloc(1, sizeof(ThreadPools));
+    if (t_pools == NULL)
+        FATAL("out of memory (pools of a thread)");
+    g_thread_pools[thread_index()] = t_pools;
+}
+
+// Counts of a shadow are relative to the last join. Live counts are "negative"
+// (wrapped around) if the thread freed more than it allocated.
+void Pool_join_threads()
+{
+    for (unsigned t = 1; t < THREADS_MAX; t++) {
+        ThreadPools *pools = g_thread_pools[t];
+        if (pools == NULL) continue;
+
+        for (unsigned id = 0; id < g_npools; id++) {
+            Pool *shadow = &pools->shadows[id];
+            Pool *pool = g_pools_by_id[id];
+            pool->allocs += shadow->allocs;
+            pool->hits += shadow->hits;
+            pool->live += shadow->live;
+            pool->reserved += shadow->reserved;
+            shadow->allocs = shadow->hits = shadow->live = shadow->reserved = 0;
+        }
+        g_live_bytes += pools->live_bytes;
+        pools->live_bytes = 0;
+    }
+
+    // peaks of the section are those seen by the main thread, or the state after it
+    for (unsigned id = 0; id < g_npools; id++) {
+        Pool *pool = g_pools_by_id[id];
+        if (pool->live > pool->peak)
+            pool->peak = pool->live;
+    }
+    if (g_live_bytes > g_peak_bytes)
+        g_peak_bytes = g_live_bytes;
+}
+
+void Pool_foreach(pool_visit_t visit, void *data)
+{
+    for (const Pool *pool = g_pools; pool != NULL; pool = pool->next)
+        visit(pool, data);
+}
+
+size_t Pool_live_bytes()
+{
+    return g_live_bytes;
+}
+
+size_t Pool_peak_bytes()
+{
+    return g_peak_bytes;
+}
+
+size_t Pool_reserved_bytes()
+{
+    size_t sz = 0;
+    for (const Pool *pool = g_pools; pool != NULL; pool = pool->next)
+        sz += pool->reserved;
+    return sz;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Pool allocator for small objects that are allocated and freed at a high rate
+// (list nodes, environments, hash table buckets).
+// Each pool serves objects of a single size from slabs and recycles freed
+// objects through a free list, so most allocations never reach malloc.
+// Memory of slabs is never given back to the system.
+//
+// Compile with _CFLAGS="-D POOL_DISABLE" to serve every allocation with
+// malloc/free directly (useful with valgrind and sanitizers); the statistics
+// are still collected then.
+
+typedef struct Pool {
+    const char *name;
+    size_t objsz;
+    void *free;  // free list (linked through the 1st word of each object)
+    void *slabs; // list of slabs owned by this pool
+    // statistics
+    size_t live;     // objects currently in use
+    size_t peak;     // max value of live
+    size_t allocs;   // total amount of allocations
+    size_t hits;     // allocations served without calling malloc
+    size_t reserved; // bytes held in slabs
+    // all pools that have been used are linked together
+    bool registered;
+    unsigned id;
+    struct Pool *next;
+} Pool;
+
+// static initializer for a pool of objects of the given type:
+// static Pool g_node_pool = POOL_INIT("node", struct Node);
+#define POOL_INIT(name_, type_) { .name = (name_), .objsz = sizeof(type_) }
+
+void *Pool_alloc(Pool *pool);
+void Pool_free(Pool *pool, void *ptr);
+
+// allocation of variable-sized blocks (e.g. arrays) using pools of size classes;
+// the size given to Pool_free_sz must be the same that was given to Pool_alloc_sz;
+// blocks larger than the largest size class go straight to malloc
+void *Pool_alloc_sz(size_t size);
+void Pool_free_sz(void *ptr, size_t size);
+
+// a worker thread gets pools of its own (see pool.c), before it allocates anything
+void Pool_thread_init();
+// adds the statistics of worker threads to the shared pools, at the end of a
+// parallel section
+void Pool_join_threads();
+
+typedef void (*pool_visit_t)(const Pool *pool, void *data);
+// visits each pool that has served at least 1 allocation
+void Pool_foreach(pool_visit_t visit, void *data);
+
+// bytes currently in use by objects of all pools
+size_t Pool_live_bytes();
+// max value of Pool_live_bytes()
+size_t Pool_peak_bytes();
+// bytes held in slabs of all pools
+size_t Pool_reserved_bytes();
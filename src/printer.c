@@ -9,134 +9,209 @@
 #include "types.h"
 #include "common.h"
 
-// When print_readably is true, doublequotes, newlines, and backslashes are
-// translated into their printed representations (the reverse of the reader).
-// In other words, print escapes as 2 characters
-char *pr_str(const LispDatum *datum, bool print_readably) 
+/* Datums are printed into a single output, either a string assembler or a file,
+ * so nested datums don't allocate strings of their own.
+ */
+typedef struct Out {
+    StrAsm *sasm; // NULL if printing to file
+    FILE *file;
+} Out;
+
+static void out_addn(Out *out, const char *s, size_t n)
 {
-    if (datum == NULL) return NULL;
+    if (out->sasm)
+        StrAsm_addn(out->sasm, s, n);
+    else
+        fwrite(s, 1, n, out->file);
+}
 
-    char *str = NULL;
+static void out_add(Out *out, const char *s)
+{
+    out_addn(out, s, strlen(s));
+}
 
-    StrAsm sa;
+static void out_addc(Out *out, char c)
+{
+    if (out->sasm)
+        StrAsm_addc(out->sasm, c);
+    else
+        putc(c, out->file);
+}
+
+// writes the n characters of s wrapped in doublequotes with the special ones escaped
+static void pr_escaped(Out *out, const char *s, size_t n)
+{
+    out_addc(out, '"');
+
+    const char *run = s; // start of the characters that need no escaping
+    for (const char *end = s + n; s < end; s++) {
+        short esc = escape_char(*s);
+        if (esc != -1) {
+            out_addn(out, run, s - run);
+            out_addc(out, '\\');
+            out_addc(out, esc);
+            run = s + 1;
+        }
+    }
+    out_addn(out, run, s - run);
+
+    out_addc(out, '"');
+}
+
+static void pr_datum(Out *out, const LispDatum *datum, bool print_readably);
+
+// writes the given datums separated by spaces and wrapped in open and close
+static void pr_seq(Out *out, const struct Node *node, char open, char close, bool print_readably)
+{
+    out_addc(out, open);
+    for (; node != NULL; node = node->next) {
+        pr_datum(out, node->value, print_readably);
+        if (node->next)
+            out_addc(out, ' ');
+    }
+    out_addc(out, close);
+}
 
+typedef struct PrMapState {
+    Out *out;
+    bool readably;
+    bool first;
+} PrMapState;
+
+static void pr_map_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    PrMapState *st = data;
+    if (!st->first)
+        out_addc(st->out, ' ');
+    st->first = false;
+    pr_datum(st->out, key, st->readably);
+    out_addc(st->out, ' ');
+    pr_datum(st->out, val, st->readably);
+}
+
+// When print_readably is true, doublequotes, newlines, and backslashes are
+// translated into their printed representations (the reverse of the reader).
+// In other words, print escapes as 2 characters
+static void pr_datum(Out *out, const LispDatum *datum, bool print_readably)
+{
     switch (LispDatum_type(datum)) {
-        case NUMBER:
-            const Number *num = (Number*) datum;
-            str = malloc(Number_len(num) + 1 + (Number_isneg(num) ? 1 : 0));
-            Number_sprint(num, str);
+        case NUMBER: {
+            char buf[NUMBER_SPRINT_MAX];
+            if (Number_sprint((Number*) datum, buf)) {
+                out_add(out, buf);
+            } else {
+                char *s = Number_tostr((Number*) datum);
+                out_add(out, s);
+                free(s);
+            }
             break;
+        }
         case SYMBOL:
             // TODO symbols with spaces
-            str = dyn_strcpy(Symbol_name((Symbol*) datum));
+            out_add(out, Symbol_name((Symbol*) datum));
             break;
         case LIST:
-            str = pr_list((List*) datum, print_readably);
+            pr_seq(out, ((List*) datum)->head, '(', ')', print_readably);
             break;
-        case STRING:
-            char *s = String_str((String*) datum);
-            assert(s != NULL);
-
-            if (print_readably) {
-                // TODO optimise
-                char *escaped = str_escape(s);
-                size_t esc_len = strlen(escaped);
-
-                char *out = calloc(esc_len + 2 + 1, sizeof(char));
-                out[0] = '"';
-                memcpy(out + 1, escaped, esc_len);
-                out[esc_len + 1] = '"';
-                out[esc_len + 2] = '\0';
-                str = out;
-
-                free(escaped);
+        case VECTOR: {
+            const Vector *vec = (Vector*) datum;
+            out_addc(out, '[');
+            for (size_t i = 0; i < Vector_len(vec); i++) {
+                if (i > 0)
+                    out_addc(out, ' ');
+                pr_datum(out, Vector_ref(vec, i), print_readably);
             }
+            out_addc(out, ']');
+            break;
+        }
+        case HASHMAP: {
+            PrMapState st = { .out = out, .readably = print_readably, .first = true };
+            out_addc(out, '{');
+            HashMap_foreach((HashMap*) datum, pr_map_entry, &st);
+            out_addc(out, '}');
+            break;
+        }
+        case STRING: {
+            const String *string = (String*) datum;
+            if (print_readably)
+                pr_escaped(out, String_chars(string), String_len(string));
             else
-                str = dyn_strcpy(s);
+                out_addn(out, String_chars(string), String_len(string));
             break;
+        }
         case NIL:
-            str = dyn_strcpy("nil");
+            out_add(out, "nil");
             break;
         case TRUE:
-            str = dyn_strcpy("true");
+            out_add(out, "true");
             break;
         case FALSE:
-            str = dyn_strcpy("false");
+            out_add(out, "false");
             break;
-        case PROCEDURE:
+        case PROCEDURE: {
             const Proc *proc = (Proc*) datum;
 
-            StrAsm_init(&sa);
-
-            StrAsm_add(&sa, "#<");
-            StrAsm_add(&sa, Proc_ismacro(proc) ? "macro" : "procedure");
+            out_add(out, "#<");
+            out_add(out, Proc_ismacro(proc) ? "macro" : "procedure");
             if (Proc_isnamed(proc)) {
-                StrAsm_addc(&sa, ':');
-                const Symbol *s_name = Proc_name(proc);
-                StrAsm_add(&sa, Symbol_name(s_name));
+                out_addc(out, ':');
+                out_add(out, Symbol_name(Proc_name(proc)));
             }
-            StrAsm_addc(&sa, '>');
-
-            str = StrAsm_str(&sa);
+            out_addc(out, '>');
             break;
+        }
         case ATOM:
-            Atom *atom = (Atom*) datum;
-
-            StrAsm_init(&sa);
-
-            char *dtm_str = pr_str(atom->dtm, print_readably);
-            StrAsm_add(&sa, "(atom ");
-            StrAsm_add(&sa, dtm_str);
-            StrAsm_addc(&sa, ')');
-
-            str = StrAsm_str(&sa);
-
-            free(dtm_str);
+            out_add(out, "(atom ");
+            pr_datum(out, ((Atom*) datum)->dtm, print_readably);
+            out_addc(out, ')');
             break;
         case EXCEPTION:
-            str = dyn_strcpy("#<exn>");
-            // Exception *exn = datum->value.exn;
-            // if (exn->msg) {
-            //     char *parts[] = { "#<exn:\"", exn->msg, "\">" };
-            //     str = str_join(parts, ARR_LEN(parts), "");
-            // }
-            // else {
-            //     str = dyn_strcpy("#<exn>");
-            // }
+            out_add(out, "#<exn>");
+            break;
+        case LAZYSEQ:
+            out_add(out, "#<lazy-seq>");
             break;
         default:
             FATAL("Unknown LispType");
-            str = NULL;
             break;
     }
+}
 
-    return str;
+void pr_sasm(StrAsm *sasm, const LispDatum *datum, bool print_readably)
+{
+    Out out = { .sasm = sasm };
+    pr_datum(&out, datum, print_readably);
 }
 
-// returns a new string with the contents of the given list separeted by spaces 
-// and wrapped in parens
-char *pr_list(const List *list, bool print_readably) 
+void pr_file(FILE *file, const LispDatum *datum, bool print_readably)
 {
-    if (list == NULL) return NULL;
+    Out out = { .file = file };
+    pr_datum(&out, datum, print_readably);
+}
+
+char *pr_str(const LispDatum *datum, bool print_readably) 
+{
+    if (datum == NULL) return NULL;
 
     StrAsm sa;
-    StrAsm_initsz(&sa, List_len(list) * 6);
-    StrAsm_addc(&sa, '(');
-
-    for (struct Node *node = list->head; node != NULL; node = node->next) {
-        char *s = pr_str(node->value, print_readably);
-        StrAsm_add(&sa, s);
-        free(s);
-        StrAsm_addc(&sa, ' ');
-    }
+    StrAsm_init(&sa);
+    pr_sasm(&sa, datum, print_readably);
 
-    // if non-empty list, drop last redundant ' '
-    if (!List_isempty(list))
-        StrAsm_drop(&sa, 1);
+    return StrAsm_str(&sa);
+}
 
-    StrAsm_addc(&sa, ')');
+// returns a new string with the contents of the given list separeted by spaces 
+// and wrapped in parens
+char *pr_list(const List *list, bool print_readably) 
+{
+    return pr_str((LispDatum*) list, print_readably);
+}
 
-    return StrAsm_str(&sa);
+// returns a new string with the contents of the given vector separeted by spaces 
+// and wrapped in square brackets
+char *pr_vector(const Vector *vec, bool print_readably) 
+{
+    return pr_str((LispDatum*) vec, print_readably);
 }
 
 char *pr_repr(const LispDatum *datum)
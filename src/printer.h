@@ -1,9 +1,20 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "types.h"
+#include "utils.h"
 #include "stdbool.h"
 
+// write the printed representation of a datum to the end of a string assembler
+// or to a file, without building intermediate strings
+void pr_sasm(StrAsm *sasm, const LispDatum *datum, bool print_readably);
+void pr_file(FILE *file, const LispDatum *datum, bool print_readably);
+
+// return a new string
+
 char *pr_str(const LispDatum *datum, bool print_readably);
 char *pr_list(const List *list, bool print_readably);
+char *pr_vector(const Vector *vec, bool print_readably);
 
 char *pr_repr(const LispDatum *datum);
@@ -0,0 +1,305 @@
+// sigaction, setitimer and clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "profile.h"
+#include "types.h"
+#include "hashtbl.h"
+#include "threads.h"
+#include "common.h"
+
+// applications nested deeper are counted, but not recorded on the shadow stack
+#define PROF_STACK_CAP (1 << 16)
+// words of the sample buffer, a sample takes as many as its depth + 1
+#define PROF_SAMPLES_CAP (1 << 22)
+
+typedef struct ProfEntry {
+    const Symbol *name;
+    size_t calls;
+    size_t active;    // activations on the shadow stack
+    uint64_t since;   // when the outermost activation was entered (ns)
+    uint64_t incl_ns; // inclusive time of the outermost activations
+    size_t self;      // samples with this procedure on top of the stack
+} ProfEntry;
+
+static bool g_running = false;
+static HashTbl *g_entries = NULL; // Symbol* -> ProfEntry*
+
+// The shadow stack and the samples are shared with the signal handler, which only
+// reads the former and appends to the latter.
+static ProfEntry *volatile g_stack[PROF_STACK_CAP];
+static volatile size_t g_depth = 0;
+
+// each sample is its depth followed by the entries from the bottom of the stack
+static uintptr_t *g_samples = NULL;
+static volatile size_t g_samples_len = 0;
+static volatile size_t g_nsamples = 0;
+static volatile size_t g_dropped = 0;
+
+static uint ptr_hash(const void *ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    return (uint) (p ^ (p >> 32));
+}
+
+static bool ptr_eq(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static void noop_free(void *ptr) { }
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void on_sigprof(int sig)
+{
+    size_t depth = g_depth < PROF_STACK_CAP ? g_depth : PROF_STACK_CAP;
+    if (g_samples_len + depth + 1 > PROF_SAMPLES_CAP) {
+        g_dropped++;
+        return;
+    }
+
+    uintptr_t *sample = g_samples + g_samples_len;
+    sample[0] = depth;
+    for (size_t i = 0; i < depth; i++)
+        sample[i + 1] = (uintptr_t) g_stack[i];
+    g_samples_len += depth + 1;
+    g_nsamples++;
+}
+
+static void set_timer(long usec)
+{
+    struct itimerval it = {
+        .it_interval = { .tv_sec = 0, .tv_usec = usec },
+        .it_value = { .tv_sec = 0, .tv_usec = usec }
+    };
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+void prof_start()
+{
+    if (g_running) prof_stop();
+
+    if (g_entries)
+        HashTbl_free(g_entries, noop_free, free);
+    g_entries = HashTbl_newc(256, ptr_hash);
+
+    if (g_samples == NULL) {
+        g_samples = malloc(sizeof(*g_samples) * PROF_SAMPLES_CAP);
+        if (g_samples == NULL)
+            FATAL("out of memory (profiler samples)");
+    }
+    g_samples_len = 0;
+    g_nsamples = 0;
+    g_dropped = 0;
+    g_depth = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    g_running = true;
+    set_timer(PROF_SAMPLE_USEC);
+}
+
+// the activation is over, the time of the outermost one is added
+static void entry_leave(ProfEntry *entry, uint64_t now)
+{
+    if (--entry->active == 0)
+        entry->incl_ns += now - entry->since;
+}
+
+void prof_stop()
+{
+    if (!g_running) return;
+    set_timer(0);
+    g_running = false;
+
+    // activations that are still on the stack end now, the tokens that they
+    // hold become stale
+    uint64_t now = now_ns();
+    size_t depth = g_depth < PROF_STACK_CAP ? g_depth : PROF_STACK_CAP;
+    for (size_t i = depth; i-- > 0; )
+        entry_leave(g_stack[i], now);
+    g_depth = 0;
+}
+
+bool prof_running()
+{
+    return g_running;
+}
+
+static ProfEntry *entry_get(const Symbol *name)
+{
+    ProfEntry *entry = HashTbl_get(g_entries, name, ptr_eq);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(ProfEntry));
+        entry->name = name;
+        HashTbl_put(g_entries, name, entry, ptr_eq);
+    }
+    return entry;
+}
+
+// the activation starts at the given slot of the shadow stack
+static void entry_enter(ProfEntry *entry, size_t slot)
+{
+    entry->calls++;
+    if (slot >= PROF_STACK_CAP) return;
+
+    if (entry->active++ == 0)
+        entry->since = now_ns();
+    g_stack[slot] = entry;
+}
+
+size_t prof_enter(const Proc *proc)
+{
+    // only applications on the main thread are recorded (see threads.h)
+    if (!g_running || thread_index() != 0) return 0;
+
+    entry_enter(entry_get(Proc_name(proc)), g_depth);
+    // the entry is in place before the handler can see it
+    g_depth++;
+    return g_depth;
+}
+
+// Tokens are depths of the applications, a token that doesn't match the current
+// depth belongs to an application entered before prof_start.
+void prof_tail(size_t token, const Proc *proc)
+{
+    if (!g_running || token == 0 || token != g_depth) return;
+
+    ProfEntry *entry = entry_get(Proc_name(proc));
+    if (token <= PROF_STACK_CAP)
+        entry_leave(g_stack[token - 1], now_ns());
+    entry_enter(entry, token - 1);
+}
+
+void prof_leave(size_t token)
+{
+    if (!g_running || token == 0 || token != g_depth) return;
+
+    if (token <= PROF_STACK_CAP)
+        entry_leave(g_stack[token - 1], now_ns());
+    g_depth--;
+}
+
+// -----------------------------------------------------------------------------
+// Reports
+
+// samples with the same stack
+typedef struct Folded {
+    const uintptr_t *sample;
+    size_t count;
+} Folded;
+
+static uint sample_hash(const void *ptr)
+{
+    const uintptr_t *sample = ptr;
+    uint64_t h = sample[0];
+    for (size_t i = 1; i <= sample[0]; i++)
+        h = (h ^ sample[i]) * 0x100000001b3;
+    return (uint) (h ^ (h >> 32));
+}
+
+static bool sample_eq(const void *a, const void *b)
+{
+    const uintptr_t *sa = a, *sb = b;
+    return sa[0] == sb[0] && memcmp(sa + 1, sb + 1, sa[0] * sizeof(*sa)) == 0;
+}
+
+// iterates over the samples, which is safe once the timer is stopped
+#define SAMPLES_FOREACH(sample) \
+    for (const uintptr_t *sample = g_samples; \
+         sample < g_samples + g_samples_len; sample += sample[0] + 1)
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const ProfEntry *ea = *(ProfEntry**) a, *eb = *(ProfEntry**) b;
+    if (ea->incl_ns != eb->incl_ns)
+        return ea->incl_ns < eb->incl_ns ? 1 : -1;
+    return ea->calls < eb->calls ? 1 : (ea->calls > eb->calls ? -1 : 0);
+}
+
+void prof_report(FILE *out)
+{
+    if (g_entries == NULL) {
+        fprintf(out, "no profile (use profile-start)\n");
+        return;
+    }
+
+    // the report is taken from a stopped profiler
+    prof_stop();
+
+    uint n = HashTbl_size(g_entries);
+    ProfEntry **entries = malloc(sizeof(*entries) * (n ? n : 1));
+    HashTbl_values(g_entries, (void**) entries);
+    for (uint i = 0; i < n; i++)
+        entries[i]->self = 0;
+    SAMPLES_FOREACH(sample) {
+        if (sample[0] > 0)
+            ((ProfEntry*) sample[sample[0]])->self++;
+    }
+    qsort(entries, n, sizeof(*entries), entry_cmp);
+
+    fprintf(out, "%zu samples every %d us (%zu dropped)\n",
+            (size_t) g_nsamples, PROF_SAMPLE_USEC, (size_t) g_dropped);
+    fprintf(out, "%-32s %12s %12s %8s\n", "procedure", "calls", "incl-ms", "self");
+    for (uint i = 0; i < n; i++) {
+        const ProfEntry *e = entries[i];
+        fprintf(out, "%-32s %12zu %12.3f %8zu\n",
+                Symbol_name(e->name), e->calls, e->incl_ns / 1e6, e->self);
+    }
+
+    free(entries);
+}
+
+bool prof_write_folded(FILE *out)
+{
+    if (g_entries == NULL) return true;
+    prof_stop();
+
+    HashTbl *stacks = HashTbl_newc(1024, sample_hash);
+    SAMPLES_FOREACH(sample) {
+        Folded *folded = HashTbl_get(stacks, sample, sample_eq);
+        if (folded == NULL) {
+            folded = malloc(sizeof(Folded));
+            folded->sample = sample;
+            folded->count = 0;
+            HashTbl_put(stacks, sample, folded, sample_eq);
+        }
+        folded->count++;
+    }
+
+    uint n = HashTbl_size(stacks);
+    Folded **all = malloc(sizeof(*all) * (n ? n : 1));
+    HashTbl_values(stacks, (void**) all);
+    for (uint i = 0; i < n; i++) {
+        const uintptr_t *sample = all[i]->sample;
+        // samples taken between applications
+        if (sample[0] == 0)
+            fputs("*toplevel*", out);
+        for (size_t k = 1; k <= sample[0]; k++) {
+            if (k > 1) fputc(';', out);
+            fputs(Symbol_name(((ProfEntry*) sample[k])->name), out);
+        }
+        fprintf(out, " %zu\n", all[i]->count);
+    }
+
+    free(all);
+    HashTbl_free(stacks, noop_free, free);
+    return !ferror(out);
+}
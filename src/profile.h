@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Profiler of procedure applications.
+ * While it's running, every application (see vm_apply) is recorded on a shadow
+ * stack of procedure names, which counts calls and measures the inclusive time of
+ * each procedure (the time of recursive activations is counted once, for the
+ * outermost one). A SIGPROF timer samples the shadow stack every
+ * PROF_SAMPLE_USEC of CPU time. Only the main thread is profiled, applications
+ * on worker threads of a parallel section aren't recorded.
+ *
+ * The report is a table of procedures with their call counts, inclusive times and
+ * self samples (those in which the procedure was on top of the stack), and the
+ * samples as folded stacks, one line per distinct stack:
+ *     outer;inner;innermost count
+ * which is the input of flamegraph.pl (https://github.com/brendangregg/FlameGraph).
+ */
+
+#define PROF_SAMPLE_USEC 1000
+
+struct Proc;
+
+// starts profiling, discarding the data of the previous run
+void prof_start();
+// stops profiling, the collected data is kept until the next prof_start
+void prof_stop();
+bool prof_running();
+
+// An application of proc is entered. Returns a token to be passed to the calls
+// below for this application, 0 if it isn't recorded (profiling is stopped).
+size_t prof_enter(const struct Proc *proc);
+// the application of the given token is replaced by a tail call to proc
+void prof_tail(size_t token, const struct Proc *proc);
+// the application of the given token returns
+void prof_leave(size_t token);
+
+// writes the table of procedures ordered by inclusive time
+void prof_report(FILE *out);
+// writes the samples as folded stacks, returns false on I/O error
+bool prof_write_folded(FILE *out);
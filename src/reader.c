@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "reader.h"
@@ -12,224 +13,140 @@
 
 #define WHITESPACE_CHARS " \t\n\r"
 #define SYMBOL_INV_CHARS WHITESPACE_CHARS "[]{}('\"`,;)"
+// characters that end a symbol or a number
+#define ATOM_END_CHARS WHITESPACE_CHARS "()[]{}" COMMENT_CHARS
 #define COMMENT_CHAR ';'
 #define COMMENT_CHARS ";"
 #define QUOTE_MACRO_CHAR '\''
 #define QUASIQUOTE_MACRO_CHAR '`'
 #define UNQUOTE_MACRO_CHAR '~'
-#define SPLICE_UNQUOTE_MACRO_STR "~@" // very fragile parsing, be careful if you change it
+#define SPLICE_UNQUOTE_MACRO_CHAR '@' // follows the unquote one
 
-/*
- * Read characters from *str until one of characters in string *set is encountered or end
- * of string is reached. 
- * *set must be a null-terminated string.
- * Returns a dynamically allocated parsed string. An empty string might be returned.
+/* The reader scans the input once with a cursor and builds datums directly from
+ * it: symbols are interned from slices of the input and numbers are parsed in
+ * place, so nothing is allocated per token. The input need not be null-terminated.
  */
-static char *parse_until(const char *str, const char *set) {
-    const char *p = strchrs(str, set);
-    if (p == NULL) {
-        // read the whole str
-        return dyn_strcpy(str);
-    }
-    else {
-        return dyn_strncpy(str, p - str);
-    }
-}
 
-// parses a string from *str that must start with a double quote
-// the resulting string is wrapped in double quotes
-static char *parse_string(const char *str) {
-    // str[0] is '"', so start from str + 1
-    size_t i = 1;
-    char c;
-    bool escaped = false;
-    while ((c = str[i]) != '\0' && (c != '"' || escaped)) {
-        if (c == '\\')
-            escaped = !escaped;
-        else if (escaped)
-            escaped = false;
-        i++;
-    }
-    if (c == '\0') {
-        ERROR("unbalanced string: %s", str);
-        return NULL;
-    }
-    return dyn_strncpy(str, i + 1);
+Reader *read_str(const char *str) {
+    return read_strn(str, strlen(str));
 }
 
-// transforms a string from a "reader form" to a "datum" form
-// by stripping surrounding doublequotes and unescaping characters
-static char *str_from_token(char *dst, const char *str)
-{
-    size_t len = strlen(str);
-    size_t di = 0;
-
-    // len - 1 because of the last doublequote
-    for (size_t si = 1; si < len - 1; si++, di++) {
-        char c = str[si];
-        if (c == '\\')
-            dst[di] = unescape_char(str[++si]);
-        else
-            dst[di] = c;
-    }
+Reader *read_strn(const char *str, size_t len) {
+    Reader *rdr = malloc(sizeof(Reader));
+    rdr->cur = str;
+    rdr->end = str + len;
+    return rdr;
+}
 
-    dst[di] = '\0';
+void Reader_free(Reader *rdr) {
+    free(rdr);
+}
 
-    return dst;
+static bool isatom_end(char c) {
+    return strchr(ATOM_END_CHARS, c) != NULL;
 }
 
-// Splits the input string into tokens. Returns NULL upon failure.
-// NOTE: keep this procedure as simple as possible
-// (i.e. delegate any validation of tokens)
-static Arr *tokenize(const char *str) {
-    Arr *arr = Arr_new();
-    size_t i = 0;
-    char c;
-    while ((c = str[i]) != '\0') {
+// skips whitespace and comments
+static void skip_blank(Reader *rdr) {
+    while (rdr->cur < rdr->end) {
+        char c = *rdr->cur;
         if (isspace(c)) {
-            i++;
-            continue;
-        }
-
-        if (c == COMMENT_CHAR) {
-            // read the rest of the line
-            ssize_t idx = stridx(str + i + 1, '\n');
-            if (idx == -1)
-                break;
-            else {
-                i += idx + 1;
-                continue;
-            }
-        }
-
-        char *tok; // token to be added
-        size_t n;  // read step (in bytes)
-
-        // paren
-        if (c == '(' || c == ')') {
-            tok = malloc(2);
-            sprintf(tok, "%c", c);
-            n = 1;
-        }
-        // string
-        else if (c == '"') {
-            tok = parse_string(str + i);
-            if (tok) {
-                n = strlen(tok);
-            }
-        }
-        // quote & quasiquote macros
-        else if (c == QUOTE_MACRO_CHAR || c == QUASIQUOTE_MACRO_CHAR) {
-            tok = malloc(2);
-            sprintf(tok, "%c", c);
-            n = 1;
+            rdr->cur++;
         }
-        // unquote & splice-unquote macro
-        else if (c == UNQUOTE_MACRO_CHAR) {
-            if (str[i + 1] == SPLICE_UNQUOTE_MACRO_STR[1]) {
-                tok = dyn_strcpy(SPLICE_UNQUOTE_MACRO_STR);
-                n = 2;
-            } 
-            else {
-                tok = malloc(2);
-                sprintf(tok, "%c", UNQUOTE_MACRO_CHAR);
-                n = 1;
-            }
+        else if (c == COMMENT_CHAR) {
+            // skip the rest of the line
+            const char *nl = memchr(rdr->cur, '\n', rdr->end - rdr->cur);
+            rdr->cur = nl ? nl + 1 : rdr->end;
         }
-        // int | symbol
         else {
-            // read until whitespace, paren or comment
-            tok = parse_until(str + i, WHITESPACE_CHARS "()" COMMENT_CHARS);
-            if (tok)
-                n = strlen(tok);
-        }
-
-        if (tok == NULL) {
-            Arr_free(arr);
-            return NULL;
+            break;
         }
-
-        Arr_add(arr, tok);
-        i += n;
     }
+}
 
-    return arr;
+bool Reader_eof(Reader *rdr) {
+    skip_blank(rdr);
+    return rdr->cur >= rdr->end;
 }
 
-Reader *read_str(const char *str) {
-    Arr *tokens = tokenize(str);
-    if (tokens == NULL)
+// Reads a string literal, the cursor must be at the opening doublequote.
+// Escaped characters are unescaped.
+static String *read_string(Reader *rdr) {
+    const char *start = rdr->cur + 1;
+    const char *p = start;
+    bool escaped = false;
+    bool has_escapes = false;
+    while (p < rdr->end && (*p != '"' || escaped)) {
+        if (*p == '\\') {
+            escaped = !escaped;
+            has_escapes = true;
+        }
+        else if (escaped)
+            escaped = false;
+        p++;
+    }
+    if (p >= rdr->end) {
+        ERROR("unbalanced string: %.*s", (int) (rdr->end - rdr->cur), rdr->cur);
         return NULL;
-
-#ifdef _MAL_TRACE
-    puts("tokens:");
-    for (size_t i = 0; i < tokens->len; i++) {
-        printf("%s\n", (char*) tokens->items[i]);
     }
-#endif
-
-    Reader *rdr = malloc(sizeof(Reader));
-    rdr->pos = 0;
-    rdr->tokens = tokens;
-    return rdr;
-}
-
-const char *Reader_next(Reader *rdr) {
-    const char *tok = Reader_peek(rdr);
-    if (tok == NULL) return NULL;
-    rdr->pos += 1;
-    return tok;
-}
+    rdr->cur = p + 1; // skip over closing doublequote
 
-const char *Reader_peek(const Reader *rdr) {
-    if (rdr->pos >= rdr->tokens->len)
-        return NULL;
+    size_t len = p - start;
+    if (!has_escapes)
+        return String_newn(start, len);
 
-    const char *tok = (char*) Arr_get(rdr->tokens, rdr->pos);
-    return tok;
+    char *buf = malloc(len + 1);
+    size_t di = 0;
+    for (const char *sp = start; sp < p; sp++, di++) {
+        if (*sp == '\\')
+            buf[di] = unescape_char(*++sp);
+        else
+            buf[di] = *sp;
+    }
+    String *string = String_newn(buf, di);
+    free(buf);
+    return string;
 }
 
-void Reader_free(Reader *rdr) {
-    Arr_free(rdr->tokens);
-    free(rdr);
-}
+// reads a number or a symbol
+static LispDatum *read_atom(Reader *rdr) {
+    const char *start = rdr->cur;
+    const char *p = start;
+    while (p < rdr->end && !isatom_end(*p))
+        p++;
+    rdr->cur = p;
 
-static LispDatum *read_atom(const char *token) {
-    //printf("read_atom token: %s\n", token);
-    if (token == NULL || token[0] == '\0') return NULL;
+    size_t len = p - start;
+    if (len == 0) return NULL;
 
     // Number
-    if (isdigit(token[0]) || (token[0] == '-' && isdigit(token[1]))) {
-        long l = strtol(token, NULL, 10);
-        return (LispDatum*) Number_new(l);
-    }
-    // String
-    else if (token[0] == '"') {
-        char buf[strlen(token) - 2 + 1]; // 2 surrounding doublequotes
-        str_from_token(buf, token);
-        return (LispDatum*) String_new(buf);
+    if (isdigit(start[0]) || (start[0] == '-' && len > 1 && isdigit(start[1]))) {
+        return (LispDatum*) Number_parse(start, p);
     }
     // Symbol
-    else if (strchr(SYMBOL_INV_CHARS, token[0]) == NULL) {
-        return (LispDatum*) Symbol_intern(token);
+    else if (strchr(SYMBOL_INV_CHARS, start[0]) == NULL) {
+        return (LispDatum*) Symbol_internn(start, len);
     }
     else {
-        DEBUG("Unknown atom: %s", token);
+        DEBUG("Unknown atom: %.*s", (int) len, start);
         return NULL;
     }
 }
 
-// current Reader token should be the next one after an open paren
+// returns the closing character of a list, vector or hash-map if it's next, otherwise 0
+static char peek_close(Reader *rdr) {
+    skip_blank(rdr);
+    if (rdr->cur >= rdr->end) return 0;
+    char c = *rdr->cur;
+    return (c == ')' || c == ']' || c == '}') ? c : 0;
+}
+
+// cursor should be right after an open paren
 static List *read_list(Reader *rdr) {
-    bool closed = false;
     List *list = List_new();
 
-    const char *token = Reader_peek(rdr);
-    while (token != NULL) {
-        if (token[0] == ')') {
-            closed = true;
-            break;
-        }
+    char close;
+    while ((close = peek_close(rdr)) == 0 && rdr->cur < rdr->end) {
         LispDatum *form = read_form(rdr);
         if (form == NULL) {
             List_free(list);
@@ -237,84 +154,156 @@ static List *read_list(Reader *rdr) {
             return NULL;
         }
         List_add(list, form);
-        token = Reader_peek(rdr);
     }
 
-    if (!closed) {
-        ERROR("unbalanced open paren '('");
+    if (close != ')') {
+        if (close) {
+            ERROR("unbalanced closing bracket '%c'", close);
+        }
+        else {
+            ERROR("unbalanced open paren '('");
+        }
         List_free(list);
         return NULL;
     }
 
-    Reader_next(rdr); // skip over closing paren
+    rdr->cur++; // skip over closing paren
 
     return list;
 }
 
-LispDatum *read_form(Reader *rdr) {
-    const char *token = Reader_next(rdr);
-    if (!token) { // no more tokens
-        return NULL;
-    }
-    // List
-    else if (token[0] == '(') {
-        return (LispDatum*) read_list(rdr);
-    } 
-    else if (token[0] == ')') {
-        ERROR("unbalanced closing paren '%c'", token[0]);
-        return NULL;
-    }
-    // quote macro
-    else if (token[0] == QUOTE_MACRO_CHAR) {
-        LispDatum *next_form = read_form(rdr);
-        if (!next_form) {
-            ERROR("bad syntax: stray quote (%c)", QUOTE_MACRO_CHAR);
+// cursor should be right after an open bracket
+static Vector *read_vector(Reader *rdr) {
+    Vector *vec = Vector_new();
+
+    char close;
+    while ((close = peek_close(rdr)) == 0 && rdr->cur < rdr->end) {
+        LispDatum *form = read_form(rdr);
+        if (form == NULL) {
+            Vector_free(vec);
+            DEBUG("Illegal form");
             return NULL;
         }
-        List *list = List_new();
-        List_add(list, (LispDatum*) Symbol_intern("quote"));
-        List_add(list, next_form);
-        return (LispDatum*) list;
+        Vector_add(vec, form);
     }
-    // quasiquote macro
-    else if (token[0] == QUASIQUOTE_MACRO_CHAR) {
-        LispDatum *next_form = read_form(rdr);
-        if (!next_form) {
-            ERROR("bad syntax: stray quasiquote (%c)", QUASIQUOTE_MACRO_CHAR);
-            return NULL;
+
+    if (close != ']') {
+        if (close) {
+            ERROR("unbalanced closing paren '%c'", close);
+        }
+        else {
+            ERROR("unbalanced open bracket '['");
         }
-        List *list = List_new();
-        List_add(list, (LispDatum*) Symbol_intern("quasiquote"));
-        List_add(list, next_form);
-        return (LispDatum*) list;
+        Vector_free(vec);
+        return NULL;
     }
-    // splice-unquote macro
-    else if (strcmp(token, SPLICE_UNQUOTE_MACRO_STR) == 0) {
-        LispDatum *next_form = read_form(rdr);
-        if (!next_form) {
-            ERROR("bad syntax: stray splice-unquote (%s)", SPLICE_UNQUOTE_MACRO_STR);
+
+    rdr->cur++; // skip over closing bracket
+
+    return vec;
+}
+
+// cursor should be right after an open brace; keys and values alternate
+static HashMap *read_hashmap(Reader *rdr) {
+    HashMap *map = HashMap_new();
+    LispDatum *key = NULL;
+
+    char close;
+    while ((close = peek_close(rdr)) == 0 && rdr->cur < rdr->end) {
+        LispDatum *form = read_form(rdr);
+        if (form == NULL) {
+            if (key) LispDatum_free(key);
+            HashMap_free(map);
+            DEBUG("Illegal form");
             return NULL;
         }
-        List *list = List_new();
-        List_add(list, (LispDatum*) Symbol_intern("splice-unquote"));
-        List_add(list, next_form);
-        return (LispDatum*) list;
+        if (key) {
+            HashMap_put(map, key, form);
+            key = NULL;
+        }
+        else {
+            key = form;
+        }
     }
-    // unquote macro
-    else if (token[0] == UNQUOTE_MACRO_CHAR) {
-        LispDatum *next_form = read_form(rdr);
-        if (!next_form) {
-            ERROR("bad syntax: stray unquote (%c)", UNQUOTE_MACRO_CHAR);
-            return NULL;
+
+    if (close != '}' || key) {
+        if (close == '}') {
+            ERROR("hash-map literal with a key without a value");
+        }
+        else if (close) {
+            ERROR("unbalanced closing bracket '%c'", close);
         }
-        List *list = List_new();
-        List_add(list, (LispDatum*) Symbol_intern("unquote"));
-        List_add(list, next_form);
-        return (LispDatum*) list;
+        else {
+            ERROR("unbalanced open brace '{'");
+        }
+        if (key) LispDatum_free(key);
+        HashMap_free(map);
+        return NULL;
     }
-    // atom
-    // TODO allow multiple atoms (in a top-level expression)
-    else {
-        return read_atom(token);
+
+    rdr->cur++; // skip over closing brace
+
+    return map;
+}
+
+// reads the form following a reader macro and wraps it: (<name> form)
+static List *read_macro(Reader *rdr, const char *name, const char *macro) {
+    LispDatum *next_form = read_form(rdr);
+    if (!next_form) {
+        ERROR("bad syntax: stray %s (%s)", name, macro);
+        return NULL;
+    }
+    List *list = List_new();
+    List_add(list, (LispDatum*) Symbol_intern(name));
+    List_add(list, next_form);
+    return list;
+}
+
+LispDatum *read_form(Reader *rdr) {
+    skip_blank(rdr);
+    if (rdr->cur >= rdr->end) { // no more forms
+        return NULL;
+    }
+
+    char c = *rdr->cur;
+    switch (c) {
+        // List
+        case '(':
+            rdr->cur++;
+            return (LispDatum*) read_list(rdr);
+        // Vector
+        case '[':
+            rdr->cur++;
+            return (LispDatum*) read_vector(rdr);
+        // HashMap
+        case '{':
+            rdr->cur++;
+            return (LispDatum*) read_hashmap(rdr);
+        case ')':
+            ERROR("unbalanced closing paren '%c'", c);
+            return NULL;
+        case ']':
+        case '}':
+            ERROR("unbalanced closing bracket '%c'", c);
+            return NULL;
+        // String
+        case '"':
+            return (LispDatum*) read_string(rdr);
+        case QUOTE_MACRO_CHAR:
+            rdr->cur++;
+            return (LispDatum*) read_macro(rdr, "quote", "'");
+        case QUASIQUOTE_MACRO_CHAR:
+            rdr->cur++;
+            return (LispDatum*) read_macro(rdr, "quasiquote", "`");
+        case UNQUOTE_MACRO_CHAR:
+            rdr->cur++;
+            if (rdr->cur < rdr->end && *rdr->cur == SPLICE_UNQUOTE_MACRO_CHAR) {
+                rdr->cur++;
+                return (LispDatum*) read_macro(rdr, "splice-unquote", "~@");
+            }
+            return (LispDatum*) read_macro(rdr, "unquote", "~");
+        // atom
+        default:
+            return read_atom(rdr);
     }
 }
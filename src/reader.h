@@ -4,14 +4,20 @@
 #include "types.h"
 
 typedef struct Reader {
-    size_t pos;
-    Arr *tokens;
+    const char *cur; // cursor
+    const char *end; // end of input
 } Reader;
 
+// Creates a reader of the given null-terminated string
 Reader *read_str(const char *str);
-const char *Reader_next(Reader *rdr);
-const char *Reader_peek(const Reader *rdr);
+// Creates a reader of the first len characters of str
+Reader *read_strn(const char *str, size_t len);
 
 void Reader_free(Reader *rdr);
 
+// returns true if there are no more forms to read (only whitespace or comments)
+bool Reader_eof(Reader *rdr);
+
+/* Reads the next form. Returns NULL if there are no more forms or the syntax is
+ * bad (Reader_eof beforehand tells them apart). */
 LispDatum *read_form(Reader *rdr);
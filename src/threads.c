@@ -0,0 +1,275 @@
+// pthreads, sysconf and pthread_sigmask
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threads.h"
+#include "pool.h"
+#include "gc.h"
+#include "common.h"
+
+bool g_threaded = false;
+
+__thread unsigned g_thread_index = 0;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct Deferred {
+    void (*fn)(void*);
+    void *ptr;
+} Deferred;
+
+// deferred calls of the current section, protected by g_lock
+static Deferred *g_deferred = NULL;
+static size_t g_ndeferred = 0;
+static size_t g_deferred_cap = 0;
+
+// A range of indices [lo, hi) packed into a single word, lo in the upper half,
+// so that both the owner and thieves can update it with a CAS.
+#define RANGE(lo, hi) (((uint64_t) (lo) << 32) | (uint32_t) (hi))
+#define RANGE_LO(r) ((uint32_t) ((r) >> 32))
+#define RANGE_HI(r) ((uint32_t) (r))
+
+typedef struct Worker {
+    pthread_t thread;
+    unsigned idx;
+    uint64_t range; // indices left to this thread
+    unsigned seed;  // for picking victims
+} Worker;
+
+static Worker g_workers[THREADS_MAX]; // g_workers[0] is the main thread
+static unsigned g_nthreads = 0;       // 0 until the workers are started
+
+// the current job, protected by g_job_lock
+static struct {
+    par_task_ft task;
+    void *data;
+    unsigned long gen;  // incremented when a job starts
+    unsigned running;   // workers that haven't finished it yet
+} g_job;
+static pthread_mutex_t g_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_job_done = PTHREAD_COND_INITIALIZER;
+
+unsigned thread_count()
+{
+    static unsigned count = 0;
+    if (count) return count;
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("MYLISP_THREADS");
+    if (env) n = strtol(env, NULL, 10);
+    if (n < 1) n = 1;
+    if (n > THREADS_MAX) n = THREADS_MAX;
+    return count = n;
+}
+
+void thread_lock()
+{
+    pthread_mutex_lock(&g_lock);
+}
+
+void thread_unlock()
+{
+    pthread_mutex_unlock(&g_lock);
+}
+
+void thread_defer(void (*fn)(void*), void *ptr)
+{
+    if (!g_threaded) {
+        fn(ptr);
+        return;
+    }
+
+    thread_lock();
+    if (g_ndeferred == g_deferred_cap) {
+        g_deferred_cap = g_deferred_cap ? g_deferred_cap * 2 : 64;
+        g_deferred = realloc(g_deferred, sizeof(*g_deferred) * g_deferred_cap);
+        if (g_deferred == NULL)
+            FATAL("out of memory (deferred calls)");
+    }
+    g_deferred[g_ndeferred++] = (Deferred) { fn, ptr };
+    thread_unlock();
+}
+
+// takes the next index of the worker's own range
+static bool range_pop(Worker *w, size_t *idx)
+{
+    uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (__atomic_compare_exchange_n(&w->range, &r, RANGE(RANGE_LO(r) + 1, RANGE_HI(r)),
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *idx = RANGE_LO(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the upper half of the victim's range (all of it, if a single index is
+// left) to the thief, whose own range is empty. Nobody else can update an empty
+// range, so the thief stores the new one without a CAS.
+static bool range_steal(Worker *thief, Worker *victim)
+{
+    uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        uint32_t lo = RANGE_LO(r), hi = RANGE_HI(r);
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (__atomic_compare_exchange_n(&victim->range, &r, RANGE(lo, mid),
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&thief->range, RANGE(mid, hi), __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_job(Worker *w, par_task_ft task, void *data)
+{
+    while (1) {
+        size_t idx;
+        while (range_pop(w, &idx))
+            task(idx, data);
+
+        // victims are visited from a random one, so that thieves spread out
+        w->seed = w->seed * 1103515245 + 12345;
+        unsigned start = (w->seed >> 16) % g_nthreads;
+        bool stolen = false;
+        for (unsigned k = 0; k < g_nthreads && !stolen; k++) {
+            Worker *victim = &g_workers[(start + k) % g_nthreads];
+            if (victim != w)
+                stolen = range_steal(w, victim);
+        }
+        if (!stolen) return;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    g_thread_index = w->idx;
+
+    // samples of the profiler are taken on the main thread
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    Pool_thread_init();
+    gc_thread_init();
+
+    unsigned long seen = 0;
+    while (1) {
+        pthread_mutex_lock(&g_job_lock);
+        while (g_job.gen == seen)
+            pthread_cond_wait(&g_job_start, &g_job_lock);
+        seen = g_job.gen;
+        par_task_ft task = g_job.task;
+        void *data = g_job.data;
+        pthread_mutex_unlock(&g_job_lock);
+
+        run_job(w, task, data);
+
+        pthread_mutex_lock(&g_job_lock);
+        if (--g_job.running == 0)
+            pthread_cond_signal(&g_job_done);
+        pthread_mutex_unlock(&g_job_lock);
+    }
+    return NULL;
+}
+
+// returns false if no worker could be started
+static bool start_workers()
+{
+    unsigned n = thread_count();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    g_workers[0].idx = 0;
+    g_workers[0].seed = 0;
+    g_nthreads = 1;
+    for (unsigned i = 1; i < n; i++) {
+        Worker *w = &g_workers[i];
+        w->idx = i;
+        w->seed = i;
+        w->range = RANGE(0, 0);
+        if (pthread_create(&w->thread, &attr, worker_main, w) != 0) {
+            ERROR("can't start worker thread %u", i);
+            break;
+        }
+        g_nthreads++;
+    }
+    pthread_attr_destroy(&attr);
+    return g_nthreads > 1;
+}
+
+// the section is over, everything the workers left behind is given back to the
+// main thread
+static void end_section()
+{
+    Pool_join_threads();
+    gc_join_threads();
+    g_threaded = false;
+
+    thread_lock();
+    Deferred *deferred = g_deferred;
+    size_t n = g_ndeferred;
+    g_deferred = NULL;
+    g_ndeferred = g_deferred_cap = 0;
+    thread_unlock();
+
+    // deferred calls may defer some more, which run right away now
+    for (size_t i = 0; i < n; i++)
+        deferred[i].fn(deferred[i].ptr);
+    free(deferred);
+}
+
+void par_for(size_t n, par_task_ft task, void *data)
+{
+    if (n > UINT32_MAX)
+        FATAL("too many tasks (%zu)", n);
+
+    if (g_threaded) {
+        for (size_t i = 0; i < n; i++)
+            task(i, data);
+        return;
+    }
+
+    // without workers the tasks still run in a section, so that they get the
+    // same restrictions whatever the number of threads
+    if (thread_count() < 2 || (g_nthreads == 0 && !start_workers()) || g_nthreads < 2) {
+        g_threaded = true;
+        for (size_t i = 0; i < n; i++)
+            task(i, data);
+        end_section();
+        return;
+    }
+
+    // each thread starts with an equal share
+    for (unsigned t = 0; t < g_nthreads; t++)
+        g_workers[t].range = RANGE(n * t / g_nthreads, n * (t + 1) / g_nthreads);
+
+    g_threaded = true;
+    pthread_mutex_lock(&g_job_lock);
+    g_job.task = task;
+    g_job.data = data;
+    g_job.running = g_nthreads - 1;
+    g_job.gen++;
+    pthread_cond_broadcast(&g_job_start);
+    pthread_mutex_unlock(&g_job_lock);
+
+    run_job(&g_workers[0], task, data);
+
+    pthread_mutex_lock(&g_job_lock);
+    while (g_job.running > 0)
+        pthread_cond_wait(&g_job_done, &g_job_lock);
+    pthread_mutex_unlock(&g_job_lock);
+
+    end_section();
+}
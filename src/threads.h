@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Parallel sections.
+ * The interpreter runs on the main thread, i.e., the thread of the host that is
+ * in it (see mylisp_enter), which can spread independent applications of a
+ * procedure over a pool of worker threads (see pmap in mylisp.c) and takes part
+ * in the work itself. While they run, the program is in a parallel section.
+ *
+ * State of an evaluation is thread-local: the last exception (see throw), the
+ * VM stack, the depth of eval and the free lists of pools (see pool.c). The rest
+ * is shared, and during a parallel section:
+ *  - reference counts are updated atomically (REFC_INC, REFC_DEC), so that a
+ *    datum is freed by the thread that releases its last reference;
+ *  - the symbol table and the lazily computed parts of forms (lexical addresses,
+ *    bytecode, expansions of macros) are updated under the global lock;
+ *  - caches of top-level bindings are used, but not filled;
+ *  - top-level bindings can't be changed;
+ *  - values replaced in atoms and anything that another thread might still be
+ *    reading are released at the end of the section (see thread_defer);
+ *  - the cycle collector doesn't run, worker threads track the frames and atoms
+ *    that they create on their own (see gc.c).
+ * Outside of parallel sections nothing is synchronized and the main thread pays
+ * only for a test of g_threaded.
+ *
+ * The number of threads is the number of online processors, or the value of the
+ * MYLISP_THREADS environment variable.
+ */
+
+#define THREADS_MAX 256
+// size of the C stacks of worker threads, the room for nested evaluation is the
+// same as on the main thread with the default limit (see vm.c)
+#define THREAD_STACK_SIZE (8 << 20)
+
+// true during a parallel section
+extern bool g_threaded;
+
+// increment and decrement a reference count, evaluate to the new count
+#define REFC_INC(refc) \
+    (g_threaded ? __atomic_add_fetch(&(refc), 1, __ATOMIC_RELAXED) : ++(refc))
+#define REFC_DEC(refc) \
+    (g_threaded ? __atomic_sub_fetch(&(refc), 1, __ATOMIC_ACQ_REL) : --(refc))
+
+// index of the calling thread, 0 for the main thread
+extern __thread unsigned g_thread_index;
+
+// number of threads that run a parallel section, including the main one
+unsigned thread_count();
+
+static inline unsigned thread_index()
+{
+    return g_thread_index;
+}
+
+// the global lock, for rare updates of shared data during a parallel section
+void thread_lock();
+void thread_unlock();
+
+// Calls fn(ptr) at the end of the current parallel section on the main thread,
+// or right away outside of one.
+void thread_defer(void (*fn)(void*), void *ptr);
+
+typedef void (*par_task_ft)(size_t idx, void *data);
+
+// Calls task(i, data) for every i in [0, n) in a parallel section and returns once
+// all of them are done. Indices are split into ranges, one per thread, and a
+// thread that is done with its own range steals half of what's left of another.
+// A nested call (from a task) runs its tasks on the calling thread, and so does
+// a call when there's a single thread, which is still a parallel section.
+void par_for(size_t n, par_task_ft task, void *data);
@@ -4,6 +4,10 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 
 #include "common.h"
 #include "mem_debug.h"
@@ -12,6 +16,9 @@
 #include "hashtbl.h"
 #include "env.h"
 #include "printer.h"
+#include "pool.h"
+#include "vm.h"
+#include "threads.h"
 
 /*
 //#define INVOKE(dtm, method, args...) \
@@ -25,12 +32,15 @@ const char *LispType_name(LispType type) {
     static char* const names[] = {
         "SYMBOL", 
         "LIST", 
+        "VECTOR",
         "NUMBER",
         "STRING", 
         "NIL", "FALSE", "TRUE", 
         "PROCEDURE",
         "ATOM",
         "EXCEPTION",
+        "HASHMAP",
+        "LAZYSEQ",
         "*undefined*"
     };
 
@@ -40,19 +50,11 @@ const char *LispType_name(LispType type) {
 // -----------------------------------------------------------------------------
 // _LispDatum
 
-// concrete types should call this function to allocate memory for the 1st member
-static _LispDatum *_LispDatum_new(const DtmMethods *methods)
+// concrete types should call this function to initialise their 1st member
+static void _LispDatum_init(_LispDatum *_dtm, const DtmMethods *methods)
 {
-    _LispDatum *_dtm = malloc(sizeof(_LispDatum));
     _dtm->methods = methods;
     _dtm->refc = 0;
-    return _dtm;
-}
-
-// concrete types should call this function to free memory allocated for the 1st member
-static void _LispDatum_free(_LispDatum *_dtm)
-{
-    free(_dtm);
 }
 
 static void _LispDatum_own(_LispDatum *_dtm)
@@ -64,78 +66,130 @@ static void _LispDatum_own(_LispDatum *_dtm)
 
     // if (LispDatum_is_singleton(datum)) return;
 
-    _dtm->refc += 1;
+    REFC_INC(_dtm->refc);
 }
 
-static void _LispDatum_rls(_LispDatum *_dtm)
+// returns the new reference count
+static long _LispDatum_rls(_LispDatum *_dtm)
 {
     if (_dtm == NULL) {
         LOG_NULL(_dtm);
-        return;
+        return 0;
     }
 
-    if (_dtm->refc <= 0)
-        FATAL("WTF? Ref count = %ld", _dtm->refc);
-
     // if (LispDatum_is_singleton(datum)) return;
 
-    _dtm->refc -= 1;
+    long refc = REFC_DEC(_dtm->refc);
+    if (refc < 0)
+        FATAL("WTF? Ref count = %ld", refc + 1);
+    return refc;
 }
 
 static long _LispDatum_refc(const _LispDatum *_dtm)
 {
-    return _dtm->refc;
+    return __atomic_load_n(&_dtm->refc, __ATOMIC_RELAXED);
 }
 
 
 // -----------------------------------------------------------------------------
-// LispDatum
+// Immediate datums
+
+#define IMM_BITS(dtm) ((uintptr_t) (dtm))
+#define IS_IMM(dtm) ((IMM_BITS(dtm) & 3) != 0)
+#define IS_FIXNUM(dtm) ((IMM_BITS(dtm) & 1) == 1)
+#define IS_SINGLETON(dtm) ((IMM_BITS(dtm) & 3) == 2)
+
+#define FIXNUM_MAKE(val) ((void*) (((uintptr_t) (val) << 1) | 1))
+// relies on arithmetic right shift of signed integers, which gcc guarantees
+#define FIXNUM_VAL(dtm) ((int64_t) ((intptr_t) (dtm) >> 1))
+
+#define SINGLETON_MAKE(type) ((void*) (((uintptr_t) (type) << 2) | 2))
+#define SINGLETON_TYPE(dtm) ((LispType) (IMM_BITS(dtm) >> 2))
+
+// methods of types that have immediate instances, defined below
+static const DtmMethods number_methods;
+static const DtmMethods nil_methods;
+static const DtmMethods false_methods;
+static const DtmMethods true_methods;
+
+bool LispDatum_isimm(const LispDatum *dtm)
+{
+    return IS_IMM(dtm);
+}
+
+static const DtmMethods *imm_methods(const LispDatum *dtm)
+{
+    if (IS_FIXNUM(dtm))
+        return &number_methods;
+
+    switch (SINGLETON_TYPE(dtm)) {
+        case NIL: return &nil_methods;
+        case FALSE: return &false_methods;
+        case TRUE: return &true_methods;
+        default: FATAL("bad immediate datum %p", dtm);
+    }
+    return NULL;
+}
 
-typedef _LispDatum* LispDatum;
+
+// -----------------------------------------------------------------------------
+// LispDatum
 
 static const DtmMethods *LispDatum_methods(const LispDatum *dtm)
 {
-    _LispDatum *_dtm = *dtm;
-    return _dtm->methods;
+    return IS_IMM(dtm) ? imm_methods(dtm) : dtm->methods;
 }
 
 void LispDatum_own(LispDatum *dtm)
 {
+    // immediate datums are not reference counted
+    if (IS_IMM(dtm)) return;
     return LispDatum_methods(dtm)->own(dtm);
 }
 
 static void LispDatum_own_dflt(LispDatum *dtm)
 {
-    _LispDatum *_dtm = *dtm;
-    _LispDatum_own(_dtm);
+    _LispDatum_own(dtm);
 }
 
 void LispDatum_rls(LispDatum *dtm)
 {
+    if (IS_IMM(dtm)) return;
     return LispDatum_methods(dtm)->rls(dtm);
 }
 
 static void LispDatum_rls_dflt(LispDatum *dtm)
 {
-    _LispDatum *_dtm = *dtm;
-    _LispDatum_rls(_dtm);
+    _LispDatum_rls(dtm);
 }
 
 void LispDatum_rls_free(LispDatum *dtm)
 {
-    LispDatum_rls(dtm);
-    LispDatum_free(dtm);
+    if (IS_IMM(dtm)) return;
+
+    const DtmMethods *methods = LispDatum_methods(dtm);
+    if (methods->rls != LispDatum_rls_dflt) {
+        methods->rls(dtm);
+        LispDatum_free(dtm);
+    }
+    // the count is tested by the thread that decremented it, so that only one of
+    // the threads releasing the last references frees the datum (see threads.h)
+    else if (_LispDatum_rls(dtm) == 0)
+        methods->free(dtm);
 }
 
 long LispDatum_refc(const LispDatum *dtm)
 {
-    _LispDatum *_dtm = *dtm;
-    return _LispDatum_refc(_dtm);
+    // immediate datums behave like singletons that are always owned
+    if (IS_IMM(dtm)) return 1;
+    return _LispDatum_refc(dtm);
 }
 
 LispType LispDatum_type(const LispDatum *dtm)
 {
-    return LispDatum_methods(dtm)->type(dtm);
+    if (IS_FIXNUM(dtm)) return NUMBER;
+    if (IS_SINGLETON(dtm)) return SINGLETON_TYPE(dtm);
+    return dtm->methods->type(dtm);
 }
 
 bool LispDatum_istype(const LispDatum *dtm, LispType type)
@@ -145,14 +199,46 @@ bool LispDatum_istype(const LispDatum *dtm, LispType type)
 
 bool LispDatum_eq(const LispDatum *dtm1, const LispDatum *dtm2)
 {
-    return dtm1 == dtm2 || LispDatum_methods(dtm1)->eq(dtm1, dtm2);
+    if (dtm1 == dtm2) return true;
+    // concrete eq methods expect both arguments to be of their type
+    if (LispDatum_type(dtm1) != LispDatum_type(dtm2)) return false;
+    return LispDatum_methods(dtm1)->eq(dtm1, dtm2);
+}
+
+unsigned int LispDatum_hash(const LispDatum *dtm)
+{
+    return LispDatum_methods(dtm)->hash(dtm);
+}
+
+// used by hash methods
+#define HASH_SEED_LIST 0x4c495354
+#define HASH_SEED_VECTOR 0x56454354
+#define HASH_SEED_HASHMAP 0x484d4150
+
+static unsigned int hash_u64(uint64_t x)
+{
+    // finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (unsigned int) x;
+}
+
+static unsigned int hash_combine(unsigned int h, unsigned int elt)
+{
+    return (h ^ elt) * 0x01000193;
 }
 
 void LispDatum_free(LispDatum *dtm)
 {
-    _LispDatum *_dtm = *dtm;
-    if (_dtm->refc > 0) {
-        DEBUG("Refuse to free %p (refc %ld)", dtm, _dtm->refc);
+    if (IS_IMM(dtm)) return;
+
+    // a datum that is shared by other threads is owned by one of them anyway
+    long refc = __atomic_load_n(&dtm->refc, __ATOMIC_RELAXED);
+    if (refc > 0) {
+        DEBUG("Refuse to free %p (refc %ld)", dtm, refc);
         return;
     }
 
@@ -172,12 +258,13 @@ LispDatum *LispDatum_copy(const LispDatum *dtm)
 // -----------------------------------------------------------------------------
 // Symbol < LispDatum
 
-// Symbol constructor
-static Symbol* Symbol_new(const char *name) {
+// Symbol constructor, name is the first len characters of the given string
+static Symbol* Symbol_new(const char *name, size_t len, unsigned int hash) {
     static const DtmMethods symbol_methods = {
         .type = (dtm_type_ft) Symbol_type,
         .free = (dtm_free_ft) Symbol_free,
         .eq = (dtm_eq_ft) Symbol_eq,
+        .hash = (dtm_hash_ft) Symbol_hash,
         .typename = (dtm_typename_ft) Symbol_typename,
         .copy = (dtm_copy_ft) Symbol_copy,
         .own = LispDatum_own_dflt,
@@ -185,8 +272,10 @@ static Symbol* Symbol_new(const char *name) {
     };
 
     Symbol* sym = malloc(sizeof(Symbol));
-    sym->name = dyn_strcpy(name);
-    sym->super = _LispDatum_new(&symbol_methods);
+    sym->name = dyn_strncpy(name, len);
+    sym->hash = hash;
+    sym->special = SF_NONE;
+    _LispDatum_init(&sym->super, &symbol_methods);
     return sym;
 }
 
@@ -199,14 +288,30 @@ static HashTbl *g_symbol_table;
 
 void init_symbol_table()
 {
-    g_symbol_table = HashTbl_newc(256, (hashkey_t) hash_simple_str);
+    static const struct { SpecialForm id; const char *name; } special_forms[] = {
+        { SF_DEF, "def!" }, { SF_DEFMACRO, "defmacro!" }, { SF_LETSTAR, "let*" },
+        { SF_IF, "if" }, { SF_DO, "do" }, { SF_LAMBDA, "lambda" },
+        { SF_QUOTE, "quote" }, { SF_QUASIQUOTE, "quasiquote" },
+        { SF_UNQUOTE, "unquote" }, { SF_SPLICE_UNQUOTE, "splice-unquote" },
+        { SF_MACROEXPAND, "macroexpand" }, { SF_TRYSTAR, "try*" },
+        { SF_CATCHSTAR, "catch*" }, { SF_AND, "and" }, { SF_OR, "or" },
+        { SF_AMPERSAND, "&" },
+    };
+
+    g_symbol_table = HashTbl_newc(256, (hashkey_t) hash_str);
+
+    // these symbols are owned by the symbol table, so that they are never freed
+    for (size_t i = 0; i < ARR_LEN(special_forms); i++) {
+        Symbol *sym = Symbol_intern(special_forms[i].name);
+        sym->special = special_forms[i].id;
+        LispDatum_own((LispDatum*) sym);
+    }
 }
 
 // concerned with Symbol only, doesn't modify the symbol table
 static void _Symbol_free(Symbol *sym) 
 {
     free(sym->name);
-    _LispDatum_free(sym->super);
     free(sym);
 }
 
@@ -225,6 +330,10 @@ static Symbol *sym_tbl_pop(const char *name)
 // frees the symbol and pops it from the symbol table
 void Symbol_free(Symbol *sym)
 {
+    // During a parallel section another thread might be interning the same name,
+    // so the symbol is kept. It is freed once it's released outside of one.
+    if (g_threaded) return;
+
     Symbol *popd = sym_tbl_pop(sym->name);
     assert(popd == sym);
     _Symbol_free(sym);
@@ -248,14 +357,34 @@ Symbol *Symbol_copy(const Symbol *sym)
 
 Symbol *Symbol_intern(const char *name) 
 {
-    Symbol *sym = HashTbl_get(g_symbol_table, name, (keyeq_t) streq);
-    if (sym)
-        return sym;
-    else {
-        Symbol *symnew = Symbol_new(name);
-        HashTbl_put(g_symbol_table, symnew->name, symnew, (keyeq_t) streq);
-        return symnew;
+    return Symbol_internn(name, strlen(name));
+}
+
+// a name that is not null-terminated
+typedef struct {
+    const char *s;
+    size_t len;
+} NameSlice;
+
+static bool name_eq_slice(const char *name, const NameSlice *slice)
+{
+    return strncmp(name, slice->s, slice->len) == 0 && name[slice->len] == '\0';
+}
+
+Symbol *Symbol_internn(const char *name, size_t len) 
+{
+    unsigned int hash = hash_strn(name, len);
+    NameSlice slice = { name, len };
+
+    bool locked = g_threaded;
+    if (locked) thread_lock();
+    Symbol *sym = HashTbl_get_hashed(g_symbol_table, &slice, hash, (keyeq_t) name_eq_slice);
+    if (sym == NULL) {
+        sym = Symbol_new(name, len, hash);
+        HashTbl_put(g_symbol_table, sym->name, sym, (keyeq_t) streq);
     }
+    if (locked) thread_unlock();
+    return sym;
 }
 
 bool Symbol_eq_str(const Symbol *sym, const char *str) 
@@ -277,6 +406,16 @@ const char *Symbol_name(const Symbol *sym)
     return sym->name;
 }
 
+unsigned int Symbol_hash(const Symbol *sym)
+{
+    return sym->hash;
+}
+
+SpecialForm Symbol_special(const Symbol *sym)
+{
+    return sym->special;
+}
+
 // -----------------------------------------------------------------------------
 // List < LispDatum
 
@@ -291,18 +430,15 @@ static const DtmMethods empty_list_methods = {
     .type = (dtm_type_ft) List_type,
     .free = (dtm_free_ft) List_free,
     .eq = (dtm_eq_ft) List_eq,
+    .hash = (dtm_hash_ft) List_hash,
     .typename = (dtm_typename_ft) List_typename,
     .copy = (dtm_copy_ft) List_copy,
     .own = LispDatum_noown,
     .rls = LispDatum_norls
 };
 
-static const _LispDatum g_empty_list_super = {
-    .methods = &empty_list_methods,
-    .refc = 1
-};
 static const List g_empty_list = {
-    .super = (_LispDatum*) &g_empty_list_super,
+    .super = { .methods = &empty_list_methods, .refc = 1 },
     .len = 0, .head = NULL, .tail = NULL 
 };
 const List *List_empty() { return &g_empty_list; }
@@ -311,23 +447,50 @@ LispType List_type() {
     return LIST; 
 }
 
+static Pool g_list_pool = POOL_INIT("list", List);
+static Pool g_node_pool = POOL_INIT("node", struct Node);
+
+static struct Node *Node_new(LispDatum *datum, struct Node *next)
+{
+    struct Node *node = Pool_alloc(&g_node_pool);
+    node->refc = 1;
+    node->depth = 0;
+    node->slot = NODE_UNRESOLVED;
+    node->value = datum;
+    node->next = next;
+    return node;
+}
+
+// releases a chain of nodes, freeing the ones that are no longer shared
+// together with the LispDatums they point to
+static void Nodes_rls_free(struct Node *node)
+{
+    while (node && REFC_DEC(node->refc) == 0) {
+        LispDatum_rls_free(node->value);
+        struct Node *p = node;
+        node = node->next;
+        Pool_free(&g_node_pool, p);
+    }
+}
+
 /* Frees the memory allocated for each Node of the list including the LispDatums they point to. */
 void List_free(List *list) {
     if (list == NULL || list == &g_empty_list) return;
 
-    if (list->head) {
-        struct Node *node = list->head;
-        while (node && --node->refc == 0) {
-            LispDatum_rls(node->value);
-            LispDatum_free(node->value);
-            struct Node *p = node;
-            node = node->next;
-            free(p);
-        }
-    }
+    Nodes_rls_free(list->head);
 
-    _LispDatum_free(list->super);
-    free(list);
+    Code_rls_free(list->code);
+    if (list->expansion)
+        LispDatum_rls_free((LispDatum*) list->expansion);
+    free(list->head_cache);
+    Pool_free(&g_list_pool, list);
+}
+
+void List_clear(List *list) {
+    struct Node *head = list->head;
+    list->head = list->tail = NULL;
+    list->len = 0;
+    Nodes_rls_free(head);
 }
 
 bool List_eq(const List *lst1, const List *lst2) {
@@ -346,6 +509,13 @@ bool List_eq(const List *lst1, const List *lst2) {
     return true;
 }
 
+unsigned int List_hash(const List *list) {
+    unsigned int h = HASH_SEED_LIST;
+    for (struct Node *node = list->head; node != NULL; node = node->next)
+        h = hash_combine(h, LispDatum_hash(node->value));
+    return h;
+}
+
 char *List_typename(const List *list) {
     return dyn_strcpy("List");
 }
@@ -375,17 +545,23 @@ List *List_new() {
         .type = (dtm_type_ft) List_type,
         .free = (dtm_free_ft) List_free,
         .eq = (dtm_eq_ft) List_eq,
+        .hash = (dtm_hash_ft) List_hash,
         .typename = (dtm_typename_ft) List_typename,
         .copy = (dtm_copy_ft) List_copy,
         .own = LispDatum_own_dflt,
         .rls = LispDatum_rls_dflt
     };
 
-    List *list = malloc(sizeof(List));
+    List *list = Pool_alloc(&g_list_pool);
     list->len = 0;
     list->head = NULL;
     list->tail = NULL;
-    list->super = _LispDatum_new(&list_methods);
+    list->resolved = false;
+    list->shares_tail = false;
+    list->code = NULL;
+    list->expansion = NULL;
+    list->head_cache = NULL;
+    _LispDatum_init(&list->super, &list_methods);
     return list;
 }
 
@@ -401,11 +577,42 @@ bool List_isempty(const List *list) {
     return list->len == 0;
 }
 
+// Replaces the nodes of the list that are reachable from another list by copies,
+// so that appending to the list leaves the other one alone. The nodes before the
+// first shared one are reachable only from this list, they are kept.
+static void List_unshare(List *list)
+{
+    list->shares_tail = false;
+
+    struct Node *prev = NULL, *node = list->head;
+    while (node && __atomic_load_n(&node->refc, __ATOMIC_RELAXED) == 1) {
+        prev = node;
+        node = node->next;
+    }
+    if (node == NULL) return;
+
+    struct Node *shared = node;
+    list->tail = prev;
+    for (; node != NULL; node = node->next) {
+        struct Node *copy = Node_new(node->value, NULL);
+        copy->depth = node->depth;
+        copy->slot = node->slot;
+        LispDatum_own(node->value);
+        if (list->tail)
+            list->tail->next = copy;
+        else
+            list->head = copy;
+        list->tail = copy;
+    }
+    // the reference of prev (or of the list, if shared was the head)
+    Nodes_rls_free(shared);
+}
+
 void List_add(List *list, LispDatum *datum) {
-    struct Node *node = malloc(sizeof(struct Node));
-    node->refc = 1;
-    node->value = datum;
-    node->next = NULL;
+    if (list->shares_tail)
+        List_unshare(list);
+
+    struct Node *node = Node_new(datum, NULL);
 
     LispDatum_own(datum);
 
@@ -458,15 +665,13 @@ List *List_cons_new(List *list, LispDatum *datum)
 {
     List *out = List_new();
 
-    struct Node *node = malloc(sizeof(struct Node));
-    node->refc = 1;
-    node->value = datum;
+    struct Node *node = Node_new(datum, list->head); // next potentially NULL
     LispDatum_own(datum);
-    node->next = list->head; // potentially NULL
     out->head = node;
     if (list->head) {
-        list->head->refc++;
+        REFC_INC(list->head->refc);
         out->tail = list->tail;
+        out->shares_tail = true;
     }
     else {
         out->tail = node;
@@ -488,8 +693,10 @@ List *List_rest_new(List *list)
     size_t tail_len = List_len(list) - 1;
     if (tail_len > 0) {
         struct Node *tail_head = list->head->next;
-        out->head = out->tail = tail_head;
-        tail_head->refc += 1;
+        out->head = tail_head;
+        out->tail = list->tail;
+        out->shares_tail = true;
+        REFC_INC(tail_head->refc);
         out->len = tail_len;
     }
 
@@ -508,40 +715,817 @@ void List_append(List *dst, const List *src)
     }
 
     if (List_isempty(src)) return;
+    // the last node is about to point to the nodes of src
+    if (dst->shares_tail)
+        List_unshare(dst);
 
     struct Node *src_head = src->head;
     if (List_isempty(dst)) {
-        dst->head = dst->tail = src_head;
+        dst->head = src_head;
     }
     else {
         dst->tail->next = src_head;
-        dst->tail = src->tail;
     }
-    src_head->refc += 1;
+    dst->tail = src->tail;
+    dst->shares_tail = true;
+    REFC_INC(src_head->refc);
 
     dst->len += src->len;
 }
 
+bool List_isreusable(const List *list)
+{
+    return list != &g_empty_list && !list->resolved && list->code == NULL
+        && list->expansion == NULL && list->head_cache == NULL;
+}
+
+bool List_isexclusive(const List *list)
+{
+    if (!List_isreusable(list)) return false;
+
+    for (const struct Node *node = list->head; node != NULL; node = node->next) {
+        if (__atomic_load_n(&node->refc, __ATOMIC_RELAXED) != 1)
+            return false;
+    }
+    return true;
+}
+
+void List_push(List *list, LispDatum *dtm)
+{
+    // the new node takes over the reference of the list to its head
+    list->head = Node_new(dtm, list->head);
+    LispDatum_own(dtm);
+    if (list->tail == NULL)
+        list->tail = list->head;
+    list->len += 1;
+}
+
+void List_pop(List *list)
+{
+    struct Node *head = list->head;
+    struct Node *next = head->next;
+    // the list takes over the reference of its head to the next node
+    if (next)
+        REFC_INC(next->refc);
+    Nodes_rls_free(head);
+
+    list->head = next;
+    if (next == NULL) {
+        list->tail = NULL;
+        list->shares_tail = false;
+    }
+    list->len -= 1;
+}
+
+void List_node_set(struct Node *node, LispDatum *dtm)
+{
+    LispDatum_own(dtm);
+    LispDatum_rls_free(node->value);
+    node->value = dtm;
+}
+
+void List_set_expansion(List *list, List *expansion)
+{
+    LispDatum_own((LispDatum*) expansion);
+    List *old = __atomic_exchange_n(&list->expansion, expansion, __ATOMIC_ACQ_REL);
+    // threads of a parallel section might still be using the old expansion
+    if (old)
+        thread_defer((free_t) LispDatum_rls_free, old);
+}
+
+GlobalCache *List_head_cache(List *list)
+{
+    // caches aren't filled during a parallel section (see MalEnv_get_cached)
+    if (list->head_cache == NULL && !g_threaded)
+        list->head_cache = calloc(1, sizeof(GlobalCache));
+    return list->head_cache;
+}
+
 
 // -----------------------------------------------------------------------------
-// Number < LispDatum
+// Vector < LispDatum
 
-Number *Number_new(int64_t val)
+#define VECBUF_MIN_CAP 4
+#define VECBUF_SIZE(cap) (sizeof(struct VecBuf) + sizeof(LispDatum*) * (cap))
+
+static Pool g_vector_pool = POOL_INIT("vector", Vector);
+
+static struct VecBuf *VecBuf_new(uint32_t cap, uint32_t lo)
+{
+    if (cap < VECBUF_MIN_CAP) cap = VECBUF_MIN_CAP;
+    struct VecBuf *buf = Pool_alloc_sz(VECBUF_SIZE(cap));
+    buf->refc = 0;
+    buf->cap = cap;
+    buf->lo = buf->hi = lo;
+    return buf;
+}
+
+static void VecBuf_rls_free(struct VecBuf *buf)
+{
+    if (buf == NULL || REFC_DEC(buf->refc) > 0) return;
+
+    for (uint32_t i = buf->lo; i < buf->hi; i++)
+        LispDatum_rls_free(buf->items[i]);
+    Pool_free_sz(buf, VECBUF_SIZE(buf->cap));
+}
+
+LispType Vector_type() {
+    return VECTOR;
+}
+
+void Vector_free(Vector *vec) {
+    VecBuf_rls_free(vec->buf);
+    Pool_free(&g_vector_pool, vec);
+}
+
+void Vector_clear(Vector *vec) {
+    struct VecBuf *buf = vec->buf;
+    vec->buf = NULL;
+    vec->off = vec->len = 0;
+    VecBuf_rls_free(buf);
+}
+
+bool Vector_eq(const Vector *v1, const Vector *v2) {
+    if (v1 == v2) return true;
+    if (v1->len != v2->len) return false;
+
+    for (size_t i = 0; i < v1->len; i++) {
+        if (!LispDatum_eq(Vector_ref(v1, i), Vector_ref(v2, i)))
+            return false;
+    }
+
+    return true;
+}
+
+unsigned int Vector_hash(const Vector *vec) {
+    unsigned int h = HASH_SEED_VECTOR;
+    for (size_t i = 0; i < vec->len; i++)
+        h = hash_combine(h, LispDatum_hash(Vector_ref(vec, i)));
+    return h;
+}
+
+char *Vector_typename(const Vector *vec) {
+    return dyn_strcpy("Vector");
+}
+
+Vector *Vector_copy(const Vector *vec) {
+    Vector *out = Vector_newc(vec->len);
+
+    for (size_t i = 0; i < vec->len; i++) {
+        LispDatum *cpy = LispDatum_copy(Vector_ref(vec, i));
+        if (cpy == NULL)
+            FATAL("cpy == NULL");
+        Vector_add(out, cpy);
+    }
+
+    return out;
+}
+
+// a new vector of the range [off, off + len) of the given buffer
+static Vector *Vector_view(struct VecBuf *buf, uint32_t off, uint32_t len)
+{
+    static const DtmMethods vector_methods = {
+        .type = (dtm_type_ft) Vector_type,
+        .free = (dtm_free_ft) Vector_free,
+        .eq = (dtm_eq_ft) Vector_eq,
+        .hash = (dtm_hash_ft) Vector_hash,
+        .typename = (dtm_typename_ft) Vector_typename,
+        .copy = (dtm_copy_ft) Vector_copy,
+        .own = LispDatum_own_dflt,
+        .rls = LispDatum_rls_dflt
+    };
+
+    Vector *vec = Pool_alloc(&g_vector_pool);
+    vec->buf = buf;
+    vec->off = off;
+    vec->len = len;
+    if (buf) REFC_INC(buf->refc);
+    _LispDatum_init(&vec->super, &vector_methods);
+    return vec;
+}
+
+Vector *Vector_new() {
+    return Vector_view(NULL, 0, 0);
+}
+
+Vector *Vector_newc(size_t cap) {
+    return Vector_view(cap > 0 ? VecBuf_new(cap, 0) : NULL, 0, 0);
+}
+
+size_t Vector_len(const Vector *vec) {
+    return vec->len;
+}
+
+bool Vector_isempty(const Vector *vec) {
+    return vec->len == 0;
+}
+
+LispDatum *Vector_ref(const Vector *vec, size_t idx) {
+    if (idx >= vec->len)
+        return NULL;
+    return vec->buf->items[vec->off + idx];
+}
+
+// Copies the elements of vec into a new buffer with room for extra elements,
+// which are left free either before (front) or after them.
+// Returns the offset of the copied elements.
+static struct VecBuf *VecBuf_copy(const Vector *vec, uint32_t extra, bool front, uint32_t *off)
+{
+    uint32_t cap = (vec->len + extra) * 2;
+    if (cap < VECBUF_MIN_CAP) cap = VECBUF_MIN_CAP;
+    *off = front ? cap - vec->len : 0;
+    struct VecBuf *buf = VecBuf_new(cap, *off);
+
+    for (uint32_t i = 0; i < vec->len; i++) {
+        LispDatum *dtm = vec->buf->items[vec->off + i];
+        LispDatum_own(dtm);
+        buf->items[buf->hi++] = dtm;
+    }
+
+    return buf;
+}
+
+void Vector_add(Vector *vec, LispDatum *dtm) {
+    struct VecBuf *buf = vec->buf;
+    if (buf == NULL || vec->off + vec->len != buf->hi || buf->hi == buf->cap) {
+        uint32_t off;
+        struct VecBuf *new_buf = VecBuf_copy(vec, 1, false, &off);
+        REFC_INC(new_buf->refc);
+        VecBuf_rls_free(buf);
+        vec->buf = buf = new_buf;
+        vec->off = off;
+    }
+
+    LispDatum_own(dtm);
+    buf->items[buf->hi++] = dtm;
+    vec->len += 1;
+}
+
+// Moves a bound of the used part of a buffer (lo or hi) from expected to claimed,
+// which fails if it has already moved. Threads of a parallel section might claim
+// the same slot, only one of them gets it.
+static bool VecBuf_claim(uint32_t *bound, uint32_t expected, uint32_t claimed)
+{
+    if (!g_threaded) {
+        if (*bound != expected) return false;
+        *bound = claimed;
+        return true;
+    }
+    return __atomic_compare_exchange_n(bound, &expected, claimed,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+bool Vector_isexclusive(const Vector *vec) {
+    const struct VecBuf *buf = vec->buf;
+    return buf && __atomic_load_n(&buf->refc, __ATOMIC_RELAXED) == 1;
+}
+
+void Vector_set(Vector *vec, size_t idx, LispDatum *dtm) {
+    LispDatum **slot = &vec->buf->items[vec->off + idx];
+    LispDatum_own(dtm);
+    LispDatum_rls_free(*slot);
+    *slot = dtm;
+}
+
+Vector *Vector_conj_new(Vector *vec, LispDatum *dtm) {
+    struct VecBuf *buf = vec->buf;
+    uint32_t end = vec->off + vec->len;
+    // claim the free slot right past the end
+    if (buf && end < buf->cap && VecBuf_claim(&buf->hi, end, end + 1)) {
+        LispDatum_own(dtm);
+        buf->items[end] = dtm;
+        return Vector_view(buf, vec->off, vec->len + 1);
+    }
+
+    uint32_t off;
+    buf = VecBuf_copy(vec, 1, false, &off);
+    LispDatum_own(dtm);
+    buf->items[buf->hi++] = dtm;
+    return Vector_view(buf, off, vec->len + 1);
+}
+
+Vector *Vector_cons_new(Vector *vec, LispDatum *dtm) {
+    struct VecBuf *buf = vec->buf;
+    uint32_t off;
+    // claim the free slot right before the start
+    if (buf && vec->off > 0 && VecBuf_claim(&buf->lo, vec->off, vec->off - 1)) {
+        off = vec->off;
+    }
+    else {
+        buf = VecBuf_copy(vec, 1, true, &off);
+        buf->lo--;
+    }
+
+    LispDatum_own(dtm);
+    buf->items[off - 1] = dtm;
+    return Vector_view(buf, off - 1, vec->len + 1);
+}
+
+Vector *Vector_rest_new(Vector *vec) {
+    if (Vector_isempty(vec)) {
+        DEBUG("got empty vector");
+        return NULL;
+    }
+
+    return Vector_view(vec->buf, vec->off + 1, vec->len - 1);
+}
+
+List *Vector_to_list(const Vector *vec) {
+    if (Vector_isempty(vec)) return (List*) List_empty();
+
+    List *list = List_new();
+    for (size_t i = 0; i < vec->len; i++)
+        List_add(list, Vector_ref(vec, i));
+    return list;
+}
+
+// -----------------------------------------------------------------------------
+// HashMap < LispDatum
+
+#define HAMT_MASK ((1u << HAMT_BITS) - 1)
+// bits of a hash, nodes deeper than that are collision nodes
+#define HAMT_HASH_BITS 32
+#define HAMT_NODE_SIZE(len) (sizeof(struct HamtNode) + sizeof(struct HamtEntry) * (len))
+
+static Pool g_hashmap_pool = POOL_INIT("hashmap", HashMap);
+
+static struct HamtNode *HamtNode_new(uint32_t bitmap, uint32_t len)
+{
+    struct HamtNode *node = Pool_alloc_sz(HAMT_NODE_SIZE(len));
+    node->refc = 0;
+    node->bitmap = bitmap;
+    node->len = len;
+    return node;
+}
+
+static void HamtNode_rls_free(struct HamtNode *node);
+
+static void HamtEntry_own(const struct HamtEntry *entry)
+{
+    if (entry->key) {
+        LispDatum_own(entry->key);
+        LispDatum_own(entry->u.val);
+    }
+    else {
+        REFC_INC(entry->u.node->refc);
+    }
+}
+
+static void HamtEntry_rls_free(const struct HamtEntry *entry)
+{
+    if (entry->key) {
+        LispDatum_rls_free(entry->key);
+        LispDatum_rls_free(entry->u.val);
+    }
+    else {
+        HamtNode_rls_free(entry->u.node);
+    }
+}
+
+static void HamtNode_rls_free(struct HamtNode *node)
+{
+    if (node == NULL || REFC_DEC(node->refc) > 0) return;
+
+    for (uint32_t i = 0; i < node->len; i++)
+        HamtEntry_rls_free(&node->entries[i]);
+    Pool_free_sz(node, HAMT_NODE_SIZE(node->len));
+}
+
+// position of the entry of the given bit among the entries present
+static uint32_t hamt_idx(uint32_t bitmap, uint32_t bit)
+{
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+static bool hamt_haskey(const struct HamtEntry *entry, unsigned int hash, const LispDatum *key)
+{
+    return entry->key && entry->hash == hash && LispDatum_eq(entry->key, key);
+}
+
+typedef enum { EDIT_REPLACE, EDIT_INSERT, EDIT_REMOVE } HamtEdit;
+
+// a copy of the node with the entry at idx replaced, inserted or removed;
+// the copy owns its entries
+static struct HamtNode *HamtNode_edit(const struct HamtNode *node, uint32_t bitmap,
+                                      HamtEdit edit, uint32_t idx, const struct HamtEntry *entry)
+{
+    uint32_t len = node->len + (edit == EDIT_INSERT) - (edit == EDIT_REMOVE);
+    struct HamtNode *copy = HamtNode_new(bitmap, len);
+
+    uint32_t j = 0;
+    for (uint32_t i = 0; i <= node->len; i++) {
+        if (i == idx && edit != EDIT_REMOVE)
+            copy->entries[j++] = *entry;
+        if (i == node->len)
+            break;
+        if (i == idx && edit != EDIT_INSERT)
+            continue;
+        copy->entries[j++] = node->entries[i];
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+        HamtEntry_own(&copy->entries[i]);
+    return copy;
+}
+
+static const struct HamtEntry *hamt_find(const struct HamtNode *node, unsigned int hash,
+                                         const LispDatum *key)
+{
+    for (unsigned shift = 0; node != NULL; shift += HAMT_BITS) {
+        if (shift >= HAMT_HASH_BITS) {
+            for (uint32_t i = 0; i < node->len; i++) {
+                if (hamt_haskey(&node->entries[i], hash, key))
+                    return &node->entries[i];
+            }
+            return NULL;
+        }
+
+        uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);
+        if (!(node->bitmap & bit))
+            return NULL;
+
+        const struct HamtEntry *entry = &node->entries[hamt_idx(node->bitmap, bit)];
+        if (entry->key)
+            return hamt_haskey(entry, hash, key) ? entry : NULL;
+        node = entry->u.node;
+    }
+    return NULL;
+}
+
+// a node at the given depth (shift) holding 2 pairs with different keys
+static struct HamtNode *hamt_pair(unsigned shift, const struct HamtEntry *a, const struct HamtEntry *b)
+{
+    struct HamtNode *node;
+    if (shift >= HAMT_HASH_BITS) {
+        node = HamtNode_new(0, 2);
+        node->entries[0] = *a;
+        node->entries[1] = *b;
+    }
+    else {
+        uint32_t ia = (a->hash >> shift) & HAMT_MASK;
+        uint32_t ib = (b->hash >> shift) & HAMT_MASK;
+        if (ia == ib) {
+            node = HamtNode_new(1u << ia, 1);
+            node->entries[0] = (struct HamtEntry) {
+                .key = NULL, .u.node = hamt_pair(shift + HAMT_BITS, a, b)
+            };
+        }
+        else {
+            node = HamtNode_new((1u << ia) | (1u << ib), 2);
+            node->entries[ia < ib ? 0 : 1] = *a;
+            node->entries[ia < ib ? 1 : 0] = *b;
+        }
+    }
+
+    for (uint32_t i = 0; i < node->len; i++)
+        HamtEntry_own(&node->entries[i]);
+    return node;
+}
+
+// returns a new node with the pair added or replaced (then *added is false)
+static struct HamtNode *hamt_assoc(const struct HamtNode *node, unsigned shift,
+                                   const struct HamtEntry *pair, bool *added)
+{
+    if (node == NULL) {
+        *added = true;
+        struct HamtNode *leaf = HamtNode_new(1u << (pair->hash & HAMT_MASK), 1);
+        leaf->entries[0] = *pair;
+        HamtEntry_own(pair);
+        return leaf;
+    }
+
+    if (shift >= HAMT_HASH_BITS) {
+        for (uint32_t i = 0; i < node->len; i++) {
+            if (hamt_haskey(&node->entries[i], pair->hash, pair->key)) {
+                *added = false;
+                return HamtNode_edit(node, 0, EDIT_REPLACE, i, pair);
+            }
+        }
+        *added = true;
+        return HamtNode_edit(node, 0, EDIT_INSERT, node->len, pair);
+    }
+
+    uint32_t bit = 1u << ((pair->hash >> shift) & HAMT_MASK);
+    uint32_t idx = hamt_idx(node->bitmap, bit);
+    if (!(node->bitmap & bit)) {
+        *added = true;
+        return HamtNode_edit(node, node->bitmap | bit, EDIT_INSERT, idx, pair);
+    }
+
+    const struct HamtEntry *entry = &node->entries[idx];
+    if (hamt_haskey(entry, pair->hash, pair->key)) {
+        *added = false;
+        return HamtNode_edit(node, node->bitmap, EDIT_REPLACE, idx, pair);
+    }
+
+    struct HamtEntry sub = { .key = NULL };
+    if (entry->key) {
+        // another key in this slot, both move down to a new node
+        *added = true;
+        sub.u.node = hamt_pair(shift + HAMT_BITS, entry, pair);
+    }
+    else {
+        sub.u.node = hamt_assoc(entry->u.node, shift + HAMT_BITS, pair, added);
+    }
+    return HamtNode_edit(node, node->bitmap, EDIT_REPLACE, idx, &sub);
+}
+
+// Returns a new node without the key, NULL if the new node would be empty,
+// or the node itself if it doesn't have the key.
+static struct HamtNode *hamt_dissoc(struct HamtNode *node, unsigned shift,
+                                    unsigned int hash, const LispDatum *key)
+{
+    if (shift >= HAMT_HASH_BITS) {
+        for (uint32_t i = 0; i < node->len; i++) {
+            if (hamt_haskey(&node->entries[i], hash, key))
+                return node->len == 1 ? NULL : HamtNode_edit(node, 0, EDIT_REMOVE, i, NULL);
+        }
+        return node;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);
+    if (!(node->bitmap & bit))
+        return node;
+    uint32_t idx = hamt_idx(node->bitmap, bit);
+    const struct HamtEntry *entry = &node->entries[idx];
+
+    if (entry->key) {
+        if (!hamt_haskey(entry, hash, key))
+            return node;
+        return node->len == 1 ? NULL : HamtNode_edit(node, node->bitmap & ~bit, EDIT_REMOVE, idx, NULL);
+    }
+
+    struct HamtNode *child = hamt_dissoc(entry->u.node, shift + HAMT_BITS, hash, key);
+    if (child == entry->u.node)
+        return node;
+    if (child == NULL)
+        return node->len == 1 ? NULL : HamtNode_edit(node, node->bitmap & ~bit, EDIT_REMOVE, idx, NULL);
+
+    struct HamtNode *copy;
+    if (child->len == 1 && child->entries[0].key) {
+        // a single pair left in the subnode takes its place
+        copy = HamtNode_edit(node, node->bitmap, EDIT_REPLACE, idx, &child->entries[0]);
+        HamtNode_rls_free(child);
+    }
+    else {
+        struct HamtEntry sub = { .key = NULL, .u.node = child };
+        copy = HamtNode_edit(node, node->bitmap, EDIT_REPLACE, idx, &sub);
+    }
+    return copy;
+}
+
+static void hamt_foreach(const struct HamtNode *node, hashmap_visit_ft visit, void *data)
+{
+    for (uint32_t i = 0; i < node->len; i++) {
+        const struct HamtEntry *entry = &node->entries[i];
+        if (entry->key)
+            visit(entry->key, entry->u.val, data);
+        else
+            hamt_foreach(entry->u.node, visit, data);
+    }
+}
+
+// true if every pair of the node is in the map
+static bool hamt_issubset(const struct HamtNode *node, const HashMap *map)
+{
+    for (uint32_t i = 0; i < node->len; i++) {
+        const struct HamtEntry *entry = &node->entries[i];
+        if (entry->key) {
+            const struct HamtEntry *other = hamt_find(map->root, entry->hash, entry->key);
+            if (other == NULL || !LispDatum_eq(entry->u.val, other->u.val))
+                return false;
+        }
+        else if (!hamt_issubset(entry->u.node, map)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// sum of the hashes of pairs, which doesn't depend on their order
+static unsigned int hamt_hash(const struct HamtNode *node)
+{
+    unsigned int h = 0;
+    for (uint32_t i = 0; i < node->len; i++) {
+        const struct HamtEntry *entry = &node->entries[i];
+        if (entry->key)
+            h += hash_combine(entry->hash, LispDatum_hash(entry->u.val));
+        else
+            h += hamt_hash(entry->u.node);
+    }
+    return h;
+}
+
+// a new map of the given root, which it owns
+static HashMap *HashMap_of(struct HamtNode *root, size_t len)
 {
-    static const DtmMethods number_methods = {
-        .type = (dtm_type_ft) Number_type,
-        .free = (dtm_free_ft) Number_free,
-        .eq = (dtm_eq_ft) Number_eq,
-        .typename = (dtm_typename_ft) Number_typename,
-        .copy = (dtm_copy_ft) Number_copy,
+    static const DtmMethods hashmap_methods = {
+        .type = (dtm_type_ft) HashMap_type,
+        .free = (dtm_free_ft) HashMap_free,
+        .eq = (dtm_eq_ft) HashMap_eq,
+        .hash = (dtm_hash_ft) HashMap_hash,
+        .typename = (dtm_typename_ft) HashMap_typename,
+        .copy = (dtm_copy_ft) HashMap_copy,
         .own = LispDatum_own_dflt,
         .rls = LispDatum_rls_dflt
     };
 
-    Number *num = malloc(sizeof(Number));
-    num->val = val;
-    num->super = _LispDatum_new(&number_methods);
-    return num;
+    HashMap *map = Pool_alloc(&g_hashmap_pool);
+    map->root = root;
+    map->len = len;
+    if (root) REFC_INC(root->refc);
+    _LispDatum_init(&map->super, &hashmap_methods);
+    return map;
+}
+
+LispType HashMap_type() {
+    return HASHMAP;
+}
+
+void HashMap_free(HashMap *map) {
+    HamtNode_rls_free(map->root);
+    Pool_free(&g_hashmap_pool, map);
+}
+
+bool HashMap_eq(const HashMap *a, const HashMap *b) {
+    if (a == b || a->root == b->root) return true;
+    if (a->len != b->len) return false;
+    return hamt_issubset(a->root, b);
+}
+
+unsigned int HashMap_hash(const HashMap *map) {
+    return map->root ? hash_combine(HASH_SEED_HASHMAP, hamt_hash(map->root)) : HASH_SEED_HASHMAP;
+}
+
+char *HashMap_typename(const HashMap *map) {
+    return dyn_strcpy("HashMap");
+}
+
+HashMap *HashMap_copy(const HashMap *map) {
+    return HashMap_of(map->root, map->len);
+}
+
+HashMap *HashMap_new() {
+    return HashMap_of(NULL, 0);
+}
+
+size_t HashMap_len(const HashMap *map) {
+    return map->len;
+}
+
+bool HashMap_isempty(const HashMap *map) {
+    return map->len == 0;
+}
+
+LispDatum *HashMap_get(const HashMap *map, const LispDatum *key) {
+    const struct HamtEntry *entry = hamt_find(map->root, LispDatum_hash(key), key);
+    return entry ? entry->u.val : NULL;
+}
+
+void HashMap_put(HashMap *map, LispDatum *key, LispDatum *val) {
+    struct HamtEntry pair = { .key = key, .u.val = val, .hash = LispDatum_hash(key) };
+    bool added;
+    struct HamtNode *root = hamt_assoc(map->root, 0, &pair, &added);
+    REFC_INC(root->refc);
+    HamtNode_rls_free(map->root);
+    map->root = root;
+    if (added) map->len++;
+}
+
+HashMap *HashMap_assoc_new(const HashMap *map, LispDatum *key, LispDatum *val) {
+    struct HamtEntry pair = { .key = key, .u.val = val, .hash = LispDatum_hash(key) };
+    bool added;
+    struct HamtNode *root = hamt_assoc(map->root, 0, &pair, &added);
+    return HashMap_of(root, map->len + added);
+}
+
+HashMap *HashMap_dissoc_new(const HashMap *map, const LispDatum *key) {
+    if (map->root == NULL)
+        return HashMap_new();
+
+    struct HamtNode *root = hamt_dissoc(map->root, 0, LispDatum_hash(key), key);
+    if (root == map->root)
+        return HashMap_of(root, map->len);
+    return HashMap_of(root, map->len - 1);
+}
+
+void HashMap_clear(HashMap *map) {
+    struct HamtNode *root = map->root;
+    map->root = NULL;
+    map->len = 0;
+    HamtNode_rls_free(root);
+}
+
+void HashMap_foreach(const HashMap *map, hashmap_visit_ft visit, void *data) {
+    if (map->root)
+        hamt_foreach(map->root, visit, data);
+}
+
+// -----------------------------------------------------------------------------
+// Number < LispDatum
+
+static const DtmMethods number_methods = {
+    .type = (dtm_type_ft) Number_type,
+    .free = (dtm_free_ft) Number_free,
+    .eq = (dtm_eq_ft) Number_eq,
+    .hash = (dtm_hash_ft) Number_hash,
+    .typename = (dtm_typename_ft) Number_typename,
+    .copy = (dtm_copy_ft) Number_copy,
+    .own = LispDatum_own_dflt,
+    .rls = LispDatum_rls_dflt
+};
+
+static Number *Number_alloc()
+{
+    Number *num = malloc(sizeof(Number));
+    num->isfloat = false;
+    num->flt = 0;
+    num->big = (BigInt) { 0 };
+    _LispDatum_init(&num->super, &number_methods);
+    return num;
+}
+
+// adopts the result of a bignum operation, which is demoted to a fixnum if it fits
+static Number *Number_frombig(BigInt *big)
+{
+    int64_t val;
+    if (BigInt_toi64(big, &val) && val >= FIXNUM_MIN && val <= FIXNUM_MAX) {
+        BigInt_free(big);
+        return FIXNUM_MAKE(val);
+    }
+
+    Number *num = Number_alloc();
+    num->big = *big;
+    return num;
+}
+
+Number *Number_new(int64_t val)
+{
+    if (val >= FIXNUM_MIN && val <= FIXNUM_MAX)
+        return FIXNUM_MAKE(val);
+
+    Number *num = Number_alloc();
+    BigInt_init_i64(&num->big, val);
+    return num;
+}
+
+Number *Number_newf(double val)
+{
+    Number *num = Number_alloc();
+    num->isfloat = true;
+    num->flt = val;
+    return num;
+}
+
+Number *Number_parse(const char *s, const char *end)
+{
+    const char *p = s;
+    bool neg = p < end && *p == '-';
+    if (neg) p++;
+
+    const char *digits = p;
+    while (p < end && isdigit(*p))
+        p++;
+    size_t ndigits = p - digits;
+
+    bool isfloat = false;
+    if (p < end && *p == '.') {
+        isfloat = true;
+        for (p++; p < end && isdigit(*p); p++);
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        if (e < end && (*e == '-' || *e == '+')) e++;
+        if (e < end && isdigit(*e)) {
+            isfloat = true;
+            for (p = e; p < end && isdigit(*p); p++);
+        }
+    }
+
+    if (isfloat) {
+        // strtod needs a null-terminated string
+        char buf[64];
+        size_t len = p - s;
+        char *str = len < sizeof(buf) ? buf : malloc(len + 1);
+        memcpy(str, s, len);
+        str[len] = 0;
+        Number *num = Number_newf(strtod(str, NULL));
+        if (str != buf) free(str);
+        return num;
+    }
+
+    // up to 18 digits always fit in 63 bits
+    if (ndigits <= 18) {
+        int64_t val = 0;
+        for (size_t i = 0; i < ndigits; i++)
+            val = val * 10 + (digits[i] - '0');
+        return Number_new(neg ? -val : val);
+    }
+
+    BigInt big;
+    BigInt_init_digits(&big, digits, ndigits);
+    big.neg = neg;
+    return Number_frombig(&big);
 }
 
 // generic method implementations
@@ -552,13 +1536,28 @@ LispType Number_type()
 
 void Number_free(Number *num)
 {
-    _LispDatum_free(num->super);
+    if (IS_FIXNUM(num)) return;
+    if (!num->isfloat)
+        BigInt_free(&num->big);
     free(num);
 }
 
 bool Number_eq(const Number *a, const Number *b)
 {
-    return a->val == b->val;
+    // (= 1 1.0) holds, a float NaN isn't equal to anything
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_tod(a) == Number_tod(b);
+    return Number_cmp(a, b) == 0;
+}
+
+unsigned int Number_hash(const Number *num)
+{
+    // equal numbers (e.g., 1 and 1.0) convert to the same double, 0.0 is added so
+    // that -0.0 turns into 0.0
+    double d = Number_tod(num) + 0.0;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return hash_u64(bits);
 }
 
 char *Number_typename(const Number *num)
@@ -573,71 +1572,178 @@ Number *Number_copy(const Number *num)
 
 Number *Number_true_copy(const Number *num)
 {
-    return Number_new(num->val);
+    if (IS_FIXNUM(num))
+        return (Number*) num;
+    if (num->isfloat)
+        return Number_newf(num->flt);
+
+    Number *copy = Number_alloc();
+    BigInt_copy(&copy->big, &num->big);
+    return copy;
 }
 
 // Number-specific methods
-void Number_add(Number *a, const Number *b)
+bool Number_isfixnum(const Number *num)
 {
-    a->val += b->val;
+    return IS_FIXNUM(num);
 }
 
-void Number_sub(Number *a, const Number *b)
+bool Number_isfloat(const Number *num)
 {
-    a->val -= b->val;
+    return !IS_FIXNUM(num) && num->isfloat;
 }
 
-void Number_div(Number *a, const Number *b)
+// the value of an integer as a bignum, a fixnum is viewed through buf
+static const BigInt *Number_big(const Number *num, BigInt *view, limb_t buf[2])
 {
-    a->val /= b->val;
+    if (IS_FIXNUM(num)) {
+        BigInt_view_i64(view, FIXNUM_VAL(num), buf);
+        return view;
+    }
+    return &num->big;
 }
 
-void Number_mul(Number *a, const Number *b)
+// declares BigInt operands x and y of integers a and b
+#define BIG_OPERANDS(a, b) \
+    limb_t _xbuf[2], _ybuf[2]; \
+    BigInt _xview, _yview; \
+    const BigInt *x = Number_big(a, &_xview, _xbuf); \
+    const BigInt *y = Number_big(b, &_yview, _ybuf);
+
+// Fixnums are 63-bit, so sums and differences of 2 of them never overflow int64_t.
+Number *Number_add(const Number *a, const Number *b)
 {
-    a->val *= b->val;
+    if (IS_FIXNUM(a) && IS_FIXNUM(b))
+        return Number_new(FIXNUM_VAL(a) + FIXNUM_VAL(b));
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_newf(Number_tod(a) + Number_tod(b));
+
+    BIG_OPERANDS(a, b);
+    BigInt r;
+    BigInt_add(&r, x, y);
+    return Number_frombig(&r);
 }
 
-int Number_cmp(const Number *a, const Number *b)
+Number *Number_sub(const Number *a, const Number *b)
 {
-    int64_t d = a->val - b->val;
-    return d ? (d > 0 ? 1 : -1) : 0;
+    if (IS_FIXNUM(a) && IS_FIXNUM(b))
+        return Number_new(FIXNUM_VAL(a) - FIXNUM_VAL(b));
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_newf(Number_tod(a) - Number_tod(b));
+
+    BIG_OPERANDS(a, b);
+    BigInt r;
+    BigInt_sub(&r, x, y);
+    return Number_frombig(&r);
 }
 
-int Number_cmpl(const Number *a, long l)
+Number *Number_mul(const Number *a, const Number *b)
 {
-    long d = a->val - l;
-    return d ? (d > 0 ? 1 : -1) : 0;
+    int64_t val;
+    if (IS_FIXNUM(a) && IS_FIXNUM(b)
+            && !__builtin_mul_overflow(FIXNUM_VAL(a), FIXNUM_VAL(b), &val))
+        return Number_new(val);
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_newf(Number_tod(a) * Number_tod(b));
+
+    BIG_OPERANDS(a, b);
+    BigInt r;
+    BigInt_mul(&r, x, y);
+    return Number_frombig(&r);
+}
+
+Number *Number_div(const Number *a, const Number *b)
+{
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_newf(Number_tod(a) / Number_tod(b));
+    if (IS_FIXNUM(b) && FIXNUM_VAL(b) == 0)
+        return NULL;
+    if (IS_FIXNUM(a) && IS_FIXNUM(b))
+        return Number_new(FIXNUM_VAL(a) / FIXNUM_VAL(b));
+
+    BIG_OPERANDS(a, b);
+    BigInt q;
+    BigInt_divmod(&q, NULL, x, y);
+    return Number_frombig(&q);
+}
+
+Number *Number_mod(const Number *a, const Number *b)
+{
+    if (Number_isfloat(a) || Number_isfloat(b))
+        return Number_newf(fmod(Number_tod(a), Number_tod(b)));
+    if (IS_FIXNUM(b) && FIXNUM_VAL(b) == 0)
+        return NULL;
+    if (IS_FIXNUM(a) && IS_FIXNUM(b))
+        return Number_new(FIXNUM_VAL(a) % FIXNUM_VAL(b));
+
+    BIG_OPERANDS(a, b);
+    BigInt m;
+    BigInt_divmod(NULL, &m, x, y);
+    return Number_frombig(&m);
+}
+
+int Number_cmp(const Number *a, const Number *b)
+{
+    if (IS_FIXNUM(a) && IS_FIXNUM(b)) {
+        int64_t va = FIXNUM_VAL(a), vb = FIXNUM_VAL(b);
+        return va == vb ? 0 : (va > vb ? 1 : -1);
+    }
+    if (Number_isfloat(a) || Number_isfloat(b)) {
+        double va = Number_tod(a), vb = Number_tod(b);
+        return va == vb ? 0 : (va > vb ? 1 : -1);
+    }
+
+    BIG_OPERANDS(a, b);
+    return BigInt_cmp(x, y);
 }
 
-void Number_mod(Number *a, const Number *b)
+int Number_cmpl(const Number *a, long l)
 {
-    a->val %= b->val;
+    if (IS_FIXNUM(a)) {
+        int64_t va = FIXNUM_VAL(a);
+        return va == l ? 0 : (va > l ? 1 : -1);
+    }
+    if (a->isfloat)
+        return a->flt == l ? 0 : (a->flt > l ? 1 : -1);
+
+    limb_t buf[2];
+    BigInt view;
+    BigInt_view_i64(&view, l, buf);
+    return BigInt_cmp(&a->big, &view);
 }
 
 bool Number_isneg(const Number *num)
 {
-    return num->val < 0;
+    if (IS_FIXNUM(num)) return FIXNUM_VAL(num) < 0;
+    return num->isfloat ? num->flt < 0 : num->big.neg;
 }
 
 bool Number_iseven(const Number *num)
 {
-    return !(num->val & 1);
+    if (IS_FIXNUM(num)) return !(FIXNUM_VAL(num) & 1);
+    return num->isfloat ? fmod(num->flt, 2) == 0 : BigInt_iseven(&num->big);
 }
 
 long Number_tol(const Number *num)
 {
-    return num->val;
+    if (IS_FIXNUM(num))
+        return FIXNUM_VAL(num);
+    if (num->isfloat) {
+        double d = num->flt;
+        if (d != d) return 0; // NaN
+        return d >= (double) LONG_MAX ? LONG_MAX : (d <= (double) LONG_MIN ? LONG_MIN : (long) d);
+    }
+
+    int64_t val;
+    if (BigInt_toi64(&num->big, &val) && val >= LONG_MIN && val <= LONG_MAX)
+        return val;
+    return num->big.neg ? LONG_MIN : LONG_MAX;
 }
 
-size_t Number_len(const Number *num)
+double Number_tod(const Number *num)
 {
-    size_t sz = 0;
-    int64_t val = num->val;
-    while (val != 0) {
-        val /= 10;
-        sz++;
-    }
-    return sz;
+    if (IS_FIXNUM(num)) return (double) FIXNUM_VAL(num);
+    return num->isfloat ? num->flt : BigInt_tod(&num->big);
 }
 
 static char *_Number_val_tos(int64_t val, char *dst)
@@ -667,14 +1773,44 @@ static char *_Number_val_tos(int64_t val, char *dst)
     return dst;
 }
 
+// the shortest of 15 to 17 significant digits that reads back as the same value,
+// with a ".0" appended if it would read back as an integer
+static void _Number_flt_tos(double val, char *dst)
+{
+    if (isnan(val)) {
+        strcpy(dst, "nan");
+        return;
+    }
+    if (isinf(val)) {
+        strcpy(dst, val < 0 ? "-inf" : "inf");
+        return;
+    }
+
+    for (int prec = 15; prec <= 17; prec++) {
+        snprintf(dst, NUMBER_SPRINT_MAX - 2, "%.*g", prec, val);
+        if (strtod(dst, NULL) == val) break;
+    }
+    if (strpbrk(dst, ".e") == NULL)
+        strcat(dst, ".0");
+}
+
 char *Number_sprint(const Number *num, char *dst)
 {
-    return _Number_val_tos(num->val, dst);
+    if (IS_FIXNUM(num))
+        _Number_val_tos(FIXNUM_VAL(num), dst);
+    else if (num->isfloat)
+        _Number_flt_tos(num->flt, dst);
+    else
+        return NULL;
+    return dst;
 }
 
 char *Number_tostr(const Number *num)
 {
-    char *s = malloc(Number_len(num) + 1);
+    if (!IS_FIXNUM(num) && !num->isfloat)
+        return BigInt_tostr(&num->big);
+
+    char *s = malloc(NUMBER_SPRINT_MAX);
     Number_sprint(num, s);
     return s;
 }
@@ -682,6 +1818,51 @@ char *Number_tostr(const Number *num)
 // -----------------------------------------------------------------------------
 // String < LispDatum
 
+// A buffer holds the characters in its claimed range [0, hi), followed by a
+// null-byte, the rest of it is free. Strings are immutable views of a range of
+// a buffer, so substrings share the buffer of the original string, and a string
+// that ends at the end of the claimed range can be appended to by claiming the
+// free space right past it. It's freed once no string views it.
+struct StrBuf {
+    long refc; // number of strings viewing this buffer
+    size_t cap; // including the null-byte
+    size_t hi;
+    char *chars;
+};
+
+#define STRBUF_MIN_CAP 16
+
+// a new buffer that takes ownership of chars, which holds len characters
+// followed by a null-byte and has room for cap characters in total
+static struct StrBuf *StrBuf_from(char *chars, size_t len, size_t cap)
+{
+    struct StrBuf *buf = malloc(sizeof(struct StrBuf));
+    buf->refc = 0;
+    buf->cap = cap;
+    buf->hi = len;
+    buf->chars = chars;
+    return buf;
+}
+
+// a new buffer with a copy of the given characters and room for extra more
+static struct StrBuf *StrBuf_new(const char *s, size_t len, size_t extra)
+{
+    size_t cap = len + extra + 1;
+    if (cap < STRBUF_MIN_CAP) cap = STRBUF_MIN_CAP;
+    char *chars = malloc(cap);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    return StrBuf_from(chars, len, cap);
+}
+
+static void StrBuf_rls_free(struct StrBuf *buf)
+{
+    if (REFC_DEC(buf->refc) > 0) return;
+
+    free(buf->chars);
+    free(buf);
+}
+
 // generic method implementations
 LispType String_type()
 {
@@ -690,14 +1871,18 @@ LispType String_type()
 
 void String_free(String *string)
 {
-    free(string->str);
-    _LispDatum_free(string->super);
+    StrBuf_rls_free(string->buf);
     free(string);
 }
 
 bool String_eq(const String *a, const String *b)
 {
-    return strcmp(a->str, b->str) == 0;
+    return a->len == b->len && memcmp(String_chars(a), String_chars(b), a->len) == 0;
+}
+
+unsigned int String_hash(const String *string)
+{
+    return hash_strn(String_chars(string), string->len);
 }
 
 char *String_typename(const String *string)
@@ -707,16 +1892,17 @@ char *String_typename(const String *string)
 
 String *String_copy(const String *string)
 {
-    return String_new(string->str);
+    return String_newn(String_chars(string), string->len);
 }
 
-// String methods
-String *String_new(const char *s)
+// a new string of the range [off, off + len) of the given buffer
+static String *String_view(struct StrBuf *buf, size_t off, size_t len)
 {
     static const DtmMethods string_methods = {
         .type = (dtm_type_ft) String_type,
         .free = (dtm_free_ft) String_free,
         .eq = (dtm_eq_ft) String_eq,
+        .hash = (dtm_hash_ft) String_hash,
         .typename = (dtm_typename_ft) String_typename,
         .copy = (dtm_copy_ft) String_copy,
         .own = LispDatum_own_dflt,
@@ -724,14 +1910,94 @@ String *String_new(const char *s)
     };
 
     String *str = malloc(sizeof(String));
-    str->str = dyn_strcpy(s);
-    str->super = _LispDatum_new(&string_methods);
+    str->buf = buf;
+    str->off = off;
+    str->len = len;
+    REFC_INC(buf->refc);
+    _LispDatum_init(&str->super, &string_methods);
     return str;
 }
 
+// String methods
+String *String_new(const char *s)
+{
+    return String_newn(s, strlen(s));
+}
+
+String *String_newn(const char *s, size_t len)
+{
+    return String_view(StrBuf_new(s, len, 0), 0, len);
+}
+
+String *String_from(char *s, size_t len, size_t cap)
+{
+    return String_view(StrBuf_from(s, len, cap), 0, len);
+}
+
+size_t String_len(const String *string)
+{
+    return string->len;
+}
+
+const char *String_chars(const String *string)
+{
+    return string->buf->chars + string->off;
+}
+
 char *String_str(const String *string)
 {
-    return string->str;
+    struct StrBuf *buf = string->buf;
+    if (buf->chars[string->off + string->len] != '\0') {
+        if (g_threaded) {
+            // other threads might be reading the string, so a copy is returned
+            // instead, which lives until the end of the parallel section
+            char *copy = dyn_strncpy(String_chars(string), string->len);
+            thread_defer(free, copy);
+            return copy;
+        }
+        // a view that isn't followed by the null-byte gets a buffer of its own
+        String *mut = (String*) string;
+        mut->buf = StrBuf_new(String_chars(string), string->len, 0);
+        REFC_INC(mut->buf->refc);
+        mut->off = 0;
+        StrBuf_rls_free(buf);
+        buf = mut->buf;
+    }
+    return buf->chars + string->off;
+}
+
+String *String_append_new(const String *string, const char *s, size_t n)
+{
+    struct StrBuf *buf = string->buf;
+    size_t end = string->off + string->len;
+
+    // claim the free space right past the end, which threads of a parallel
+    // section don't do, since the null-byte of one would overwrite the
+    // characters of another
+    if (!g_threaded && end == buf->hi && buf->hi + n < buf->cap) {
+        memcpy(buf->chars + buf->hi, s, n);
+        buf->hi += n;
+        buf->chars[buf->hi] = '\0';
+        return String_view(buf, string->off, string->len + n);
+    }
+
+    // the new buffer has room to grow, so that repeated appends take amortised
+    // linear time
+    buf = StrBuf_new(String_chars(string), string->len, string->len + n * 2);
+    memcpy(buf->chars + buf->hi, s, n);
+    buf->hi += n;
+    buf->chars[buf->hi] = '\0';
+    return String_view(buf, 0, string->len + n);
+}
+
+String *String_substr_new(const String *string, size_t start, size_t len)
+{
+    if (start > string->len || len > string->len - start) {
+        DEBUG("bad range [%zu, %zu) of string of length %zu", start, start + len, string->len);
+        return NULL;
+    }
+
+    return String_view(string->buf, string->off + start, len);
 }
 
 
@@ -761,6 +2027,11 @@ bool Nil_eq(const Nil *a, const Nil *b)
     return true;
 }
 
+unsigned int Nil_hash(const Nil *nil)
+{
+    return hash_u64(NIL);
+}
+
 char *Nil_typename(const Nil *nil)
 {
     return dyn_strcpy("Nil");
@@ -771,29 +2042,21 @@ Nil *Nil_copy(const Nil *nil)
     return (Nil*) nil;
 }
 
+static const DtmMethods nil_methods = {
+    .type = (dtm_type_ft) Nil_type,
+    .free = (dtm_free_ft) Nil_free,
+    .eq = (dtm_eq_ft) Nil_eq,
+    .hash = (dtm_hash_ft) Nil_hash,
+    .typename = (dtm_typename_ft) Nil_typename,
+    .copy = (dtm_copy_ft) Nil_copy,
+    .own = LispDatum_noown,
+    .rls = LispDatum_norls
+};
+
 // Nil methods
 const Nil *Nil_get()
 {
-    static const DtmMethods nil_methods = {
-        .type = (dtm_type_ft) Nil_type,
-        .free = (dtm_free_ft) Nil_free,
-        .eq = (dtm_eq_ft) Nil_eq,
-        .typename = (dtm_typename_ft) Nil_typename,
-        .copy = (dtm_copy_ft) Nil_copy,
-        .own = LispDatum_noown,
-        .rls = LispDatum_norls
-    };
-
-    static const _LispDatum super = {
-        .methods = &nil_methods,
-        .refc = 1
-    };
-
-    static const Nil nil = {
-        .super = (_LispDatum*) &super
-    };
-
-    return &nil;
+    return SINGLETON_MAKE(NIL);
 }
 
 // -----------------------------------------------------------------------------
@@ -815,6 +2078,11 @@ bool False_eq(const False *a, const False *b)
     return true;
 }
 
+unsigned int False_hash(const False *fls)
+{
+    return hash_u64(FALSE);
+}
+
 char *False_typename(const False *fls)
 {
     return dyn_strcpy("False");
@@ -825,29 +2093,21 @@ False *False_copy(const False *fls)
     return (False*) fls;
 }
 
+static const DtmMethods false_methods = {
+    .type = (dtm_type_ft) False_type,
+    .free = (dtm_free_ft) False_free,
+    .eq = (dtm_eq_ft) False_eq,
+    .hash = (dtm_hash_ft) False_hash,
+    .typename = (dtm_typename_ft) False_typename,
+    .copy = (dtm_copy_ft) False_copy,
+    .own = LispDatum_noown,
+    .rls = LispDatum_norls
+};
+
 // False methods
 const False *False_get()
 {
-    static const DtmMethods false_methods = {
-        .type = (dtm_type_ft) False_type,
-        .free = (dtm_free_ft) False_free,
-        .eq = (dtm_eq_ft) False_eq,
-        .typename = (dtm_typename_ft) False_typename,
-        .copy = (dtm_copy_ft) False_copy,
-        .own = LispDatum_noown,
-        .rls = LispDatum_norls
-    };
-
-    static const _LispDatum super = {
-        .methods = &false_methods,
-        .refc = 1
-    };
-
-    static const False fls = {
-        .super = (_LispDatum*) &super
-    };
-
-    return &fls;
+    return SINGLETON_MAKE(FALSE);
 }
 
 // -----------------------------------------------------------------------------
@@ -869,6 +2129,11 @@ bool True_eq(const True *a, const True *b)
     return true;
 }
 
+unsigned int True_hash(const True *tru)
+{
+    return hash_u64(TRUE);
+}
+
 char *True_typename(const True *tru)
 {
     return dyn_strcpy("True");
@@ -879,29 +2144,21 @@ True *True_copy(const True *tru)
     return (True*) tru;
 }
 
+static const DtmMethods true_methods = {
+    .type = (dtm_type_ft) True_type,
+    .free = (dtm_free_ft) True_free,
+    .eq = (dtm_eq_ft) True_eq,
+    .hash = (dtm_hash_ft) True_hash,
+    .typename = (dtm_typename_ft) True_typename,
+    .copy = (dtm_copy_ft) True_copy,
+    .own = LispDatum_noown,
+    .rls = LispDatum_norls
+};
+
 // True methods
 const True *True_get()
 {
-    static const DtmMethods true_methods = {
-        .type = (dtm_type_ft) True_type,
-        .free = (dtm_free_ft) True_free,
-        .eq = (dtm_eq_ft) True_eq,
-        .typename = (dtm_typename_ft) True_typename,
-        .copy = (dtm_copy_ft) True_copy,
-        .own = LispDatum_noown,
-        .rls = LispDatum_norls
-    };
-
-    static const _LispDatum super = {
-        .methods = &true_methods,
-        .refc = 1
-    };
-
-    static const True tru = {
-        .super = (_LispDatum*) &super
-    };
-
-    return &tru;
+    return SINGLETON_MAKE(TRUE);
 }
 
 const LispDatum *LispDatum_bool(bool b)
@@ -925,24 +2182,44 @@ void Proc_free(Proc *proc)
         Arr_freep(proc->params, (free_t) LispDatum_rls_free);
         // free body
         List_free(proc->logic.body);
+        Code_rls_free(proc->code);
     }
 
     if (proc->name) 
         LispDatum_rls_free((LispDatum*) proc->name);
 
-    MalEnv_release(proc->env);
-    MalEnv_free(proc->env);
-
-    _LispDatum_free(proc->super);
+    if (proc->env) {
+        MalEnv_release(proc->env);
+        MalEnv_free(proc->env);
+    }
 
     free(proc);
 }
 
+void Proc_clear(Proc *proc)
+{
+    if (proc->builtin) return;
+
+    List *body = proc->logic.body;
+    proc->logic.body = NULL;
+    LispDatum_rls_free((LispDatum*) body);
+
+    MalEnv *env = proc->env;
+    proc->env = NULL;
+    if (env)
+        MalEnv_rls_free(env);
+}
+
 bool Proc_eq(const Proc *a, const Proc *b)
 {
     return a == b;
 }
 
+unsigned int Proc_hash(const Proc *proc)
+{
+    return hash_u64((uintptr_t) proc);
+}
+
 char *Proc_typename(const Proc *proc)
 {
     return dyn_strcpy("Procedure");
@@ -960,6 +2237,7 @@ static const DtmMethods Proc_methods = {
     .type = (dtm_type_ft) Proc_type,
     .free = (dtm_free_ft) Proc_free,
     .eq = (dtm_eq_ft) Proc_eq,
+    .hash = (dtm_hash_ft) Proc_hash,
     .typename = (dtm_typename_ft) Proc_typename,
     .copy = (dtm_copy_ft) Proc_copy,
     .own = LispDatum_own_dflt,
@@ -988,6 +2266,8 @@ Proc *Proc_new(
 
     proc->builtin = false;
     proc->macro = false;
+    proc->pure = false;
+    proc->functional = false;
 
     proc->logic.body = body;
     LispDatum_own((LispDatum*) body);
@@ -995,7 +2275,9 @@ Proc *Proc_new(
     proc->env = env;
     MalEnv_own(env);
 
-    proc->super = _LispDatum_new(&Proc_methods);
+    proc->code = NULL;
+
+    _LispDatum_init(&proc->super, &Proc_methods);
 
     return proc;
 }
@@ -1022,12 +2304,15 @@ Proc *Proc_builtin(Symbol *name, int argc, bool variadic, const builtin_apply_t
     proc->variadic = variadic;
     proc->builtin = true;
     proc->macro = false;
+    proc->pure = false;
+    proc->functional = false;
 
     proc->logic.apply = apply;
 
     proc->env = NULL;
+    proc->code = NULL;
 
-    proc->super = _LispDatum_new(&Proc_methods);
+    _LispDatum_init(&proc->super, &Proc_methods);
 
     return proc;
 }
@@ -1063,6 +2348,16 @@ bool Proc_isbuiltin(const Proc *proc)
     return proc->builtin;
 }
 
+bool Proc_ispure(const Proc *proc)
+{
+    return proc->pure;
+}
+
+bool Proc_isfunctional(const Proc *proc)
+{
+    return proc->functional;
+}
+
 int Proc_argc(const Proc *proc)
 {
     return proc->argc;
@@ -1082,6 +2377,24 @@ void Proc_set_macro(Proc *proc)
     proc->macro = true;
 }
 
+void Proc_set_pure(Proc *proc)
+{
+    proc->pure = true;
+    proc->functional = true;
+}
+
+void Proc_set_functional(Proc *proc)
+{
+    proc->functional = true;
+}
+
+void Proc_set_code(Proc *proc, struct Code *code)
+{
+    Code_own(code);
+    Code_rls_free(proc->code);
+    proc->code = code;
+}
+
 
 // -----------------------------------------------------------------------------
 // Atom < LispDatum
@@ -1094,17 +2407,33 @@ LispType Atom_type()
 
 void Atom_free(Atom *atom)
 {
+    if (!gc_untrack_atom(atom)) {
+        thread_defer((free_t) Atom_free, atom);
+        return;
+    }
     LispDatum_rls_free(atom->dtm);
-    _LispDatum_free(atom->super);
     free(atom);
 }
 
+void Atom_clear(Atom *atom)
+{
+    LispDatum *dtm = atom->dtm;
+    atom->dtm = (LispDatum*) Nil_get();
+    LispDatum_rls_free(dtm);
+}
+
 // 2 Atoms are equal only if they point to the same value
 bool Atom_eq(const Atom *a, const Atom *b)
 {
     return a->dtm == b->dtm;
 }
 
+// consistent with Atom_eq, thus it changes when the atom is reset
+unsigned int Atom_hash(const Atom *atom)
+{
+    return hash_u64((uintptr_t) atom->dtm);
+}
+
 char *Atom_typename(const Atom *atom)
 {
     return dyn_strcpy("Atom");
@@ -1122,6 +2451,7 @@ Atom *Atom_new(LispDatum *dtm)
         .type = (dtm_type_ft) Atom_type,
         .free = (dtm_free_ft) Atom_free,
         .eq = (dtm_eq_ft) Atom_eq,
+        .hash = (dtm_hash_ft) Atom_hash,
         .typename = (dtm_typename_ft) Atom_typename,
         .copy = (dtm_copy_ft) Atom_copy,
         .own = LispDatum_own_dflt,
@@ -1131,8 +2461,9 @@ Atom *Atom_new(LispDatum *dtm)
     Atom *atom = malloc(sizeof(Atom));
     atom->dtm = dtm;
     LispDatum_own(dtm);
+    gc_track_atom(atom);
 
-    atom->super = _LispDatum_new(&atom_methods);
+    _LispDatum_init(&atom->super, &atom_methods);
 
     return atom;
 }
@@ -1141,14 +2472,147 @@ void Atom_set(Atom *atom, LispDatum *dtm)
 {
     if (atom->dtm == dtm) return;
 
+    if (g_threaded) {
+        // other threads might still be using the old value, a reference that
+        // Atom_deref doesn't own
+        LispDatum_own(dtm);
+        LispDatum *old = __atomic_exchange_n(&atom->dtm, dtm, __ATOMIC_ACQ_REL);
+        thread_defer((free_t) LispDatum_rls_free, old);
+        return;
+    }
+
     LispDatum_rls_free(atom->dtm);
     atom->dtm = dtm;
     LispDatum_own(dtm);
 }
 
+bool Atom_compare_set(Atom *atom, LispDatum *expected, LispDatum *dtm)
+{
+    if (!g_threaded) {
+        if (atom->dtm != expected) return false;
+        Atom_set(atom, dtm);
+        return true;
+    }
+
+    LispDatum_own(dtm);
+    if (!__atomic_compare_exchange_n(&atom->dtm, &expected, dtm,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        LispDatum_rls(dtm);
+        return false;
+    }
+    thread_defer((free_t) LispDatum_rls_free, expected);
+    return true;
+}
+
 LispDatum *Atom_deref(const Atom *atom)
 {
-    return atom->dtm;
+    return __atomic_load_n(&atom->dtm, __ATOMIC_ACQUIRE);
+}
+
+
+// -----------------------------------------------------------------------------
+// LazySeq < LispDatum
+
+// generic method implementations
+LispType LazySeq_type()
+{
+    return LAZYSEQ;
+}
+
+void LazySeq_free(LazySeq *seq)
+{
+    LazySeq_clear(seq);
+    free(seq);
+}
+
+void LazySeq_clear(LazySeq *seq)
+{
+    LispDatum *refs[] = {
+        seq->src, (LispDatum*) seq->proc,
+        (LispDatum*) seq->start, (LispDatum*) seq->end, (LispDatum*) seq->step
+    };
+    seq->src = NULL;
+    seq->proc = NULL;
+    seq->start = seq->end = seq->step = NULL;
+    for (size_t i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+        if (refs[i])
+            LispDatum_rls_free(refs[i]);
+    }
+}
+
+bool LazySeq_eq(const LazySeq *a, const LazySeq *b)
+{
+    return a == b;
+}
+
+unsigned int LazySeq_hash(const LazySeq *seq)
+{
+    return hash_u64((uintptr_t) seq);
+}
+
+char *LazySeq_typename(const LazySeq *seq)
+{
+    return dyn_strcpy("LazySeq");
+}
+
+LazySeq *LazySeq_copy(const LazySeq *seq)
+{
+    return (LazySeq*) seq;
+}
+
+// LazySeq methods
+
+// owns the datums it's given, any of which may be NULL
+static LazySeq *LazySeq_of(SeqKind kind, LispDatum *src, Proc *proc,
+        Number *start, Number *end, Number *step)
+{
+    static const DtmMethods lazyseq_methods = {
+        .type = (dtm_type_ft) LazySeq_type,
+        .free = (dtm_free_ft) LazySeq_free,
+        .eq = (dtm_eq_ft) LazySeq_eq,
+        .hash = (dtm_hash_ft) LazySeq_hash,
+        .typename = (dtm_typename_ft) LazySeq_typename,
+        .copy = (dtm_copy_ft) LazySeq_copy,
+        .own = LispDatum_own_dflt,
+        .rls = LispDatum_rls_dflt
+    };
+
+    LazySeq *seq = malloc(sizeof(LazySeq));
+    seq->kind = kind;
+    seq->src = src;
+    seq->proc = proc;
+    seq->start = start;
+    seq->end = end;
+    seq->step = step;
+    if (src) LispDatum_own(src);
+    if (proc) LispDatum_own((LispDatum*) proc);
+    if (start) LispDatum_own((LispDatum*) start);
+    if (end) LispDatum_own((LispDatum*) end);
+    if (step) LispDatum_own((LispDatum*) step);
+
+    _LispDatum_init(&seq->super, &lazyseq_methods);
+
+    return seq;
+}
+
+LazySeq *LazySeq_range(Number *start, Number *end, Number *step)
+{
+    return LazySeq_of(SEQ_RANGE, NULL, NULL, start, end, step);
+}
+
+LazySeq *LazySeq_lines(String *path)
+{
+    return LazySeq_of(SEQ_LINES, (LispDatum*) path, NULL, NULL, NULL, NULL);
+}
+
+LazySeq *LazySeq_map(Proc *proc, LispDatum *src)
+{
+    return LazySeq_of(SEQ_MAP, src, proc, NULL, NULL, NULL);
+}
+
+LazySeq *LazySeq_filter(Proc *pred, LispDatum *src)
+{
+    return LazySeq_of(SEQ_FILTER, src, pred, NULL, NULL, NULL);
 }
 
 
@@ -1159,6 +2623,7 @@ static const DtmMethods exception_methods = {
     .type = (dtm_type_ft) Exception_type,
     .free = (dtm_free_ft) Exception_free,
     .eq = (dtm_eq_ft) Exception_eq,
+    .hash = (dtm_hash_ft) Exception_hash,
     .typename = (dtm_typename_ft) Exception_typename,
     .copy = (dtm_copy_ft) Exception_copy,
     .own = LispDatum_own_dflt,
@@ -1174,7 +2639,6 @@ LispType Exception_type()
 void Exception_free(Exception *exn)
 {
     LispDatum_rls_free(exn->dtm);
-    _LispDatum_free(exn->super);
     free(exn);
 }
 
@@ -1184,6 +2648,11 @@ bool Exception_eq(const Exception *a, const Exception *b)
     return LispDatum_eq(a->dtm, b->dtm);
 }
 
+unsigned int Exception_hash(const Exception *exn)
+{
+    return LispDatum_hash(exn->dtm);
+}
+
 char *Exception_typename(const Exception *exn)
 {
     return dyn_strcpy("Exception");
@@ -1193,8 +2662,9 @@ Exception *Exception_copy(const Exception *exn)
 {
     Exception *copy = malloc(sizeof(Exception));
     copy->dtm = exn->dtm;
+    LispDatum_own(copy->dtm);
 
-    copy->super = _LispDatum_new(&exception_methods);
+    _LispDatum_init(&copy->super, &exception_methods);
 
     return copy;
 }
@@ -1213,18 +2683,14 @@ Exception *Exception_new(const LispDatum *dtm)
     LispDatum_own(dtm_cpy);
     exn->dtm = dtm_cpy;
 
-    exn->super = _LispDatum_new(&exception_methods);
+    _LispDatum_init(&exn->super, &exception_methods);
 
     return exn;
 }
 
-// global last raised exception
-static const _LispDatum g_last_exn_super = {
-    .methods = &exception_methods,
-    .refc = 1
-};
-static Exception g_last_exn = {
-    .super = (_LispDatum*) &g_last_exn_super,
+// last raised exception of this thread
+static __thread Exception g_last_exn = {
+    .super = { .methods = &exception_methods, .refc = 1 },
     .dtm = NULL
 };
 
@@ -1237,18 +2703,24 @@ Exception *thrown_copy()
 }
 
 // we need to know the last thing that happened: error or exception?
-static enum LastFail {
+enum LastFail {
     LF_NONE,
     LF_ERROR,
     LF_EXCEPTION
-} g_lastfail = LF_NONE;
+};
+static __thread enum LastFail g_lastfail = LF_NONE;
+
+const LispDatum *thrown_datum()
+{
+    return g_lastfail == LF_EXCEPTION ? g_last_exn.dtm : NULL;
+}
 
 bool didthrow()
 {
     return g_lastfail == LF_EXCEPTION;
 }
 
-void throw(const char *src, const LispDatum *dtm)
+void rethrow(const LispDatum *dtm)
 {
     g_lastfail = LF_EXCEPTION;
 
@@ -1259,6 +2731,21 @@ void throw(const char *src, const LispDatum *dtm)
     LispDatum *copy = LispDatum_copy(dtm);
     LispDatum_own(copy);
     g_last_exn.dtm = copy;
+}
+
+static __thread bool g_throw_quiet = false;
+
+bool throw_set_quiet(bool quiet)
+{
+    bool prev = g_throw_quiet;
+    g_throw_quiet = quiet;
+    return prev;
+}
+
+void throw(const char *src, const LispDatum *dtm)
+{
+    rethrow(dtm);
+    if (g_throw_quiet) return;
 
     char *s = pr_str(dtm, true);
     if (src != NULL)
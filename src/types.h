@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #include "utils.h"
+#include "gc.h"
+#include "bignum.h"
 
 
 // pre-declare
@@ -13,19 +15,31 @@ typedef struct _LispDatum _LispDatum;
 // LispDatum
 // external view of a polymorphic type;
 // works because pointer to a concrete type is a pointer to its 1st member,
-// which must have type _LispDatum*
-typedef _LispDatum* LispDatum;
+// which must have type _LispDatum (the header is embedded, not pointed to)
+typedef _LispDatum LispDatum;
+
+// Immediate datums: small integers (fixnums) and the singletons nil, true and
+// false are not allocated at all, instead they are encoded in the LispDatum
+// pointer itself (heap datums are aligned, so their low bits are always 0):
+//   fixnum    ...vvvv1  (63-bit signed value)
+//   singleton ...tttt10 (LispType of the singleton)
+// An immediate datum must never be dereferenced; the generic LispDatum_*
+// methods take care of it, and so do the methods of Number, Nil, True, False.
+bool LispDatum_isimm(const LispDatum *);
 
 // datum type identifiers
 typedef enum LispType {
     SYMBOL,
     LIST,
+    VECTOR,
     NUMBER,
     STRING,
     NIL, FALSE, TRUE,
     PROCEDURE,
     ATOM,
     EXCEPTION,
+    HASHMAP,
+    LAZYSEQ,
     TYPE_COUNT
 } LispType;
 
@@ -50,6 +64,10 @@ void LispDatum_free(LispDatum *);
 typedef bool (*dtm_eq_ft)(const LispDatum*, const LispDatum *);
 bool LispDatum_eq(const LispDatum*, const LispDatum *);
 
+// hash consistent with LispDatum_eq: equal datums have equal hashes
+typedef unsigned int (*dtm_hash_ft)(const LispDatum *);
+unsigned int LispDatum_hash(const LispDatum *);
+
 typedef char* (*dtm_typename_ft)(const LispDatum *);
 char *LispDatum_typename(const LispDatum *);
 
@@ -80,6 +98,7 @@ typedef struct {
     dtm_type_ft type;
     dtm_free_ft free;
     dtm_eq_ft eq;
+    dtm_hash_ft hash;
     dtm_typename_ft typename;
     dtm_copy_ft copy;
     dtm_own_ft own;
@@ -98,18 +117,18 @@ long LispDatum_refc(const LispDatum *dtm);
 
 
 // internal super-type;
-// each concrete type must declare its 1st member as a pointer to this type
-// e.g. struct List { _LispDatum *super; ... }
+// each concrete type must declare its 1st member as this type (embedded inline,
+// so that a datum is a single allocation)
+// e.g. struct List { _LispDatum super; ... }
 typedef struct _LispDatum {
     const DtmMethods *methods;
     long refc; // reference count
 } _LispDatum;
 
 // internal
-//static _LispDatum *_LispDatum_new(const DtmMethods *);
+//static void _LispDatum_init(_LispDatum *, const DtmMethods *);
 //static long _LispDatum_refc(const _LispDatum *_dtm);
 // default implementations of ref. management methods
-//static void _LispDatum_free(_LispDatum *);
 //static void _LispDatum_own(_LispDatum *);
 //static void _LispDatum_rls(_LispDatum *);
 
@@ -120,9 +139,21 @@ typedef struct _LispDatum {
 void init_symbol_table();
 void free_symbol_table();
 
+// symbols with a special meaning to the evaluator, which are recognised by
+// their id instead of their name (see Symbol_special)
+typedef enum {
+    SF_NONE = 0,
+    SF_DEF, SF_DEFMACRO, SF_LETSTAR, SF_IF, SF_DO, SF_LAMBDA,
+    SF_QUOTE, SF_QUASIQUOTE, SF_UNQUOTE, SF_SPLICE_UNQUOTE,
+    SF_MACROEXPAND, SF_TRYSTAR, SF_CATCHSTAR, SF_AND, SF_OR,
+    SF_AMPERSAND, // marks the variadic parameter
+} SpecialForm;
+
 typedef struct {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
     char *name;
+    unsigned int hash; // hash of the name, computed once when interned
+    unsigned char special; // SpecialForm
 } Symbol;
 
 // generic method implementations
@@ -134,29 +165,56 @@ Symbol *Symbol_copy(const Symbol *sym);
 
 // Symbol-specific methods
 Symbol* Symbol_intern(const char *name);
+// interns the symbol named by the first len characters of name
+Symbol* Symbol_internn(const char *name, size_t len);
 bool Symbol_eq_str(const Symbol *sym, const char *str);
 const char *Symbol_name(const Symbol *sym);
+unsigned int Symbol_hash(const Symbol *sym);
+SpecialForm Symbol_special(const Symbol *sym);
 
 
 // -----------------------------------------------------------------------------
 // List < LispDatum
 
+// values of Node.slot other than a lexical address
+#define NODE_UNRESOLVED -1  // lexical address was never computed
+#define NODE_UNADDRESSED -2 // value is not a variable with a known lexical address
+
 struct Node {
-    long refc; // reference count
+    int32_t refc; // reference count
+    // lexical address of the variable this node refers to (see mylisp.c)
+    int16_t depth;
+    int16_t slot;
     LispDatum *value;
     struct Node *next;
 };
-typedef struct {
-    /*void*/ _LispDatum *super;
-    size_t len;
+struct Code; // vm.h
+struct GlobalCache; // env.h
+
+// Lists share nodes: cons and rest share the nodes of their argument, appending
+// shares the nodes of the appended list. A node is freed when no list reaches it.
+typedef struct List {
+    _LispDatum super;
+    uint32_t len;
+    bool resolved; // true once lexical addresses of this form were computed
+    // true if the last nodes might be reachable from another list, in which case
+    // they are copied before anything is appended to this one
+    bool shares_tail;
     struct Node *head;
     struct Node *tail;
+    // bytecode of the body if this is a lambda expression that has been evaluated
+    struct Code *code;
+    // (macro expanded-form) if this is a macro call that has been expanded
+    struct List *expansion;
+    // top-level binding of the head if this is an application that has been evaluated
+    struct GlobalCache *head_cache;
 } List;
 
 // generic method implementations
 LispType List_type();
 void List_free(List *list);
 bool List_eq(const List *l1, const List *l2);
+unsigned int List_hash(const List *list);
 char *List_typename(const List *list);
 /* Returns a deep copy of a list: both the nodes and LispDatums they point to are copied. */
 List *List_copy(const List *list);
@@ -176,46 +234,222 @@ List *List_cons_new(List *list, LispDatum *dtm);
 // creates a new list containing the tail of the given list
 List *List_rest_new(List *list);
 
+// appends the elements of src to dst, sharing the nodes of src
 void List_append(List *dst, const List *src);
 
+// In-place updates of a list that nothing else refers to (see vm_unique_arg in
+// vm.h), so that a built-in procedure can reuse it for its result. A list that
+// is code (it has lexical addresses, bytecode or caches) is never reused.
+bool List_isreusable(const List *list);
+// true if the list is reusable and none of its nodes are reachable from another
+// list, so that its elements can be replaced and it can be appended to
+bool List_isexclusive(const List *list);
+// prepends datum to a reusable list
+void List_push(List *list, LispDatum *dtm);
+// removes the first element of a reusable non-empty list
+void List_pop(List *list);
+// replaces the value of a node of an exclusive list
+void List_node_set(struct Node *node, LispDatum *dtm);
+
+// caches the expansion of a macro call (see macroexpand in mylisp.c)
+void List_set_expansion(List *list, List *expansion);
+
+// returns the inline cache of the binding of the head of an application
+// (see eval in mylisp.c), which is allocated upon the first call outside of a
+// parallel section (NULL until then)
+struct GlobalCache *List_head_cache(List *list);
+
 // List functions
 const List *List_empty();
 
 
+// -----------------------------------------------------------------------------
+// Vector < LispDatum
+
+// Elements of a vector are stored contiguously in a buffer, which may be shared
+// by several vectors, each of them viewing a range of it (e.g., rest).
+// The buffer keeps track of its claimed range of slots: a vector whose range
+// ends where the claimed range ends (or starts where it starts) may claim the
+// adjacent free slot, so appending to it (or consing onto it) shares the buffer
+// with the original vector, which keeps seeing only its own range.
+// Otherwise the elements are copied into a new buffer with room to spare.
+// A buffer owns the elements in its claimed range [lo, hi), the rest of its
+// slots are free. It's freed together with its elements once no vector views it.
+struct VecBuf {
+    long refc; // number of vectors viewing this buffer
+    uint32_t cap;
+    uint32_t lo;
+    uint32_t hi;
+    LispDatum *items[];
+};
+
+typedef struct Vector {
+    _LispDatum super;
+    struct VecBuf *buf; // NULL if nothing was ever added
+    uint32_t off;
+    uint32_t len;
+} Vector;
+
+// generic method implementations
+LispType Vector_type();
+void Vector_free(Vector *vec);
+bool Vector_eq(const Vector *v1, const Vector *v2);
+unsigned int Vector_hash(const Vector *vec);
+char *Vector_typename(const Vector *vec);
+// deep copy: elements are copied
+Vector *Vector_copy(const Vector *vec);
+
+// Vector methods
+Vector *Vector_new();
+// creates an empty vector with room for cap elements
+Vector *Vector_newc(size_t cap);
+size_t Vector_len(const Vector *vec);
+bool Vector_isempty(const Vector *vec);
+LispDatum *Vector_ref(const Vector *vec, size_t idx);
+// appends in place, meant for vectors that are still being constructed
+void Vector_add(Vector *vec, LispDatum *dtm);
+// true if no other vector views the buffer of this one, so that a vector that
+// nothing else refers to can have its elements replaced (see List_isexclusive)
+bool Vector_isexclusive(const Vector *vec);
+// replaces an element of an exclusive vector
+void Vector_set(Vector *vec, size_t idx, LispDatum *dtm);
+
+// creates a new vector with the elements of the given one followed by datum
+Vector *Vector_conj_new(Vector *vec, LispDatum *dtm);
+// creates a new vector headed by datum followed by the elements of the given one
+Vector *Vector_cons_new(Vector *vec, LispDatum *dtm);
+// creates a new vector containing the tail of the given vector
+Vector *Vector_rest_new(Vector *vec);
+
+// creates a new list with the elements of the given vector
+List *Vector_to_list(const Vector *vec);
+
+
+// -----------------------------------------------------------------------------
+// HashMap < LispDatum
+
+// A persistent hash array mapped trie (HAMT): every node maps the next 5 bits of
+// key hashes to its entries, which are either key-value pairs or subnodes, and
+// stores only the entries present (a bitmap tells which ones). Once all 32 bits
+// of the hash are used up, keys with equal hashes share a collision node.
+// Adding or removing a key copies only the path to its entry, the rest of the
+// nodes are shared with the original map.
+
+#define HAMT_BITS 5
+
+struct HamtEntry {
+    LispDatum *key; // NULL if this entry is a subnode
+    union {
+        LispDatum *val;
+        struct HamtNode *node;
+    } u;
+    unsigned int hash; // hash of the key
+};
+
+struct HamtNode {
+    long refc;       // number of maps and nodes referencing this node
+    uint32_t bitmap; // entries present (0 for a collision node)
+    uint32_t len;    // number of entries
+    struct HamtEntry entries[];
+};
+
+typedef struct HashMap {
+    _LispDatum super;
+    struct HamtNode *root; // NULL if empty
+    size_t len;
+} HashMap;
+
+// generic method implementations
+LispType HashMap_type();
+void HashMap_free(HashMap *map);
+bool HashMap_eq(const HashMap *a, const HashMap *b);
+unsigned int HashMap_hash(const HashMap *map);
+char *HashMap_typename(const HashMap *map);
+// maps are immutable, the copy shares all nodes
+HashMap *HashMap_copy(const HashMap *map);
+
+// HashMap methods
+HashMap *HashMap_new();
+size_t HashMap_len(const HashMap *map);
+bool HashMap_isempty(const HashMap *map);
+// returns the value of the key or NULL if it's absent
+LispDatum *HashMap_get(const HashMap *map, const LispDatum *key);
+// adds or replaces an entry in place, only for a map that is being built
+void HashMap_put(HashMap *map, LispDatum *key, LispDatum *val);
+// returns a new map with the entry added or replaced
+HashMap *HashMap_assoc_new(const HashMap *map, LispDatum *key, LispDatum *val);
+// returns a new map without the key
+HashMap *HashMap_dissoc_new(const HashMap *map, const LispDatum *key);
+// releases all entries, so that the map is empty
+void HashMap_clear(HashMap *map);
+
+typedef void (*hashmap_visit_ft)(LispDatum *key, LispDatum *val, void *data);
+// visits the entries in an unspecified order
+void HashMap_foreach(const HashMap *map, hashmap_visit_ft visit, void *data);
+
 // -----------------------------------------------------------------------------
 // Number < LispDatum
 
-// TODO support arbitrary large numbers
-// TODO support floating point numbers (potentially as another type)
+// Numeric tower: integers of arbitrary size and IEEE double floats.
+// An integer is a fixnum if it fits in the fixnum range, otherwise it's an
+// allocated bignum, so each integer has a single representation.
+// Arithmetic on integers is exact, an operation with a float yields a float.
+
+// values in this range are represented by immediate datums (fixnums),
+// only those outside of it are allocated
+#define FIXNUM_MIN (-((int64_t) 1 << 62))
+#define FIXNUM_MAX (((int64_t) 1 << 62) - 1)
+
 typedef struct {
-    /*void*/ _LispDatum *super;
-    int64_t val;
+    _LispDatum super;
+    bool isfloat;
+    double flt;    // value of a float
+    BigInt big;    // value of a bignum
 } Number;
 
 // generic method implementations
 LispType Number_type();
 void Number_free(Number *num);
 bool Number_eq(const Number *a, const Number *b);
+unsigned int Number_hash(const Number *num);
 char *Number_typename(const Number *num);
 Number *Number_copy(const Number *num);
 Number *Number_true_copy(const Number *num);
 
 // Number methods
+// returns a fixnum if val fits, otherwise allocates
 Number *Number_new(int64_t val);
-void Number_add(Number *a, const Number *b);
-void Number_sub(Number *a, const Number *b);
-void Number_div(Number *a, const Number *b);
-void Number_mul(Number *a, const Number *b);
+Number *Number_newf(double val);
+// parses the longest prefix of [s, end) that is a number: an optional minus sign,
+// decimal digits and, in case of a float, a fraction and/or an exponent
+Number *Number_parse(const char *s, const char *end);
+
+bool Number_isfixnum(const Number *num);
+bool Number_isfloat(const Number *num);
+
+// Arithmetic, the results are new datums.
+// Number_div truncates a quotient of integers, Number_mod takes the sign of a;
+// both return NULL if b is an integer 0.
+Number *Number_add(const Number *a, const Number *b);
+Number *Number_sub(const Number *a, const Number *b);
+Number *Number_mul(const Number *a, const Number *b);
+Number *Number_div(const Number *a, const Number *b);
+Number *Number_mod(const Number *a, const Number *b);
+
 int Number_cmp(const Number *a, const Number *b);
 int Number_cmpl(const Number *a, long l);
-void Number_mod(Number *a, const Number *b);
 
 bool Number_isneg(const Number *num);
 bool Number_iseven(const Number *num);
 
-// Number length: amount of digits excluding the sign 
-size_t Number_len(const Number *num);
+// values that don't fit in a long saturate, floats are truncated
 long Number_tol(const Number *num);
+double Number_tod(const Number *num);
+
+// max length of a printed fixnum or float including the terminating null byte
+#define NUMBER_SPRINT_MAX 32
+// prints a fixnum or a float into dst, which must hold NUMBER_SPRINT_MAX chars;
+// returns NULL for a bignum, which has to be printed with Number_tostr
 char *Number_sprint(const Number *num, char *dst);
 char *Number_tostr(const Number *num);
 
@@ -223,34 +457,63 @@ char *Number_tostr(const Number *num);
 // -----------------------------------------------------------------------------
 // String < LispDatum
 
+// Strings carry their length and are immutable, so they can share a buffer:
+// a substring is a view of the buffer of the original string and appending to a
+// string might extend it in place (see types.c). The characters of a string
+// need not be followed by a null-byte, unless they are obtained with String_str.
+struct StrBuf;
+
 typedef struct {
-    /*void*/ _LispDatum *super;
-    char *str;
+    _LispDatum super;
+    struct StrBuf *buf;
+    size_t off;
+    size_t len;
 } String;
 
 // generic method implementations
 LispType String_type();
 void String_free(String *string);
 bool String_eq(const String *a, const String *b);
+unsigned int String_hash(const String *string);
 char *String_typename(const String *string);
 String *String_copy(const String *string);
 
 // String methods
 String *String_new(const char *s);
+// the string is the first len characters of s
+String *String_newn(const char *s, size_t len);
+// The string takes ownership of s, which should be dynamically allocated with
+// room for cap characters and hold the len characters followed by a null-byte.
+String *String_from(char *s, size_t len, size_t cap);
+
+size_t String_len(const String *string);
+// the characters of the string, not necessarily null-terminated
+const char *String_chars(const String *string);
+// The null-terminated characters of the string, which must not be modified.
+// Might copy the characters (once), which invalidates pointers returned by
+// String_chars before.
 char *String_str(const String *string);
 
+// returns a new string of the given one followed by the first n characters of s
+String *String_append_new(const String *string, const char *s, size_t n);
+// returns a new string of len characters of the given one starting at start,
+// which shares its characters, or NULL if the range is out of bounds
+String *String_substr_new(const String *string, size_t start, size_t len);
+
 
 // -----------------------------------------------------------------------------
 // Nil < LispDatum
 
+// never instantiated: the only value of this type is an immediate datum
 typedef struct {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
 } Nil;
 
 // generic method implementations
 LispType Nil_type();
 void Nil_free(Nil *nil);
 bool Nil_eq(const Nil *a, const Nil *b);
+unsigned int Nil_hash(const Nil *nil);
 char *Nil_typename(const Nil *nil);
 Nil *Nil_copy(const Nil *nil);
 
@@ -261,14 +524,16 @@ const Nil *Nil_get();
 // -----------------------------------------------------------------------------
 // False < LispDatum
 
+// never instantiated: the only value of this type is an immediate datum
 typedef struct {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
 } False;
 
 // generic method implementations
 LispType False_type();
 void False_free(False *fls);
 bool False_eq(const False *a, const False *b);
+unsigned int False_hash(const False *f);
 char *False_typename(const False *fls);
 False *False_copy(const False *fls);
 
@@ -279,14 +544,16 @@ const False *False_get();
 // -----------------------------------------------------------------------------
 // True < LispDatum
 
+// never instantiated: the only value of this type is an immediate datum
 typedef struct {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
 } True;
 
 // generic method implementations
 LispType True_type();
 void True_free(True *tru);
 bool True_eq(const True *a, const True *b);
+unsigned int True_hash(const True *t);
 char *True_typename(const True *tru);
 True *True_copy(const True *tru);
 
@@ -313,7 +580,7 @@ typedef struct MalEnv MalEnv; // env.h
 typedef LispDatum* (*builtin_apply_t)(const Proc *proc, const Arr *args, MalEnv *env);
 
 typedef struct Proc {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
     Symbol *name; // NULL for lambdas
     // number of mandatory arguments, (TODO optimise: if negative then it's also variadic)
     int argc;
@@ -326,18 +593,28 @@ typedef struct Proc {
     // TODO replace by bitmask (and include variadic into it)
     bool macro;
     bool builtin;
+    // a built-in procedure without side effects, whose result depends only on its
+    // arguments (see constant folding in vm.c)
+    bool pure;
+    // the same, but it might build a new datum or apply a procedure that it was
+    // given, so it isn't folded (pure ones are also functional); macros that call
+    // only these can have their expansions cached (see load_file in mylisp.c)
+    bool functional;
     union {
         List *body;
         builtin_apply_t apply; // function pointer to the built-in procedure
     } logic;
     // the enclosing environment in which this procedure was defined
     /*const*/ MalEnv *env;
+    // compiled body (NULL for built-in procedures)
+    struct Code *code;
 } Proc;
 
 // generic method implementations
 LispType Proc_type();
 void Proc_free(Proc *proc);
 bool Proc_eq(const Proc *a, const Proc *b);
+unsigned int Proc_hash(const Proc *proc);
 char *Proc_typename(const Proc *proc);
 Proc *Proc_copy(const Proc *proc);
 
@@ -366,10 +643,15 @@ const Symbol *Proc_name(const Proc *proc);
 bool Proc_isnamed(const Proc *proc);
 bool Proc_ismacro(const Proc *proc);
 bool Proc_isbuiltin(const Proc *proc);
+bool Proc_ispure(const Proc *proc);
+bool Proc_isfunctional(const Proc *proc);
 int Proc_argc(const Proc *proc);
 
 void Proc_set_name(Proc *proc, Symbol *name);
 void Proc_set_macro(Proc *proc);
+void Proc_set_pure(Proc *proc);
+void Proc_set_functional(Proc *proc);
+void Proc_set_code(Proc *proc, struct Code *code);
 
 
 // -----------------------------------------------------------------------------
@@ -379,8 +661,9 @@ void Proc_set_macro(Proc *proc);
 // reading the pointed value and modifying the reference to point to another value.
 // Atoms are mutable.
 typedef struct Atom {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
     LispDatum *dtm;
+    GcLink gc; // atoms can close cycles, so they are tracked (see gc.h)
 } Atom;
 
 // generic method implementations
@@ -388,19 +671,76 @@ LispType Atom_type();
 void Atom_free(Atom *atom);
 // 2 Atoms are equal only if they point to the same value
 bool Atom_eq(const Atom *a, const Atom *b);
+unsigned int Atom_hash(const Atom *atom);
 char *Atom_typename(const Atom *atom);
 Atom *Atom_copy(const Atom *atom);
 
 // Atom methods
 Atom *Atom_new(LispDatum *dtm);
 void Atom_set(Atom *atom, LispDatum *dtm);
+// sets the value only if it's still expected, returns false otherwise
+bool Atom_compare_set(Atom *atom, LispDatum *expected, LispDatum *dtm);
 LispDatum *Atom_deref(const Atom *atom);
 
 
+// -----------------------------------------------------------------------------
+// LazySeq < LispDatum
+
+// A lazy sequence only describes how its elements are produced: it's either a
+// source (a range of numbers, the lines of a file) or a stage that maps or
+// filters the elements of another sequence, a list or a vector. Nothing is
+// computed until the sequence is consumed (see seq_run in mylisp.c), which pulls
+// the elements of the source through all stages one at a time, so a pipeline
+// never builds intermediate lists. Consuming a sequence again computes its
+// elements again.
+typedef enum {
+    SEQ_RANGE,  // numbers from start by step up to end (exclusive, NULL for none)
+    SEQ_LINES,  // lines of the file at path src, without the newlines
+    SEQ_MAP,    // proc applied to each element of src
+    SEQ_FILTER, // elements of src for which proc returns true
+} SeqKind;
+
+typedef struct LazySeq {
+    _LispDatum super;
+    SeqKind kind;
+    LispDatum *src;
+    Proc *proc;
+    Number *start, *end, *step;
+} LazySeq;
+
+// generic method implementations
+LispType LazySeq_type();
+void LazySeq_free(LazySeq *seq);
+// 2 lazy sequences are equal only if they are the same one
+bool LazySeq_eq(const LazySeq *a, const LazySeq *b);
+unsigned int LazySeq_hash(const LazySeq *seq);
+char *LazySeq_typename(const LazySeq *seq);
+// lazy sequences are immutable, so this doesn't copy
+LazySeq *LazySeq_copy(const LazySeq *seq);
+
+// LazySeq methods
+LazySeq *LazySeq_range(Number *start, Number *end, Number *step);
+LazySeq *LazySeq_lines(String *path);
+// src is a list, a vector or a lazy sequence
+LazySeq *LazySeq_map(Proc *proc, LispDatum *src);
+LazySeq *LazySeq_filter(Proc *pred, LispDatum *src);
+
+
+// -----------------------------------------------------------------------------
+// Clearing, used by the cycle collector (gc.c) to break cycles of garbage:
+// each of these releases what the datum refers to, leaving it empty but valid,
+// so that it can then be freed as usual.
+void List_clear(List *list);
+void Vector_clear(Vector *vec);
+void Atom_clear(Atom *atom);
+void Proc_clear(Proc *proc);
+void LazySeq_clear(LazySeq *seq);
+
+
 // -----------------------------------------------------------------------------
 // Exception < LispDatum
 typedef struct {
-    /*void*/ _LispDatum *super;
+    _LispDatum super;
     LispDatum *dtm;
 } Exception;
 
@@ -409,6 +749,7 @@ LispType Exception_type();
 void Exception_free(Exception *exn);
 // 2 Exceptions are equal only if they point to the same value
 bool Exception_eq(const Exception *a, const Exception *b);
+unsigned int Exception_hash(const Exception *exn);
 char *Exception_typename(const Exception *exn);
 // since Exception is immutable, this does not copy the underlying LispDatum
 Exception *Exception_copy(const Exception *exn);
@@ -422,8 +763,17 @@ Exception *Exception_new(const LispDatum *);
 // returns a deep copy of the last thrown exception
 Exception *thrown_copy();
 
+// returns the value of the last thrown exception, NULL if the last failure wasn't
+// an exception
+const LispDatum *thrown_datum();
 bool didthrow();
 void throw(const char *src, const LispDatum *dtm);
+// raises an exception that has already been reported (e.g., by another thread)
+void rethrow(const LispDatum *dtm);
 void throwf(const char *src, const char *fmt, ...);
+// While quiet, exceptions thrown by this thread are not reported on stderr, for
+// evaluations that are only attempted (e.g., constant folding in vm.c).
+// Returns the previous setting.
+bool throw_set_quiet(bool quiet);
 
 void error(const char *fmt, ...);
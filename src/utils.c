@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 #include "utils.h"
 #include <stdio.h>
@@ -9,6 +10,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define CAPACITY_INCR_RATIO 1.5
 #define DEFAULT_CAPACITY 10
@@ -158,7 +161,7 @@ char *dyn_strcpy(const char *s) {
 }
 
 char *dyn_strncpy(const char *s, size_t n) {
-    char *cpy = calloc(n + 1, sizeof(char));
+    char *cpy = malloc(n + 1);
     memcpy(cpy, s, n);
     cpy[n] = '\0';
     return cpy;
@@ -298,12 +301,36 @@ bool streq(const char *s1, const char *s2)
     return strcmp(s1, s2) == 0;
 }
 
-unsigned int hash_simple_str(const char *s)
+// FxHash: rotate, xor and multiply, a word at a time
+#define FX_SEED 0x517cc1b727220a95ull
+#define FX_ADD(h, w) ((((h) << 5) | ((h) >> 59)) ^ (w)) * FX_SEED
+
+unsigned int hash_str(const char *s)
+{
+    return hash_strn(s, strlen(s));
+}
+
+unsigned int hash_strn(const char *s, size_t len)
 {
-    // simple and works (unique hash for each unique string)
-    // collisions might happen only if str is longer than (2^32 - 1) / (2^8 - 1) = 16843009 bytes
-    unsigned int h = *(s++);
-    while (*s) h += *s++;
+    uint64_t h = hash_strn64(s, len);
+    // fold the high bits in, since they are the ones mixed the best
+    return (unsigned int) (h ^ (h >> 32));
+}
+
+uint64_t hash_strn64(const char *s, size_t len)
+{
+    uint64_t h = 0;
+
+    for (; len >= sizeof(uint64_t); s += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, s, sizeof(w));
+        h = FX_ADD(h, w);
+    }
+    if (len > 0) {
+        uint64_t w = 0;
+        memcpy(&w, s, len);
+        h = FX_ADD(h, w ^ ((uint64_t) len << 56));
+    }
     return h;
 }
 
@@ -318,7 +345,9 @@ StrAsm *StrAsm_init(StrAsm *sasm)
 
 StrAsm *StrAsm_initsz(StrAsm *sasm, size_t cap)
 {
+    if (cap == 0) cap = 1; // room for the null-byte
     sasm->str = malloc(cap * sizeof(*(sasm->str)));
+    sasm->str[0] = '\0';
     sasm->len = 0;
     sasm->cap = cap;
     return sasm;
@@ -332,12 +361,12 @@ void StrAsm_destroy(StrAsm *sasm)
 static bool StrAsm_hasroom(const StrAsm *sasm, size_t n)
 {
     // need to remember about the last null-byte
-    return sasm->cap - sasm->len - 1 >= n;
+    return sasm->len + n + 1 <= sasm->cap;
 }
 
 static void StrAsm_mkroom(StrAsm *sasm, size_t n)
 {
-    size_t newcap = (sasm->cap * STR_ASM_GROW_RAT) + n;
+    size_t newcap = (sasm->cap * STR_ASM_GROW_RAT) + n + 1; // + null-byte
     sasm->str = realloc(sasm->str, newcap * sizeof(*(sasm->str)));
     sasm->cap = newcap;
 }
@@ -420,18 +449,53 @@ char *file_to_str(const char *path)
     }
     close(fd);
 
-    if (tot_size % chunk_size == 0) { // filled up to the brim?
-        // make room for null-byte
-        buf = realloc(buf, tot_size++);
-    } else {
-        // get rid of unused space
-        buf = realloc(buf, tot_size);
-    }
+    // get rid of unused space, but keep room for the null-byte
+    buf = realloc(buf, tot_size + 1);
     buf[tot_size] = '\0';
 
     return buf;
 }
 
+bool file_mtime(const char *path, int64_t *mtime)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return false;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+char *file_map(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    *len = st.st_size;
+    if (*len == 0) { // can't map an empty file
+        close(fd);
+        return "";
+    }
+
+    char *contents = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+
+    return contents == MAP_FAILED ? NULL : contents;
+}
+
+void file_unmap(char *contents, size_t len)
+{
+    if (len > 0)
+        munmap(contents, len);
+}
+
 // -----------------------------------------------------------------------------
 // Miscellaneous ---------------------------------------------------------------
 char itoa(int i)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include "common.h"
 #include <sys/types.h>
@@ -55,7 +56,11 @@ char *str_escape(const char *src);
 char *str_join(char *strings[], size_t n, const char *sep);
 char *addr_to_str(const void *ptr);
 bool streq(const char *s1, const char *s2);
-unsigned int hash_simple_str(const char *s);
+unsigned int hash_str(const char *s);
+// hash of the first len characters of s, equal to hash_str of them
+unsigned int hash_strn(const char *s, size_t len);
+// the full 64-bit hash that hash_strn is folded from (e.g., of contents of files)
+uint64_t hash_strn64(const char *s, size_t len);
 
 // string assembler ------------------------------------------------------------
 typedef struct StrAsm {
@@ -79,6 +84,13 @@ char *StrAsm_str(const StrAsm *sasm);
  
 bool file_readable(const char *path);
 char *file_to_str(const char *path);
+// stores the modification time (seconds since the epoch) of a file in mtime,
+// returns false upon failure
+bool file_mtime(const char *path, int64_t *mtime);
+// Maps the contents of a file into memory (read-only) and stores its size in len.
+// The contents are not null-terminated. Returns NULL upon failure.
+char *file_map(const char *path, size_t *len);
+void file_unmap(char *contents, size_t len);
 
 // -----------------------------------------------------------------------------
 // Miscellaneous ---------------------------------------------------------------
@@ -0,0 +1,1464 @@
+// getrlimit, sysconf and MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "types.h"
+#include "env.h"
+#include "common.h"
+#include "utils.h"
+#include "printer.h"
+#include "profile.h"
+#include "threads.h"
+#include "gc.h"
+
+// -----------------------------------------------------------------------------
+// Bytecode
+//
+// Code is a sequence of 32-bit words: an opcode followed by its operands.
+// Operands that refer to data (symbols, constants, forms) are indices into the
+// constant pool of the code. Jump targets are absolute indices into the code.
+// Every reference to a variable without a lexical address has its own inline
+// cache of the top-level binding (see GlobalCache in env.h).
+
+enum Opcode {
+    OP_CONST,       // k             : push consts[k]
+    OP_LOCAL,       // k depth slot  : push the value of symbol consts[k] at the lexical address
+    OP_GLOBAL,      // k c           : push the value of symbol consts[k], whose
+                    //                 top-level binding is cached in caches[c]
+    OP_EVAL,        // k             : push eval(consts[k]) (forms that are not compiled)
+    OP_POP,         //               : discard the top
+    OP_JUMP,        // target
+    OP_JUMP_FALSE,  // target        : pop and jump if nil or false
+    OP_AND,         // target        : jump if the top is nil or false, otherwise pop
+    OP_OR,          // target        : jump unless the top is nil or false, otherwise pop
+    OP_MACRO_CHECK, // k target s    : if the top is a macro, then replace it by the
+                    //                 value of the expansion of consts[k] (the whole
+                    //                 call form), compiled in sites[s], and jump
+    OP_FOLDED,      // p k target    : if the top is consts[p], then replace it by
+                    //                 consts[k] (the value of the call to it, which
+                    //                 was folded at compile time) and jump
+    OP_CALL,        // n             : apply the procedure below n arguments
+    OP_TAIL_CALL,   // n             : like OP_CALL, but replaces the current activation
+    OP_RETURN,      //               : pop the result and leave the activation
+    OP_LET,         // n             : enter a new frame with n static slots (let*)
+    OP_BIND,        // k             : pop and bind symbol consts[k] in the current frame
+    OP_UNLET,       //               : leave the current frame for the enclosing one
+    OP_TRY,         // target        : install a handler of exceptions at target
+    OP_END_TRY,     // target        : remove the handler and jump
+    OP_CATCH,       // k             : enter a new frame with symbol consts[k] bound
+                    //                 to the caught exception
+};
+
+static const char *opcode_names[] = {
+    [OP_CONST] = "CONST", [OP_LOCAL] = "LOCAL", [OP_GLOBAL] = "GLOBAL",
+    [OP_EVAL] = "EVAL", [OP_POP] = "POP", [OP_JUMP] = "JUMP",
+    [OP_JUMP_FALSE] = "JUMP_FALSE", [OP_AND] = "AND", [OP_OR] = "OR",
+    [OP_MACRO_CHECK] = "MACRO_CHECK", [OP_FOLDED] = "FOLDED",
+    [OP_CALL] = "CALL", [OP_TAIL_CALL] = "TAIL_CALL", [OP_RETURN] = "RETURN",
+    [OP_LET] = "LET", [OP_BIND] = "BIND", [OP_UNLET] = "UNLET",
+    [OP_TRY] = "TRY", [OP_END_TRY] = "END_TRY", [OP_CATCH] = "CATCH",
+};
+
+static const int opcode_argc[] = {
+    [OP_CONST] = 1, [OP_LOCAL] = 3, [OP_GLOBAL] = 2, [OP_EVAL] = 1, [OP_POP] = 0,
+    [OP_JUMP] = 1, [OP_JUMP_FALSE] = 1, [OP_AND] = 1, [OP_OR] = 1,
+    [OP_MACRO_CHECK] = 3, [OP_FOLDED] = 3, [OP_CALL] = 1, [OP_TAIL_CALL] = 1, [OP_RETURN] = 0,
+    [OP_LET] = 1, [OP_BIND] = 1, [OP_UNLET] = 0, [OP_TRY] = 1, [OP_END_TRY] = 1, [OP_CATCH] = 1,
+};
+
+// The expansion of a macro call, which is compiled the first time the call is
+// evaluated and used for as long as the call expands to the same form (see
+// macroexpand in mylisp.c). A new expansion replaces the old one.
+typedef struct Expansion {
+    LispDatum *form; // owned
+    Code *code;      // owned, evaluates the form in the environment of the call
+} Expansion;
+
+typedef struct MacroSite {
+    Expansion *expansion; // NULL until the call is evaluated
+    bool tail;            // the call is in tail position
+} MacroSite;
+
+struct Code {
+    long refc;
+    int32_t *ops;
+    size_t len;
+    size_t cap;
+    // constant pool, each constant is owned by the code
+    LispDatum **consts;
+    size_t nconsts;
+    size_t constcap;
+    // inline caches of OP_GLOBAL sites
+    GlobalCache *caches;
+    size_t ncaches;
+    size_t cachecap;
+    // macro calls (OP_MACRO_CHECK)
+    MacroSite *sites;
+    size_t nsites;
+    size_t sitecap;
+    // during compilation, the environment in which calls are folded (see fold_call)
+    MalEnv *env;
+};
+
+static Code *Code_new(MalEnv *env)
+{
+    Code *code = malloc(sizeof(Code));
+    code->env = env;
+    code->refc = 0;
+    code->len = 0;
+    code->cap = 16;
+    code->ops = malloc(sizeof(*code->ops) * code->cap);
+    code->nconsts = 0;
+    code->constcap = 8;
+    code->consts = malloc(sizeof(*code->consts) * code->constcap);
+    code->ncaches = 0;
+    code->cachecap = 0;
+    code->caches = NULL;
+    code->nsites = 0;
+    code->sitecap = 0;
+    code->sites = NULL;
+    return code;
+}
+
+static void Expansion_free(Expansion *exp)
+{
+    LispDatum_rls_free(exp->form);
+    Code_rls_free(exp->code);
+    free(exp);
+}
+
+static void Code_free(Code *code)
+{
+    for (size_t i = 0; i < code->nconsts; i++)
+        LispDatum_rls_free(code->consts[i]);
+    free(code->consts);
+    free(code->caches);
+    for (size_t i = 0; i < code->nsites; i++) {
+        if (code->sites[i].expansion)
+            Expansion_free(code->sites[i].expansion);
+    }
+    free(code->sites);
+    free(code->ops);
+    free(code);
+}
+
+void Code_own(Code *code)
+{
+    REFC_INC(code->refc);
+}
+
+void Code_rls_free(Code *code)
+{
+    if (code == NULL) return;
+    if (REFC_DEC(code->refc) <= 0)
+        Code_free(code);
+}
+
+// appends a word and returns its index
+static size_t emit(Code *code, int32_t word)
+{
+    if (code->len == code->cap) {
+        code->cap *= 2;
+        code->ops = realloc(code->ops, sizeof(*code->ops) * code->cap);
+    }
+    code->ops[code->len] = word;
+    return code->len++;
+}
+
+static void patch(Code *code, size_t at, int32_t word)
+{
+    code->ops[at] = word;
+}
+
+// returns the index of the datum in the constant pool, adding it if needed
+static int32_t add_const(Code *code, LispDatum *dtm)
+{
+    for (size_t i = 0; i < code->nconsts; i++) {
+        if (code->consts[i] == dtm)
+            return i;
+    }
+
+    if (code->nconsts == code->constcap) {
+        code->constcap *= 2;
+        code->consts = realloc(code->consts, sizeof(*code->consts) * code->constcap);
+    }
+    LispDatum_own(dtm);
+    code->consts[code->nconsts] = dtm;
+    return code->nconsts++;
+}
+
+// returns the index of a new empty inline cache
+static int32_t add_cache(Code *code)
+{
+    if (code->ncaches == code->cachecap) {
+        code->cachecap = code->cachecap ? code->cachecap * 2 : 4;
+        code->caches = realloc(code->caches, sizeof(*code->caches) * code->cachecap);
+    }
+    code->caches[code->ncaches] = (GlobalCache) { .root = NULL, .datum = NULL, .version = 0 };
+    return code->ncaches++;
+}
+
+// returns the index of a new macro call site
+static int32_t add_site(Code *code, bool tail)
+{
+    if (code->nsites == code->sitecap) {
+        code->sitecap = code->sitecap ? code->sitecap * 2 : 4;
+        code->sites = realloc(code->sites, sizeof(*code->sites) * code->sitecap);
+    }
+    code->sites[code->nsites] = (MacroSite) { .expansion = NULL, .tail = tail };
+    return code->nsites++;
+}
+
+void Code_print(const Code *code)
+{
+    for (size_t pc = 0; pc < code->len; ) {
+        int32_t op = code->ops[pc];
+        printf("%4zu %-12s", pc, opcode_names[op]);
+        for (int i = 1; i <= opcode_argc[op]; i++)
+            printf(" %d", code->ops[pc + i]);
+
+        if (op == OP_CONST || op == OP_LOCAL || op == OP_GLOBAL
+                || op == OP_EVAL || op == OP_MACRO_CHECK)
+        {
+            char *s = pr_str(code->consts[code->ops[pc + 1]], true);
+            printf("  ; %s", s);
+            free(s);
+        }
+        else if (op == OP_FOLDED) {
+            char *s = pr_str(code->consts[code->ops[pc + 2]], true);
+            printf("  ; => %s", s);
+            free(s);
+        }
+        printf("\n");
+        pc += 1 + opcode_argc[op];
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Compiler
+//
+// if, do, let*, try* and quote are compiled, as well as variable references and
+// procedure applications. Other special forms (def!, lambda, quasiquote, ...) are
+// evaluated by eval in the environment of the current frame (OP_EVAL), and so
+// are forms with bad syntax, which eval reports.
+// Whether a call is a macro call is decided at runtime (OP_MACRO_CHECK), since
+// the head symbol's binding may change after compilation. The expansion is then
+// compiled on its own and evaluated in the same environment, in tail position if
+// the call is.
+//
+// Constants are pushed by reference: literals, quoted data, vectors and hash-maps
+// of literals and quasiquoted data without anything unquoted. A call to a pure
+// built-in procedure (see Proc_ispure) whose arguments are all constants (or such
+// calls) is folded: it's applied at compile time in the environment of the
+// compilation, and its value is pushed in place of the call for as long as the
+// head evaluates to the same procedure (OP_FOLDED). A call that throws is left to
+// be evaluated, which throws again.
+
+static void compile_node(Code *code, const struct Node *node, bool tail);
+static void compile_datum(Code *code, LispDatum *dtm, bool tail);
+
+static bool isliteral(const LispDatum *dtm);
+
+static void isliteral_entry(LispDatum *key, LispDatum *val, void *data)
+{
+    bool *lit = data;
+    *lit = *lit && isliteral(val);
+}
+
+// true if the datum evaluates to itself
+static bool isliteral(const LispDatum *dtm)
+{
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL:
+        case LIST:
+            return false;
+        case VECTOR: {
+            const Vector *vec = (Vector*) dtm;
+            for (size_t i = 0; i < Vector_len(vec); i++) {
+                if (!isliteral(Vector_ref(vec, i)))
+                    return false;
+            }
+            return true;
+        }
+        case HASHMAP: {
+            // keys aren't evaluated
+            bool lit = true;
+            HashMap_foreach((HashMap*) dtm, isliteral_entry, &lit);
+            return lit;
+        }
+        default:
+            return true;
+    }
+}
+
+// true if nothing within quasiquoted data is unquoted
+static bool isquasiconst(const LispDatum *dtm)
+{
+    if (!LispDatum_istype(dtm, LIST)) return true;
+
+    const List *list = (List*) dtm;
+    for (const struct Node *node = list->head; node != NULL; node = node->next) {
+        if (node == list->head && LispDatum_istype(node->value, SYMBOL)) {
+            SpecialForm form = Symbol_special((Symbol*) node->value);
+            if (form == SF_UNQUOTE || form == SF_SPLICE_UNQUOTE)
+                return false;
+        }
+        if (!isquasiconst(node->value))
+            return false;
+    }
+    return true;
+}
+
+static LispDatum *fold_call(Code *code, const List *form, Proc **proc);
+
+// Returns the value of a constant expression, NULL if it isn't one. The value
+// is either a part of the expression or a new datum.
+static LispDatum *fold_node(Code *code, const struct Node *node)
+{
+    LispDatum *dtm = node->value;
+    if (!LispDatum_istype(dtm, LIST))
+        return isliteral(dtm) ? dtm : NULL;
+
+    const List *list = (List*) dtm;
+    if (List_isempty(list)) return NULL;
+
+    const LispDatum *head = List_ref(list, 0);
+    if (LispDatum_istype(head, SYMBOL)) {
+        switch (Symbol_special((Symbol*) head)) {
+            case SF_QUOTE:
+                return List_len(list) == 2 ? List_ref(list, 1) : NULL;
+            case SF_NONE: {
+                Proc *proc;
+                return fold_call(code, list, &proc);
+            }
+            default:
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Applies the pure built-in procedure (stored in proc) that the head of the call
+// is bound to, if its arguments are constant expressions. Returns the value, or
+// NULL if the call can't be folded.
+static LispDatum *fold_call(Code *code, const List *form, Proc **proc)
+{
+    const struct Node *head = form->head;
+    if (code->env == NULL || head->slot >= 0 || !LispDatum_istype(head->value, SYMBOL))
+        return NULL;
+    LispDatum *dtm = MalEnv_get(code->env, (Symbol*) head->value);
+    if (dtm == NULL || !LispDatum_istype(dtm, PROCEDURE) || !Proc_ispure((Proc*) dtm))
+        return NULL;
+    *proc = (Proc*) dtm;
+
+    Arr *args = Arr_newn(List_len(form) - 1);
+    for (const struct Node *node = head->next; node != NULL; node = node->next) {
+        LispDatum *arg = fold_node(code, node);
+        if (arg == NULL) break;
+        LispDatum_own(arg);
+        Arr_add(args, arg);
+    }
+
+    LispDatum *out = NULL;
+    if (args->len == List_len(form) - 1) {
+        bool quiet = throw_set_quiet(true);
+        out = vm_apply(*proc, args, code->env);
+        throw_set_quiet(quiet);
+    }
+    LispDatum_guard(out,
+        for (size_t i = 0; i < args->len; i++)
+            LispDatum_rls_free(args->items[i]);
+    );
+    Arr_free(args);
+    return out;
+}
+
+// a sequence of expressions, the value of the last one remains on the stack
+static void compile_seq(Code *code, const struct Node *node, bool tail)
+{
+    for (; node->next != NULL; node = node->next) {
+        compile_node(code, node, false);
+        emit(code, OP_POP);
+    }
+    compile_node(code, node, tail);
+}
+
+static void compile_eval(Code *code, List *form)
+{
+    emit(code, OP_EVAL);
+    emit(code, add_const(code, (LispDatum*) form));
+}
+
+// (if cond if-true [if-false])
+static void compile_if(Code *code, List *form, bool tail)
+{
+    const struct Node *cond = form->head->next;
+    compile_node(code, cond, false);
+    emit(code, OP_JUMP_FALSE);
+    size_t to_else = emit(code, 0);
+
+    compile_node(code, cond->next, tail);
+    emit(code, OP_JUMP);
+    size_t to_end = emit(code, 0);
+
+    patch(code, to_else, code->len);
+    if (cond->next->next) {
+        compile_node(code, cond->next->next, tail);
+    }
+    else {
+        emit(code, OP_CONST);
+        emit(code, add_const(code, (LispDatum*) Nil_get()));
+    }
+    patch(code, to_end, code->len);
+}
+
+// (and expr ...) or (or expr ...), the last expression is in tail position
+static void compile_and_or(Code *code, List *form, bool tail)
+{
+    bool and = Symbol_special((Symbol*) List_ref(form, 0)) == SF_AND;
+    const struct Node *node = form->head->next;
+    if (node == NULL) {
+        emit(code, OP_CONST);
+        emit(code, add_const(code, (LispDatum*) LispDatum_bool(and)));
+        return;
+    }
+
+    // operands of the jumps to the end
+    size_t *to_end = malloc(sizeof(size_t) * List_len(form));
+    size_t njumps = 0;
+    for (; node->next != NULL; node = node->next) {
+        compile_node(code, node, false);
+        emit(code, and ? OP_AND : OP_OR);
+        to_end[njumps++] = emit(code, 0);
+    }
+    compile_node(code, node, tail);
+
+    for (size_t i = 0; i < njumps; i++)
+        patch(code, to_end[i], code->len);
+    free(to_end);
+}
+
+// (let* ((id val) ...) expr ...), the frame has the same layout as the one of
+// eval_letstar (mylisp.c), whose lexical addresses are resolved
+// returns false if the form has bad syntax
+static bool compile_let(Code *code, List *form, bool tail)
+{
+    if (List_len(form) < 3 || !LispDatum_istype(List_ref(form, 1), LIST))
+        return false;
+    const List *bindings = (List*) List_ref(form, 1);
+    if (List_isempty(bindings))
+        return false;
+
+    // the static layout consists of distinct bound symbols
+    unsigned nstatic = 0;
+    for (const struct Node *node = bindings->head; node; node = node->next) {
+        if (!LispDatum_istype(node->value, LIST))
+            return false;
+        const List *bind = (List*) node->value;
+        if (List_len(bind) != 2 || !LispDatum_istype(bind->head->value, SYMBOL))
+            return false;
+
+        const struct Node *prev = bindings->head;
+        while (prev != node && ((List*) prev->value)->head->value != bind->head->value)
+            prev = prev->next;
+        if (prev == node) nstatic++;
+    }
+
+    emit(code, OP_LET);
+    emit(code, nstatic);
+    for (const struct Node *node = bindings->head; node; node = node->next) {
+        const List *bind = (List*) node->value;
+        compile_node(code, bind->head->next, false);
+        emit(code, OP_BIND);
+        emit(code, add_const(code, bind->head->value));
+    }
+    compile_seq(code, form->head->next->next, tail);
+    // in tail position the frame is left together with the activation
+    if (!tail)
+        emit(code, OP_UNLET);
+    return true;
+}
+
+// (try* expr (catch* id expr)), the body is never in tail position, since the
+// handler has to outlive it
+// returns false if the form has bad syntax
+static bool compile_try(Code *code, List *form, bool tail)
+{
+    if (List_len(form) != 3 || !LispDatum_istype(List_ref(form, 2), LIST))
+        return false;
+    const List *catch = (List*) List_ref(form, 2);
+    if (List_len(catch) != 3
+            || !LispDatum_istype(catch->head->value, SYMBOL)
+            || Symbol_special((Symbol*) catch->head->value) != SF_CATCHSTAR
+            || !LispDatum_istype(List_ref(catch, 1), SYMBOL))
+        return false;
+
+    emit(code, OP_TRY);
+    size_t to_handler = emit(code, 0);
+    compile_node(code, form->head->next, false);
+    emit(code, OP_END_TRY);
+    size_t to_end = emit(code, 0);
+
+    patch(code, to_handler, code->len);
+    emit(code, OP_CATCH);
+    emit(code, add_const(code, List_ref(catch, 1)));
+    compile_node(code, catch->tail, tail);
+    if (!tail)
+        emit(code, OP_UNLET);
+    patch(code, to_end, code->len);
+    return true;
+}
+
+static void compile_call(Code *code, List *form, bool tail)
+{
+    const struct Node *head = form->head;
+    compile_node(code, head, false);
+
+    size_t to_folded = 0;
+    Proc *proc;
+    LispDatum *value = fold_call(code, form, &proc);
+    if (value) {
+        emit(code, OP_FOLDED);
+        emit(code, add_const(code, (LispDatum*) proc));
+        emit(code, add_const(code, value));
+        to_folded = emit(code, 0);
+    }
+
+    size_t to_end = 0;
+    if (LispDatum_istype(head->value, SYMBOL)) {
+        emit(code, OP_MACRO_CHECK);
+        emit(code, add_const(code, (LispDatum*) form));
+        to_end = emit(code, 0);
+        emit(code, add_site(code, tail));
+    }
+
+    int32_t argc = 0;
+    for (const struct Node *node = head->next; node != NULL; node = node->next) {
+        compile_node(code, node, false);
+        argc++;
+    }
+    emit(code, tail ? OP_TAIL_CALL : OP_CALL);
+    emit(code, argc);
+
+    if (to_end)
+        patch(code, to_end, code->len);
+    if (to_folded)
+        patch(code, to_folded, code->len);
+}
+
+static void compile_list(Code *code, List *form, bool tail)
+{
+    if (List_isempty(form)) {
+        compile_eval(code, form); // reports the error
+        return;
+    }
+    size_t argc = List_len(form) - 1;
+
+    LispDatum *head = List_ref(form, 0);
+    if (LispDatum_istype(head, SYMBOL)) {
+        const Symbol *sym = (Symbol*) head;
+        switch (Symbol_special(sym)) {
+            case SF_IF:
+                if (argc == 2 || argc == 3)
+                    compile_if(code, form, tail);
+                else
+                    compile_eval(code, form);
+                return;
+            case SF_DO:
+                if (argc >= 1)
+                    compile_seq(code, form->head->next, tail);
+                else
+                    compile_eval(code, form);
+                return;
+            case SF_QUOTE:
+                if (argc == 1) {
+                    emit(code, OP_CONST);
+                    emit(code, add_const(code, List_ref(form, 1)));
+                }
+                else {
+                    compile_eval(code, form);
+                }
+                return;
+            case SF_AND:
+            case SF_OR:
+                compile_and_or(code, form, tail);
+                return;
+            case SF_LETSTAR:
+                if (!compile_let(code, form, tail))
+                    compile_eval(code, form);
+                return;
+            case SF_TRYSTAR:
+                if (!compile_try(code, form, tail))
+                    compile_eval(code, form);
+                return;
+            case SF_QUASIQUOTE:
+                if (argc == 1 && isquasiconst(List_ref(form, 1))) {
+                    emit(code, OP_CONST);
+                    emit(code, add_const(code, List_ref(form, 1)));
+                }
+                else {
+                    compile_eval(code, form);
+                }
+                return;
+            case SF_DEF:
+            case SF_DEFMACRO:
+            case SF_LAMBDA:
+            case SF_MACROEXPAND:
+                compile_eval(code, form);
+                return;
+            default:
+                break;
+        }
+    }
+
+    compile_call(code, form, tail);
+}
+
+// a datum that isn't held by a node, so a symbol has no lexical address
+static void compile_datum(Code *code, LispDatum *dtm, bool tail)
+{
+    switch (LispDatum_type(dtm)) {
+        case SYMBOL:
+            emit(code, OP_GLOBAL);
+            emit(code, add_const(code, dtm));
+            emit(code, add_cache(code));
+            break;
+        case LIST:
+            compile_list(code, (List*) dtm, tail);
+            break;
+        case VECTOR:
+        case HASHMAP:
+            // elements are evaluated by eval, unless they are literals
+            emit(code, isliteral(dtm) ? OP_CONST : OP_EVAL);
+            emit(code, add_const(code, dtm));
+            break;
+        default:
+            emit(code, OP_CONST);
+            emit(code, add_const(code, dtm));
+            break;
+    }
+}
+
+static void compile_node(Code *code, const struct Node *node, bool tail)
+{
+    LispDatum *dtm = node->value;
+    if (node->slot >= 0 && LispDatum_istype(dtm, SYMBOL)) {
+        emit(code, OP_LOCAL);
+        emit(code, add_const(code, dtm));
+        emit(code, node->depth);
+        emit(code, node->slot);
+    }
+    else {
+        compile_datum(code, dtm, tail);
+    }
+}
+
+Code *Code_compile(const struct Node *body, MalEnv *env)
+{
+    Code *code = Code_new(env);
+    if (body) {
+        compile_seq(code, body, true);
+    }
+    else {
+        emit(code, OP_CONST);
+        emit(code, add_const(code, (LispDatum*) Nil_get()));
+    }
+    emit(code, OP_RETURN);
+    code->env = NULL;
+    return code;
+}
+
+// the expansion of a macro call is evaluated like a body of a single expression
+static Code *compile_expansion(LispDatum *form, MalEnv *env)
+{
+    Code *code = Code_new(env);
+    compile_datum(code, form, true);
+    emit(code, OP_RETURN);
+    code->env = NULL;
+    return code;
+}
+
+// -----------------------------------------------------------------------------
+// VM
+//
+// The value stack is shared by all active procedure applications, each of which
+// uses the part above the height at which it was entered. Values on the stack
+// are owned by it.
+// Arguments of an application are passed as a view of the stack (no copy), so
+// the stack never moves: address space for as many values as fit in physical
+// memory is reserved up front, and it's committed in growing chunks as the stack
+// gets higher, so the depth of recursion is limited only by memory. Each thread
+// has a stack of its own (see threads.h).
+//
+// An activation is the evaluation of compiled code in an environment: the body of
+// a procedure that is applied or the expansion of a macro call. An activation
+// that applies a procedure or evaluates an expansion is suspended on the
+// continuation stack, which is allocated on the heap and grows as needed, and
+// resumed when the callee returns, so that recursion among compiled code doesn't
+// consume the C stack. A call in tail position replaces the current activation
+// instead, and so does an application of apply (see spread_apply).
+// vm_run is only entered recursively by eval and by built-in procedures that
+// apply procedures (e.g., map), which is limited by the size of the C stack (see
+// run_enter).
+
+// the first chunk of the stack, in values
+#define VM_STACK_CHUNK (1 << 16)
+
+static __thread LispDatum **g_stack = NULL;
+static __thread size_t g_sp = 0; // stack height
+static __thread size_t g_stack_committed = 0; // capacity that can be used
+static __thread size_t g_stack_reserved = 0;
+
+typedef struct Activation {
+    const Code *code;
+    size_t pc;
+    // the current environment, which is either the one the activation was
+    // entered with (frame) or one of the frames of let* and catch* enclosed by it;
+    // the activation owns a reference to each of them
+    MalEnv *env;
+    MalEnv *frame;
+    Proc *proc;     // owned procedure, NULL if it's owned by the caller of vm_run
+                    // or if the activation evaluates an expansion
+    Code *exp_code; // owned code of an expansion, NULL if the code is the body of proc
+    size_t base;    // stack height when the activation was entered
+    size_t prof;    // profiler token of the application
+} Activation;
+
+// a handler installed by try*
+typedef struct Handler {
+    size_t depth;  // of the continuation stack when it was installed
+    size_t sp;     // stack height when it was installed
+    MalEnv *env;   // environment of the try* form
+    size_t pc;     // of the code of catch*
+} Handler;
+
+static __thread Activation *g_conts = NULL; // suspended activations
+static __thread size_t g_nconts = 0;
+static __thread size_t g_contcap = 0;
+
+static __thread Handler *g_handlers = NULL;
+static __thread size_t g_nhandlers = 0;
+static __thread size_t g_handlercap = 0;
+
+// the running activation during a collection at a safe point (see vm_roots)
+static __thread const Activation *g_running = NULL;
+
+// Frees the stacks of a thread that exits. The main thread and worker threads
+// keep theirs until the process exits, host threads that enter the interpreter
+// (see mylisp_enter) may come and go.
+static void stacks_free(void *stack)
+{
+    munmap(stack, sizeof(*g_stack) * g_stack_reserved);
+    free(g_conts);
+    free(g_handlers);
+}
+
+static pthread_key_t g_stacks_key;
+static pthread_once_t g_stacks_once = PTHREAD_ONCE_INIT;
+
+static void stacks_key_create()
+{
+    pthread_key_create(&g_stacks_key, stacks_free);
+}
+
+static void stack_reserve()
+{
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    size_t size = pages > 0 && page_size > 0 ? (size_t) pages * page_size : (size_t) 1 << 32;
+    // a smaller range is reserved if there isn't enough address space
+    for (; size >= sizeof(*g_stack) * VM_STACK_CHUNK; size /= 2) {
+        void *p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            g_stack = p;
+            g_stack_reserved = size / sizeof(*g_stack);
+            pthread_once(&g_stacks_once, stacks_key_create);
+            pthread_setspecific(g_stacks_key, p);
+            return;
+        }
+    }
+    FATAL("out of memory (VM stack)");
+}
+
+// makes room for more values, returns false if there's no memory left for them
+static bool stack_grow()
+{
+    if (g_stack == NULL)
+        stack_reserve();
+
+    size_t cap = g_stack_committed ? g_stack_committed * 2 : VM_STACK_CHUNK;
+    if (cap > g_stack_reserved)
+        cap = g_stack_reserved;
+    if (cap == g_stack_committed
+            || mprotect(g_stack, sizeof(*g_stack) * cap, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    g_stack_committed = cap;
+    return true;
+}
+
+static bool push(LispDatum *dtm)
+{
+    if (g_sp == g_stack_committed && !stack_grow()) {
+        throwf(NULL, "stack overflow");
+        return false;
+    }
+    LispDatum_own(dtm);
+    g_stack[g_sp++] = dtm;
+    return true;
+}
+
+// pops n values and discards them
+static void drop(size_t n)
+{
+    while (n-- > 0)
+        LispDatum_rls_free(g_stack[--g_sp]);
+}
+
+static void suspend(const Activation *act)
+{
+    if (g_nconts == g_contcap) {
+        g_contcap = g_contcap ? g_contcap * 2 : 64;
+        g_conts = realloc(g_conts, sizeof(*g_conts) * g_contcap);
+        if (g_conts == NULL)
+            FATAL("out of memory (continuation stack)");
+    }
+    g_conts[g_nconts++] = *act;
+}
+
+static void handler_push(const Handler *handler)
+{
+    if (g_nhandlers == g_handlercap) {
+        g_handlercap = g_handlercap ? g_handlercap * 2 : 16;
+        g_handlers = realloc(g_handlers, sizeof(*g_handlers) * g_handlercap);
+        if (g_handlers == NULL)
+            FATAL("out of memory (handlers)");
+    }
+    g_handlers[g_nhandlers++] = *handler;
+}
+
+// leaves environments from env up to the given one, which is left too
+static void release_envs(MalEnv *env, MalEnv *last)
+{
+    while (1) {
+        MalEnv *enclosing = env->enclosing;
+        bool done = env == last;
+        // the enclosing env survives, the activation holds a reference to it
+        MalEnv_rls_free(env);
+        if (done) return;
+        env = enclosing;
+    }
+}
+
+// releases what the activation owns, once its values are dropped
+static void leave(const Activation *act)
+{
+    release_envs(act->env, act->frame);
+    if (act->proc)
+        LispDatum_rls_free((LispDatum*) act->proc);
+    if (act->exp_code)
+        Code_rls_free(act->exp_code);
+}
+
+// C stack of the thread at the start of the outermost run of the VM
+static __thread uintptr_t g_cstack_base = 0;
+static __thread unsigned g_nruns = 0;
+
+// room on the C stack for nested runs of the VM, with a margin for whatever is
+// called between them
+static size_t cstack_room()
+{
+    static size_t room = 0;
+    size_t r = __atomic_load_n(&room, __ATOMIC_RELAXED);
+    if (r) return r;
+
+    size_t size = THREAD_STACK_SIZE;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            && rl.rlim_cur < size)
+        size = rl.rlim_cur;
+    r = size / 4 * 3;
+    __atomic_store_n(&room, r, __ATOMIC_RELAXED);
+    return r;
+}
+
+// Enters a run of the VM, whose locals are at the given address.
+// Returns false after raising an exception if the C stack is running out.
+static bool run_enter(const void *locals)
+{
+    uintptr_t at = (uintptr_t) locals;
+    if (g_nruns == 0)
+        g_cstack_base = at;
+    else if ((at < g_cstack_base ? g_cstack_base - at : at - g_cstack_base) > cstack_room()) {
+        throwf(NULL, "stack overflow");
+        return false;
+    }
+    g_nruns++;
+    return true;
+}
+
+static bool verify_proc_application(const Proc *proc, const Arr* args)
+{
+    const Symbol *proc_name = Proc_name(proc);
+
+    int argc = args->len;
+    int proc_argc = Proc_argc(proc);
+    if (argc < proc_argc /* too few? */
+            || (!Proc_isva(proc) && argc > proc_argc)) /* too much? */
+    {
+        throwf(Symbol_name(proc_name),
+                "expected at least %d arguments, but %d were given",
+                proc_argc, argc);
+        return false;
+    }
+
+    return true;
+}
+
+// Creates the frame of a procedure application with parameters bound to arguments.
+// The local env is created even if a procedure expects no parameters
+// so that def! inside it have only local effect
+// NOTE: this is where the need to track reachability stems from,
+// since we don't know whether the environment of this particular application
+// (with all the arguments) will be needed after its applied.
+// Example where it won't be needed and thus can be safely discarded:
+// ((lambda (x) x) 10) => 10
+// Here a local env { x = 10 } with enclosing one set to the global env will be created
+// and discarded immediately after the result (10) is obtained.
+// (((lambda (x) (lambda () x)) 10)) => 10
+// But here the result of this application will be a procedure that should
+// "remember" about x = 10, so the local env should be preserved.
+static MalEnv *frame_new(const Proc *proc, const Arr *args)
+{
+    MalEnv *env = MalEnv_new_frame(proc->env, proc->params->len);
+    MalEnv_own(env);
+
+    // mandatory arguments
+    for (int i = 0; i < proc->argc; i++) {
+        Symbol *param = Arr_get(proc->params, i);
+        LispDatum *arg = Arr_get(args, i);
+        MalEnv_put(env, param, arg);
+    }
+
+    // if variadic, then bind the last param to the rest of arguments
+    if (Proc_isva(proc)) {
+        Symbol *var_param = Arr_get(proc->params, proc->params->len - 1);
+        List *var_args = List_new();
+        for (size_t i = proc->argc; i < args->len; i++) {
+            LispDatum *arg = Arr_get(args, i);
+            List_add(var_args, arg);
+        }
+
+        MalEnv_put(env, var_param, (LispDatum*) var_args);
+    }
+
+    return env;
+}
+
+static const Code *proc_code(const Proc *proc)
+{
+    // lambdas are compiled when they are created (eval_fnstar)
+    if (proc->code == NULL)
+        FATAL("procedure %s was not compiled", Symbol_name(Proc_name(proc)));
+    return proc->code;
+}
+
+// a view of the n arguments at the top of the stack
+static Arr stack_args(unsigned n)
+{
+    return (Arr) { .len = n, .cap = n, .items = (void**) &g_stack[g_sp - n] };
+}
+
+// prof is the profiler token of the application
+static LispDatum *vm_run(const Proc *proc, const Arr *args, size_t prof);
+
+LispDatum *vm_call(unsigned n, MalEnv *env)
+{
+    LispDatum *head = g_stack[g_sp - n - 1];
+    if (!LispDatum_istype(head, PROCEDURE)) {
+        throwf(NULL, "application: expected a procedure");
+        drop(n + 1);
+        return NULL;
+    }
+
+    Arr args = stack_args(n);
+    LispDatum *out = vm_apply((Proc*) head, &args, env);
+    LispDatum_guard(out, drop(n + 1));
+    return out;
+}
+
+bool vm_unique_arg(const Arr *args, size_t idx)
+{
+    LispDatum **items = (LispDatum**) args->items;
+    if (g_stack == NULL || items < g_stack || items + args->len > g_stack + g_sp)
+        return false;
+
+    const LispDatum *dtm = items[idx];
+    return !LispDatum_isimm(dtm) && LispDatum_refc(dtm) == 1;
+}
+
+static void activation_roots(const Activation *act,
+        void (*fn)(void *ptr, bool isenv, void *data), void *data)
+{
+    // the activation owns the environments from env up to its frame
+    for (MalEnv *env = act->env; ; env = env->enclosing) {
+        fn(env, true, data);
+        if (env == act->frame) break;
+    }
+    if (act->proc)
+        fn(act->proc, false, data);
+}
+
+void vm_roots(void (*fn)(void *ptr, bool isenv, void *data), void *data)
+{
+    for (size_t i = 0; i < g_sp; i++)
+        fn(g_stack[i], false, data);
+    for (size_t i = 0; i < g_nconts; i++)
+        activation_roots(&g_conts[i], fn, data);
+    if (g_running)
+        activation_roots(g_running, fn, data);
+    for (size_t i = 0; i < g_nhandlers; i++)
+        fn(g_handlers[i].env, true, data);
+}
+
+size_t vm_height()
+{
+    return g_sp;
+}
+
+bool vm_push(LispDatum *dtm)
+{
+    return push(dtm);
+}
+
+void vm_drop(size_t n)
+{
+    drop(n);
+}
+
+static LispDatum *lookup(MalEnv *env, const Symbol *id)
+{
+    LispDatum *dtm = MalEnv_get(env, id);
+    if (dtm == NULL)
+        throwf(NULL, "symbol binding '%s' not found", Symbol_name(id));
+    return dtm;
+}
+
+static bool isapply(const LispDatum *dtm)
+{
+    return LispDatum_istype(dtm, PROCEDURE) && Proc_isbuiltin((Proc*) dtm)
+        && ((Proc*) dtm)->logic.apply == lisp_apply;
+}
+
+// An application of apply to n arguments at the top of the stack is replaced by
+// the application of the procedure to the spread arguments, and n is updated:
+//     apply f a ... (x ...) => f a ... x ...
+// Applications that apply would reject are left to it to report the error.
+// Returns false if an exception was thrown.
+static bool spread_apply(unsigned *n)
+{
+    while (isapply(g_stack[g_sp - *n - 1]) && *n >= 2) {
+        unsigned argc = *n;
+        LispDatum *head = g_stack[g_sp - argc - 1];
+        const LispDatum *f = g_stack[g_sp - argc];
+        LispDatum *last = g_stack[g_sp - 1];
+        if (!LispDatum_istype(f, PROCEDURE)
+                || (!LispDatum_istype(last, LIST) && !LispDatum_istype(last, VECTOR)))
+            return true;
+
+        // apply and the last argument are taken off the stack, the references
+        // are released once the elements are pushed
+        size_t at = g_sp - argc - 1;
+        memmove(&g_stack[at], &g_stack[at + 1], sizeof(*g_stack) * (argc - 1));
+        g_sp -= 2;
+
+        bool ok = true;
+        size_t len = 0;
+        if (LispDatum_istype(last, LIST)) {
+            for (struct Node *node = ((List*) last)->head; ok && node; node = node->next, len++)
+                ok = push(node->value);
+        }
+        else {
+            const Vector *vec = (Vector*) last;
+            for (; ok && len < Vector_len(vec); len++)
+                ok = push(Vector_ref(vec, len));
+        }
+        LispDatum_rls_free(last);
+        LispDatum_rls_free(head);
+        if (!ok) return false;
+        *n = argc - 2 + len;
+    }
+    return true;
+}
+
+// Returns the code of the expansion of a macro call, which is compiled again if
+// the call expands to another form than the last time (e.g., the macro was
+// redefined). Returns NULL if the expansion failed.
+static Code *expansion_code(MacroSite *site, LispDatum *form, MalEnv *env)
+{
+    LispDatum *expanded = macroexpand(form, env);
+    if (expanded == NULL) return NULL;
+
+    Expansion *exp = __atomic_load_n(&site->expansion, __ATOMIC_ACQUIRE);
+    if (exp && exp->form == expanded)
+        return exp->code;
+
+    Expansion *new = malloc(sizeof(Expansion));
+    LispDatum_own(expanded);
+    new->form = expanded;
+    new->code = compile_expansion(expanded, env);
+    Code_own(new->code);
+
+    // threads of a parallel section might compile the same expansion, the first
+    // one to install its own wins, and the replaced one might still be in use
+    if (__atomic_compare_exchange_n(&site->expansion, &exp, new,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (exp)
+            thread_defer((free_t) Expansion_free, exp);
+        return new->code;
+    }
+    Expansion_free(new);
+    return exp->code;
+}
+
+static LispDatum *vm_run(const Proc *proc, const Arr *args, size_t prof)
+{
+    if (!run_enter(&proc)) return NULL;
+
+    // activations and handlers below these belong to callers of this run
+    const size_t depth = g_nconts;
+    const size_t handlers = g_nhandlers;
+
+    // the current activation, the procedure of the first one is owned by the caller
+    const Code *code = proc_code(proc);
+    const int32_t *ops = code->ops;
+    size_t pc = 0;
+    MalEnv *env = frame_new(proc, args);
+    MalEnv *frame = env;
+    Proc *owned_proc = NULL;
+    Code *exp_code = NULL;
+    size_t base = g_sp;
+    LispDatum *out = NULL;
+
+#define ACTIVATION() \
+    ((Activation) { code, pc, env, frame, owned_proc, exp_code, base, prof })
+// Calls in the outermost run are safe points of the cycle collector, since the C
+// code below it owns what it refers to (see gc.h). The running activation is a
+// root too.
+#define SAFE_POINT() do { \
+        if (g_nruns == 1 && !g_threaded && gc_isdue()) { \
+            Activation _act = ACTIVATION(); \
+            g_running = &_act; \
+            gc_maybe_collect(); \
+            g_running = NULL; \
+        } \
+    } while (0)
+#define RESUME() do { \
+        const Activation *_act = &g_conts[--g_nconts]; \
+        code = _act->code; ops = code->ops; pc = _act->pc; \
+        env = _act->env; frame = _act->frame; \
+        owned_proc = _act->proc; exp_code = _act->exp_code; \
+        base = _act->base; prof = _act->prof; \
+    } while (0)
+
+    while (1) {
+        switch (ops[pc++]) {
+            case OP_CONST:
+                if (!push(code->consts[ops[pc++]]))
+                    goto fail;
+                break;
+            case OP_LOCAL: {
+                const Symbol *id = (Symbol*) code->consts[ops[pc]];
+                LispDatum *dtm = MalEnv_get_addr(env, ops[pc + 1], ops[pc + 2], id);
+                if (dtm == NULL && (dtm = lookup(env, id)) == NULL)
+                    goto fail;
+                if (!push(dtm))
+                    goto fail;
+                pc += 3;
+                break;
+            }
+            case OP_GLOBAL: {
+                const Symbol *id = (Symbol*) code->consts[ops[pc]];
+                LispDatum *dtm = MalEnv_get_cached(env, id, &code->caches[ops[pc + 1]]);
+                if (dtm == NULL) {
+                    throwf(NULL, "symbol binding '%s' not found", Symbol_name(id));
+                    goto fail;
+                }
+                if (!push(dtm))
+                    goto fail;
+                pc += 2;
+                break;
+            }
+            case OP_EVAL: {
+                LispDatum *dtm = eval(code->consts[ops[pc++]], env);
+                if (dtm == NULL || !push(dtm))
+                    goto fail;
+                break;
+            }
+            case OP_POP:
+                drop(1);
+                break;
+            case OP_JUMP:
+                pc = ops[pc];
+                break;
+            case OP_JUMP_FALSE: {
+                const LispDatum *cond = g_stack[g_sp - 1];
+                bool jump = LispDatum_istype(cond, NIL) || LispDatum_istype(cond, FALSE);
+                drop(1);
+                pc = jump ? (size_t) ops[pc] : pc + 1;
+                break;
+            }
+            case OP_AND:
+            case OP_OR: {
+                const LispDatum *top = g_stack[g_sp - 1];
+                bool truth = !LispDatum_istype(top, NIL) && !LispDatum_istype(top, FALSE);
+                if (truth == (ops[pc - 1] == OP_OR)) {
+                    pc = ops[pc];
+                }
+                else {
+                    drop(1);
+                    pc++;
+                }
+                break;
+            }
+            case OP_MACRO_CHECK: {
+                const LispDatum *head = g_stack[g_sp - 1];
+                if (!LispDatum_istype(head, PROCEDURE) || !Proc_ismacro((Proc*) head)) {
+                    pc += 3;
+                    break;
+                }
+                drop(1);
+
+                MacroSite *site = &code->sites[ops[pc + 2]];
+                Code *expansion = expansion_code(site, code->consts[ops[pc]], env);
+                if (expansion == NULL)
+                    goto fail;
+                Code_own(expansion);
+
+                if (site->tail) {
+                    // nothing but returning the value follows the call
+                    if (exp_code)
+                        Code_rls_free(exp_code);
+                }
+                else {
+                    pc = ops[pc + 1];
+                    suspend(&ACTIVATION());
+                    MalEnv_own(env);
+                    frame = env;
+                    owned_proc = NULL;
+                    base = g_sp;
+                    prof = 0;
+                }
+                exp_code = expansion;
+                code = expansion;
+                ops = code->ops;
+                pc = 0;
+                break;
+            }
+            case OP_FOLDED:
+                if (g_stack[g_sp - 1] != code->consts[ops[pc]]) {
+                    pc += 3;
+                    break;
+                }
+                drop(1);
+                if (!push(code->consts[ops[pc + 1]]))
+                    goto fail;
+                pc = ops[pc + 2];
+                break;
+            case OP_CALL: {
+                SAFE_POINT();
+                unsigned n = ops[pc++];
+                if (!spread_apply(&n))
+                    goto fail;
+                LispDatum *head = g_stack[g_sp - n - 1];
+                if (!LispDatum_istype(head, PROCEDURE) || Proc_isbuiltin((Proc*) head)) {
+                    LispDatum *dtm = vm_call(n, env);
+                    if (dtm == NULL || !push(dtm))
+                        goto fail;
+                    break;
+                }
+
+                Proc *callee = (Proc*) head;
+                Arr callee_args = stack_args(n);
+                if (!verify_proc_application(callee, &callee_args))
+                    goto fail;
+                // arguments are owned by the new frame, the callee by its activation
+                MalEnv *callee_env = frame_new(callee, &callee_args);
+                LispDatum_own((LispDatum*) callee);
+                drop(n + 1);
+
+                suspend(&ACTIVATION());
+                code = proc_code(callee);
+                ops = code->ops;
+                pc = 0;
+                env = frame = callee_env;
+                owned_proc = callee;
+                exp_code = NULL;
+                base = g_sp;
+                prof = prof_enter(callee);
+                break;
+            }
+            case OP_TAIL_CALL: {
+                SAFE_POINT();
+                unsigned n = ops[pc++];
+                if (!spread_apply(&n))
+                    goto fail;
+                LispDatum *head = g_stack[g_sp - n - 1];
+                if (!LispDatum_istype(head, PROCEDURE) || Proc_isbuiltin((Proc*) head)) {
+                    // nothing to reuse, an ordinary call
+                    LispDatum *dtm = vm_call(n, env);
+                    if (dtm == NULL || !push(dtm))
+                        goto fail;
+                    goto ret;
+                }
+
+                Proc *callee = (Proc*) head;
+                Arr callee_args = stack_args(n);
+                if (!verify_proc_application(callee, &callee_args))
+                    goto fail;
+                MalEnv *callee_env = frame_new(callee, &callee_args);
+                LispDatum_own((LispDatum*) callee);
+                drop(n + 1);
+
+                release_envs(env, frame);
+                env = frame = callee_env;
+                if (owned_proc)
+                    LispDatum_rls_free((LispDatum*) owned_proc);
+                owned_proc = callee;
+                if (exp_code) {
+                    Code_rls_free(exp_code);
+                    exp_code = NULL;
+                }
+
+                // an expansion that calls a procedure in tail position becomes
+                // its application
+                if (prof)
+                    prof_tail(prof, callee);
+                else if (g_nconts > depth)
+                    prof = prof_enter(callee);
+
+                code = proc_code(callee);
+                ops = code->ops;
+                pc = 0;
+                break;
+            }
+            case OP_RETURN:
+            ret:
+                // take over the reference held by the stack
+                out = g_stack[--g_sp];
+                drop(g_sp - base);
+                if (g_nconts == depth)
+                    goto done;
+
+                leave(&ACTIVATION());
+                prof_leave(prof);
+                RESUME();
+                // the reference goes back to the stack of the caller
+                g_stack[g_sp++] = out;
+                break;
+            case OP_LET: {
+                MalEnv *let_env = MalEnv_new_frame(env, ops[pc++]);
+                MalEnv_own(let_env);
+                env = let_env;
+                break;
+            }
+            case OP_BIND:
+                MalEnv_put(env, (Symbol*) code->consts[ops[pc++]], g_stack[g_sp - 1]);
+                drop(1);
+                break;
+            case OP_UNLET: {
+                MalEnv *enclosing = env->enclosing;
+                MalEnv_rls_free(env);
+                env = enclosing;
+                break;
+            }
+            case OP_TRY:
+                handler_push(&(Handler) {
+                        .depth = g_nconts, .sp = g_sp, .env = env, .pc = ops[pc] });
+                pc++;
+                break;
+            case OP_END_TRY:
+                g_nhandlers--;
+                pc = ops[pc];
+                break;
+            case OP_CATCH: {
+                MalEnv *catch_env = MalEnv_new_frame(env, 1);
+                MalEnv_own(catch_env);
+                MalEnv_put(catch_env, (Symbol*) code->consts[ops[pc++]],
+                        (LispDatum*) thrown_copy());
+                env = catch_env;
+                break;
+            }
+            default:
+                FATAL("bad opcode %d", ops[pc - 1]);
+        }
+        continue;
+
+fail:
+        // exceptions are caught by the innermost handler of this run, which
+        // resumes its activation
+        if (g_nhandlers > handlers && didthrow()) {
+            const Handler handler = g_handlers[--g_nhandlers];
+            while (g_nconts > handler.depth) {
+                drop(g_sp - base);
+                leave(&ACTIVATION());
+                prof_leave(prof);
+                RESUME();
+            }
+            drop(g_sp - handler.sp);
+            while (env != handler.env) {
+                MalEnv *enclosing = env->enclosing;
+                MalEnv_rls_free(env);
+                env = enclosing;
+            }
+            pc = handler.pc;
+            continue;
+        }
+        break;
+    }
+
+    // the failure leaves the activations of this run
+    while (g_nconts > depth) {
+        drop(g_sp - base);
+        leave(&ACTIVATION());
+        prof_leave(prof);
+        RESUME();
+    }
+    drop(g_sp - base);
+    leave(&ACTIVATION());
+    g_nhandlers = handlers;
+    g_nruns--;
+    return NULL;
+
+done:
+    // out is owned, so that it survives the frame
+    leave(&ACTIVATION());
+    g_nruns--;
+    LispDatum_rls(out);
+    return out;
+
+#undef ACTIVATION
+#undef RESUME
+#undef SAFE_POINT
+}
+
+LispDatum *vm_apply(const Proc *proc, const Arr *args, MalEnv *env)
+{
+    if (!verify_proc_application(proc, args)) return NULL;
+
+    size_t prof = prof_enter(proc);
+    LispDatum *out = proc->builtin
+        ? proc->logic.apply(proc, args, env)
+        : vm_run(proc, args, prof);
+    prof_leave(prof);
+
+    return out;
+}
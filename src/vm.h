@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.h"
+#include "env.h"
+#include "utils.h"
+
+/* Bodies of language-defined procedures are compiled to bytecode when a lambda
+ * expression is evaluated for the first time, and executed by a stack-based VM
+ * when the procedure is applied. Top-level forms are still evaluated by eval
+ * (mylisp.c), which the VM falls back to for forms that it doesn't compile.
+ */
+
+typedef struct Code Code;
+
+// Compiles a sequence of expressions (nodes of a lambda body) that are evaluated
+// in order, with the value of the last one being the result.
+// Lexical addresses of the nodes should already be resolved. Calls with constant
+// arguments are folded in env, the environment of the lambda expression.
+Code *Code_compile(const struct Node *body, MalEnv *env);
+void Code_own(Code *code);
+void Code_rls_free(Code *code);
+
+// prints the disassembled code to stdout (for debugging)
+void Code_print(const Code *code);
+
+/* Applies a procedure to arguments (LispDatum*).
+ * env is the environment of the application, it's passed on to built-in procedures.
+ * Returns NULL if an exception was thrown.
+ */
+LispDatum *vm_apply(const Proc *proc, const Arr *args, MalEnv *env);
+
+/* The value stack of the VM, which eval uses as well to pass arguments without
+ * copying them: the procedure and then its arguments are pushed, and vm_call
+ * applies it to the arguments, which built-in procedures receive as a view of
+ * the stack. Values on the stack are owned by it.
+ */
+size_t vm_height();
+// returns false if an exception was thrown (stack overflow)
+bool vm_push(LispDatum *dtm);
+// pops n values and discards them
+void vm_drop(size_t n);
+// Applies the procedure below n arguments at the top of the stack and pops them
+// together with the procedure.
+// Returns NULL if an exception was thrown.
+LispDatum *vm_call(unsigned n, MalEnv *env);
+// True if argument idx of a built-in procedure is referred to only by the stack,
+// so that the procedure may update it in place and return it as its result,
+// since nothing else can observe the change (see List_isreusable). Arguments
+// that weren't passed on the stack (e.g., by map) are never unique.
+bool vm_unique_arg(const Arr *args, size_t idx);
+
+// Applies fn to each value on the stack of the calling thread and to the frames
+// (isenv) of its activations and handlers, which the cycle collector marks as
+// roots (see gc.h).
+void vm_roots(void (*fn)(void *ptr, bool isenv, void *data), void *data);
+
+// defined in mylisp.c
+LispDatum *eval(LispDatum *ast, MalEnv *env);
+// returns the expansion of a macro call, ast itself if it isn't one
+LispDatum *macroexpand(LispDatum *ast, MalEnv *env);
+// the built-in procedure apply, the VM applies its procedure in its place
+LispDatum *lisp_apply(const Proc *proc, const Arr *args, MalEnv *env);